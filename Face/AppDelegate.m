@@ -13,9 +13,7 @@
 #import "MainTabBarController.h"
 #import "AskPhoneNumberViewController.h"
 #import "APIRequest.h"
-#include <netdb.h>
-#include <arpa/inet.h>
-#include <netinet/in.h>
+#import <imsdk/DNSCache.h>
 
 @implementation AppDelegate
 
@@ -139,43 +137,13 @@
     });
 }
 
--(NSString*)IP2String:(struct in_addr)addr {
-    char buf[64] = {0};
-    const char *p = inet_ntop(AF_INET, &addr, buf, 64);
-    if (p) {
-        return [NSString stringWithUTF8String:p];
-    }
-    return nil;
-    
-}
-
 -(NSString*)resolveIP:(NSString*)host {
-    struct addrinfo hints;
-    struct addrinfo *result, *rp;
-    int s;
-    
-    char buf[32];
-    snprintf(buf, 32, "%d", 0);
-    
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-    hints.ai_flags = 0;
-    
-    s = getaddrinfo([host UTF8String], buf, &hints, &result);
-    if (s != 0) {
-        NSLog(@"get addr info error:%s", gai_strerror(s));
+    //和im连接共用dns缓存, 预热之后连接时不需要再次解析
+    NSArray *addrs = [[DNSCache instance] resolve:host];
+    if (addrs.count == 0) {
         return nil;
     }
-    NSString *ip = nil;
-    rp = result;
-    if (rp != NULL) {
-        struct sockaddr_in *addr = (struct sockaddr_in*)rp->ai_addr;
-        ip = [self IP2String:addr->sin_addr];
-    }
-    freeaddrinfo(result);
-    return ip;
+    return [DNSCache addressToString:[addrs objectAtIndex:0]];
 }
 
 
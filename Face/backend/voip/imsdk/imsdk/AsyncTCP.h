@@ -14,12 +14,41 @@ typedef void(^ConnectCB)(AsyncTCP *tcp, int err);
 typedef void(^ReadCB)(AsyncTCP *tcp, NSData *data, int err);
 typedef void(^CloseCB)(AsyncTCP *tcp, int err);
 
+//发送的优先级, 数值越小越先发送
+//每次写socket按优先级从各队列取数据, 除CONTROL之外每个优先级每次最多取固定的字节数, 低优先级不会被饿死
+//已经开始写的数据块写完之后才会切换, 调用方按帧提交数据块, 高优先级的帧只会插在帧的边界上
+#define SEND_CLASS_CONTROL 0 //音视频信令, 心跳, 认证
+#define SEND_CLASS_ACK 1
+#define SEND_CLASS_INTERACTIVE 2 //用户发送的消息
+#define SEND_CLASS_BULK 3 //同步请求, 客服消息
+#define SEND_CLASS_MAX 4
+
+//socket的读写在内部的网络线程上进行, 所有回调都派发到queue上
+//除init之外的方法也需要在queue上调用
 @interface AsyncTCP : NSObject
+-(id)initWithQueue:(dispatch_queue_t)queue;
 -(BOOL)connect:(NSString*)host port:(int)port cb:(ConnectCB)cb;
+//addrs为sockaddr的NSData数组, 按rfc8305每隔250ms在下一个地址上发起连接, 第一个连上的胜出
+-(BOOL)connectAddresses:(NSArray*)addrs port:(int)port cb:(ConnectCB)cb;
 -(void)close;
+//按SEND_CLASS_INTERACTIVE发送
 -(void)write:(NSData*)data;
+//ordered的数据块之间不分优先级, 按提交的顺序发送, 用于共享压缩上下文或者需要按顺序重组的帧
+//NSMutableData会复制一份, 不可变的NSData直接引用, 提交之后不能再修改它的内容
+-(void)write:(NSData*)data sendClass:(int)sendClass ordered:(BOOL)ordered;
 -(void)flush;
 -(void)startRead:(ReadCB)cb;
+
+//连接成功的地址类型(AF_INET/AF_INET6)和耗时(毫秒)
+@property(nonatomic, readonly) int family;
+@property(nonatomic, readonly) double connectTime;
+
+//读回调所在的队列, 默认与queue相同, 需要在startRead之前设置
+@property(nonatomic, strong) dispatch_queue_t readQueue;
+
+//消费者处理不过来时暂停读socket, 可以在任意线程上调用
+-(void)suspendRead;
+-(void)resumeRead;
 @end
 
 
@@ -8,11 +8,63 @@
 */
 
 #import "AsyncTCP.h"
+#import "DNSCache.h"
 #import "util.h"
+#import "imlog.h"
+#import "metrics.h"
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+
+//一次writev最多提交的数据块
+#define MAX_IOV 64
+
+//rfc8305建议的连接尝试间隔(毫秒)
+#define CONNECTION_ATTEMPT_DELAY 250
+
+//每次writev各优先级最多提交的字节数(超出时以数据块为单位), 0为不限制
+static const NSUInteger sendClassBudget[SEND_CLASS_MAX] = {0, 16*1024, 64*1024, 32*1024};
+
+//所有socket的读写都在这个串行队列上进行
+static dispatch_queue_t networkQueue() {
+    static dispatch_queue_t queue;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        queue = dispatch_queue_create("im.network", DISPATCH_QUEUE_SERIAL);
+    });
+    return queue;
+}
+
+//一个候选地址上的连接尝试
+@interface ConnectAttempt : NSObject
+@property(nonatomic) int sock;
+@property(nonatomic) int family;
+@property(nonatomic, strong) dispatch_source_t source;
+@end
+
+@implementation ConnectAttempt
+@end
+
+//排队等待发送的数据块
+@interface SendChunk : NSObject
+@property(nonatomic) NSData *data;
+@property(nonatomic) int sendClass;
+@property(nonatomic) BOOL ordered;
+//ordered的数据块的提交顺序
+@property(nonatomic) uint64_t order;
+//提交时间(微秒), 用于统计排队时间
+@property(nonatomic) uint64_t enqueueTime;
+@end
+
+@implementation SendChunk
+@end
+
 @interface AsyncTCP()
+//回调所在的队列
+@property(nonatomic, strong)dispatch_queue_t queue;
+//close之后不再回调
+@property(atomic)BOOL closed;
 @property(nonatomic, strong)ConnectCB connect_cb;
 @property(nonatomic, strong)ReadCB read_cb;
 @property(nonatomic, strong)dispatch_source_t readSource;
@@ -21,164 +73,412 @@
 @property(nonatomic)BOOL readSourceActive;
 @property(nonatomic)int sock;
 @property(nonatomic)BOOL connecting;
-@property(nonatomic)NSMutableData *data;
+//胜出的连接尝试的事件源正在取消, sock在onConnected:中才交给正式的读写事件源
+@property(nonatomic)BOOL handingOver;
+
+//happy eyeballs的状态, 只在网络线程上访问
+@property(nonatomic)NSArray *candidates;
+@property(nonatomic)NSUInteger nextCandidate;
+@property(nonatomic)NSMutableArray *attempts;
+@property(nonatomic, strong)dispatch_source_t attemptTimer;
+@property(nonatomic)int lastError;
+@property(nonatomic)NSTimeInterval connectBegin;
+@property(nonatomic, readwrite)int family;
+@property(nonatomic, readwrite)double connectTime;
+//各优先级待发送的数据块
+@property(nonatomic)NSArray *queues;
+//已经发送了headOffset个字节的数据块, 写完之前不发送其它数据块
+@property(nonatomic)SendChunk *current;
+@property(nonatomic)NSUInteger headOffset;
+//已经提交和已经开始发送的ordered数据块的个数
+@property(nonatomic)uint64_t orderQueued;
+@property(nonatomic)uint64_t orderSent;
 @end
 
 @implementation AsyncTCP
 
 -(id)init {
+    return [self initWithQueue:dispatch_get_main_queue()];
+}
+
+-(id)initWithQueue:(dispatch_queue_t)queue {
     self = [super init];
     if (self) {
-        self.data = [NSMutableData data];
+        self.queue = queue;
+        self.readQueue = queue;
+        NSMutableArray *queues = [NSMutableArray arrayWithCapacity:SEND_CLASS_MAX];
+        for (int i = 0; i < SEND_CLASS_MAX; i++) {
+            [queues addObject:[NSMutableArray array]];
+        }
+        self.queues = queues;
         self.sock = -1;
     }
     return self;
 }
 
 -(void)dealloc {
-    NSLog(@"async tcp dealloc");
+    IMLogD("async tcp dealloc");
     self.readSource = nil;
     self.writeSource = nil;
     self.connect_cb = nil;
     self.read_cb = nil;
 }
 
-- (BOOL)synthesizeIPv6:(NSString*)host port:(int)port addr:(struct sockaddr*)addr addrinfo:(struct addrinfo*)info {
-    int error;
-    struct addrinfo hints, *res0, *res;
-    const char *ipv4_str = [host UTF8String];
-    
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = PF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_DEFAULT;
-    error = getaddrinfo(ipv4_str, "", &hints, &res0);
-    if (error) {
-        NSLog(@"%s", gai_strerror(error));
-        return FALSE;
+-(BOOL)connect:(NSString*)host port:(int)port cb:(ConnectCB)cb {
+    NSArray *addrs = [[DNSCache instance] resolve:host];
+    if (addrs.count == 0) {
+        IMLogW("resolve host:%s fail", [host UTF8String]);
+        return NO;
     }
+    return [self connectAddresses:addrs port:port cb:cb];
+}
 
-    for (res = res0; res; res = res->ai_next) {
-        NSLog(@"family:%d socktype;%d protocol:%d", res->ai_family, res->ai_socktype, res->ai_protocol);
+-(BOOL)connectAddresses:(NSArray*)addrs port:(int)port cb:(ConnectCB)cb {
+    if (addrs.count == 0) {
+        return NO;
     }
-    
-    BOOL r = YES;
-    //use first
-    if (res0) {
-        if (res0->ai_family == AF_INET6) {
-            struct sockaddr_in6 *addr6 = ((struct sockaddr_in6*)res0->ai_addr);
-            addr6->sin6_port = htons(port);
-            
-            memcpy(addr, res0->ai_addr, res0->ai_addrlen);
-            *info = *res0;
-        } else if (res0->ai_family == AF_INET) {
-            struct sockaddr_in *addr4 = ((struct sockaddr_in*)res0->ai_addr);
-            addr4->sin_port = htons(port);
-            
-            memcpy(addr, res0->ai_addr, res0->ai_addrlen);
-            *info = *res0;
+    NSMutableArray *candidates = [NSMutableArray arrayWithCapacity:addrs.count];
+    for (NSData *addr in addrs) {
+        NSMutableData *a = [NSMutableData dataWithData:addr];
+        struct sockaddr *sa = (struct sockaddr*)[a mutableBytes];
+        if (sa->sa_family == AF_INET) {
+            ((struct sockaddr_in*)sa)->sin_port = htons(port);
+        } else if (sa->sa_family == AF_INET6) {
+            ((struct sockaddr_in6*)sa)->sin6_port = htons(port);
         } else {
-            r = NO;
+            continue;
         }
+        [candidates addObject:a];
     }
-
-    freeaddrinfo(res0);
-    return r;
-}
-
--(BOOL)connect:(NSString*)host port:(int)port cb:(ConnectCB)cb {
-    struct sockaddr_in6 addr;
-    struct addrinfo addrinfo;
-    
-    BOOL res = [self synthesizeIPv6:host port:port addr:(struct sockaddr*)&addr addrinfo:&addrinfo];
-    if (!res) {
-        NSLog(@"synthesize ipv6 fail");
+    if (candidates.count == 0) {
         return NO;
     }
     
-    int r;
-    int sockfd;
-    
-    sockfd = socket(addrinfo.ai_family, addrinfo.ai_socktype, addrinfo.ai_protocol);
-    sock_nonblock(sockfd, 1);
-    
-    int value = 1;
-    setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, &value, sizeof(value));
+    self.connect_cb = cb;
+    self.connectBegin = [[NSProcessInfo processInfo] systemUptime];
+    dispatch_async(networkQueue(), ^{
+        self.connecting = YES;
+        self.candidates = candidates;
+        self.nextCandidate = 0;
+        self.attempts = [NSMutableArray array];
+        self.lastError = ECONNREFUSED;
+        [self startNextAttempt];
+    });
+    return YES;
+}
 
-    do {
-        if (addrinfo.ai_family == AF_INET) {
-            r = connect(sockfd, (struct sockaddr*)&addr, sizeof(struct sockaddr_in));
-        } else {
-            //ipv6
-            r = connect(sockfd, (struct sockaddr*)&addr, sizeof(struct sockaddr_in6));
+//依次在下一个候选地址上发起连接, 之前的尝试在CONNECTION_ATTEMPT_DELAY内没有结果时调用
+-(void)startNextAttempt {
+    while (self.connecting && !self.closed && self.nextCandidate < self.candidates.count) {
+        NSData *addr = [self.candidates objectAtIndex:self.nextCandidate];
+        self.nextCandidate = self.nextCandidate + 1;
+        const struct sockaddr *sa = (const struct sockaddr*)[addr bytes];
+        
+        int sockfd = socket(sa->sa_family, SOCK_STREAM, IPPROTO_TCP);
+        if (sockfd == -1) {
+            self.lastError = errno;
+            continue;
         }
-    } while (r == -1 && errno == EINTR);
-    if (r == -1) {
-        if (errno != EINPROGRESS) {
+        sock_nonblock(sockfd, 1);
+        int value = 1;
+        setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, &value, sizeof(value));
+        
+        int r;
+        do {
+            r = connect(sockfd, sa, (socklen_t)addr.length);
+        } while (r == -1 && errno == EINTR);
+        if (r == -1 && errno != EINPROGRESS) {
+            IMLogW("connect %s error:%s", [[DNSCache addressToString:addr] UTF8String], strerror(errno));
+            self.lastError = errno;
             close(sockfd);
-            NSLog(@"connect error:%s", strerror(errno));
-            return FALSE;
+            continue;
+        }
+        
+        ConnectAttempt *attempt = [[ConnectAttempt alloc] init];
+        attempt.sock = sockfd;
+        attempt.family = sa->sa_family;
+        attempt.source = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, sockfd, 0, networkQueue());
+        __weak AsyncTCP *wself = self;
+        __weak ConnectAttempt *wattempt = attempt;
+        dispatch_source_set_event_handler(attempt.source, ^{
+            [wself onAttemptWritable:wattempt];
+        });
+        dispatch_resume(attempt.source);
+        [self.attempts addObject:attempt];
+        
+        if (self.nextCandidate < self.candidates.count) {
+            [self startAttemptTimer];
         }
+        return;
+    }
+    
+    if (self.connecting && self.attempts.count == 0) {
+        [self connectFail];
+    }
+}
+
+-(void)startAttemptTimer {
+    if (!self.attemptTimer) {
+        self.attemptTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, networkQueue());
+        __weak AsyncTCP *wself = self;
+        dispatch_source_set_event_handler(self.attemptTimer, ^{
+            [wself startNextAttempt];
+        });
+        dispatch_resume(self.attemptTimer);
+    }
+    dispatch_time_t w = dispatch_time(DISPATCH_TIME_NOW, CONNECTION_ATTEMPT_DELAY*NSEC_PER_MSEC);
+    dispatch_source_set_timer(self.attemptTimer, w, DISPATCH_TIME_FOREVER, 0);
+}
+
+-(void)cancelAttemptTimer {
+    if (self.attemptTimer) {
+        dispatch_source_cancel(self.attemptTimer);
+        self.attemptTimer = nil;
+    }
+}
+
+-(void)cancelAttempt:(ConnectAttempt*)attempt closeSocket:(BOOL)closeSocket {
+    int sock = attempt.sock;
+    if (closeSocket) {
+        dispatch_source_set_cancel_handler(attempt.source, ^{
+            close(sock);
+        });
+    }
+    dispatch_source_cancel(attempt.source);
+    [self.attempts removeObject:attempt];
+}
+
+-(void)onAttemptWritable:(ConnectAttempt*)attempt {
+    if (!attempt || !self.connecting) {
+        return;
+    }
+    int error = 0;
+    socklen_t errorsize = sizeof(int);
+    getsockopt(attempt.sock, SOL_SOCKET, SO_ERROR, &error, &errorsize);
+    if (error == EINPROGRESS) {
+        return;
+    }
+    if (error) {
+        IMLogW("connect attempt family:%d error:%s", attempt.family, strerror(error));
+        self.lastError = error;
+        [self cancelAttempt:attempt closeSocket:YES];
+        //失败时不用等待, 立即尝试下一个地址
+        [self startNextAttempt];
+        return;
     }
     
-    dispatch_queue_t queue = dispatch_get_main_queue();
-    self.writeSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, sockfd, 0, queue);
+    //第一个连上的地址胜出, 关闭其它的尝试
+    [self cancelAttemptTimer];
+    for (ConnectAttempt *a in [self.attempts copy]) {
+        if (a != attempt) {
+            [self cancelAttempt:a closeSocket:YES];
+        }
+    }
+    self.connecting = NO;
+    self.candidates = nil;
+    self.sock = attempt.sock;
+    self.handingOver = YES;
+    self.family = attempt.family;
+    self.connectTime = ([[NSProcessInfo processInfo] systemUptime] - self.connectBegin)*1000;
+    
+    //同一个fd上的事件源取消之后再创建正式的写事件源
+    __weak AsyncTCP *wself = self;
+    int sock = attempt.sock;
+    dispatch_source_set_cancel_handler(attempt.source, ^{
+        AsyncTCP *tcp = wself;
+        if (tcp) {
+            [tcp onConnected:sock];
+        } else {
+            close(sock);
+        }
+    });
+    [self cancelAttempt:attempt closeSocket:NO];
+}
+
+-(void)onConnected:(int)sock {
+    self.handingOver = NO;
+    if (self.sock != sock) {
+        //等待取消的过程中已经close, 连接尝试的事件源取消完成之后才能关闭
+        close(sock);
+        return;
+    }
+    self.writeSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, sock, 0, networkQueue());
     __weak AsyncTCP *wself = self;
     dispatch_source_set_event_handler(self.writeSource, ^{
         [wself onWrite];
     });
+    if ([self hasChunks]) {
+        dispatch_resume(self.writeSource);
+        self.writeSourceActive = YES;
+    }
     
-    dispatch_resume(self.writeSource);
-    self.writeSourceActive = YES;
-    
-    self.connecting = YES;
-    self.connect_cb = cb;
-    self.sock = sockfd;
-
-    return TRUE;
+    dispatch_async(self.queue, ^{
+        if (self.closed) {
+            return;
+        }
+        self.connect_cb(self, 0);
+    });
 }
 
--(void)onWrite {
-    if (self.connecting) {
-        int error;
-        socklen_t errorsize = sizeof(int);
-        getsockopt(self.sock, SOL_SOCKET, SO_ERROR, &error, &errorsize);
-        if (error == EINPROGRESS)
+-(void)connectFail {
+    self.connecting = NO;
+    self.candidates = nil;
+    [self cancelAttemptTimer];
+    int error = self.lastError;
+    dispatch_async(self.queue, ^{
+        if (self.closed) {
             return;
-        self.connecting = NO;
+        }
         self.connect_cb(self, error);
-        return;
-    }
-    const char *p = [self.data bytes];
-    int n = write_data(self.sock, (uint8_t*)p, (int)self.data.length);
+    });
+}
+
+-(void)onWrite {
+    int n = [self writeChunks];
     if (n < 0) {
-        NSLog(@"sock write error:%d", errno);
+        IMLogE("sock write error:%d", errno);
         dispatch_suspend(self.writeSource);
         self.writeSourceActive = NO;
         return;
     }
-    self.data = [NSMutableData dataWithBytes:p+n length:self.data.length - n];
-    if (self.data.length == 0) {
+    if (![self hasChunks]) {
         dispatch_suspend(self.writeSource);
         self.writeSourceActive = NO;
     }
     return;
 }
 
+-(BOOL)hasChunks {
+    if (self.current) {
+        return YES;
+    }
+    for (NSArray *q in self.queues) {
+        if (q.count > 0) {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+//按优先级从各队列取数据块用writev一次提交, 返回写入的字节数
+//没有写完的数据块成为current, 下一次最先提交
+-(int)writeChunks {
+    struct iovec iov[MAX_IOV];
+    __unsafe_unretained SendChunk *batch[MAX_IOV];
+    int cnt = 0;
+    if (self.current) {
+        iov[cnt].iov_base = (char*)[self.current.data bytes] + self.headOffset;
+        iov[cnt].iov_len = self.current.data.length - self.headOffset;
+        batch[cnt++] = self.current;
+    }
+    uint64_t order = self.orderSent;
+    for (int c = 0; c < SEND_CLASS_MAX && cnt < MAX_IOV; c++) {
+        NSUInteger budget = sendClassBudget[c];
+        NSUInteger used = 0;
+        for (SendChunk *chunk in [self.queues objectAtIndex:c]) {
+            if (cnt == MAX_IOV || (budget > 0 && used >= budget)) {
+                break;
+            }
+            //更早提交的ordered数据块还在其它队列中
+            if (chunk.ordered && chunk.order != order) {
+                break;
+            }
+            if (chunk.ordered) {
+                order++;
+            }
+            iov[cnt].iov_base = (char*)[chunk.data bytes];
+            iov[cnt].iov_len = chunk.data.length;
+            batch[cnt++] = chunk;
+            used += chunk.data.length;
+        }
+    }
+    if (cnt == 0) {
+        return 0;
+    }
+
+    ssize_t n;
+    do {
+        n = writev(self.sock, iov, cnt);
+    } while (n == -1 && errno == EINTR);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        return 0;
+    }
+
+    //写完的数据块出队并统计排队时间, 写了一部分的记录偏移
+    uint64_t now = metrics_now_us();
+    NSUInteger left = n;
+    for (int i = 0; i < cnt && left > 0; i++) {
+        SendChunk *chunk = batch[i];
+        NSUInteger remain = iov[i].iov_len;
+        if (chunk != self.current) {
+            //batch中同一优先级的数据块就是队列的前几个
+            [[self.queues objectAtIndex:chunk.sendClass] removeObjectAtIndex:0];
+            if (chunk.ordered) {
+                self.orderSent = self.orderSent + 1;
+            }
+        }
+        if (left < remain) {
+            self.headOffset = (chunk == self.current ? self.headOffset : 0) + left;
+            self.current = chunk;
+            break;
+        }
+        left -= remain;
+        self.current = nil;
+        self.headOffset = 0;
+        metrics_observe(METRIC_SEND_DELAY_CONTROL + chunk.sendClass, now - chunk.enqueueTime);
+    }
+    return (int)n;
+}
+
 -(void)close {
+    self.closed = YES;
+    dispatch_async(networkQueue(), ^{
+        [self closeSocket];
+    });
+}
+
+-(void)closeSocket {
+    //还在连接中, 关闭所有的尝试
+    self.connecting = NO;
+    self.candidates = nil;
+    [self cancelAttemptTimer];
+    for (ConnectAttempt *a in [self.attempts copy]) {
+        [self cancelAttempt:a closeSocket:YES];
+    }
+    
     __block int count = 0;
+    int sock = self.sock;
+    self.sock = -1;
+    if (self.handingOver) {
+        //由onConnected:关闭
+        return;
+    }
     
+    //socket要在读写事件源都取消之后才能关闭
     void (^on_cancel)() = ^{
         --count;
         if (count == 0) {
-            NSLog(@"async tcp closed");
+            IMLogD("async tcp closed");
+            if (sock != -1) {
+                close(sock);
+            }
         }
     };
     
     if (self.writeSource) count++;
     if (self.readSource) count++;
+    if (count == 0) {
+        if (sock != -1) {
+            IMLogD("close socket");
+            close(sock);
+        }
+        return;
+    }
     if (self.writeSource) {
-        NSLog(@"cancel write source");
+        IMLogD("cancel write source");
         if (!self.writeSourceActive) {
             dispatch_resume(self.writeSource);
             self.writeSourceActive = YES;
@@ -188,7 +488,7 @@
     }
     
     if (self.readSource) {
-        NSLog(@"cancel read source");
+        IMLogD("cancel read source");
         if (!self.readSourceActive) {
             dispatch_resume(self.readSource);
             self.readSourceActive = YES;
@@ -196,35 +496,50 @@
         dispatch_source_set_cancel_handler(self.readSource, on_cancel);
         dispatch_source_cancel(self.readSource);
     }
-    
-    if (self.sock != -1) {
-        NSLog(@"close socket");
-        //because event handler and close both be called on main thread
-        //here can safely close socket
-        close(self.sock);
-        self.sock = -1;
-    }
 }
 
 -(void)write:(NSData*)data {
-    [self.data appendData:data];
-    if (!self.writeSourceActive && self.writeSource) {
-        dispatch_resume(self.writeSource);
-        self.writeSourceActive = YES;
-    }
+    [self write:data sendClass:SEND_CLASS_INTERACTIVE ordered:NO];
 }
 
--(void)flush {
-    if (self.data.length == 0) {
+-(void)write:(NSData*)data sendClass:(int)sendClass ordered:(BOOL)ordered {
+    if (data.length == 0) {
         return;
     }
-    const char *p = [self.data bytes];
-    int n = write_data(self.sock, (uint8_t*)p, (int)self.data.length);
-    if (n < 0) {
-        NSLog(@"sock write error:%d", errno);
-        return;
-    }
-    self.data = [NSMutableData dataWithBytes:p+n length:self.data.length - n];
+    SendChunk *chunk = [[SendChunk alloc] init];
+    //不可变的数据直接引用, 可变的数据需要复制一份
+    chunk.data = [data isKindOfClass:[NSMutableData class]] ? [data copy] : data;
+    chunk.sendClass = MAX(0, MIN(sendClass, SEND_CLASS_MAX - 1));
+    chunk.ordered = ordered;
+    chunk.enqueueTime = metrics_now_us();
+    dispatch_async(networkQueue(), ^{
+        //连接建立之前写入的数据在连上之后发送
+        if (self.sock == -1 && !self.connecting) {
+            return;
+        }
+        if (chunk.ordered) {
+            chunk.order = self.orderQueued;
+            self.orderQueued = self.orderQueued + 1;
+        }
+        [[self.queues objectAtIndex:chunk.sendClass] addObject:chunk];
+        if (!self.writeSourceActive && self.writeSource) {
+            dispatch_resume(self.writeSource);
+            self.writeSourceActive = YES;
+        }
+    });
+}
+
+-(void)flush {
+    dispatch_async(networkQueue(), ^{
+        if (![self hasChunks] || self.sock == -1) {
+            return;
+        }
+        int n = [self writeChunks];
+        if (n < 0) {
+            IMLogE("sock write error:%d", errno);
+            return;
+        }
+    });
 }
 
 #define BUF_SIZE (64*1024)
@@ -241,31 +556,63 @@
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 return;
             } else {
-                self.read_cb(self, nil, errno);
+                [self deliverRead:nil error:errno];
                 return;
             }
         } else if (nread == 0) {
-            self.read_cb(self, nil, 0);
+            [self deliverRead:nil error:0];
             return;
         } else {
             NSData *data = [NSData dataWithBytes:buf length:nread];
-            self.read_cb(self, data, 0);
+            [self deliverRead:data error:0];
             if (nread < BUF_SIZE) {
                 return;
             }
         }
     }
 }
--(void)startRead:(ReadCB)cb {
-    dispatch_queue_t queue = dispatch_get_main_queue();
-    self.readSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, self.sock, 0, queue);
-    __weak AsyncTCP *wself = self;
-    dispatch_source_set_event_handler(self.readSource, ^{
-        [wself onRead];
+
+-(void)deliverRead:(NSData*)data error:(int)err {
+    dispatch_async(self.readQueue, ^{
+        if (self.closed) {
+            return;
+        }
+        self.read_cb(self, data, err);
     });
-    dispatch_resume(self.readSource);
-    self.readSourceActive = YES;
+}
+
+-(void)startRead:(ReadCB)cb {
     self.read_cb = cb;
+    dispatch_async(networkQueue(), ^{
+        if (self.sock == -1) {
+            return;
+        }
+        self.readSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, self.sock, 0, networkQueue());
+        __weak AsyncTCP *wself = self;
+        dispatch_source_set_event_handler(self.readSource, ^{
+            [wself onRead];
+        });
+        dispatch_resume(self.readSource);
+        self.readSourceActive = YES;
+    });
+}
+
+-(void)suspendRead {
+    dispatch_async(networkQueue(), ^{
+        if (self.readSource && self.readSourceActive && self.sock != -1) {
+            dispatch_suspend(self.readSource);
+            self.readSourceActive = NO;
+        }
+    });
+}
+
+-(void)resumeRead {
+    dispatch_async(networkQueue(), ^{
+        if (self.readSource && !self.readSourceActive && self.sock != -1) {
+            dispatch_resume(self.readSource);
+            self.readSourceActive = YES;
+        }
+    });
 }
 
 @end
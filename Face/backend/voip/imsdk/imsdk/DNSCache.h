@@ -0,0 +1,34 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#import <Foundation/Foundation.h>
+
+/*
+ * 进程内共享的dns缓存, 按记录的ttl过期
+ * 解析结果为sockaddr的NSData数组, ipv6和ipv4交替排列(rfc8305), 端口为0
+ * 过期的结果在刷新成功之前仍然可以使用
+ */
+@interface DNSCache : NSObject
+
++(DNSCache*)instance;
+
+//阻塞解析, 缓存有效时直接返回, 不能在主线程调用
+-(NSArray*)resolve:(NSString*)host;
+
+//只读缓存, 不阻塞, 结果过期时在后台刷新
+-(NSArray*)addressesForHost:(NSString*)host;
+
+//在后台刷新
+-(void)refresh:(NSString*)host;
+
+//返回第一个family类型的地址, 如AF_INET
+-(NSString*)resolveIP:(NSString*)host family:(int)family;
+
++(NSString*)addressToString:(NSData*)addr;
+@end
@@ -0,0 +1,276 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <dns_sd.h>
+#import "DNSCache.h"
+#import "imlog.h"
+
+//ttl的上下界(秒), getaddrinfo拿不到ttl时使用默认值
+#define MIN_TTL 30
+#define MAX_TTL 600
+#define DEFAULT_TTL 60
+
+//一次解析最长等待的时间(秒)
+#define RESOLVE_TIMEOUT 5
+
+@interface DNSEntry : NSObject
+@property(nonatomic) NSArray *addresses;
+//过期时间, systemUptime
+@property(nonatomic) NSTimeInterval expire;
+@end
+
+@implementation DNSEntry
+@end
+
+//DNSServiceGetAddrInfo回调的上下文
+@interface DNSResolveContext : NSObject
+@property(nonatomic) NSMutableArray *ipv4;
+@property(nonatomic) NSMutableArray *ipv6;
+@property(nonatomic) uint32_t ttl;
+@property(nonatomic) BOOL ipv4Done;
+@property(nonatomic) BOOL ipv6Done;
+@property(nonatomic) BOOL moreComing;
+@end
+
+@implementation DNSResolveContext
+@end
+
+static void addrInfoReply(DNSServiceRef sdRef, DNSServiceFlags flags, uint32_t interfaceIndex,
+                          DNSServiceErrorType errorCode, const char *hostname,
+                          const struct sockaddr *address, uint32_t ttl, void *context) {
+    DNSResolveContext *ctx = (__bridge DNSResolveContext*)context;
+    ctx.moreComing = (flags & kDNSServiceFlagsMoreComing) != 0;
+    if (address == NULL) {
+        return;
+    }
+    //kDNSServiceErr_NoSuchRecord表示该类型没有记录
+    if (errorCode == kDNSServiceErr_NoError && (flags & kDNSServiceFlagsAdd)) {
+        if (address->sa_family == AF_INET) {
+            [ctx.ipv4 addObject:[NSData dataWithBytes:address length:sizeof(struct sockaddr_in)]];
+        } else if (address->sa_family == AF_INET6) {
+            [ctx.ipv6 addObject:[NSData dataWithBytes:address length:sizeof(struct sockaddr_in6)]];
+        }
+        ctx.ttl = ctx.ttl ? MIN(ctx.ttl, ttl) : ttl;
+    }
+    if (address->sa_family == AF_INET) {
+        ctx.ipv4Done = YES;
+    } else if (address->sa_family == AF_INET6) {
+        ctx.ipv6Done = YES;
+    }
+}
+
+//ipv6和ipv4交替排列, 第一个地址使用ipv6
+static NSArray *interleave(NSArray *ipv6, NSArray *ipv4) {
+    NSMutableArray *addrs = [NSMutableArray arrayWithCapacity:ipv6.count + ipv4.count];
+    NSUInteger n = MAX(ipv6.count, ipv4.count);
+    for (NSUInteger i = 0; i < n; i++) {
+        if (i < ipv6.count) {
+            [addrs addObject:[ipv6 objectAtIndex:i]];
+        }
+        if (i < ipv4.count) {
+            [addrs addObject:[ipv4 objectAtIndex:i]];
+        }
+    }
+    return addrs;
+}
+
+@interface DNSCache()
+@property(nonatomic) NSMutableDictionary *entries;
+@property(nonatomic) NSMutableSet *refreshing;
+@end
+
+@implementation DNSCache
+
++(DNSCache*)instance {
+    static DNSCache *cache;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        cache = [[DNSCache alloc] init];
+    });
+    return cache;
+}
+
+-(id)init {
+    self = [super init];
+    if (self) {
+        self.entries = [NSMutableDictionary dictionary];
+        self.refreshing = [NSMutableSet set];
+    }
+    return self;
+}
+
++(NSString*)addressToString:(NSData*)addr {
+    char buf[INET6_ADDRSTRLEN] = {0};
+    const struct sockaddr *sa = (const struct sockaddr*)[addr bytes];
+    const char *p = NULL;
+    if (sa->sa_family == AF_INET) {
+        p = inet_ntop(AF_INET, &((const struct sockaddr_in*)sa)->sin_addr, buf, sizeof(buf));
+    } else if (sa->sa_family == AF_INET6) {
+        p = inet_ntop(AF_INET6, &((const struct sockaddr_in6*)sa)->sin6_addr, buf, sizeof(buf));
+    }
+    return p ? [NSString stringWithUTF8String:p] : nil;
+}
+
+static BOOL isIPLiteral(const char *host) {
+    struct in6_addr addr;
+    return inet_pton(AF_INET, host, &addr) == 1 || inet_pton(AF_INET6, host, &addr) == 1;
+}
+
+//ip字面量和DNSService失败时使用, 可以在nat64网络上合成ipv6地址
+-(NSArray*)getAddrInfo:(const char*)host {
+    struct addrinfo hints, *res0, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = PF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_DEFAULT;
+    int error = getaddrinfo(host, NULL, &hints, &res0);
+    if (error) {
+        IMLogW("get addr info error:%s", gai_strerror(error));
+        return nil;
+    }
+    NSMutableArray *ipv4 = [NSMutableArray array];
+    NSMutableArray *ipv6 = [NSMutableArray array];
+    for (res = res0; res; res = res->ai_next) {
+        NSData *addr = [NSData dataWithBytes:res->ai_addr length:res->ai_addrlen];
+        if (res->ai_family == AF_INET6) {
+            [ipv6 addObject:addr];
+        } else if (res->ai_family == AF_INET) {
+            [ipv4 addObject:addr];
+        }
+    }
+    freeaddrinfo(res0);
+    return interleave(ipv6, ipv4);
+}
+
+-(NSArray*)resolveService:(const char*)host ttl:(uint32_t*)ttl {
+    DNSResolveContext *ctx = [[DNSResolveContext alloc] init];
+    ctx.ipv4 = [NSMutableArray array];
+    ctx.ipv6 = [NSMutableArray array];
+    
+    DNSServiceRef ref = NULL;
+    DNSServiceErrorType err = DNSServiceGetAddrInfo(&ref, kDNSServiceFlagsReturnIntermediates, 0,
+                                                    kDNSServiceProtocol_IPv4|kDNSServiceProtocol_IPv6,
+                                                    host, addrInfoReply, (__bridge void*)ctx);
+    if (err != kDNSServiceErr_NoError) {
+        IMLogW("dns service error:%d", err);
+        return nil;
+    }
+    
+    int fd = DNSServiceRefSockFD(ref);
+    NSTimeInterval deadline = [[NSProcessInfo processInfo] systemUptime] + RESOLVE_TIMEOUT;
+    while (!(ctx.ipv4Done && ctx.ipv6Done) || ctx.moreComing) {
+        NSTimeInterval left = deadline - [[NSProcessInfo processInfo] systemUptime];
+        if (left <= 0) {
+            break;
+        }
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        struct timeval tv;
+        tv.tv_sec = (int)left;
+        tv.tv_usec = (int)((left - tv.tv_sec)*1000000);
+        int r = select(fd + 1, &fds, NULL, NULL, &tv);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0 || DNSServiceProcessResult(ref) != kDNSServiceErr_NoError) {
+            break;
+        }
+    }
+    DNSServiceRefDeallocate(ref);
+    
+    *ttl = ctx.ttl;
+    return interleave(ctx.ipv6, ctx.ipv4);
+}
+
+-(NSArray*)resolve:(NSString*)host {
+    if (host.length == 0) {
+        return nil;
+    }
+    NSTimeInterval now = [[NSProcessInfo processInfo] systemUptime];
+    @synchronized(self) {
+        DNSEntry *entry = [self.entries objectForKey:host];
+        if (entry && entry.expire > now) {
+            return entry.addresses;
+        }
+    }
+    
+    const char *h = [host UTF8String];
+    uint32_t ttl = 0;
+    NSArray *addrs = nil;
+    if (isIPLiteral(h)) {
+        addrs = [self getAddrInfo:h];
+        ttl = MAX_TTL;
+    } else {
+        addrs = [self resolveService:h ttl:&ttl];
+        if (addrs.count == 0) {
+            addrs = [self getAddrInfo:h];
+            ttl = DEFAULT_TTL;
+        }
+    }
+    
+    @synchronized(self) {
+        if (addrs.count == 0) {
+            //解析失败时继续使用过期的结果
+            DNSEntry *entry = [self.entries objectForKey:host];
+            return entry.addresses;
+        }
+        DNSEntry *entry = [[DNSEntry alloc] init];
+        entry.addresses = addrs;
+        entry.expire = now + MAX(MIN_TTL, MIN(ttl ? ttl : DEFAULT_TTL, MAX_TTL));
+        [self.entries setObject:entry forKey:host];
+    }
+    IMLogI("dns host:%s addresses:%d ttl:%d", [host UTF8String], (int)addrs.count, ttl);
+    return addrs;
+}
+
+-(NSArray*)addressesForHost:(NSString*)host {
+    if (host.length == 0) {
+        return nil;
+    }
+    DNSEntry *entry = nil;
+    @synchronized(self) {
+        entry = [self.entries objectForKey:host];
+    }
+    if (!entry || entry.expire <= [[NSProcessInfo processInfo] systemUptime]) {
+        [self refresh:host];
+    }
+    return entry.addresses;
+}
+
+-(void)refresh:(NSString*)host {
+    @synchronized(self) {
+        if ([self.refreshing containsObject:host]) {
+            return;
+        }
+        [self.refreshing addObject:host];
+    }
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), ^{
+        [self resolve:host];
+        @synchronized(self) {
+            [self.refreshing removeObject:host];
+        }
+    });
+}
+
+-(NSString*)resolveIP:(NSString*)host family:(int)family {
+    for (NSData *addr in [self resolve:host]) {
+        const struct sockaddr *sa = (const struct sockaddr*)[addr bytes];
+        if (sa->sa_family == family) {
+            return [DNSCache addressToString:addr];
+        }
+    }
+    return nil;
+}
+
+@end
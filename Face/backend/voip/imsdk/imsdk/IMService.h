@@ -44,6 +44,9 @@
 @protocol PeerMessageObserver <NSObject>
 @optional
 -(void)onPeerMessage:(IMMessage*)msg;
+//一次读取收到的多条消息, 实现之后不再逐条调用onPeerMessage:
+//在这次读取中所有消息的ack回调之后调用
+-(void)onPeerMessages:(NSArray*)msgs;
 
 //服务器ack
 -(void)onPeerMessageACK:(int)msgLocalID uid:(int64_t)uid;
@@ -59,6 +62,8 @@
 @protocol GroupMessageObserver <NSObject>
 @optional
 -(void)onGroupMessage:(IMMessage*)msg;
+//同onPeerMessages:
+-(void)onGroupMessages:(NSArray*)msgs;
 -(void)onGroupMessageACK:(int)msgLocalID gid:(int64_t)gid;
 -(void)onGroupMessageFailure:(int)msgLocalID gid:(int64_t)gid;
 
@@ -68,6 +73,8 @@
 @protocol RoomMessageObserver <NSObject>
 @optional
 -(void)onRoomMessage:(RoomMessage*)rm;
+//同onPeerMessages:
+-(void)onRoomMessages:(NSArray*)rms;
 -(void)onRoomMessageACK:(RoomMessage*)rm;
 -(void)onRoomMessageFailure:(RoomMessage*)rm;
 
@@ -103,6 +110,19 @@
 
 @end
 
+//挂在IMService连接上的逻辑服务, 共用同一个socket、心跳、认证和发送缓冲区
+//新的服务实现这个协议注册命令范围, 而不是继承TCPConnection另外建立连接
+//自定义命令的消息体通过Message的registerCodec:codec:注册编解码(在start之前), 没有注册时为NSData
+@protocol IMChannel <NSObject>
+//收到注册范围内的命令, 在queue上调用
+-(void)handleMessage:(Message*)msg;
+@optional
+//连接认证完成或者会话恢复之后, 可以开始发送
+-(void)onChannelUsable;
+//连接断开
+-(void)onChannelClose;
+@end
+
 
 /*消息如何接收
  *1.初始化消息的同步key和所有超级群的同步key
@@ -121,6 +141,17 @@
 //离线消息的同步key
 @property(nonatomic) int64_t syncKey;
 
+//ACK合并发送的最大延迟(毫秒), 0表示每次读到数据处理完之后立即发送
+@property(nonatomic) int ackDelay;
+
+//短时间断开之后是否用会话票据恢复, 跳过认证和同步, 默认为YES
+@property(nonatomic) BOOL resumeSession;
+
+//是否和服务器协商压缩消息体, 默认为YES
+@property(nonatomic) BOOL compression;
+//不小于此长度的消息体才压缩
+@property(nonatomic) int compressThreshold;
+
 @property(nonatomic, weak)id<IMPeerMessageHandler> peerMessageHandler;
 @property(nonatomic, weak)id<IMGroupMessageHandler> groupMessageHandler;
 @property(nonatomic, weak)id<IMCustomerMessageHandler> customerMessageHandler;
@@ -141,6 +172,11 @@
                          customerAppID:(int64_t)customerAppID;
 -(BOOL)isCustomerMessageSending:(int)msgLocalID storeID:(int64_t)storeID;
 
+//最近消息的服务器ack延迟(毫秒), 不包括重发过的消息, p取值0~1, 如0.5, 0.99
+-(double)ackLatencyPercentile:(double)p;
+//最近连接从tcp建立到可用(认证并完成首次同步, 或者恢复会话)的耗时(毫秒)
+-(double)usableLatencyPercentile:(double)p resumed:(BOOL)resumed;
+
 -(BOOL)sendPeerMessage:(IMMessage*)msg;
 -(BOOL)sendGroupMessage:(IMMessage*)msg;
 -(BOOL)sendRoomMessage:(RoomMessage*)msg;
@@ -181,5 +217,16 @@
 
 -(BOOL)sendVOIPControl:(VOIPControl*)ctl;
 
+//注册[firstCmd, lastCmd]范围内的命令, 优先于IMService自己的处理方法
+//和已经注册的通道范围重叠, 或者包含IMService自己处理的命令(ack, 认证, 心跳等)时返回NO
+-(BOOL)addChannel:(id<IMChannel>)channel firstCmd:(int)firstCmd lastCmd:(int)lastCmd;
+-(void)removeChannel:(id<IMChannel>)channel;
+//连接可用时发送, 和IMService的消息共用seq, 连接断开或者正在恢复会话时返回NO, 不会重发
+-(BOOL)sendMessage:(Message*)msg;
+
+//protect method
+//注册命令的处理方法, 方法签名为-(void)handleXXX:(Message*)msg
+-(void)registerHandler:(SEL)sel cmd:(int)cmd;
+
 @end
 
@@ -10,34 +10,170 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #import "IMService.h"
+#import <objc/message.h>
 #import "AsyncTCP.h"
 #import "Message.h"
 #import "util.h"
+#import "frame_decoder.h"
+#import "fragment.h"
+#import "frame_deflate.h"
+#import "metrics.h"
+#import "imlog.h"
 #import "GOReachability.h"
+#import "PendingMessageTable.h"
+#import "ObserverRegistry.h"
 
 #define HEARTBEAT_HZ (180)
 
+//积压的ACK超过此数目时立即发送
+#define MAX_PENDING_ACK 64
+
+//重发定时器的间隔(毫秒)
+#define RETRANSMIT_TICK_MS 500
+//第一次重发前等待的tick数, 之后每次翻倍
+#define RETRANSMIT_TIMEOUT_TICKS 8
+#define RETRANSMIT_MAX_TIMEOUT_TICKS 64
+//从第一次发送开始超过这个tick数仍未ack则发送失败
+#define MESSAGE_EXPIRE_TICKS 240
+
+//保留最近的连接可用耗时样本数
+#define USABLE_LATENCY_SAMPLES 64
+
+//记录最近收到的点对点和群消息的数目, 用于过滤对方重发的消息
+#define RECENT_MESSAGE_COUNT 1024
+
 #define HOST  @"imnode2.gobelieve.io"
 #define PORT 23000
 
-@interface IMService()
+struct MessageHandler {
+    SEL sel;
+    IMP imp;
+};
+
+//个人或者一个超级群的消息同步状态
+@interface SyncState : NSObject
+@property(nonatomic) int64_t syncKey;
+//服务器通知的最新同步key
+@property(nonatomic) int64_t notifyKey;
+//同步请求已发出, 还没有收到sync end
+@property(nonatomic) BOOL syncing;
+//等待和其它同步请求合并发送
+@property(nonatomic) BOOL queued;
+//syncKey更新后还没有保存
+@property(nonatomic) BOOL dirty;
+@end
+
+@implementation SyncState
+@end
+
+//观察者可选方法对应的掩码位, 和创建注册表时的方法顺序一致
+enum {
+    PEER_ON_MESSAGE = 1 << 0,
+    PEER_ON_MESSAGES = 1 << 1,
+    PEER_ON_ACK = 1 << 2,
+    PEER_ON_FAILURE = 1 << 3,
+    PEER_ON_INPUTING = 1 << 4,
+};
+
+enum {
+    GROUP_ON_MESSAGE = 1 << 0,
+    GROUP_ON_MESSAGES = 1 << 1,
+    GROUP_ON_ACK = 1 << 2,
+    GROUP_ON_FAILURE = 1 << 3,
+    GROUP_ON_NOTIFICATION = 1 << 4,
+};
+
+enum {
+    ROOM_ON_MESSAGE = 1 << 0,
+    ROOM_ON_MESSAGES = 1 << 1,
+    ROOM_ON_ACK = 1 << 2,
+    ROOM_ON_FAILURE = 1 << 3,
+};
+
+enum {
+    CUSTOMER_ON_MESSAGE = 1 << 0,
+    CUSTOMER_ON_SUPPORT_MESSAGE = 1 << 1,
+    CUSTOMER_ON_ACK = 1 << 2,
+    CUSTOMER_ON_FAILURE = 1 << 3,
+};
+
+//系统消息和实时消息的观察者只有一个方法
+enum {
+    SYSTEM_ON_MESSAGE = 1 << 0,
+};
+
+enum {
+    RT_ON_MESSAGE = 1 << 0,
+};
+
+@interface IMService() {
+    struct frame_decoder _decoder;
+    //解码线程使用
+    struct frame_inflate _inflater;
+    //解码线程使用, 重组分片的消息
+    struct fragment_arena _arena;
+    //queue上使用
+    struct frame_deflate _deflater;
+    //以命令字为下标的消息处理表
+    struct MessageHandler _handlers[256];
+    //以命令字为下标的通道, 由channels持有
+    __unsafe_unretained id<IMChannel> _channels[256];
+    //完整认证和会话恢复两种情况下, 连接建立到可用的耗时(毫秒)
+    uint32_t _usableSamples[2][USABLE_LATENCY_SAMPLES];
+    int _usableCount[2];
+    int _usableIndex[2];
+}
 @property(nonatomic)int seq;
 @property(nonatomic)int64_t roomID;
-@property(nonatomic)NSMutableArray *peerObservers;
-@property(nonatomic)NSMutableArray *groupObservers;
-@property(nonatomic)NSMutableArray *roomObservers;
-@property(nonatomic)NSMutableArray *systemObservers;
-@property(nonatomic)NSMutableArray *customerServiceObservers;
+@property(nonatomic)ObserverRegistry *peerObservers;
+@property(nonatomic)ObserverRegistry *groupObservers;
+@property(nonatomic)ObserverRegistry *roomObservers;
+@property(nonatomic)ObserverRegistry *systemObservers;
+@property(nonatomic)ObserverRegistry *customerServiceObservers;
+//只通知栈顶的观察者
 @property(nonatomic)NSMutableArray *voipObservers;
-@property(nonatomic)NSMutableArray *rtObservers;
-
-@property(nonatomic)NSMutableData *data;
-@property(nonatomic)NSMutableDictionary *peerMessages;
-@property(nonatomic)NSMutableDictionary *groupMessages;
-@property(nonatomic)NSMutableDictionary *roomMessages;
-@property(nonatomic)NSMutableDictionary *customerServiceMessages;
-
-@property(nonatomic)NSMutableDictionary *groupSyncKeys;
+@property(nonatomic)ObserverRegistry *rtObservers;
+@property(nonatomic)NSMutableArray *channels;
+
+//一次读取中收到的消息, 处理完之后通知实现了批量方法的观察者
+@property(nonatomic)NSMutableArray *batchPeerMessages;
+@property(nonatomic)NSMutableArray *batchGroupMessages;
+@property(nonatomic)NSMutableArray *batchRoomMessages;
+
+//最近收到的消息的(命令, 发送者, 接收者, msgLocalID, 时间戳, 内容的hash), 按收到的顺序淘汰
+@property(nonatomic)NSMutableSet *recentMessageKeys;
+@property(nonatomic)NSMutableArray *recentMessageOrder;
+
+//等待ack的消息
+@property(nonatomic)PendingMessageTable *pendingMessages;
+@property(nonatomic)dispatch_source_t retransmitTimer;
+@property(nonatomic)BOOL retransmitTimerRunning;
+
+@property(nonatomic)SyncState *syncState;
+//gid -> SyncState
+@property(nonatomic)NSMutableDictionary *groupSyncStates;
+
+//发送消息时复用的序列化缓冲区
+@property(nonatomic)NSMutableData *sendBuffer;
+
+//等待合并发送的ACK
+@property(nonatomic)NSMutableArray *pendingACKs;
+@property(nonatomic)BOOL ackFlushScheduled;
+
+//服务器下发的会话票据, 断开之后在有效期内可以跳过认证和同步
+@property(nonatomic)SessionTicket *sessionTicket;
+//收到的最后一个服务器seq
+@property(nonatomic)int lastSeq;
+//连接断开的时间, systemUptime
+@property(nonatomic)NSTimeInterval closeTime;
+//恢复请求已发出, 还没有收到结果
+@property(nonatomic)BOOL resuming;
+//连接建立的时间, 为0表示已经可用
+@property(nonatomic)NSTimeInterval connectedTime;
+//当前连接使用的协议版本, 收到服务器的高版本帧之后升级
+@property(nonatomic)int wireVersion;
+//服务器同意压缩之后上行帧才压缩
+@property(nonatomic)BOOL compressing;
 @end
 
 @implementation IMService
@@ -52,75 +188,176 @@
     return im;
 }
 
--(id)init {
-    self = [super init];
+-(id)initWithQueue:(dispatch_queue_t)queue {
+    self = [super initWithQueue:queue];
     if (self) {
-        self.peerObservers = [NSMutableArray array];
-        self.groupObservers = [NSMutableArray array];
-        self.roomObservers = [NSMutableArray array];
-        self.systemObservers = [NSMutableArray array];
-        self.customerServiceObservers = [NSMutableArray array];
+        SEL peerSels[] = {@selector(onPeerMessage:), @selector(onPeerMessages:),
+            @selector(onPeerMessageACK:uid:), @selector(onPeerMessageFailure:uid:),
+            @selector(onPeerInputing:)};
+        self.peerObservers = [[ObserverRegistry alloc] initWithSelectors:peerSels count:5];
+        SEL groupSels[] = {@selector(onGroupMessage:), @selector(onGroupMessages:),
+            @selector(onGroupMessageACK:gid:), @selector(onGroupMessageFailure:gid:),
+            @selector(onGroupNotification:)};
+        self.groupObservers = [[ObserverRegistry alloc] initWithSelectors:groupSels count:5];
+        SEL roomSels[] = {@selector(onRoomMessage:), @selector(onRoomMessages:),
+            @selector(onRoomMessageACK:), @selector(onRoomMessageFailure:)};
+        self.roomObservers = [[ObserverRegistry alloc] initWithSelectors:roomSels count:4];
+        SEL systemSels[] = {@selector(onSystemMessage:)};
+        self.systemObservers = [[ObserverRegistry alloc] initWithSelectors:systemSels count:1];
+        SEL customerSels[] = {@selector(onCustomerMessage:), @selector(onCustomerSupportMessage:),
+            @selector(onCustomerMessageACK:), @selector(onCustomerMessageFailure:)};
+        self.customerServiceObservers = [[ObserverRegistry alloc] initWithSelectors:customerSels count:4];
+        SEL rtSels[] = {@selector(onRTMessage:)};
+        self.rtObservers = [[ObserverRegistry alloc] initWithSelectors:rtSels count:1];
         self.voipObservers = [NSMutableArray array];
-        self.rtObservers = [NSMutableArray array];
+        self.channels = [NSMutableArray array];
+        self.batchPeerMessages = [NSMutableArray array];
+        self.batchGroupMessages = [NSMutableArray array];
+        self.batchRoomMessages = [NSMutableArray array];
+        self.recentMessageKeys = [NSMutableSet set];
+        self.recentMessageOrder = [NSMutableArray array];
+        
+        frame_decoder_init(&_decoder);
+        frame_inflate_init(&_inflater);
+        fragment_arena_init(&_arena, FRAME_HEAD_SIZE);
+        frame_deflate_init(&_deflater, FRAME_DEFLATE_LEVEL);
+        self.pendingMessages = [[PendingMessageTable alloc] init];
         
-        self.data = [NSMutableData data];
-        self.peerMessages = [NSMutableDictionary dictionary];
-        self.groupMessages = [NSMutableDictionary dictionary];
-        self.roomMessages = [NSMutableDictionary dictionary];
-        self.customerServiceMessages = [NSMutableDictionary dictionary];
-        self.groupSyncKeys = [NSMutableDictionary dictionary];
+        __weak IMService *wself = self;
+        self.retransmitTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, self.queue);
+        dispatch_source_set_event_handler(self.retransmitTimer, ^{
+            [wself onRetransmitTimer];
+        });
+        dispatch_source_set_timer(self.retransmitTimer, DISPATCH_TIME_NOW,
+                                  RETRANSMIT_TICK_MS*NSEC_PER_MSEC, RETRANSMIT_TICK_MS*NSEC_PER_MSEC/10);
+        self.syncState = [[SyncState alloc] init];
+        self.groupSyncStates = [NSMutableDictionary dictionary];
+        self.sendBuffer = [NSMutableData dataWithCapacity:4*1024];
+        self.pendingACKs = [NSMutableArray array];
+        self.wireVersion = PROTOCOL_VERSION_1;
+        self.compression = YES;
+        self.compressThreshold = FRAME_DEFLATE_THRESHOLD;
         
         self.host = HOST;
         self.port = PORT;
         self.heartbeatHZ = HEARTBEAT_HZ;
         self.isSync = YES;
+        self.resumeSession = YES;
+
+        [self registerHandler:@selector(handleAuthStatus:) cmd:MSG_AUTH_STATUS];
+        [self registerHandler:@selector(handleACK:) cmd:MSG_ACK];
+        [self registerHandler:@selector(handleIMMessage:) cmd:MSG_IM];
+        [self registerHandler:@selector(handleGroupIMMessage:) cmd:MSG_GROUP_IM];
+        [self registerHandler:@selector(handleInputing:) cmd:MSG_INPUTING];
+        [self registerHandler:@selector(handlePong:) cmd:MSG_PONG];
+        [self registerHandler:@selector(handleGroupNotification:) cmd:MSG_GROUP_NOTIFICATION];
+        [self registerHandler:@selector(handleRoomMessage:) cmd:MSG_ROOM_IM];
+        [self registerHandler:@selector(handleSystemMessage:) cmd:MSG_SYSTEM];
+        [self registerHandler:@selector(handleCustomerMessage:) cmd:MSG_CUSTOMER];
+        [self registerHandler:@selector(handleCustomerSupportMessage:) cmd:MSG_CUSTOMER_SUPPORT];
+        [self registerHandler:@selector(handleVOIPControl:) cmd:MSG_VOIP_CONTROL];
+        [self registerHandler:@selector(handleRTMessage:) cmd:MSG_RT];
+        [self registerHandler:@selector(handleSyncNotify:) cmd:MSG_SYNC_NOTIFY];
+        [self registerHandler:@selector(handleSyncBegin:) cmd:MSG_SYNC_BEGIN];
+        [self registerHandler:@selector(handleSyncEnd:) cmd:MSG_SYNC_END];
+        [self registerHandler:@selector(handleSyncGroupNotify:) cmd:MSG_SYNC_GROUP_NOTIFY];
+        [self registerHandler:@selector(handleSyncGroupBegin:) cmd:MSG_SYNC_GROUP_BEGIN];
+        [self registerHandler:@selector(handleSyncGroupEnd:) cmd:MSG_SYNC_GROUP_END];
+        [self registerHandler:@selector(handleSessionTicket:) cmd:MSG_SESSION_TICKET];
+        [self registerHandler:@selector(handleResumeStatus:) cmd:MSG_RESUME_STATUS];
     }
     return self;
 }
 
+-(void)registerHandler:(SEL)sel cmd:(int)cmd {
+    struct MessageHandler *h = &_handlers[(uint8_t)cmd];
+    h->sel = sel;
+    h->imp = sel ? [self methodForSelector:sel] : NULL;
+}
+
+-(void)dealloc {
+    frame_decoder_free(&_decoder);
+    frame_inflate_free(&_inflater);
+    fragment_arena_free(&_arena);
+    frame_deflate_free(&_deflater);
+    //挂起状态的source不能直接释放
+    if (!self.retransmitTimerRunning) {
+        dispatch_resume(self.retransmitTimer);
+    }
+    dispatch_source_cancel(self.retransmitTimer);
+}
+
 -(void)handleACK:(Message*)msg {
     NSNumber *seq = (NSNumber*)msg.body;
-    IMMessage *m = (IMMessage*)[self.peerMessages objectForKey:seq];
-    IMMessage *m2 = (IMMessage*)[self.groupMessages objectForKey:seq];
-    RoomMessage *m3 = (RoomMessage*)[self.roomMessages objectForKey:seq];
-    CustomerMessage *m4 = [self.customerServiceMessages objectForKey:seq];
-    if (!m && !m2 && !m3 && !m4) {
+    PendingMessage *pending = [self.pendingMessages ackMessageForSeq:[seq intValue]];
+    if (!pending) {
         return;
     }
-    if (m) {
-        [self.peerMessageHandler handleMessageACK:m.msgLocalID uid:m.receiver];
-        [self.peerMessages removeObjectForKey:seq];
-        [self publishPeerMessageACK:m.msgLocalID uid:m.receiver];
-    } else if (m2) {
-        [self.groupMessageHandler handleMessageACK:m2.msgLocalID gid:m2.receiver];
-        [self.groupMessages removeObjectForKey:seq];
-        [self publishGroupMessageACK:m2.msgLocalID gid:m2.receiver];
-    } else if (m3) {
-        [self.roomMessages removeObjectForKey:seq];
-        [self publishRoomMessageACK:m3];
-    } else if (m4) {
-        [self.customerMessageHandler handleMessageACK:m4];
-        [self.customerServiceMessages removeObjectForKey:seq];
-        [self publishCustomerMessageACK:m4];
+    switch (pending.kind) {
+        case PENDING_PEER: {
+            IMMessage *m = pending.message;
+            [self.peerMessageHandler handleMessageACK:m.msgLocalID uid:m.receiver];
+            [self publishPeerMessageACK:m.msgLocalID uid:m.receiver];
+            break;
+        }
+        case PENDING_GROUP: {
+            IMMessage *m = pending.message;
+            [self.groupMessageHandler handleMessageACK:m.msgLocalID gid:m.receiver];
+            [self publishGroupMessageACK:m.msgLocalID gid:m.receiver];
+            break;
+        }
+        case PENDING_ROOM:
+            [self publishRoomMessageACK:pending.message];
+            break;
+        case PENDING_CUSTOMER:
+        case PENDING_CUSTOMER_SUPPORT:
+            [self.customerMessageHandler handleMessageACK:pending.message];
+            [self publishCustomerMessageACK:pending.message];
+            break;
     }
 }
 
+//发送方没有收到ack时用新的seq重发, 服务器已经保存过的消息会再次下发
+//msgLocalID是发送设备上的本地id, 同一个用户的不同设备会重复, 加上时间戳和内容区分
+//重发的消息这几项都相同, 只回调一次
+-(BOOL)isDuplicateMessage:(int)cmd message:(IMMessage*)im {
+    if (im.msgLocalID == 0) {
+        return NO;
+    }
+    NSString *key = [NSString stringWithFormat:@"%d:%lld:%lld:%d:%d:%lu", cmd, im.sender, im.receiver,
+                     im.msgLocalID, im.timestamp, (unsigned long)[im.content hash]];
+    if ([self.recentMessageKeys containsObject:key]) {
+        return YES;
+    }
+    [self.recentMessageKeys addObject:key];
+    [self.recentMessageOrder addObject:key];
+    if (self.recentMessageOrder.count > RECENT_MESSAGE_COUNT) {
+        [self.recentMessageKeys removeObject:[self.recentMessageOrder objectAtIndex:0]];
+        [self.recentMessageOrder removeObjectAtIndex:0];
+    }
+    return NO;
+}
+
 -(void)handleIMMessage:(Message*)msg {
     IMMessage *im = (IMMessage*)msg.body;
+    if ([self isDuplicateMessage:MSG_IM message:im]) {
+        IMLogI("duplicate peer message sender:%lld msgLocalID:%d", im.sender, im.msgLocalID);
+        [self sendACK:msg.seq];
+        return;
+    }
     if (self.uid == im.sender) {
         [self.peerMessageHandler handleMessage:im uid:im.receiver];
     } else {
         [self.peerMessageHandler handleMessage:im uid:im.sender];
     }
-    NSLog(@"peer message sender:%lld receiver:%lld content:%s", im.sender, im.receiver, [im.content UTF8String]);
+    IMLogD("peer message sender:%lld receiver:%lld msgLocalID:%d length:%d", im.sender, im.receiver, im.msgLocalID, (int)im.content.length);
     
-    Message *ack = [[Message alloc] init];
-    ack.cmd = MSG_ACK;
-    ack.body = [NSNumber numberWithInt:msg.seq];
-    [self sendMessage:ack];
+    [self sendACK:msg.seq];
     [self publishPeerMessage:im];
     
     if (self.uid == im.sender) {
+        //重发的消息已经被服务器收到
+        [self removePendingMessage:PENDING_PEER receiver:im.receiver msgLocalID:im.msgLocalID];
         [self.peerMessageHandler handleMessageACK:im.msgLocalID uid:im.receiver];
         [self publishPeerMessageACK:im.msgLocalID uid:im.receiver];
     }
@@ -128,15 +365,18 @@
 
 -(void)handleGroupIMMessage:(Message*)msg {
     IMMessage *im = (IMMessage*)msg.body;
+    if ([self isDuplicateMessage:MSG_GROUP_IM message:im]) {
+        IMLogI("duplicate group message sender:%lld gid:%lld msgLocalID:%d", im.sender, im.receiver, im.msgLocalID);
+        [self sendACK:msg.seq];
+        return;
+    }
     [self.groupMessageHandler handleMessage:im];
-    NSLog(@"group message sender:%lld receiver:%lld content:%s", im.sender, im.receiver, [im.content UTF8String]);
-    Message *ack = [[Message alloc] init];
-    ack.cmd = MSG_ACK;
-    ack.body = [NSNumber numberWithInt:msg.seq];
-    [self sendMessage:ack];
+    IMLogD("group message sender:%lld receiver:%lld msgLocalID:%d length:%d", im.sender, im.receiver, im.msgLocalID, (int)im.content.length);
+    [self sendACK:msg.seq];
     [self publishGroupMessage:im];
     
     if (im.sender == self.uid) {
+        [self removePendingMessage:PENDING_GROUP receiver:im.receiver msgLocalID:im.msgLocalID];
         [self.groupMessageHandler handleMessageACK:im.msgLocalID gid:im.receiver];
         [self publishGroupMessageACK:im.msgLocalID gid:im.receiver];
     }
@@ -146,13 +386,10 @@
     CustomerMessage *im = (CustomerMessage*)msg.body;
     [self.customerMessageHandler handleCustomerSupportMessage:im];
     
-    NSLog(@"customer support message customer id:%lld customer appid:%lld store id:%lld seller id:%lld content:%s",
-          im.customerID, im.customerAppID, im.storeID, im.sellerID, [im.content UTF8String]);
+    IMLogD("customer support message customer id:%lld customer appid:%lld store id:%lld seller id:%lld length:%d",
+          im.customerID, im.customerAppID, im.storeID, im.sellerID, (int)im.content.length);
     
-    Message *ack = [[Message alloc] init];
-    ack.cmd = MSG_ACK;
-    ack.body = [NSNumber numberWithInt:msg.seq];
-    [self sendMessage:ack];
+    [self sendACK:msg.seq];
     [self publishCustomerSupportMessage:im];
     
     //客服端收到发自客服的消息
@@ -166,13 +403,10 @@
     CustomerMessage *im = (CustomerMessage*)msg.body;
     [self.customerMessageHandler handleMessage:im];
     
-    NSLog(@"customer message customer id:%lld customer appid:%lld store id:%lld seller id:%lld content:%s",
-          im.customerID, im.customerAppID, im.storeID, im.sellerID, [im.content UTF8String]);
+    IMLogD("customer message customer id:%lld customer appid:%lld store id:%lld seller id:%lld length:%d",
+          im.customerID, im.customerAppID, im.storeID, im.sellerID, (int)im.content.length);
     
-    Message *ack = [[Message alloc] init];
-    ack.cmd = MSG_ACK;
-    ack.body = [NSNumber numberWithInt:msg.seq];
-    [self sendMessage:ack];
+    [self sendACK:msg.seq];
     [self publishCustomerMessage:im];
     
     //客户收到发自客户自己的消息
@@ -184,31 +418,100 @@
 
 -(void)handleRTMessage:(Message*)msg {
     RTMessage *rt = (RTMessage*)msg.body;
-    for (id<RTMessageObserver> ob in self.rtObservers) {
-        if ([ob respondsToSelector:@selector(onRTMessage:)]) {
-            [ob onRTMessage:rt];
-        }
-    }
+    [self publish:self.rtObservers bit:RT_ON_MESSAGE sel:@selector(onRTMessage:) object:rt];
 }
 
 -(void)handleAuthStatus:(Message*)msg {
+    AuthenticationStatus *auth = (AuthenticationStatus*)msg.body;
+    IMLogI("auth status:%d retry after:%d", auth.status, auth.retryAfter);
+    if (auth.status != 0) {
+        //失效的accesstoken或者服务器过载, 退避之后重新连接
+        [self reconnect:auth.retryAfter];
+        return;
+    }
+    if (self.roomID > 0) {
+        [self sendEnterRoom:self.roomID];
+    }
+    if (!self.isSync) {
+        [self onUsable:NO];
+    }
+}
+
+-(void)handleSessionTicket:(Message*)msg {
+    SessionTicket *ticket = (SessionTicket*)msg.body;
+    IMLogD("session ticket ttl:%d", ticket.ttl);
+    self.sessionTicket = ticket;
+}
+
+-(void)handleResumeStatus:(Message*)msg {
+    if (!self.resuming) {
+        return;
+    }
+    self.resuming = NO;
     int status = [(NSNumber*)msg.body intValue];
-    NSLog(@"auth status:%d", status);
     if (status != 0) {
-        //失效的accesstoken,2s后重新连接
-        [self reconnect2S];
+        //票据过期或者服务器已经丢弃了会话, 在同一个连接上重新认证
+        IMLogW("resume session fail:%d", status);
+        [self startSession];
         return;
     }
+    IMLogI("session resumed");
     if (self.roomID > 0) {
         [self sendEnterRoom:self.roomID];
     }
+    //恢复期间推迟的同步请求和消息
+    [self flushSync];
+    [self resendPendingMessages];
+    [self onUsable:YES];
+}
+
+//完成认证和首次同步, 或者恢复会话之后连接可用
+-(void)onUsable:(BOOL)resumed {
+    if (self.connectedTime == 0) {
+        return;
+    }
+    double ms = ([[NSProcessInfo processInfo] systemUptime] - self.connectedTime)*1000;
+    self.connectedTime = 0;
+    IMLogI("connection usable in %.0fms resumed:%d", ms, resumed);
+    metrics_add(resumed ? METRIC_RESUMES : METRIC_AUTHS, 1);
+    metrics_observe(resumed ? METRIC_RESUME_TIME : METRIC_AUTH_TIME, (uint64_t)(ms*1000));
+    
+    int i = resumed ? 1 : 0;
+    _usableSamples[i][_usableIndex[i]] = (uint32_t)ms;
+    _usableIndex[i] = (_usableIndex[i] + 1) % USABLE_LATENCY_SAMPLES;
+    _usableCount[i] = MIN(_usableCount[i] + 1, USABLE_LATENCY_SAMPLES);
+
+    for (id<IMChannel> channel in [self.channels copy]) {
+        if ([channel respondsToSelector:@selector(onChannelUsable)]) {
+            [channel onChannelUsable];
+        }
+    }
+}
+
+static int compareSample(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+-(double)usableLatencyPercentile:(double)p resumed:(BOOL)resumed {
+    int i = resumed ? 1 : 0;
+    if (_usableCount[i] == 0) {
+        return 0;
+    }
+    uint32_t sorted[USABLE_LATENCY_SAMPLES];
+    memcpy(sorted, _usableSamples[i], _usableCount[i]*sizeof(uint32_t));
+    qsort(sorted, _usableCount[i], sizeof(uint32_t), compareSample);
+    p = MAX(0, MIN(p, 1));
+    return sorted[(int)((_usableCount[i] - 1)*p)];
 }
 
 -(void)handleInputing:(Message*)msg {
     MessageInputing *inputing = (MessageInputing*)msg.body;
-    for (id<PeerMessageObserver> ob in self.peerObservers) {
-        if ([ob respondsToSelector:@selector(onPeerInputing:)]) {
-            [ob onPeerInputing:inputing.sender];
+    ObserverSnapshot *s = self.peerObservers.snapshot;
+    for (int i = 0; i < s->count; i++) {
+        if (s->entries[i].mask & PEER_ON_INPUTING) {
+            [s->entries[i].observer onPeerInputing:inputing.sender];
         }
     }
 }
@@ -219,18 +522,11 @@
 
 -(void)handleGroupNotification:(Message*)msg {
     NSString *notification = (NSString*)msg.body;
-    NSLog(@"group notification:%@", notification);
+    IMLogD("group notification length:%d", (int)notification.length);
     [self.groupMessageHandler handleGroupNotification:notification];
-    for (id<GroupMessageObserver> ob in self.groupObservers) {
-        if ([ob respondsToSelector:@selector(onGroupNotification:)]) {
-            [ob onGroupNotification:notification];
-        }
-    }
+    [self publish:self.groupObservers bit:GROUP_ON_NOTIFICATION sel:@selector(onGroupNotification:) object:notification];
     
-    Message *ack = [[Message alloc] init];
-    ack.cmd = MSG_ACK;
-    ack.body = [NSNumber numberWithInt:msg.seq];
-    [self sendMessage:ack];
+    [self sendACK:msg.seq];
 }
 
 -(void)handleRoomMessage:(Message*)msg {
@@ -242,61 +538,125 @@
     NSString *sys = (NSString*)msg.body;
     [self publishSystemMessage:sys];
     
-    Message *ack = [[Message alloc] init];
-    ack.cmd = MSG_ACK;
-    ack.body = [NSNumber numberWithInt:msg.seq];
-    [self sendMessage:ack];
+    [self sendACK:msg.seq];
 }
 
 -(void)handleSyncBegin:(Message*)msg {
-    NSLog(@"sync begin...:%@", msg.body);
+    IMLogD("sync begin:%lld", [(NSNumber*)msg.body longLongValue]);
 }
 
 -(void)handleSyncEnd:(Message*)msg {
-    NSLog(@"sync end...:%@", msg.body);
+    IMLogD("sync end:%lld", [(NSNumber*)msg.body longLongValue]);
     
     NSNumber *newSyncKey = (NSNumber*)msg.body;
-    if ([newSyncKey longLongValue] > self.syncKey) {
-        self.syncKey = [newSyncKey longLongValue];
-        [self.syncKeyHandler saveSyncKey:self.syncKey];
-    }
+    [self endSync:self.syncState syncKey:[newSyncKey longLongValue]];
+    [self onUsable:NO];
 }
 
 -(void)handleSyncNotify:(Message*)msg {
-    NSLog(@"sync notify:%@", msg.body);
+    IMLogD("sync notify:%lld", [(NSNumber*)msg.body longLongValue]);
     NSNumber *newSyncKey = (NSNumber*)msg.body;
-    
-    if ([newSyncKey longLongValue] > self.syncKey) {
-        [self sendSync:self.syncKey];
-    }
+    [self notifySync:self.syncState syncKey:[newSyncKey longLongValue]];
 }
 
 -(void)handleSyncGroupBegin:(Message*)msg {
     GroupSyncKey *groupSyncKey = (GroupSyncKey*)msg.body;
-    NSLog(@"sync group begin:%lld %lld", groupSyncKey.groupID, groupSyncKey.syncKey);
+    IMLogD("sync group begin:%lld %lld", groupSyncKey.groupID, groupSyncKey.syncKey);
 }
 
 -(void)handleSyncGroupEnd:(Message*)msg {
     GroupSyncKey *groupSyncKey = (GroupSyncKey*)msg.body;
-    NSLog(@"sync group end:%lld %lld", groupSyncKey.groupID, groupSyncKey.syncKey);
-    
-    NSNumber *originSyncKey = [self.groupSyncKeys objectForKey:[NSNumber numberWithLongLong:groupSyncKey.groupID]];
+    IMLogD("sync group end:%lld %lld", groupSyncKey.groupID, groupSyncKey.syncKey);
     
-    if (groupSyncKey.syncKey > [originSyncKey longLongValue]) {
-        [self.groupSyncKeys setObject:[NSNumber numberWithLongLong:groupSyncKey.syncKey] forKey:[NSNumber numberWithLongLong:groupSyncKey.groupID]];
-        [self.syncKeyHandler saveGroupSyncKey:groupSyncKey.syncKey gid:groupSyncKey.groupID];
+    //同步过程中被移除的超级群直接忽略
+    SyncState *state = [self.groupSyncStates objectForKey:[NSNumber numberWithLongLong:groupSyncKey.groupID]];
+    if (state) {
+        [self endSync:state syncKey:groupSyncKey.syncKey];
     }
-    
 }
 
 -(void)handleSyncGroupNotify:(Message*)msg {
     GroupSyncKey *groupSyncKey = (GroupSyncKey*)msg.body;
-    NSLog(@"sync group notify:%lld %lld", groupSyncKey.groupID, groupSyncKey.syncKey);
+    IMLogD("sync group notify:%lld %lld", groupSyncKey.groupID, groupSyncKey.syncKey);
     
-    NSNumber *originSyncKey = [self.groupSyncKeys objectForKey:[NSNumber numberWithLongLong:groupSyncKey.groupID]];
+    NSNumber *k = [NSNumber numberWithLongLong:groupSyncKey.groupID];
+    SyncState *state = [self.groupSyncStates objectForKey:k];
+    if (!state) {
+        state = [[SyncState alloc] init];
+        [self.groupSyncStates setObject:state forKey:k];
+    }
+    [self notifySync:state syncKey:groupSyncKey.syncKey];
+}
+
+//同步请求在途时收到的通知只记录最新的key, 等sync end之后再决定是否继续同步
+-(void)notifySync:(SyncState*)state syncKey:(int64_t)syncKey {
+    if (syncKey <= state.syncKey) {
+        return;
+    }
+    state.notifyKey = MAX(state.notifyKey, syncKey);
+    if (!state.syncing) {
+        state.queued = YES;
+    }
+}
+
+-(void)endSync:(SyncState*)state syncKey:(int64_t)syncKey {
+    state.syncing = NO;
+    if (syncKey > state.syncKey) {
+        state.syncKey = syncKey;
+        state.dirty = YES;
+    }
+    if (state.notifyKey > state.syncKey) {
+        state.queued = YES;
+    }
+}
+
+//所有排队的同步请求合并成一次写
+-(void)flushSync {
+    if (!self.tcp || self.connectState != STATE_CONNECTED || self.resuming) {
+        return;
+    }
     
-    if (groupSyncKey.syncKey > [originSyncKey longLongValue]) {
-        [self sendGroupSyncKey:[originSyncKey longLongValue] gid:groupSyncKey.groupID];
+    [self.sendBuffer setLength:0];
+    if (self.syncState.queued) {
+        Message *msg = [[Message alloc] init];
+        msg.cmd = MSG_SYNC;
+        msg.body = [NSNumber numberWithLongLong:self.syncState.syncKey];
+        [self packMessage:msg];
+        self.syncState.queued = NO;
+        self.syncState.syncing = YES;
+    }
+    
+    for (NSNumber *k in self.groupSyncStates) {
+        SyncState *state = [self.groupSyncStates objectForKey:k];
+        if (!state.queued) {
+            continue;
+        }
+        Message *msg = [[Message alloc] init];
+        msg.cmd = MSG_SYNC_GROUP;
+        GroupSyncKey *s = [[GroupSyncKey alloc] init];
+        s.groupID = [k longLongValue];
+        s.syncKey = state.syncKey;
+        msg.body = s;
+        [self packMessage:msg];
+        state.queued = NO;
+        state.syncing = YES;
+    }
+    
+    [self writeSendBuffer:SEND_CLASS_BULK];
+}
+
+//一批消息处理完之后才保存同步key
+-(void)saveSyncKeys {
+    if (self.syncState.dirty) {
+        self.syncState.dirty = NO;
+        [self.syncKeyHandler saveSyncKey:self.syncState.syncKey];
+    }
+    for (NSNumber *k in self.groupSyncStates) {
+        SyncState *state = [self.groupSyncStates objectForKey:k];
+        if (state.dirty) {
+            state.dirty = NO;
+            [self.syncKeyHandler saveGroupSyncKey:state.syncKey gid:[k longLongValue]];
+        }
     }
 }
 
@@ -308,235 +668,284 @@
     }
 }
 
--(void)publishPeerMessage:(IMMessage*)msg {
-    for (id<PeerMessageObserver> ob in self.peerObservers) {
-        if ([ob respondsToSelector:@selector(onPeerMessage:)]) {
-            [ob onPeerMessage:msg];
+//通知实现了bit对应方法的观察者, 方法只有一个对象参数
+-(void)publish:(ObserverRegistry*)registry bit:(uint32_t)bit sel:(SEL)sel object:(id)obj {
+    [self publish:registry bit:bit except:0 sel:sel object:obj];
+}
+
+//跳过实现了except对应方法的观察者
+-(void)publish:(ObserverRegistry*)registry bit:(uint32_t)bit except:(uint32_t)except sel:(SEL)sel object:(id)obj {
+    ObserverSnapshot *s = registry.snapshot;
+    if (!(s->mask & bit)) {
+        return;
+    }
+    for (int i = 0; i < s->count; i++) {
+        if ((s->entries[i].mask & (bit | except)) == bit) {
+            ((void (*)(id, SEL, id))objc_msgSend)(s->entries[i].observer, sel, obj);
         }
     }
 }
 
+-(void)publishPeerMessage:(IMMessage*)msg {
+    if (self.peerObservers.snapshot->mask & PEER_ON_MESSAGES) {
+        [self.batchPeerMessages addObject:msg];
+    }
+    [self publish:self.peerObservers bit:PEER_ON_MESSAGE except:PEER_ON_MESSAGES
+              sel:@selector(onPeerMessage:) object:msg];
+}
+
 -(void)publishPeerMessageACK:(int)msgLocalID uid:(int64_t)uid {
-    for (id<PeerMessageObserver> ob in self.peerObservers) {
-        if ([ob respondsToSelector:@selector(onPeerMessageACK:uid:)]) {
-            [ob onPeerMessageACK:msgLocalID uid:uid];
+    ObserverSnapshot *s = self.peerObservers.snapshot;
+    for (int i = 0; i < s->count; i++) {
+        if (s->entries[i].mask & PEER_ON_ACK) {
+            [s->entries[i].observer onPeerMessageACK:msgLocalID uid:uid];
         }
     }
 }
 
 -(void)publishPeerMessageFailure:(IMMessage*)msg {
-    for (id<PeerMessageObserver> ob in self.peerObservers) {
-        if ([ob respondsToSelector:@selector(onPeerMessageFailure:uid:)]) {
-            [ob onPeerMessageFailure:msg.msgLocalID uid:msg.receiver];
+    ObserverSnapshot *s = self.peerObservers.snapshot;
+    for (int i = 0; i < s->count; i++) {
+        if (s->entries[i].mask & PEER_ON_FAILURE) {
+            [s->entries[i].observer onPeerMessageFailure:msg.msgLocalID uid:msg.receiver];
         }
     }
 }
 
 -(void)publishGroupMessage:(IMMessage*)msg {
-    for (id<GroupMessageObserver> ob in self.groupObservers) {
-        if ([ob respondsToSelector:@selector(onGroupMessage:)]) {
-            [ob onGroupMessage:msg];
-        }
+    if (self.groupObservers.snapshot->mask & GROUP_ON_MESSAGES) {
+        [self.batchGroupMessages addObject:msg];
     }
+    [self publish:self.groupObservers bit:GROUP_ON_MESSAGE except:GROUP_ON_MESSAGES
+              sel:@selector(onGroupMessage:) object:msg];
 }
 
 -(void)publishGroupMessageACK:(int)msgLocalID gid:(int64_t)gid {
-    for (id<GroupMessageObserver> ob in self.groupObservers) {
-        if ([ob respondsToSelector:@selector(onGroupMessageACK:gid:)]) {
-            [ob onGroupMessageACK:msgLocalID gid:gid];
+    ObserverSnapshot *s = self.groupObservers.snapshot;
+    for (int i = 0; i < s->count; i++) {
+        if (s->entries[i].mask & GROUP_ON_ACK) {
+            [s->entries[i].observer onGroupMessageACK:msgLocalID gid:gid];
         }
     }
 }
 
 -(void)publishGroupMessageFailure:(IMMessage*)msg {
-    for (id<GroupMessageObserver> ob in self.groupObservers) {
-        if ([ob respondsToSelector:@selector(onGroupMessageFailure:gid:)]) {
-            [ob onGroupMessageFailure:msg.msgLocalID gid:msg.receiver];
+    ObserverSnapshot *s = self.groupObservers.snapshot;
+    for (int i = 0; i < s->count; i++) {
+        if (s->entries[i].mask & GROUP_ON_FAILURE) {
+            [s->entries[i].observer onGroupMessageFailure:msg.msgLocalID gid:msg.receiver];
         }
     }
 }
 
 -(void)publishRoomMessage:(RoomMessage*)msg {
-    for (id<RoomMessageObserver> ob in self.roomObservers) {
-        if ([ob respondsToSelector:@selector(onRoomMessage:)]) {
-            [ob onRoomMessage:msg];
-        }
+    if (self.roomObservers.snapshot->mask & ROOM_ON_MESSAGES) {
+        [self.batchRoomMessages addObject:msg];
     }
+    [self publish:self.roomObservers bit:ROOM_ON_MESSAGE except:ROOM_ON_MESSAGES
+              sel:@selector(onRoomMessage:) object:msg];
 }
 
 -(void)publishRoomMessageACK:(RoomMessage*)msg {
-    for (id<RoomMessageObserver> ob in self.roomObservers) {
-        if ([ob respondsToSelector:@selector(onRoomMessageACK:)]) {
-            [ob onRoomMessageACK:msg];
-        }
-    }
+    [self publish:self.roomObservers bit:ROOM_ON_ACK sel:@selector(onRoomMessageACK:) object:msg];
 }
 
 -(void)publishRoomMessageFailure:(RoomMessage*)msg {
-    for (id<RoomMessageObserver> ob in self.roomObservers) {
-        if ([ob respondsToSelector:@selector(onRoomMessageFailure:)]) {
-            [ob onRoomMessageFailure:msg];
-        }
-    }
+    [self publish:self.roomObservers bit:ROOM_ON_FAILURE sel:@selector(onRoomMessageFailure:) object:msg];
 }
 
 -(void)publishSystemMessage:(NSString*)sys {
-    for (id<SystemMessageObserver> ob in self.systemObservers) {
-        if ([ob respondsToSelector:@selector(onSystemMessage:)]) {
-            [ob onSystemMessage:sys];
-        }
-    }
+    [self publish:self.systemObservers bit:SYSTEM_ON_MESSAGE sel:@selector(onSystemMessage:) object:sys];
 }
 
 -(void)publishCustomerSupportMessage:(CustomerMessage*)msg {
-    for (id<CustomerMessageObserver> ob in self.customerServiceObservers) {
-        if ([ob respondsToSelector:@selector(onCustomerSupportMessage:)]) {
-            [ob onCustomerSupportMessage:msg];
-        }
-    }
+    [self publish:self.customerServiceObservers bit:CUSTOMER_ON_SUPPORT_MESSAGE
+              sel:@selector(onCustomerSupportMessage:) object:msg];
 }
 
 -(void)publishCustomerMessage:(CustomerMessage*)msg {
-    for (id<CustomerMessageObserver> ob in self.customerServiceObservers) {
-        if ([ob respondsToSelector:@selector(onCustomerMessage:)]) {
-            [ob onCustomerMessage:msg];
-        }
-    }
+    [self publish:self.customerServiceObservers bit:CUSTOMER_ON_MESSAGE
+              sel:@selector(onCustomerMessage:) object:msg];
 }
 
 -(void)publishCustomerMessageACK:(CustomerMessage*)msg {
-    for (id<CustomerMessageObserver> ob in self.customerServiceObservers) {
-        if ([ob respondsToSelector:@selector(onCustomerMessageACK:)]) {
-            [ob onCustomerMessageACK:msg];
-        }
-    }
+    [self publish:self.customerServiceObservers bit:CUSTOMER_ON_ACK
+              sel:@selector(onCustomerMessageACK:) object:msg];
 }
 
 -(void)publishCustomerMessageFailure:(CustomerMessage*)msg {
-    for (id<CustomerMessageObserver> ob in self.customerServiceObservers) {
-        if ([ob respondsToSelector:@selector(onCustomerMessageFailure:)]) {
-            [ob onCustomerMessageFailure:msg];
-        }
+    [self publish:self.customerServiceObservers bit:CUSTOMER_ON_FAILURE
+              sel:@selector(onCustomerMessageFailure:) object:msg];
+}
+
+//一次读取的消息处理完之后, 批量通知
+-(void)flushBatchMessages {
+    if (self.batchPeerMessages.count > 0) {
+        NSArray *msgs = self.batchPeerMessages;
+        self.batchPeerMessages = [NSMutableArray array];
+        [self publish:self.peerObservers bit:PEER_ON_MESSAGES sel:@selector(onPeerMessages:) object:msgs];
+    }
+    if (self.batchGroupMessages.count > 0) {
+        NSArray *msgs = self.batchGroupMessages;
+        self.batchGroupMessages = [NSMutableArray array];
+        [self publish:self.groupObservers bit:GROUP_ON_MESSAGES sel:@selector(onGroupMessages:) object:msgs];
+    }
+    if (self.batchRoomMessages.count > 0) {
+        NSArray *msgs = self.batchRoomMessages;
+        self.batchRoomMessages = [NSMutableArray array];
+        [self publish:self.roomObservers bit:ROOM_ON_MESSAGES sel:@selector(onRoomMessages:) object:msgs];
     }
 }
 
 -(void)handleMessage:(Message*)msg {
-    NSLog(@"message cmd:%d", msg.cmd);
-    if (msg.cmd == MSG_AUTH_STATUS) {
-        [self handleAuthStatus:msg];
-    } else if (msg.cmd == MSG_ACK) {
-        [self handleACK:msg];
-    } else if (msg.cmd == MSG_IM) {
-        [self handleIMMessage:msg];
-    } else if (msg.cmd == MSG_GROUP_IM) {
-        [self handleGroupIMMessage:msg];
-    } else if (msg.cmd == MSG_INPUTING) {
-        [self handleInputing:msg];
-    } else if (msg.cmd == MSG_PONG) {
-        [self handlePong:msg];
-    } else if (msg.cmd == MSG_GROUP_NOTIFICATION) {
-        [self handleGroupNotification:msg];
-    } else if (msg.cmd == MSG_ROOM_IM) {
-        [self handleRoomMessage:msg];
-    } else if (msg.cmd == MSG_SYSTEM) {
-        [self handleSystemMessage:msg];
-    } else if (msg.cmd == MSG_CUSTOMER) {
-        [self handleCustomerMessage:msg];
-    } else if (msg.cmd == MSG_CUSTOMER_SUPPORT) {
-        [self handleCustomerSupportMessage:msg];
-    } else if (msg.cmd == MSG_VOIP_CONTROL) {
-        [self handleVOIPControl:msg];
-    } else if (msg.cmd == MSG_RT) {
-        [self handleRTMessage:msg];
-    } else if (msg.cmd == MSG_SYNC_NOTIFY) {
-        [self handleSyncNotify:msg];
-    } else if (msg.cmd == MSG_SYNC_BEGIN) {
-        [self handleSyncBegin:msg];
-    } else if (msg.cmd == MSG_SYNC_END) {
-        [self handleSyncEnd:msg];
-    } else if (msg.cmd == MSG_SYNC_GROUP_NOTIFY) {
-        [self handleSyncGroupNotify:msg];
-    } else if (msg.cmd == MSG_SYNC_GROUP_BEGIN) {
-        [self handleSyncGroupBegin:msg];
-    } else if (msg.cmd == MSG_SYNC_GROUP_END) {
-        [self handleSyncGroupEnd:msg];
-    } else {
-        NSLog(@"cmd:%d no handler", msg.cmd);
+    IMLogD("message cmd:%d", msg.cmd);
+    id<IMChannel> channel = _channels[(uint8_t)msg.cmd];
+    if (channel) {
+        [channel handleMessage:msg];
+        return;
     }
+    const struct MessageHandler *h = &_handlers[(uint8_t)msg.cmd];
+    if (h->imp == NULL) {
+        IMLogW("cmd:%d no handler", msg.cmd);
+        return;
+    }
+    ((void (*)(id, SEL, Message*))h->imp)(self, h->sel, msg);
+}
+
+-(void)resetDecoder {
+    frame_decoder_reset(&_decoder);
+    frame_inflate_reset(&_inflater);
+    fragment_arena_reset(&_arena);
 }
 
--(BOOL)handleData:(NSData*)data {
-    [self.data appendData:data];
-    int pos = 0;
-    const uint8_t *p = [self.data bytes];
+-(BOOL)decodeData:(NSData*)data messages:(NSMutableArray*)messages {
+    if (frame_decoder_append(&_decoder, [data bytes], data.length) != 0) {
+        IMLogE("frame decoder out of memory");
+        return NO;
+    }
+    struct frame_view frame;
     while (YES) {
-        if (self.data.length < pos + 4) {
+        int r = frame_decoder_next(&_decoder, &frame);
+        if (r == 0) {
             break;
+        } else if (r < 0) {
+            IMLogE("invalid frame length");
+            return NO;
         }
-        int len = readInt32(p+pos);
-        if (self.data.length < 4 + 8 + pos + len) {
-            break;
+        const char *bytes = (const char*)frame.head;
+        int length = FRAME_HEAD_SIZE + frame.body_len;
+        NSMutableData *inflated = nil;
+        if (frame.head[6] & FRAME_FLAG_COMPRESSED) {
+            const uint8_t *body;
+            int n = frame_inflate_body(&_inflater, frame.body, frame.body_len, &body);
+            if (n < 0) {
+                IMLogE("inflate frame fail");
+                return NO;
+            }
+            inflated = [NSMutableData dataWithCapacity:FRAME_HEAD_SIZE + n];
+            [inflated appendBytes:frame.head length:FRAME_HEAD_SIZE];
+            [inflated appendBytes:body length:n];
+            bytes = (const char*)[inflated bytes];
+            length = (int)inflated.length;
+        }
+        if (bytes[4] == MSG_FRAGMENT) {
+            r = fragment_arena_add(&_arena, (const uint8_t*)bytes + FRAME_HEAD_SIZE, length - FRAME_HEAD_SIZE);
+            if (r < 0) {
+                IMLogE("invalid fragment");
+                return NO;
+            } else if (r == 0) {
+                continue;
+            }
+            //重组的消息使用最后一个分片的seq和版本
+            char *head = (char*)_arena.buf;
+            memcpy(head, bytes, FRAME_HEAD_SIZE);
+            head[4] = (uint8_t)_arena.cmd;
+            head[6] = 0;
+            bytes = head;
+            length = FRAME_HEAD_SIZE + _arena.total;
         }
-        NSData *tmp = [NSData dataWithBytes:p+4+pos length:len + 8];
         Message *msg = [[Message alloc] init];
-        if (![msg unpack:tmp]) {
-            NSLog(@"unpack message fail");
+        msg.uid = self.uid;
+        if (![msg unpack:bytes length:length]) {
+            IMLogE("unpack message fail");
             return NO;
         }
-        [self handleMessage:msg];
-        pos += 4+8+len;
+        metrics_frame_in(msg.cmd);
+        [messages addObject:msg];
     }
-    self.data = [NSMutableData dataWithBytes:p+pos length:self.data.length - pos];
     return YES;
 }
 
+-(void)handleMessages:(NSArray*)messages {
+    for (Message *msg in messages) {
+        if (msg.version > self.wireVersion) {
+            IMLogI("wire version:%d", msg.version);
+            self.wireVersion = msg.version;
+        }
+        if ((msg.flags & FRAME_FLAG_DEFLATE) && self.compression && !self.compressing) {
+            IMLogI("server accept compression");
+            self.compressing = YES;
+        }
+        if (msg.seq > self.lastSeq) {
+            self.lastSeq = msg.seq;
+        }
+        [self handleMessage:msg];
+    }
+    [self flushBatchMessages];
+    [self saveSyncKeys];
+    [self flushSync];
+    if (self.ackDelay == 0) {
+        [self flushACK];
+    }
+}
+
 
 -(void)addPeerMessageObserver:(id<PeerMessageObserver>)ob {
-    [self.peerObservers addObject:ob];
+    [self.peerObservers addObserver:ob];
 }
 
 -(void)removePeerMessageObserver:(id<PeerMessageObserver>)ob {
-    [self.peerObservers removeObject:ob];
+    [self.peerObservers removeObserver:ob];
 }
 
 -(void)addGroupMessageObserver:(id<GroupMessageObserver>)ob {
-    [self.groupObservers addObject:ob];
+    [self.groupObservers addObserver:ob];
 }
 
 -(void)removeGroupMessageObserver:(id<GroupMessageObserver>)ob {
-    [self.groupObservers removeObject:ob];
+    [self.groupObservers removeObserver:ob];
 }
 
 -(void)addRoomMessageObserver:(id<RoomMessageObserver>)ob {
-    [self.roomObservers addObject:ob];
+    [self.roomObservers addObserver:ob];
 }
 
 -(void)removeRoomMessageObserver:(id<RoomMessageObserver>)ob {
-    [self.roomObservers removeObject:ob];
+    [self.roomObservers removeObserver:ob];
 }
 
 -(void)addSystemMessageObserver:(id<SystemMessageObserver>)ob {
-    [self.systemObservers addObject:ob];
+    [self.systemObservers addObserver:ob];
 }
 
 -(void)removeSystemMessageObserver:(id<SystemMessageObserver>)ob {
-    [self.systemObservers removeObject:ob];
+    [self.systemObservers removeObserver:ob];
 }
 
 -(void)addCustomerMessageObserver:(id<CustomerMessageObserver>)ob {
-    [self.customerServiceObservers addObject:ob];
+    [self.customerServiceObservers addObserver:ob];
 }
 
 -(void)removeCustomerMessageObserver:(id<CustomerMessageObserver>)ob {
-    [self.customerServiceObservers removeObject:ob];
+    [self.customerServiceObservers removeObserver:ob];
 }
 
 -(void)addRTMessageObserver:(id<RTMessageObserver>)ob {
-    [self.rtObservers addObject:ob];
+    [self.rtObservers addObserver:ob];
 }
 
 -(void)removeRTMessageObserver:(id<RTMessageObserver>)ob {
-    [self.rtObservers removeObject:ob];
+    [self.rtObservers removeObserver:ob];
 }
 
 -(void)pushVOIPObserver:(id<VOIPObserver>)ob {
@@ -556,18 +965,26 @@
 
 -(void)removeSuperGroupSyncKey:(int64_t)gid {
     NSNumber *k = [NSNumber numberWithLongLong:gid];
-    [self.groupSyncKeys removeObjectForKey:k];
+    [self.groupSyncStates removeObjectForKey:k];
 }
 
 -(void)addSuperGroupSyncKey:(int64_t)syncKey gid:(int64_t)gid {
     NSNumber *k = [NSNumber numberWithLongLong:gid];
-    NSNumber *v = [NSNumber numberWithLongLong:syncKey];
-    
-    [self.groupSyncKeys setObject:v forKey:k];
+    SyncState *state = [[SyncState alloc] init];
+    state.syncKey = syncKey;
+    [self.groupSyncStates setObject:state forKey:k];
 }
 
 -(void)clearSuperGroupSyncKey {
-    [self.groupSyncKeys removeAllObjects];
+    [self.groupSyncStates removeAllObjects];
+}
+
+-(int64_t)syncKey {
+    return self.syncState.syncKey;
+}
+
+-(void)setSyncKey:(int64_t)syncKey {
+    self.syncState.syncKey = syncKey;
 }
 
 -(BOOL)sendVOIPControl:(VOIPControl*)ctl {
@@ -578,59 +995,83 @@
 }
 
 
--(BOOL)isPeerMessageSending:(int64_t)peer id:(int)msgLocalID {
-    for (NSNumber *s in self.peerMessages) {
-        IMMessage *im = [self.peerMessages objectForKey:s];
-        if (im.receiver == peer && im.msgLocalID == msgLocalID) {
-            return YES;
+-(BOOL)addChannel:(id<IMChannel>)channel firstCmd:(int)firstCmd lastCmd:(int)lastCmd {
+    if (!channel || firstCmd < 0 || lastCmd > 255 || firstCmd > lastCmd) {
+        return NO;
+    }
+    for (int cmd = firstCmd; cmd <= lastCmd; cmd++) {
+        if (_channels[cmd] && _channels[cmd] != channel) {
+            IMLogW("channel cmd:%d already registered", cmd);
+            return NO;
+        }
+        //通道优先于handler, 不能接管IMService自己处理的命令
+        if (_handlers[cmd].imp != NULL || cmd == MSG_FRAGMENT) {
+            IMLogW("channel cmd:%d reserved by im service", cmd);
+            return NO;
         }
     }
-    return NO;
+    if (![self.channels containsObject:channel]) {
+        [self.channels addObject:channel];
+    }
+    for (int cmd = firstCmd; cmd <= lastCmd; cmd++) {
+        _channels[cmd] = channel;
+    }
+    return YES;
 }
 
--(BOOL)isGroupMessageSending:(int64_t)groupID id:(int)msgLocalID {
-    for (NSNumber *s in self.groupMessages) {
-        IMMessage *im = [self.groupMessages objectForKey:s];
-        if (im.receiver == groupID && im.msgLocalID == msgLocalID) {
-            return YES;
+-(void)removeChannel:(id<IMChannel>)channel {
+    for (int cmd = 0; cmd < 256; cmd++) {
+        if (_channels[cmd] == channel) {
+            _channels[cmd] = nil;
         }
     }
-    return NO;
+    [self.channels removeObject:channel];
+}
+
+-(BOOL)isPeerMessageSending:(int64_t)peer id:(int)msgLocalID {
+    return [self.pendingMessages messageForKind:PENDING_PEER receiver:peer appID:0 msgLocalID:msgLocalID] != nil;
+}
+
+-(BOOL)isGroupMessageSending:(int64_t)groupID id:(int)msgLocalID {
+    return [self.pendingMessages messageForKind:PENDING_GROUP receiver:groupID appID:0 msgLocalID:msgLocalID] != nil;
 }
 
 -(BOOL)isCustomerSupportMessageSending:(int)msgLocalID customerID:(int64_t)customerID customerAppID:(int64_t)customerAppID {
-    for (NSNumber *s in self.customerServiceMessages) {
-        CustomerMessage *im = [self.customerServiceMessages objectForKey:s];
-        if (im.msgLocalID == msgLocalID &&
-            im.customerID == customerID &&
-            im.customerAppID == customerAppID) {
-            return YES;
-        }
-    }
-    return NO;
+    return [self.pendingMessages messageForKind:PENDING_CUSTOMER_SUPPORT
+                                       receiver:customerID
+                                          appID:customerAppID
+                                     msgLocalID:msgLocalID] != nil;
 }
 
 -(BOOL)isCustomerMessageSending:(int)msgLocalID  storeID:(int64_t)storeID {
-    for (NSNumber *s in self.customerServiceMessages) {
-        CustomerMessage *im = [self.customerServiceMessages objectForKey:s];
-        
-        if (im.msgLocalID == msgLocalID && im.storeID == storeID) {
-            return YES;
-        }
+    return [self.pendingMessages messageForKind:PENDING_CUSTOMER receiver:storeID appID:0 msgLocalID:msgLocalID] != nil;
+}
+
+-(double)ackLatencyPercentile:(double)p {
+    return [self.pendingMessages ackLatencyPercentile:p];
+}
+
+//恢复会话期间需要ack的消息不发送, 只放入待确认的表(seq为0)
+//恢复成功或者重新认证之后由resendPendingMessages按顺序发送
+-(BOOL)sendOrDeferMessage:(Message*)m {
+    if (self.resuming && self.tcp && self.connectState == STATE_CONNECTED) {
+        m.seq = 0;
+        return YES;
     }
-    return NO;
+    return [self sendMessage:m];
 }
 
 -(BOOL)sendPeerMessage:(IMMessage *)im {
     Message *m = [[Message alloc] init];
     m.cmd = MSG_IM;
     m.body = im;
-    BOOL r = [self sendMessage:m];
+    BOOL r = [self sendOrDeferMessage:m];
 
     if (!r) {
         return r;
     }
-    [self.peerMessages setObject:im forKey:[NSNumber numberWithInt:m.seq]];
+    [self addPendingMessage:im kind:PENDING_PEER seq:m.seq
+                   receiver:im.receiver appID:0 msgLocalID:im.msgLocalID];
     return r;
 }
 
@@ -638,10 +1079,11 @@
     Message *m = [[Message alloc] init];
     m.cmd = MSG_GROUP_IM;
     m.body = im;
-    BOOL r = [self sendMessage:m];
+    BOOL r = [self sendOrDeferMessage:m];
     
     if (!r) return r;
-    [self.groupMessages setObject:im forKey:[NSNumber numberWithInt:m.seq]];
+    [self addPendingMessage:im kind:PENDING_GROUP seq:m.seq
+                   receiver:im.receiver appID:0 msgLocalID:im.msgLocalID];
     return r;
 }
 
@@ -649,9 +1091,10 @@
     Message *m = [[Message alloc] init];
     m.cmd = MSG_ROOM_IM;
     m.body = rm;
-    BOOL r = [self sendMessage:m];
+    BOOL r = [self sendOrDeferMessage:m];
     if (!r) return r;
-    [self.roomMessages setObject:rm forKey:[NSNumber numberWithInt:m.seq]];
+    [self addPendingMessage:rm kind:PENDING_ROOM seq:m.seq
+                   receiver:rm.receiver appID:0 msgLocalID:0];
     return r;
 }
 
@@ -659,12 +1102,13 @@
     Message *m = [[Message alloc] init];
     m.cmd = MSG_CUSTOMER_SUPPORT;
     m.body = im;
-    BOOL r = [self sendMessage:m];
+    BOOL r = [self sendOrDeferMessage:m];
     
     if (!r) {
         return r;
     }
-    [self.customerServiceMessages setObject:im forKey:[NSNumber numberWithInt:m.seq]];
+    [self addPendingMessage:im kind:PENDING_CUSTOMER_SUPPORT seq:m.seq
+                   receiver:im.customerID appID:im.customerAppID msgLocalID:im.msgLocalID];
     return r;
 }
 
@@ -672,12 +1116,13 @@
     Message *m = [[Message alloc] init];
     m.cmd = MSG_CUSTOMER;
     m.body = im;
-    BOOL r = [self sendMessage:m];
+    BOOL r = [self sendOrDeferMessage:m];
     
     if (!r) {
         return r;
     }
-    [self.customerServiceMessages setObject:im forKey:[NSNumber numberWithInt:m.seq]];
+    [self addPendingMessage:im kind:PENDING_CUSTOMER seq:m.seq
+                   receiver:im.storeID appID:0 msgLocalID:im.msgLocalID];
     return r;
 }
 
@@ -689,28 +1134,348 @@
     return r;
 }
 
--(BOOL)sendMessage:(Message *)msg {
-    if (!self.tcp || self.connectState != STATE_CONNECTED) return NO;
+-(void)addPendingMessage:(id)message kind:(PendingMessageKind)kind seq:(int)seq
+                receiver:(int64_t)receiver appID:(int64_t)appID msgLocalID:(int)msgLocalID {
+    PendingMessage *m = [self.pendingMessages addMessage:message kind:kind seq:seq
+                                                receiver:receiver appID:appID msgLocalID:msgLocalID];
+    m.expireTick = self.pendingMessages.currentTick + MESSAGE_EXPIRE_TICKS;
+    [self.pendingMessages scheduleMessage:m ticks:RETRANSMIT_TIMEOUT_TICKS];
+    
+    if (!self.retransmitTimerRunning) {
+        self.retransmitTimerRunning = YES;
+        dispatch_resume(self.retransmitTimer);
+    }
+}
+
+-(void)removePendingMessage:(PendingMessageKind)kind receiver:(int64_t)receiver msgLocalID:(int)msgLocalID {
+    PendingMessage *m = [self.pendingMessages messageForKind:kind receiver:receiver appID:0 msgLocalID:msgLocalID];
+    if (m) {
+        [self.pendingMessages removeMessage:m];
+    }
+}
+
+static int pendingMessageCommand(PendingMessageKind kind) {
+    switch (kind) {
+        case PENDING_PEER:
+            return MSG_IM;
+        case PENDING_GROUP:
+            return MSG_GROUP_IM;
+        case PENDING_ROOM:
+            return MSG_ROOM_IM;
+        case PENDING_CUSTOMER:
+            return MSG_CUSTOMER;
+        case PENDING_CUSTOMER_SUPPORT:
+            return MSG_CUSTOMER_SUPPORT;
+    }
+    return 0;
+}
+
+//发送的优先级, 音视频信令和连接的控制请求不能排在大批的消息后面
+static int sendClassForCommand(int cmd) {
+    switch (cmd) {
+        case MSG_VOIP_CONTROL:
+        case MSG_RT:
+        case MSG_PING:
+        case MSG_AUTH_TOKEN:
+        case MSG_RESUME:
+            return SEND_CLASS_CONTROL;
+        case MSG_ACK:
+            return SEND_CLASS_ACK;
+        case MSG_SYNC:
+        case MSG_SYNC_GROUP:
+        case MSG_CUSTOMER:
+        case MSG_CUSTOMER_SUPPORT:
+            return SEND_CLASS_BULK;
+        default:
+            return SEND_CLASS_INTERACTIVE;
+    }
+}
+
+//接收方按msgLocalID过滤重复的消息, 只有点对点和群消息可以重发
+//客服消息的msgLocalID不在协议中, 重发之后无法去重
+static BOOL canRetransmit(PendingMessageKind kind) {
+    return kind == PENDING_PEER || kind == PENDING_GROUP;
+}
+
+//用新的seq把消息打包到sendBuffer中
+-(BOOL)packPendingMessage:(PendingMessage*)pending {
+    Message *m = [[Message alloc] init];
+    m.cmd = pendingMessageCommand(pending.kind);
+    m.body = pending.message;
+    if (![self packMessage:m]) {
+        return NO;
+    }
+    [self.pendingMessages addSeq:m.seq forMessage:pending];
+    return YES;
+}
+
+-(void)onRetransmitTimer {
+    NSArray *expired = [self.pendingMessages expireMessages];
+    BOOL connected = self.tcp && self.connectState == STATE_CONNECTED && !self.resuming;
+    uint64_t tick = self.pendingMessages.currentTick;
+    
+    [self.sendBuffer setLength:0];
+    int sendClass = SEND_CLASS_INTERACTIVE;
+    NSMutableArray *failed = [NSMutableArray array];
+    for (PendingMessage *m in expired) {
+        //房间消息不重发
+        if (tick >= m.expireTick || m.kind == PENDING_ROOM) {
+            IMLogW("message timeout seq:%d retries:%d", m.seq, m.retries);
+            [self.pendingMessages removeMessage:m];
+            [failed addObject:m];
+            continue;
+        }
+        //客服消息不重发, 等到过期之前仍然可以收到ack
+        if (connected && canRetransmit(m.kind)) {
+            sendClass = [self switchSendClass:sendClass command:pendingMessageCommand(m.kind)];
+            if ([self packPendingMessage:m]) {
+                m.retries = m.retries + 1;
+            }
+        }
+        int ticks = MIN(RETRANSMIT_TIMEOUT_TICKS << MIN(m.retries, 8), RETRANSMIT_MAX_TIMEOUT_TICKS);
+        ticks = (int)MIN((uint64_t)ticks, m.expireTick - tick);
+        [self.pendingMessages scheduleMessage:m ticks:ticks];
+    }
+    [self writeSendBuffer:sendClass];
+    [self.sendBuffer setLength:0];
+    
+    //失败的回调中可能发送新的消息并复用sendBuffer, 重发的帧提交之后再回调
+    for (PendingMessage *m in failed) {
+        [self failPendingMessage:m];
+    }
+    
+    if (self.pendingMessages.count == 0 && self.retransmitTimerRunning) {
+        self.retransmitTimerRunning = NO;
+        dispatch_suspend(self.retransmitTimer);
+    }
+}
+
+//重连之后按照原来的发送顺序重发所有未ack的消息
+-(void)resendPendingMessages {
+    NSArray *messages = [[self.pendingMessages allMessages] sortedArrayUsingComparator:^NSComparisonResult(PendingMessage *a, PendingMessage *b) {
+        if (a.sendTime == b.sendTime) {
+            return NSOrderedSame;
+        }
+        return a.sendTime < b.sendTime ? NSOrderedAscending : NSOrderedDescending;
+    }];
+    if (messages.count == 0) {
+        return;
+    }
+    
+    [self.sendBuffer setLength:0];
+    uint64_t tick = self.pendingMessages.currentTick;
+    int sendClass = SEND_CLASS_INTERACTIVE;
+    for (PendingMessage *m in messages) {
+        sendClass = [self switchSendClass:sendClass command:pendingMessageCommand(m.kind)];
+        if (![self packPendingMessage:m]) {
+            continue;
+        }
+        int ticks = (int)MIN((uint64_t)RETRANSMIT_TIMEOUT_TICKS, m.expireTick - tick);
+        [self.pendingMessages scheduleMessage:m ticks:ticks];
+    }
+    IMLogI("resend %d pending messages", (int)messages.count);
+    [self writeSendBuffer:sendClass];
+}
+
+-(void)failPendingMessage:(PendingMessage*)pending {
+    switch (pending.kind) {
+        case PENDING_PEER: {
+            IMMessage *msg = pending.message;
+            [self.peerMessageHandler handleMessageFailure:msg.msgLocalID uid:msg.receiver];
+            [self publishPeerMessageFailure:msg];
+            break;
+        }
+        case PENDING_GROUP: {
+            IMMessage *msg = pending.message;
+            [self.groupMessageHandler handleMessageFailure:msg.msgLocalID gid:msg.receiver];
+            [self publishGroupMessageFailure:msg];
+            break;
+        }
+        case PENDING_ROOM:
+            [self publishRoomMessageFailure:pending.message];
+            break;
+        case PENDING_CUSTOMER:
+        case PENDING_CUSTOMER_SUPPORT:
+            [self.customerMessageHandler handleMessageFailure:pending.message];
+            [self publishCustomerMessageFailure:pending.message];
+            break;
+    }
+}
+
+-(BOOL)packMessage:(Message*)msg {
     self.seq = self.seq + 1;
     msg.seq = self.seq;
+    msg.uid = self.uid;
+    msg.flags = 0;
+    if ((msg.cmd == MSG_AUTH_TOKEN || msg.cmd == MSG_RESUME) && self.uid > 0) {
+        //这两个请求的布局在各版本中相同, 帧头带上支持的最高版本
+        //v2的用户id相对uid编码, 没有设置uid时不升级
+        msg.version = PROTOCOL_MAX_VERSION;
+    } else {
+        msg.version = self.wireVersion;
+    }
+    if (msg.cmd == MSG_AUTH_TOKEN || msg.cmd == MSG_RESUME) {
+        msg.flags = self.compression ? FRAME_FLAG_DEFLATE : 0;
+    }
+    NSUInteger offset = self.sendBuffer.length;
+    if (![msg packFrame:self.sendBuffer]) {
+        IMLogE("message pack error cmd:%d", msg.cmd);
+        return NO;
+    }
+    //分片的消息占用多个seq
+    self.seq = msg.seq;
+    //控制请求和ack不压缩, 不用等待之前压缩的帧, 可以优先发送
+    if (self.compressing && sendClassForCommand(msg.cmd) > SEND_CLASS_ACK) {
+        [self compressFrame:offset];
+    }
+    metrics_frame_out(msg.cmd);
+    metrics_add(METRIC_BYTES_OUT, self.sendBuffer.length - offset);
+    return YES;
+}
 
-    NSMutableData *data = [NSMutableData data];
-    NSData *p = [msg pack];
-    if (!p) {
-        NSLog(@"message pack error");
+//把sendBuffer中offset开始的各帧(分片的消息有多帧)的消息体用连接的deflate流压缩
+-(void)compressFrame:(NSUInteger)offset {
+    while (offset < self.sendBuffer.length) {
+        char *p = (char*)[self.sendBuffer mutableBytes] + offset;
+        int len = readInt32(p);
+        NSUInteger start = offset + FRAME_LENGTH_SIZE + FRAME_HEAD_SIZE;
+        if (len < self.compressThreshold) {
+            offset = start + len;
+            continue;
+        }
+        const uint8_t *out;
+        int n = frame_deflate_body(&_deflater, (const uint8_t*)p + FRAME_LENGTH_SIZE + FRAME_HEAD_SIZE, len, &out);
+        if (n < 0) {
+            //服务器只解压带标志的帧, 之后都不压缩仍然是一致的
+            IMLogW("deflate frame fail, stop compression");
+            self.compressing = NO;
+            return;
+        }
+        writeInt32(n, p);
+        p[FRAME_LENGTH_SIZE + 6] |= FRAME_FLAG_COMPRESSED;
+        [self.sendBuffer replaceBytesInRange:NSMakeRange(start, len) withBytes:out length:n];
+        offset = start + n;
+    }
+}
+
+-(BOOL)sendMessage:(Message *)msg {
+    if (!self.tcp || self.connectState != STATE_CONNECTED) return NO;
+    //恢复会话的结果返回之前只发送恢复请求, 失败时服务器会关闭发送了其它请求的未认证连接
+    if (self.resuming && msg.cmd != MSG_RESUME) return NO;
+
+    [self.sendBuffer setLength:0];
+    if (![self packMessage:msg]) {
         return NO;
     }
-    char b[4];
-    writeInt32((int)(p.length)-8, b);
-    [data appendBytes:(void*)b length:4];
-    [data appendData:p];
-    [self.tcp write:data];
+    [self writeSendBuffer:sendClassForCommand(msg.cmd)];
     return YES;
 }
 
+//sendBuffer中的消息和接下来要打包的消息优先级不同时先提交已经打包的部分
+-(int)switchSendClass:(int)sendClass command:(int)cmd {
+    int c = sendClassForCommand(cmd);
+    if (c != sendClass) {
+        [self writeSendBuffer:sendClass];
+        [self.sendBuffer setLength:0];
+    }
+    return c;
+}
+
+//按帧把sendBuffer提交给tcp
+//压缩的帧共用连接的deflate流, 分片的帧在服务器逐条重组, 这两种帧跨优先级也要按打包的顺序发送
+//分片逐帧提交, 高优先级的帧可以插在两个分片之间
+//超过一个分片大小的sendBuffer整个交给tcp, 换一块新的缓冲区, 各块只引用其中的一段, 不再复制
+-(void)writeSendBuffer:(int)sendClass {
+    NSData *buffer = self.sendBuffer;
+    if (buffer.length > FRAGMENT_MAX_BODY) {
+        self.sendBuffer = [NSMutableData dataWithCapacity:4*1024];
+    }
+    const char *p = (const char*)[buffer bytes];
+    NSUInteger length = buffer.length;
+    NSUInteger start = 0;
+    NSUInteger offset = 0;
+    BOOL ordered = NO;
+    while (offset < length) {
+        const char *frame = p + offset;
+        NSUInteger end = offset + FRAME_LENGTH_SIZE + FRAME_HEAD_SIZE + readInt32(frame);
+        BOOL fragment = (uint8_t)frame[FRAME_LENGTH_SIZE + 4] == MSG_FRAGMENT;
+        if (fragment && offset > start) {
+            [self writeSendBuffer:buffer sendClass:sendClass range:NSMakeRange(start, offset - start) ordered:ordered];
+            start = offset;
+            ordered = NO;
+        }
+        ordered = ordered || fragment || (frame[FRAME_LENGTH_SIZE + 6] & FRAME_FLAG_COMPRESSED);
+        offset = end;
+        if (fragment) {
+            [self writeSendBuffer:buffer sendClass:sendClass range:NSMakeRange(start, offset - start) ordered:YES];
+            start = offset;
+            ordered = NO;
+        }
+    }
+    if (offset > start) {
+        [self writeSendBuffer:buffer sendClass:sendClass range:NSMakeRange(start, offset - start) ordered:ordered];
+    }
+}
+
+-(void)writeSendBuffer:(NSData*)buffer sendClass:(int)sendClass range:(NSRange)range ordered:(BOOL)ordered {
+    NSData *data = buffer;
+    if (buffer == self.sendBuffer) {
+        //仍在复用的sendBuffer由tcp复制
+        if (range.length < buffer.length) {
+            data = [buffer subdataWithRange:range];
+        }
+    } else {
+        //deallocator引用buffer, 所有的块释放之后buffer才会释放
+        data = [[NSData alloc] initWithBytesNoCopy:(char*)[buffer bytes] + range.location
+                                            length:range.length
+                                       deallocator:^(void *bytes, NSUInteger length) {
+                                           (void)buffer;
+                                       }];
+    }
+    [self.tcp write:data sendClass:sendClass ordered:ordered];
+}
+
+-(void)sendACK:(int)seq {
+    [self.pendingACKs addObject:[NSNumber numberWithInt:seq]];
+    if (self.pendingACKs.count >= MAX_PENDING_ACK) {
+        [self flushACK];
+    } else if (self.ackDelay > 0 && !self.ackFlushScheduled) {
+        self.ackFlushScheduled = YES;
+        __weak IMService *wself = self;
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)self.ackDelay*NSEC_PER_MSEC), self.queue, ^{
+            wself.ackFlushScheduled = NO;
+            [wself flushACK];
+        });
+    }
+}
+
+//一批消息中收到的所有ACK合并成一次写
+-(void)flushACK {
+    if (self.pendingACKs.count == 0) {
+        return;
+    }
+    if (!self.tcp || self.connectState != STATE_CONNECTED) {
+        [self.pendingACKs removeAllObjects];
+        return;
+    }
+    if (self.resuming) {
+        return;
+    }
+
+    [self.sendBuffer setLength:0];
+    for (NSNumber *seq in self.pendingACKs) {
+        Message *ack = [[Message alloc] init];
+        ack.cmd = MSG_ACK;
+        ack.body = seq;
+        [self packMessage:ack];
+    }
+    [self.pendingACKs removeAllObjects];
+    [self writeSendBuffer:SEND_CLASS_ACK];
+}
+
 
 -(void)sendAuth {
-    NSLog(@"send auth");
+    IMLogI("send auth");
     Message *msg = [[Message alloc] init];
     msg.cmd = MSG_AUTH_TOKEN;
     AuthenticationToken *auth = [[AuthenticationToken alloc] init];
@@ -722,68 +1487,109 @@
 }
 
 -(void)onConnect {
-    [self sendAuth];
-    if (self.roomID > 0) {
-        [self sendEnterRoom:self.roomID];
-    }
-    
-    if (!self.isSync) {
+    self.connectedTime = [[NSProcessInfo processInfo] systemUptime];
+    self.wireVersion = PROTOCOL_VERSION_1;
+    self.compressing = NO;
+    frame_deflate_reset(&_deflater);
+    if ([self canResume]) {
+        //恢复成功之前不发送其它请求, 由handleResumeStatus继续
+        self.resuming = YES;
+        [self sendResume];
         return;
     }
-    //send sync
-    [self sendSync:self.syncKey];
-    
-    for (NSNumber *k in self.groupSyncKeys) {
-        NSNumber *v = [self.groupSyncKeys objectForKey:k];
-        [self sendGroupSyncKey:[v longLongValue] gid:[k longLongValue]];
-    }
+    [self startSession];
 }
 
--(void)sendSync:(int64_t)syncKey {
-    Message *msg = [[Message alloc] init];
-    msg.cmd = MSG_SYNC;
-    msg.body = [NSNumber numberWithLongLong:syncKey];
-    [self sendMessage:msg];
+-(BOOL)canResume {
+    if (!self.resumeSession || !self.sessionTicket) {
+        return NO;
+    }
+    NSTimeInterval now = [[NSProcessInfo processInfo] systemUptime];
+    return now - self.closeTime < self.sessionTicket.ttl;
 }
 
--(void)sendGroupSyncKey:(int64_t)syncKey gid:(int64_t)gid {
+-(void)sendResume {
+    IMLogI("send resume last seq:%d", self.lastSeq);
     Message *msg = [[Message alloc] init];
-    msg.cmd = MSG_SYNC_GROUP;
-    GroupSyncKey *s = [[GroupSyncKey alloc] init];
-    s.groupID = gid;
-    s.syncKey = syncKey;
-    msg.body = s;
+    msg.cmd = MSG_RESUME;
+    SessionResume *resume = [[SessionResume alloc] init];
+    resume.ticket = self.sessionTicket.ticket;
+    resume.lastSeq = self.lastSeq;
+    resume.syncKey = self.syncState.syncKey;
+    msg.body = resume;
     [self sendMessage:msg];
 }
 
--(void)onClose {
-    for (NSNumber *seq in self.peerMessages) {
-        IMMessage *msg = [self.peerMessages objectForKey:seq];
-        [self.peerMessageHandler handleMessageFailure:msg.msgLocalID uid:msg.receiver];
-        [self publishPeerMessageFailure:msg];
+//完整的认证和同步, 服务器会下发新的票据
+-(void)startSession {
+    self.sessionTicket = nil;
+    self.lastSeq = 0;
+    [self sendAuth];
+    if (self.roomID > 0) {
+        [self sendEnterRoom:self.roomID];
     }
     
-    for (NSNumber *seq in self.groupMessages) {
-        IMMessage *msg = [self.peerMessages objectForKey:seq];
-        [self.groupMessageHandler handleMessageFailure:msg.msgLocalID gid:msg.receiver];
-        [self publishGroupMessageFailure:msg];
+    if (self.isSync) {
+        //个人和所有超级群的同步请求一次发出
+        self.syncState.queued = YES;
+        for (NSNumber *k in self.groupSyncStates) {
+            SyncState *state = [self.groupSyncStates objectForKey:k];
+            state.queued = YES;
+        }
+        [self flushSync];
     }
     
-    for (NSNumber *seq in self.roomMessages) {
-        RoomMessage *msg = [self.roomMessages objectForKey:seq];
-        [self publishRoomMessageFailure:msg];
+    [self resendPendingMessages];
+}
+
+-(void)resetSyncState:(SyncState*)state {
+    state.syncing = NO;
+    state.queued = NO;
+    state.notifyKey = 0;
+}
+
+-(void)onClose {
+    self.closeTime = [[NSProcessInfo processInfo] systemUptime];
+    self.resuming = NO;
+    self.connectedTime = 0;
+    if (self.stopped) {
+        //停止服务之后可能换了用户
+        self.sessionTicket = nil;
     }
     
-    for (NSNumber *seq in self.customerServiceMessages) {
-        CustomerMessage *msg = [self.customerServiceMessages objectForKey:seq];
-        [self.customerMessageHandler handleMessageFailure:msg];
-        [self publishCustomerMessageFailure:msg];
-    }
+    //未确认的消息服务器会重新推送
+    [self.pendingACKs removeAllObjects];
     
-    [self.peerMessages removeAllObjects];
-    [self.groupMessages removeAllObjects];
-    [self.roomMessages removeAllObjects];
-    [self.customerServiceMessages removeAllObjects];
+    //在途的同步请求作废, 重连之后重新同步
+    [self resetSyncState:self.syncState];
+    for (NSNumber *k in self.groupSyncStates) {
+        [self resetSyncState:[self.groupSyncStates objectForKey:k]];
+    }
+
+    //断线期间的点对点和群消息等重连之后重发, 其它消息和停止服务后的消息直接失败
+    NSMutableArray *messages = [NSMutableArray array];
+    if (self.stopped) {
+        [messages addObjectsFromArray:[self.pendingMessages allMessages]];
+        [self.pendingMessages removeAllMessages];
+    } else {
+        PendingMessageKind kinds[] = {PENDING_ROOM, PENDING_CUSTOMER, PENDING_CUSTOMER_SUPPORT};
+        for (int i = 0; i < 3; i++) {
+            [messages addObjectsFromArray:[self.pendingMessages removeMessagesOfKind:kinds[i]]];
+        }
+    }
+    for (PendingMessage *pending in messages) {
+        [self failPendingMessage:pending];
+    }
+
+    for (id<IMChannel> channel in [self.channels copy]) {
+        if ([channel respondsToSelector:@selector(onChannelClose)]) {
+            [channel onChannelClose];
+        }
+    }
+}
+
+-(BOOL)canSendPing {
+    return !self.resuming;
 }
 
 -(void)sendPing {
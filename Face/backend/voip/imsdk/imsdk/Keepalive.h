@@ -0,0 +1,32 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#import <Foundation/Foundation.h>
+
+/*
+ * 按网络类型学习心跳间隔
+ * 连续几次空闲interval之后ping成功就增大间隔, 失败则退回到上一个成功的间隔并固定下来
+ * 学到的间隔保存在NSUserDefaults中, 下次在同类网络上直接使用
+ */
+@interface Keepalive : NSObject
+//当前网络上使用的心跳间隔(秒)
+@property(nonatomic, readonly) int interval;
+//当前网络的间隔是否已经探测完成
+@property(nonatomic, readonly) BOOL stable;
+//网络类型, 如wifi, wwan, 切换时加载该网络上学到的间隔
+@property(nonatomic, copy) NSString *network;
+
+//interval为没有学习结果时的初始间隔
+-(id)initWithInterval:(int)interval;
+
+//空闲idle秒之后ping成功
+-(void)onIdleSuccess:(int)idle;
+//空闲idle秒之后ping超时或者连接断开
+-(void)onIdleFailure:(int)idle;
+@end
@@ -0,0 +1,130 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#import "Keepalive.h"
+#import "imlog.h"
+
+#define KEEPALIVE_DEFAULTS_KEY @"im_keepalive"
+
+//探测的上下界和步长(秒)
+#define MIN_INTERVAL 60
+#define MAX_INTERVAL 540
+#define PROBE_STEP 60
+//同一间隔连续成功这么多次后才继续增大
+#define PROBE_SUCCESS_COUNT 3
+//固定之后连续失败这么多次就减小间隔重新探测
+#define STABLE_FAILURE_COUNT 2
+
+@interface Keepalive()
+@property(nonatomic) int initialInterval;
+@property(nonatomic) int interval;
+@property(nonatomic) BOOL stable;
+//最后一个确认可用的间隔
+@property(nonatomic) int safeInterval;
+@property(nonatomic) int successCount;
+@property(nonatomic) int failureCount;
+@end
+
+@implementation Keepalive
+
+-(id)initWithInterval:(int)interval {
+    self = [super init];
+    if (self) {
+        self.initialInterval = MAX(MIN_INTERVAL, MIN(interval, MAX_INTERVAL));
+        self.interval = self.initialInterval;
+        self.safeInterval = MIN_INTERVAL;
+    }
+    return self;
+}
+
+-(void)setNetwork:(NSString*)network {
+    if ([_network isEqualToString:network]) {
+        return;
+    }
+    _network = [network copy];
+    self.successCount = 0;
+    self.failureCount = 0;
+    
+    NSDictionary *dict = [[NSUserDefaults standardUserDefaults] dictionaryForKey:KEEPALIVE_DEFAULTS_KEY];
+    NSDictionary *learned = [dict objectForKey:network];
+    if (learned) {
+        self.interval = [[learned objectForKey:@"interval"] intValue];
+        self.safeInterval = [[learned objectForKey:@"safe"] intValue];
+        self.stable = [[learned objectForKey:@"stable"] boolValue];
+        self.interval = MAX(MIN_INTERVAL, MIN(self.interval, MAX_INTERVAL));
+        IMLogI("keepalive network:%s interval:%d stable:%d", [network UTF8String], self.interval, self.stable);
+    } else {
+        self.interval = self.initialInterval;
+        self.safeInterval = MIN_INTERVAL;
+        self.stable = NO;
+    }
+}
+
+-(void)save {
+    if (self.network.length == 0) {
+        return;
+    }
+    NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+    NSMutableDictionary *dict = [NSMutableDictionary dictionaryWithDictionary:[defaults dictionaryForKey:KEEPALIVE_DEFAULTS_KEY]];
+    NSDictionary *learned = @{@"interval":[NSNumber numberWithInt:self.interval],
+                              @"safe":[NSNumber numberWithInt:self.safeInterval],
+                              @"stable":[NSNumber numberWithBool:self.stable]};
+    [dict setObject:learned forKey:self.network];
+    [defaults setObject:dict forKey:KEEPALIVE_DEFAULTS_KEY];
+}
+
+-(void)onIdleSuccess:(int)idle {
+    self.failureCount = 0;
+    //中途有数据往来, 没有真正空闲满一个间隔
+    if (idle < self.interval) {
+        return;
+    }
+    if (self.interval > self.safeInterval) {
+        self.safeInterval = self.interval;
+        [self save];
+    }
+    if (self.stable || self.interval >= MAX_INTERVAL) {
+        return;
+    }
+    self.successCount = self.successCount + 1;
+    if (self.successCount >= PROBE_SUCCESS_COUNT) {
+        self.successCount = 0;
+        self.interval = MIN(self.interval + PROBE_STEP, MAX_INTERVAL);
+        IMLogI("keepalive probe interval:%d", self.interval);
+        [self save];
+    }
+}
+
+-(void)onIdleFailure:(int)idle {
+    self.successCount = 0;
+    if (idle < self.safeInterval) {
+        //比已知安全的间隔还短, 不是nat超时造成的
+        return;
+    }
+    if (!self.stable) {
+        //退回到上一个成功的间隔
+        self.interval = self.safeInterval;
+        self.stable = YES;
+        IMLogI("keepalive stable interval:%d", self.interval);
+        [self save];
+        return;
+    }
+    self.failureCount = self.failureCount + 1;
+    if (self.failureCount >= STABLE_FAILURE_COUNT) {
+        //网络环境变了, 减小间隔重新探测
+        self.failureCount = 0;
+        self.interval = MAX(self.interval - PROBE_STEP, MIN_INTERVAL);
+        self.safeInterval = MIN_INTERVAL;
+        self.stable = NO;
+        IMLogI("keepalive reprobe interval:%d", self.interval);
+        [self save];
+    }
+}
+
+@end
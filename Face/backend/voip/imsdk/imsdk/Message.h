@@ -51,10 +51,26 @@
 //通知客户端有新消息
 #define MSG_SYNC_GROUP_NOTIFY  33
 
+//服务端->客户端, 认证成功之后下发的会话票据
+#define MSG_SESSION_TICKET 40
+//客户端->服务端, 短时间断开之后用票据恢复会话, 代替认证和同步
+#define MSG_RESUME 41
+//服务端->客户端, 0表示恢复成功
+#define MSG_RESUME_STATUS 42
+//超过一帧长度上限的消息拆成的分片, 见fragment.h
+#define MSG_FRAGMENT 43
+
 
 
 #define MSG_VOIP_CONTROL 64
 
+//帧头的VERSION字节, 每一帧按自己的版本解码
+//v1: 定长的大端整数
+//v2: LEB128变长整数, 用户id编码为与会话uid的差值
+#define PROTOCOL_VERSION_1 1
+#define PROTOCOL_VERSION_2 2
+#define PROTOCOL_MAX_VERSION PROTOCOL_VERSION_2
+
 #define PLATFORM_IOS  1
 #define PLATFORM_ANDROID 2
 #define PLATFORM_WEB 3
@@ -101,6 +117,12 @@ typedef RoomMessage RTMessage;
 @property(nonatomic, copy) NSString *deviceID;
 @end
 
+@interface AuthenticationStatus : NSObject
+@property(nonatomic, assign) int32_t status;
+//服务器建议的重连间隔(秒), 旧版本服务器没有这个字段, 为0
+@property(nonatomic, assign) int32_t retryAfter;
+@end
+
 
 @interface VOIPControl : NSObject
 @property(nonatomic, assign) int64_t sender;
@@ -116,13 +138,60 @@ typedef NSNumber SyncKey;
 @property(nonatomic, assign) int64_t syncKey;
 @end
 
+@interface SessionTicket : NSObject
+@property(nonatomic, assign) int64_t ticket;
+//断开之后票据的有效期(秒)
+@property(nonatomic, assign) int32_t ttl;
+@end
+
+@interface SessionResume : NSObject
+@property(nonatomic, assign) int64_t ticket;
+//收到的最后一个服务器seq, 之后的消息由服务器重发
+@property(nonatomic, assign) int32_t lastSeq;
+@property(nonatomic, assign) int64_t syncKey;
+@end
+
+
+@class Message;
+
+//body的长度, -1表示无法序列化
+typedef int (*MessageBodyLength)(Message *msg);
+//p指向帧头之后的消息体
+typedef void (*MessagePackBody)(Message *msg, char *p);
+typedef BOOL (*MessageUnpackBody)(Message *msg, const char *p, int len);
+
+struct MessageCodec {
+    MessageBodyLength length;
+    MessagePackBody pack;
+    MessageUnpackBody unpack;
+    //定长部分的长度, 消息体短于此长度时不调用unpack, 解码函数不需要再检查
+    int minLength;
+};
 
 @interface Message : NSObject
 @property(nonatomic, assign)int cmd;
 @property(nonatomic, assign)int seq;
 @property(nonatomic) NSObject *body;
-
+//发送时使用的协议版本, 接收时为帧头中的版本, 默认为v1
+@property(nonatomic, assign)int version;
+//当前会话的uid, v2的用户id相对它编码
+@property(nonatomic, assign)int64_t uid;
+//帧头的标志位, 见frame_deflate.h
+@property(nonatomic, assign)int flags;
+
+//注册新命令的编解码函数, 未注册的命令接收时body为原始数据
+//编解码表在decode队列上读取, 没有加锁, 注册必须在任何连接start之前完成
++(void)registerCodec:(int)cmd codec:(struct MessageCodec)codec;
+//注册某个协议版本的编解码函数, v2没有注册的命令使用v1的格式
++(void)registerCodec:(int)cmd version:(int)version codec:(struct MessageCodec)codec;
+
+//只返回单个帧, 消息体需要分片时返回nil
 -(NSData*)pack;
+//在buffer末尾追加完整的帧: 长度(4) + 帧头 + 消息体
+//消息体超过FRAGMENT_MAX_BODY时追加多个MSG_FRAGMENT帧, seq更新为最后一个分片的seq
+-(BOOL)packFrame:(NSMutableData*)buffer;
 
 -(BOOL)unpack:(NSData*)data;
+//bytes指向帧头(不含长度字段), length为帧头+消息体的长度
+-(BOOL)unpack:(const char*)bytes length:(int)length;
 @end
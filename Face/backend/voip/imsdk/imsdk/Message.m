@@ -9,9 +9,11 @@
 
 #import "Message.h"
 #import "util.h"
+#import "varint.h"
+#import "fragment.h"
+#import "imlog.h"
 
 #define HEAD_SIZE 8
-#define VERSION 1
 
 @implementation IMMessage
 
@@ -33,235 +35,778 @@
 
 @end
 
+@implementation AuthenticationStatus
+
+@end
+
 
 @implementation GroupSyncKey
 
 @end
 
+@implementation SessionTicket
+
+@end
+
+@implementation SessionResume
+
+@end
+
 @implementation VOIPControl
 
 @end
 
+static int utf8Length(NSString *s) {
+    return (int)[s lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+}
+
+static char *writeUTF8(NSString *s, char *p, int len) {
+    if (len > 0) {
+        [s getBytes:p maxLength:len usedLength:NULL encoding:NSUTF8StringEncoding
+            options:0 range:NSMakeRange(0, s.length) remainingRange:NULL];
+    }
+    return p + len;
+}
+
+static NSString *readUTF8(const char *p, int len) {
+    return [[NSString alloc] initWithBytes:p length:len encoding:NSUTF8StringEncoding];
+}
+
+#pragma mark - codec
+
+static int emptyLength(Message *msg) {
+    return 0;
+}
+
+static void packEmpty(Message *msg, char *p) {
+}
+
+static BOOL unpackEmpty(Message *msg, const char *p, int len) {
+    return YES;
+}
+
+static int authTokenLength(Message *msg) {
+    AuthenticationToken *auth = (AuthenticationToken*)msg.body;
+    int tl = utf8Length(auth.token);
+    int dl = utf8Length(auth.deviceID);
+    if (tl > 255 || dl > 255) {
+        return -1;
+    }
+    return 3 + tl + dl;
+}
+
+static void packAuthToken(Message *msg, char *p) {
+    AuthenticationToken *auth = (AuthenticationToken*)msg.body;
+    *p++ = auth.platformID;
+    int l = utf8Length(auth.token);
+    *p++ = l;
+    p = writeUTF8(auth.token, p, l);
+    l = utf8Length(auth.deviceID);
+    *p++ = l;
+    p = writeUTF8(auth.deviceID, p, l);
+}
+
+static BOOL unpackAuthStatus(Message *msg, const char *p, int len) {
+    AuthenticationStatus *auth = [[AuthenticationStatus alloc] init];
+    auth.status = readInt32(p);
+    if (len >= 8) {
+        auth.retryAfter = readInt32(p + 4);
+    }
+    msg.body = auth;
+    return YES;
+}
+
+static int imLength(Message *msg) {
+    IMMessage *m = (IMMessage*)msg.body;
+    int l = utf8Length(m.content);
+    if (l + 24 > FRAGMENT_MAX_MESSAGE) {
+        return -1;
+    }
+    return 24 + l;
+}
+
+static void packIM(Message *msg, char *p) {
+    IMMessage *m = (IMMessage*)msg.body;
+    writeInt64(m.sender, p);
+    p += 8;
+    writeInt64(m.receiver, p);
+    p += 8;
+    writeInt32(m.timestamp, p);
+    p += 4;
+    writeInt32(m.msgLocalID, p);
+    p += 4;
+    p = writeUTF8(m.content, p, utf8Length(m.content));
+}
+
+static BOOL unpackIM(Message *msg, const char *p, int len) {
+    IMMessage *m = [[IMMessage alloc] init];
+    m.sender = readInt64(p);
+    p += 8;
+    m.receiver = readInt64(p);
+    p += 8;
+    m.timestamp = readInt32(p);
+    p += 4;
+    m.msgLocalID = readInt32(p);
+    p += 4;
+    m.content = readUTF8(p, len - 24);
+    msg.body = m;
+    return YES;
+}
+
+static int customerLength(Message *msg) {
+    CustomerMessage *m = (CustomerMessage*)msg.body;
+    int l = utf8Length(m.content);
+    if (l + 36 > FRAGMENT_MAX_MESSAGE) {
+        return -1;
+    }
+    return 36 + l;
+}
+
+static void packCustomer(Message *msg, char *p) {
+    CustomerMessage *m = (CustomerMessage*)msg.body;
+    writeInt64(m.customerAppID, p);
+    p += 8;
+    writeInt64(m.customerID, p);
+    p += 8;
+    writeInt64(m.storeID, p);
+    p += 8;
+    writeInt64(m.sellerID, p);
+    p += 8;
+    writeInt32(m.timestamp, p);
+    p += 4;
+    p = writeUTF8(m.content, p, utf8Length(m.content));
+}
+
+static BOOL unpackCustomer(Message *msg, const char *p, int len) {
+    CustomerMessage *m = [[CustomerMessage alloc] init];
+    m.customerAppID = readInt64(p);
+    p += 8;
+    m.customerID = readInt64(p);
+    p += 8;
+    m.storeID = readInt64(p);
+    p += 8;
+    m.sellerID = readInt64(p);
+    p += 8;
+    m.timestamp = readInt32(p);
+    p += 4;
+    m.content = readUTF8(p, len - 36);
+    msg.body = m;
+    return YES;
+}
+
+static int int32Length(Message *msg) {
+    return 4;
+}
+
+static void packInt32(Message *msg, char *p) {
+    writeInt32([(NSNumber*)msg.body intValue], p);
+}
+
+static BOOL unpackInt32(Message *msg, const char *p, int len) {
+    msg.body = [NSNumber numberWithInt:readInt32(p)];
+    return YES;
+}
+
+static int int64Length(Message *msg) {
+    return 8;
+}
+
+static void packInt64(Message *msg, char *p) {
+    writeInt64([(NSNumber*)msg.body longLongValue], p);
+}
+
+static BOOL unpackInt64(Message *msg, const char *p, int len) {
+    msg.body = [NSNumber numberWithLongLong:readInt64(p)];
+    return YES;
+}
+
+static int inputingLength(Message *msg) {
+    return 16;
+}
+
+static void packInputing(Message *msg, char *p) {
+    MessageInputing *inputing = (MessageInputing*)msg.body;
+    writeInt64(inputing.sender, p);
+    p += 8;
+    writeInt64(inputing.receiver, p);
+}
+
+static BOOL unpackInputing(Message *msg, const char *p, int len) {
+    MessageInputing *inputing = [[MessageInputing alloc] init];
+    inputing.sender = readInt64(p);
+    p += 8;
+    inputing.receiver = readInt64(p);
+    msg.body = inputing;
+    return YES;
+}
+
+static BOOL unpackString(Message *msg, const char *p, int len) {
+    msg.body = readUTF8(p, len);
+    return YES;
+}
+
+static int roomLength(Message *msg) {
+    RoomMessage *rm = (RoomMessage*)msg.body;
+    int l = utf8Length(rm.content);
+    if (l + 16 > FRAGMENT_MAX_MESSAGE) {
+        return -1;
+    }
+    return 16 + l;
+}
+
+static void packRoom(Message *msg, char *p) {
+    RoomMessage *rm = (RoomMessage*)msg.body;
+    writeInt64(rm.sender, p);
+    p += 8;
+    writeInt64(rm.receiver, p);
+    p += 8;
+    p = writeUTF8(rm.content, p, utf8Length(rm.content));
+}
+
+static BOOL unpackRoom(Message *msg, const char *p, int len) {
+    RoomMessage *rm = [[RoomMessage alloc] init];
+    rm.sender = readInt64(p);
+    p += 8;
+    rm.receiver = readInt64(p);
+    p += 8;
+    rm.content = readUTF8(p, len - 16);
+    msg.body = rm;
+    return YES;
+}
+
+static int voipControlLength(Message *msg) {
+    VOIPControl *ctl = (VOIPControl*)msg.body;
+    return 16 + (int)ctl.content.length;
+}
+
+static void packVOIPControl(Message *msg, char *p) {
+    VOIPControl *ctl = (VOIPControl*)msg.body;
+    writeInt64(ctl.sender, p);
+    p += 8;
+    writeInt64(ctl.receiver, p);
+    p += 8;
+    if (ctl.content.length > 0) {
+        [ctl.content getBytes:p length:ctl.content.length];
+    }
+}
+
+static BOOL unpackVOIPControl(Message *msg, const char *p, int len) {
+    VOIPControl *ctl = [[VOIPControl alloc] init];
+    ctl.sender = readInt64(p);
+    p += 8;
+    ctl.receiver = readInt64(p);
+    p += 8;
+    ctl.content = [NSData dataWithBytes:p length:len - 16];
+    msg.body = ctl;
+    return YES;
+}
+
+static int groupSyncKeyLength(Message *msg) {
+    return 16;
+}
+
+static void packGroupSyncKey(Message *msg, char *p) {
+    GroupSyncKey *s = (GroupSyncKey*)msg.body;
+    writeInt64(s.groupID, p);
+    p += 8;
+    writeInt64(s.syncKey, p);
+}
+
+static BOOL unpackGroupSyncKey(Message *msg, const char *p, int len) {
+    GroupSyncKey *groupSyncKey = [[GroupSyncKey alloc] init];
+    groupSyncKey.groupID = readInt64(p);
+    p += 8;
+    groupSyncKey.syncKey = readInt64(p);
+    msg.body = groupSyncKey;
+    return YES;
+}
+
+static BOOL unpackSessionTicket(Message *msg, const char *p, int len) {
+    SessionTicket *ticket = [[SessionTicket alloc] init];
+    ticket.ticket = readInt64(p);
+    p += 8;
+    ticket.ttl = readInt32(p);
+    msg.body = ticket;
+    return YES;
+}
+
+static int resumeLength(Message *msg) {
+    return 20;
+}
+
+static void packResume(Message *msg, char *p) {
+    SessionResume *resume = (SessionResume*)msg.body;
+    writeInt64(resume.ticket, p);
+    p += 8;
+    writeInt32(resume.lastSeq, p);
+    p += 4;
+    writeInt64(resume.syncKey, p);
+}
+
+#pragma mark - codec v2
+
+//v2消息体的读取游标, 越界之后ok为NO, 之后读到的都是0
+struct BodyReader {
+    const uint8_t *p;
+    const uint8_t *end;
+    BOOL ok;
+};
+
+static struct BodyReader bodyReader(const char *p, int len) {
+    struct BodyReader r = {(const uint8_t*)p, (const uint8_t*)p + len, len >= 0};
+    return r;
+}
+
+static uint64_t readVarint(struct BodyReader *r) {
+    uint64_t v = 0;
+    int n = r->ok ? varint_read(r->p, (int)(r->end - r->p), &v) : 0;
+    if (n == 0) {
+        r->ok = NO;
+        return 0;
+    }
+    r->p += n;
+    return v;
+}
+
+//相对uid的有符号差值
+static int64_t readDelta(struct BodyReader *r, int64_t uid) {
+    return (int64_t)((uint64_t)uid + (uint64_t)zigzag_decode(readVarint(r)));
+}
+
+static int32_t readFixed32(struct BodyReader *r) {
+    if (!r->ok || r->end - r->p < 4) {
+        r->ok = NO;
+        return 0;
+    }
+    int32_t v = readInt32(r->p);
+    r->p += 4;
+    return v;
+}
+
+//剩余的字节作为字符串
+static NSString *readRemainUTF8(struct BodyReader *r) {
+    if (!r->ok) {
+        return nil;
+    }
+    NSString *s = readUTF8((const char*)r->p, (int)(r->end - r->p));
+    r->p = r->end;
+    return s;
+}
+
+static int deltaSize(int64_t v, int64_t uid) {
+    return varint_size(zigzag_encode((int64_t)((uint64_t)v - (uint64_t)uid)));
+}
+
+static char *writeVarint(uint64_t v, char *p) {
+    return (char*)varint_write((uint8_t*)p, v);
+}
+
+static char *writeDelta(int64_t v, int64_t uid, char *p) {
+    return writeVarint(zigzag_encode((int64_t)((uint64_t)v - (uint64_t)uid)), p);
+}
+
+//时间戳使用当前的秒数, 变长编码需要5个字节, v2仍然使用定长的4个字节
+static int imLengthV2(Message *msg) {
+    IMMessage *m = (IMMessage*)msg.body;
+    int l = utf8Length(m.content);
+    if (l + 24 > FRAGMENT_MAX_MESSAGE) {
+        return -1;
+    }
+    return deltaSize(m.sender, msg.uid) + deltaSize(m.receiver, msg.uid) + 4 +
+        varint_size((uint32_t)m.msgLocalID) + l;
+}
+
+static void packIMV2(Message *msg, char *p) {
+    IMMessage *m = (IMMessage*)msg.body;
+    p = writeDelta(m.sender, msg.uid, p);
+    p = writeDelta(m.receiver, msg.uid, p);
+    writeInt32(m.timestamp, p);
+    p += 4;
+    p = writeVarint((uint32_t)m.msgLocalID, p);
+    p = writeUTF8(m.content, p, utf8Length(m.content));
+}
+
+static BOOL unpackIMV2(Message *msg, const char *p, int len) {
+    struct BodyReader r = bodyReader(p, len);
+    IMMessage *m = [[IMMessage alloc] init];
+    m.sender = readDelta(&r, msg.uid);
+    m.receiver = readDelta(&r, msg.uid);
+    m.timestamp = readFixed32(&r);
+    m.msgLocalID = (int32_t)readVarint(&r);
+    m.content = readRemainUTF8(&r);
+    msg.body = m;
+    return r.ok;
+}
+
+static int customerLengthV2(Message *msg) {
+    CustomerMessage *m = (CustomerMessage*)msg.body;
+    int l = utf8Length(m.content);
+    if (l + 36 > FRAGMENT_MAX_MESSAGE) {
+        return -1;
+    }
+    return varint_size(m.customerAppID) + deltaSize(m.customerID, msg.uid) +
+        varint_size(m.storeID) + deltaSize(m.sellerID, msg.uid) + 4 + l;
+}
+
+static void packCustomerV2(Message *msg, char *p) {
+    CustomerMessage *m = (CustomerMessage*)msg.body;
+    p = writeVarint(m.customerAppID, p);
+    p = writeDelta(m.customerID, msg.uid, p);
+    p = writeVarint(m.storeID, p);
+    p = writeDelta(m.sellerID, msg.uid, p);
+    writeInt32(m.timestamp, p);
+    p += 4;
+    p = writeUTF8(m.content, p, utf8Length(m.content));
+}
+
+static BOOL unpackCustomerV2(Message *msg, const char *p, int len) {
+    struct BodyReader r = bodyReader(p, len);
+    CustomerMessage *m = [[CustomerMessage alloc] init];
+    m.customerAppID = readVarint(&r);
+    m.customerID = readDelta(&r, msg.uid);
+    m.storeID = readVarint(&r);
+    m.sellerID = readDelta(&r, msg.uid);
+    m.timestamp = readFixed32(&r);
+    m.content = readRemainUTF8(&r);
+    msg.body = m;
+    return r.ok;
+}
+
+static int varint32Length(Message *msg) {
+    return varint_size((uint32_t)[(NSNumber*)msg.body intValue]);
+}
+
+static void packVarint32(Message *msg, char *p) {
+    writeVarint((uint32_t)[(NSNumber*)msg.body intValue], p);
+}
+
+static BOOL unpackVarint32(Message *msg, const char *p, int len) {
+    struct BodyReader r = bodyReader(p, len);
+    msg.body = [NSNumber numberWithInt:(int32_t)readVarint(&r)];
+    return r.ok;
+}
+
+static int varint64Length(Message *msg) {
+    return varint_size((uint64_t)[(NSNumber*)msg.body longLongValue]);
+}
+
+static void packVarint64(Message *msg, char *p) {
+    writeVarint((uint64_t)[(NSNumber*)msg.body longLongValue], p);
+}
+
+static BOOL unpackVarint64(Message *msg, const char *p, int len) {
+    struct BodyReader r = bodyReader(p, len);
+    msg.body = [NSNumber numberWithLongLong:(int64_t)readVarint(&r)];
+    return r.ok;
+}
+
+static BOOL unpackAuthStatusV2(Message *msg, const char *p, int len) {
+    struct BodyReader r = bodyReader(p, len);
+    AuthenticationStatus *auth = [[AuthenticationStatus alloc] init];
+    auth.status = (int32_t)readVarint(&r);
+    if (r.ok && r.p < r.end) {
+        auth.retryAfter = (int32_t)readVarint(&r);
+    }
+    msg.body = auth;
+    return r.ok;
+}
+
+static int inputingLengthV2(Message *msg) {
+    MessageInputing *inputing = (MessageInputing*)msg.body;
+    return deltaSize(inputing.sender, msg.uid) + deltaSize(inputing.receiver, msg.uid);
+}
+
+static void packInputingV2(Message *msg, char *p) {
+    MessageInputing *inputing = (MessageInputing*)msg.body;
+    p = writeDelta(inputing.sender, msg.uid, p);
+    p = writeDelta(inputing.receiver, msg.uid, p);
+}
+
+static BOOL unpackInputingV2(Message *msg, const char *p, int len) {
+    struct BodyReader r = bodyReader(p, len);
+    MessageInputing *inputing = [[MessageInputing alloc] init];
+    inputing.sender = readDelta(&r, msg.uid);
+    inputing.receiver = readDelta(&r, msg.uid);
+    msg.body = inputing;
+    return r.ok;
+}
+
+//房间id和用户id无关, 直接变长编码
+static int roomLengthV2(Message *msg) {
+    RoomMessage *rm = (RoomMessage*)msg.body;
+    int l = utf8Length(rm.content);
+    if (l + 16 > FRAGMENT_MAX_MESSAGE) {
+        return -1;
+    }
+    return deltaSize(rm.sender, msg.uid) + varint_size(rm.receiver) + l;
+}
+
+static void packRoomV2(Message *msg, char *p) {
+    RoomMessage *rm = (RoomMessage*)msg.body;
+    p = writeDelta(rm.sender, msg.uid, p);
+    p = writeVarint(rm.receiver, p);
+    p = writeUTF8(rm.content, p, utf8Length(rm.content));
+}
+
+static BOOL unpackRoomV2(Message *msg, const char *p, int len) {
+    struct BodyReader r = bodyReader(p, len);
+    RoomMessage *rm = [[RoomMessage alloc] init];
+    rm.sender = readDelta(&r, msg.uid);
+    rm.receiver = readVarint(&r);
+    rm.content = readRemainUTF8(&r);
+    msg.body = rm;
+    return r.ok;
+}
+
+static int voipControlLengthV2(Message *msg) {
+    VOIPControl *ctl = (VOIPControl*)msg.body;
+    return deltaSize(ctl.sender, msg.uid) + deltaSize(ctl.receiver, msg.uid) + (int)ctl.content.length;
+}
+
+static void packVOIPControlV2(Message *msg, char *p) {
+    VOIPControl *ctl = (VOIPControl*)msg.body;
+    p = writeDelta(ctl.sender, msg.uid, p);
+    p = writeDelta(ctl.receiver, msg.uid, p);
+    if (ctl.content.length > 0) {
+        [ctl.content getBytes:p length:ctl.content.length];
+    }
+}
+
+static BOOL unpackVOIPControlV2(Message *msg, const char *p, int len) {
+    struct BodyReader r = bodyReader(p, len);
+    VOIPControl *ctl = [[VOIPControl alloc] init];
+    ctl.sender = readDelta(&r, msg.uid);
+    ctl.receiver = readDelta(&r, msg.uid);
+    if (r.ok) {
+        ctl.content = [NSData dataWithBytes:r.p length:r.end - r.p];
+    }
+    msg.body = ctl;
+    return r.ok;
+}
+
+static int groupSyncKeyLengthV2(Message *msg) {
+    GroupSyncKey *s = (GroupSyncKey*)msg.body;
+    return varint_size(s.groupID) + varint_size(s.syncKey);
+}
+
+static void packGroupSyncKeyV2(Message *msg, char *p) {
+    GroupSyncKey *s = (GroupSyncKey*)msg.body;
+    p = writeVarint(s.groupID, p);
+    p = writeVarint(s.syncKey, p);
+}
+
+static BOOL unpackGroupSyncKeyV2(Message *msg, const char *p, int len) {
+    struct BodyReader r = bodyReader(p, len);
+    GroupSyncKey *groupSyncKey = [[GroupSyncKey alloc] init];
+    groupSyncKey.groupID = readVarint(&r);
+    groupSyncKey.syncKey = readVarint(&r);
+    msg.body = groupSyncKey;
+    return r.ok;
+}
+
+//以命令字为下标的编解码表, 只发送或只接收的命令对应的函数为NULL
+static struct MessageCodec codecs[256] = {
+    [MSG_HEARTBEAT] = {emptyLength, packEmpty, NULL},
+    [MSG_PING] = {emptyLength, packEmpty, NULL},
+    [MSG_PONG] = {NULL, NULL, unpackEmpty},
+    [MSG_AUTH_TOKEN] = {authTokenLength, packAuthToken, NULL},
+    [MSG_AUTH_STATUS] = {NULL, NULL, unpackAuthStatus, 4},
+    [MSG_IM] = {imLength, packIM, unpackIM, 24},
+    [MSG_GROUP_IM] = {imLength, packIM, unpackIM, 24},
+    [MSG_CUSTOMER] = {customerLength, packCustomer, unpackCustomer, 36},
+    [MSG_CUSTOMER_SUPPORT] = {customerLength, packCustomer, unpackCustomer, 36},
+    [MSG_ACK] = {int32Length, packInt32, unpackInt32, 4},
+    [MSG_UNREAD_COUNT] = {int32Length, packInt32, NULL},
+    [MSG_INPUTING] = {inputingLength, packInputing, unpackInputing, 16},
+    [MSG_ENTER_ROOM] = {int64Length, packInt64, NULL},
+    [MSG_LEAVE_ROOM] = {int64Length, packInt64, NULL},
+    [MSG_GROUP_NOTIFICATION] = {NULL, NULL, unpackString},
+    [MSG_SYSTEM] = {NULL, NULL, unpackString},
+    [MSG_ROOM_IM] = {roomLength, packRoom, unpackRoom, 16},
+    [MSG_RT] = {roomLength, packRoom, unpackRoom, 16},
+    [MSG_VOIP_CONTROL] = {voipControlLength, packVOIPControl, unpackVOIPControl, 16},
+    [MSG_SYNC] = {int64Length, packInt64, NULL},
+    [MSG_SYNC_BEGIN] = {NULL, NULL, unpackInt64, 8},
+    [MSG_SYNC_END] = {NULL, NULL, unpackInt64, 8},
+    [MSG_SYNC_NOTIFY] = {NULL, NULL, unpackInt64, 8},
+    [MSG_SYNC_GROUP] = {groupSyncKeyLength, packGroupSyncKey, NULL},
+    [MSG_SYNC_GROUP_BEGIN] = {NULL, NULL, unpackGroupSyncKey, 16},
+    [MSG_SYNC_GROUP_END] = {NULL, NULL, unpackGroupSyncKey, 16},
+    [MSG_SYNC_GROUP_NOTIFY] = {NULL, NULL, unpackGroupSyncKey, 16},
+    [MSG_SESSION_TICKET] = {NULL, NULL, unpackSessionTicket, 12},
+    [MSG_RESUME] = {resumeLength, packResume, NULL},
+    [MSG_RESUME_STATUS] = {NULL, NULL, unpackInt32, 4},
+};
+
+//v2的编解码表, 为空的命令(认证, 会话恢复, 字符串消息等)和v1相同
+//认证和恢复请求在两个版本中的布局一样, 客户端用它们的帧头告诉服务器支持的最高版本
+static struct MessageCodec codecsV2[256] = {
+    [MSG_AUTH_STATUS] = {NULL, NULL, unpackAuthStatusV2},
+    [MSG_IM] = {imLengthV2, packIMV2, unpackIMV2},
+    [MSG_GROUP_IM] = {imLengthV2, packIMV2, unpackIMV2},
+    [MSG_CUSTOMER] = {customerLengthV2, packCustomerV2, unpackCustomerV2},
+    [MSG_CUSTOMER_SUPPORT] = {customerLengthV2, packCustomerV2, unpackCustomerV2},
+    [MSG_ACK] = {varint32Length, packVarint32, unpackVarint32},
+    [MSG_UNREAD_COUNT] = {varint32Length, packVarint32, NULL},
+    [MSG_INPUTING] = {inputingLengthV2, packInputingV2, unpackInputingV2},
+    [MSG_ENTER_ROOM] = {varint64Length, packVarint64, NULL},
+    [MSG_LEAVE_ROOM] = {varint64Length, packVarint64, NULL},
+    [MSG_ROOM_IM] = {roomLengthV2, packRoomV2, unpackRoomV2},
+    [MSG_RT] = {roomLengthV2, packRoomV2, unpackRoomV2},
+    [MSG_VOIP_CONTROL] = {voipControlLengthV2, packVOIPControlV2, unpackVOIPControlV2},
+    [MSG_SYNC] = {varint64Length, packVarint64, NULL},
+    [MSG_SYNC_BEGIN] = {NULL, NULL, unpackVarint64},
+    [MSG_SYNC_END] = {NULL, NULL, unpackVarint64},
+    [MSG_SYNC_NOTIFY] = {NULL, NULL, unpackVarint64},
+    [MSG_SYNC_GROUP] = {groupSyncKeyLengthV2, packGroupSyncKeyV2, NULL},
+    [MSG_SYNC_GROUP_BEGIN] = {NULL, NULL, unpackGroupSyncKeyV2},
+    [MSG_SYNC_GROUP_END] = {NULL, NULL, unpackGroupSyncKeyV2},
+    [MSG_SYNC_GROUP_NOTIFY] = {NULL, NULL, unpackGroupSyncKeyV2},
+    [MSG_RESUME_STATUS] = {NULL, NULL, unpackVarint32},
+};
+
+static const struct MessageCodec *packCodec(int cmd, int version) {
+    const struct MessageCodec *codec = &codecsV2[(uint8_t)cmd];
+    if (version >= PROTOCOL_VERSION_2 && codec->length && codec->pack) {
+        return codec;
+    }
+    return &codecs[(uint8_t)cmd];
+}
+
+static const struct MessageCodec *unpackCodec(int cmd, int version) {
+    const struct MessageCodec *codec = &codecsV2[(uint8_t)cmd];
+    if (version >= PROTOCOL_VERSION_2 && codec->unpack) {
+        return codec;
+    }
+    return &codecs[(uint8_t)cmd];
+}
+
 @implementation Message
--(NSData*)pack {
-    char buf[64*1024] = {0};
-    char *p = buf;
 
-    writeInt32(self.seq, p);
++(void)registerCodec:(int)cmd codec:(struct MessageCodec)codec {
+    codecs[(uint8_t)cmd] = codec;
+}
+
++(void)registerCodec:(int)cmd version:(int)version codec:(struct MessageCodec)codec {
+    if (version >= PROTOCOL_VERSION_2) {
+        codecsV2[(uint8_t)cmd] = codec;
+    } else {
+        codecs[(uint8_t)cmd] = codec;
+    }
+}
+
+-(id)init {
+    self = [super init];
+    if (self) {
+        self.version = PROTOCOL_VERSION_1;
+    }
+    return self;
+}
+
+static char *writeFrameHead(char *p, int len, int seq, int cmd, int version, int flags) {
+    writeInt32(len, p);
     p += 4;
-    *p++ = (uint8_t)self.cmd;
-    *p++ = (uint8_t)VERSION;
-    p += 2;
-    
-    if (self.cmd == MSG_HEARTBEAT || self.cmd == MSG_PING) {
-        return [NSData dataWithBytes:buf length:HEAD_SIZE];
-    } else if (self.cmd == MSG_AUTH_TOKEN) {
-        AuthenticationToken *auth = (AuthenticationToken*)self.body;
-        *p++ = auth.platformID;
-        const char *t;
-        t = [auth.token UTF8String];
-        *p++ = strlen(t);
-        memcpy(p, t, strlen(t));
-        p += strlen(t);
-        t = [auth.deviceID UTF8String];
-        *p++ = strlen(t);
-        memcpy(p, t, strlen(t));
-        p += strlen(t);
-        return [NSData dataWithBytes:buf length:(p-buf)];
-    }  else if (self.cmd == MSG_IM || self.cmd == MSG_GROUP_IM) {
-        IMMessage *m = (IMMessage*)self.body;
-        writeInt64(m.sender, p);
-        p += 8;
-        writeInt64(m.receiver, p);
-        p += 8;
-        writeInt32(m.timestamp, p);
-        p += 4;
-        writeInt32(m.msgLocalID, p);
-        p += 4;
-        const char *s = [m.content UTF8String];
-        size_t l = strlen(s);
-        if ((l + 36) > 64*1024) {
-            return nil;
-        }
-        memcpy(p, s, l);
-        return [NSData dataWithBytes:buf length:HEAD_SIZE + 24 +l];
-    } else if (self.cmd == MSG_CUSTOMER || self.cmd == MSG_CUSTOMER_SUPPORT) {
-        CustomerMessage *m = (CustomerMessage*)self.body;
-        writeInt64(m.customerAppID, p);
-        p += 8;
-        writeInt64(m.customerID, p);
-        p += 8;
-        writeInt64(m.storeID, p);
-        p += 8;
-        writeInt64(m.sellerID, p);
-        p += 8;
-        writeInt32(m.timestamp, p);
-        p += 4;
-        const char *s = [m.content UTF8String];
-        size_t l = strlen(s);
-        if ((l + 36) >= 32*1024) {
-            return nil;
-        }
-        memcpy(p, s, l);
-        return [NSData dataWithBytes:buf length:HEAD_SIZE + 36 + l];
-    } else if (self.cmd == MSG_ACK) {
-        writeInt32([(NSNumber*)self.body intValue], p);
-        return [NSData dataWithBytes:buf length:HEAD_SIZE+4];
-    } else if (self.cmd == MSG_INPUTING) {
-        MessageInputing *inputing = (MessageInputing*)self.body;
-        writeInt64(inputing.sender, p);
-        p += 8;
-        writeInt64(inputing.receiver, p);
-        return [NSData dataWithBytes:buf length:HEAD_SIZE + 16];
-    } else if (self.cmd == MSG_ENTER_ROOM || self.cmd == MSG_LEAVE_ROOM) {
-        NSNumber *n = (NSNumber*)self.body;
-        int64_t roomID = [n longLongValue];
-        writeInt64(roomID, p);
-        p += 8;
-        return [NSData dataWithBytes:buf length:HEAD_SIZE + 8];
-    } else if (self.cmd == MSG_ROOM_IM || self.cmd == MSG_RT) {
-        RoomMessage *rm = (RoomMessage*)self.body;
-        writeInt64(rm.sender, p);
-        p += 8;
-        writeInt64(rm.receiver, p);
-        p += 8;
-        const char *s = [rm.content UTF8String];
-        size_t l = strlen(s);
-        if ((l + 28) > 64*1024) {
-            return nil;
-        }
-        memcpy(p, s, l);
-        return [NSData dataWithBytes:buf length:HEAD_SIZE + 16 +l];
-    } else if (self.cmd == MSG_UNREAD_COUNT) {
-        NSNumber *u = (NSNumber*)self.body;
-        writeInt32([u intValue], p);
-        p += 4;
-        return [NSData dataWithBytes:buf length:HEAD_SIZE + 4];
-    } else if (self.cmd == MSG_VOIP_CONTROL) {
-        VOIPControl *ctl = (VOIPControl*)self.body;
-        writeInt64(ctl.sender, p);
-        p += 8;
-        writeInt64(ctl.receiver, p);
-        p += 8;
-        if (ctl.content.length > 0) {
-            [ctl.content getBytes:p length:ctl.content.length];
-            p += ctl.content.length;
-        }
-        return [NSData dataWithBytes:buf length:HEAD_SIZE + 16 + ctl.content.length];
-    } else if (self.cmd == MSG_SYNC) {
-        NSNumber *u = (NSNumber*)self.body;
-        writeInt64([u longLongValue], p);
-        p += 8;
-        return [NSData dataWithBytes:buf length:HEAD_SIZE + 8];
-    } else if (self.cmd == MSG_SYNC_GROUP) {
-        GroupSyncKey *s = (GroupSyncKey*)self.body;
-        writeInt64(s.groupID, p);
-        p += 8;
-        writeInt64(s.syncKey, p);
-        p += 8;
-        return [NSData dataWithBytes:buf length:HEAD_SIZE + 16];
+    writeInt32(seq, p);
+    p += 4;
+    *p++ = (uint8_t)cmd;
+    *p++ = (uint8_t)version;
+    *p++ = (uint8_t)flags;
+    *p++ = 0;
+    return p;
+}
+
+-(BOOL)packFrame:(NSMutableData*)buffer {
+    const struct MessageCodec *codec = packCodec(self.cmd, self.version);
+    if (!codec->length || !codec->pack) {
+        return NO;
+    }
+    int len = codec->length(self);
+    if (len < 0) {
+        return NO;
+    }
+    if (len > FRAGMENT_MAX_BODY) {
+        [self packFragments:buffer codec:codec length:len];
+        return YES;
     }
-    return nil;
+    NSUInteger offset = buffer.length;
+    [buffer increaseLengthBy:4 + HEAD_SIZE + len];
+    char *p = (char*)[buffer mutableBytes] + offset;
+    p = writeFrameHead(p, len, self.seq, self.cmd, self.version, self.flags);
+    codec->pack(self, p);
+    return YES;
+}
+
+//消息体先完整地编码到新增区域的末尾, 再从前往后把每一片移到自己的帧头后面,
+//第i片的目标位置不会超过它和后面各片的原位置, 打包时不需要第二份消息体的缓冲区
+//各分片帧随后由IMService按帧引用这块缓冲区提交给tcp, 同样不复制
+//分片依次使用seq, seq+1..., 完成之后self.seq为最后一个分片的seq
+-(void)packFragments:(NSMutableData*)buffer codec:(const struct MessageCodec*)codec length:(int)len {
+    int count = fragment_count(len);
+    int overhead = 4 + HEAD_SIZE + FRAGMENT_HEAD_SIZE;
+    NSUInteger offset = buffer.length;
+    [buffer increaseLengthBy:count*overhead + len];
+    char *base = (char*)[buffer mutableBytes] + offset;
+    char *body = base + count*overhead;
+    codec->pack(self, body);
+
+    char *p = base;
+    for (int i = 0; i < count; i++) {
+        struct fragment_head h;
+        h.cmd = (uint8_t)self.cmd;
+        h.total = len;
+        h.offset = i*FRAGMENT_MAX_BODY;
+        int n = MIN(FRAGMENT_MAX_BODY, len - h.offset);
+        p = writeFrameHead(p, FRAGMENT_HEAD_SIZE + n, self.seq + i, MSG_FRAGMENT, self.version, self.flags);
+        fragment_write_head((uint8_t*)p, &h);
+        p += FRAGMENT_HEAD_SIZE;
+        memmove(p, body + h.offset, n);
+        p += n;
+    }
+    self.seq = self.seq + count - 1;
+}
+
+-(NSData*)pack {
+    NSMutableData *data = [NSMutableData data];
+    int seq = self.seq;
+    if (![self packFrame:data]) {
+        return nil;
+    }
+    if (self.seq != seq) {
+        self.seq = seq;
+        return nil;
+    }
+    return [data subdataWithRange:NSMakeRange(4, data.length - 4)];
 }
 
 -(BOOL)unpack:(NSData*)data {
-    const char *p = [data bytes];
+    return [self unpack:[data bytes] length:(int)data.length];
+}
+
+-(BOOL)unpack:(const char*)bytes length:(int)length {
+    if (length < HEAD_SIZE) {
+        return NO;
+    }
+    const char *p = bytes;
     self.seq = readInt32(p);
     p += 4;
     self.cmd = *p;
+    self.version = (uint8_t)*(p + 1);
+    self.flags = (uint8_t)*(p + 2);
     p += 4;
-    NSLog(@"seq:%d cmd:%d", self.seq, self.cmd);
-    if (self.cmd == MSG_PONG) {
-        return YES;
-    } else if (self.cmd == MSG_AUTH_STATUS) {
-        int status = readInt32(p);
-        self.body = [NSNumber numberWithInt:status];
-        return YES;
-    } else if (self.cmd == MSG_IM || self.cmd == MSG_GROUP_IM) {
-        IMMessage *m = [[IMMessage alloc] init];
-        m.sender = readInt64(p);
-        p += 8;
-        m.receiver = readInt64(p);
-        p += 8;
-        m.timestamp = readInt32(p);
-        p += 4;
-        m.msgLocalID = readInt32(p);
-        p += 4;
-        m.content = [[NSString alloc] initWithBytes:p length:data.length-32 encoding:NSUTF8StringEncoding];
-        self.body = m;
-        return YES;
-    } else if (self.cmd == MSG_CUSTOMER || self.cmd == MSG_CUSTOMER_SUPPORT) {
-        CustomerMessage *m = [[CustomerMessage alloc] init];
-        m.customerAppID = readInt64(p);
-        p += 8;
-        m.customerID = readInt64(p);
-        p += 8;
-        m.storeID = readInt64(p);
-        p += 8;
-        m.sellerID = readInt64(p);
-        p += 8;
-        m.timestamp = readInt32(p);
-        p += 4;
-        m.content = [[NSString alloc] initWithBytes:p length:data.length- HEAD_SIZE - 36 encoding:NSUTF8StringEncoding];
-        self.body = m;
-        return YES;
-    } else if (self.cmd == MSG_ACK) {
-        int seq = readInt32(p);
-        self.body = [NSNumber numberWithInt:seq];
-        return YES;
-    } else if (self.cmd == MSG_INPUTING) {
-        MessageInputing *inputing = [[MessageInputing alloc] init];
-        inputing.sender = readInt64(p);
-        p += 8;
-        inputing.receiver = readInt64(p);
-        p += 8;
-        self.body = inputing;
-        return YES;
-    } else if (self.cmd == MSG_GROUP_NOTIFICATION) {
-        self.body = [[NSString alloc] initWithBytes:p length:data.length-HEAD_SIZE encoding:NSUTF8StringEncoding];
-        return YES;
-    } else if (self.cmd == MSG_ROOM_IM || self.cmd == MSG_RT) {
-        RoomMessage *rm = [[RoomMessage alloc] init];
-        rm.sender = readInt64(p);
-        p += 8;
-        rm.receiver = readInt64(p);
-        p += 8;
-        rm.content = [[NSString alloc] initWithBytes:p length:data.length-24 encoding:NSUTF8StringEncoding];
-        self.body = rm;
-        return YES;
-    } else if (self.cmd == MSG_SYSTEM) {
-        self.body = [[NSString alloc] initWithBytes:p length:data.length-HEAD_SIZE encoding:NSUTF8StringEncoding];
-        return YES;
-    } else if (self.cmd == MSG_VOIP_CONTROL) {
-        VOIPControl *ctl = [[VOIPControl alloc] init];
-        ctl.sender = readInt64(p);
-        p += 8;
-        ctl.receiver = readInt64(p);
-        p += 8;
-        ctl.content = [NSData dataWithBytes:p length:data.length - 24];
-        self.body = ctl;
-        return YES;
-    } else if (self.cmd == MSG_SYNC_BEGIN ||
-               self.cmd == MSG_SYNC_END ||
-               self.cmd == MSG_SYNC_NOTIFY) {
-        int64_t k = readInt64(p);
-        p += 8;
-        self.body = [NSNumber numberWithLongLong:k];
-        return YES;
-    } else if (self.cmd == MSG_SYNC_GROUP_BEGIN ||
-               self.cmd == MSG_SYNC_GROUP_END ||
-               self.cmd == MSG_SYNC_GROUP_NOTIFY) {
-        GroupSyncKey *groupSyncKey = [[GroupSyncKey alloc] init];
-        groupSyncKey.groupID = readInt64(p);
-        p += 8;
-        groupSyncKey.syncKey = readInt64(p);
-        p += 8;
-        self.body = groupSyncKey;
-        return YES;
-    } else {
-        self.body = [NSData dataWithBytes:p length:data.length-8];
-        return YES;
+    IMLogD("seq:%d cmd:%d version:%d", self.seq, self.cmd, self.version);
+    if (self.version > PROTOCOL_MAX_VERSION) {
+        return NO;
+    }
+
+    const struct MessageCodec *codec = unpackCodec(self.cmd, self.version);
+    if (codec->unpack) {
+        if (length - HEAD_SIZE < codec->minLength) {
+            return NO;
+        }
+        return codec->unpack(self, p, length - HEAD_SIZE);
     }
+    self.body = [NSData dataWithBytes:p length:length - HEAD_SIZE];
+    return YES;
 }
 
 @end
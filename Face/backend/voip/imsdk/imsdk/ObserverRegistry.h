@@ -0,0 +1,46 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#import <Foundation/Foundation.h>
+
+#define OBSERVER_MAX_SELECTORS 32
+
+struct observer_entry {
+    __unsafe_unretained id observer;
+    //第i位表示观察者实现了第i个方法
+    uint32_t mask;
+};
+
+//某一时刻的观察者列表, 创建之后不再修改, 持有其中所有的观察者
+@interface ObserverSnapshot : NSObject {
+@public
+    int count;
+    //所有观察者掩码的并集, 没有观察者实现某个方法时发布方可以跳过准备参数
+    uint32_t mask;
+    struct observer_entry *entries;
+}
+@end
+
+/*
+ * 观察者注册表
+ * 注册时用respondsToSelector:检查一次观察者实现了哪些可选方法, 发布时只比较掩码
+ * 注册和注销复制出新的快照整体替换(copy-on-write), 发布方遍历取到的快照,
+ * 回调中注册注销观察者不影响当前的遍历, 可以在任意线程上注册和发布
+ */
+@interface ObserverRegistry : NSObject
+//sels为各个可选方法, 按顺序对应掩码的第0位, 第1位...
+-(id)initWithSelectors:(const SEL*)sels count:(int)count;
+
+@property(atomic, readonly) ObserverSnapshot *snapshot;
+@property(nonatomic, readonly) NSUInteger count;
+
+//同一个观察者只注册一次
+-(void)addObserver:(id)ob;
+-(void)removeObserver:(id)ob;
+@end
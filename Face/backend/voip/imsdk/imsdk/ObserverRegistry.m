@@ -0,0 +1,115 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#import "ObserverRegistry.h"
+
+@interface ObserverSnapshot()
+//entries中的observer不持有引用, 由这个数组持有
+@property(nonatomic) NSArray *observers;
+-(id)initWithObservers:(NSArray*)observers masks:(const uint32_t*)masks;
+@end
+
+@implementation ObserverSnapshot
+-(id)initWithObservers:(NSArray*)observers masks:(const uint32_t*)masks {
+    self = [super init];
+    if (self) {
+        self.observers = observers;
+        count = (int)observers.count;
+        entries = count > 0 ? malloc(sizeof(struct observer_entry)*count) : NULL;
+        for (int i = 0; i < count; i++) {
+            entries[i].observer = [observers objectAtIndex:i];
+            entries[i].mask = masks[i];
+            mask |= masks[i];
+        }
+    }
+    return self;
+}
+
+-(void)dealloc {
+    free(entries);
+}
+@end
+
+@interface ObserverRegistry() {
+    SEL _sels[OBSERVER_MAX_SELECTORS];
+    int _selCount;
+}
+@property(atomic, readwrite) ObserverSnapshot *snapshot;
+@end
+
+@implementation ObserverRegistry
+-(id)initWithSelectors:(const SEL*)sels count:(int)count {
+    self = [super init];
+    if (self) {
+        NSAssert(count <= OBSERVER_MAX_SELECTORS, @"too many selectors");
+        _selCount = MIN(count, OBSERVER_MAX_SELECTORS);
+        for (int i = 0; i < _selCount; i++) {
+            _sels[i] = sels[i];
+        }
+        self.snapshot = [[ObserverSnapshot alloc] initWithObservers:@[] masks:NULL];
+    }
+    return self;
+}
+
+-(NSUInteger)count {
+    return self.snapshot->count;
+}
+
+-(uint32_t)maskOfObserver:(id)ob {
+    uint32_t mask = 0;
+    for (int i = 0; i < _selCount; i++) {
+        if ([ob respondsToSelector:_sels[i]]) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+}
+
+//写者之间互斥, 读者只取快照
+-(void)addObserver:(id)ob {
+    if (!ob) {
+        return;
+    }
+    @synchronized(self) {
+        ObserverSnapshot *old = self.snapshot;
+        for (int i = 0; i < old->count; i++) {
+            if (old->entries[i].observer == ob) {
+                return;
+            }
+        }
+        uint32_t *masks = malloc(sizeof(uint32_t)*(old->count + 1));
+        for (int i = 0; i < old->count; i++) {
+            masks[i] = old->entries[i].mask;
+        }
+        masks[old->count] = [self maskOfObserver:ob];
+        NSArray *observers = [old.observers arrayByAddingObject:ob];
+        self.snapshot = [[ObserverSnapshot alloc] initWithObservers:observers masks:masks];
+        free(masks);
+    }
+}
+
+-(void)removeObserver:(id)ob {
+    @synchronized(self) {
+        ObserverSnapshot *old = self.snapshot;
+        NSMutableArray *observers = [NSMutableArray arrayWithCapacity:old->count];
+        uint32_t *masks = malloc(sizeof(uint32_t)*(old->count + 1));
+        for (int i = 0; i < old->count; i++) {
+            if (old->entries[i].observer == ob) {
+                continue;
+            }
+            masks[observers.count] = old->entries[i].mask;
+            [observers addObject:old->entries[i].observer];
+        }
+        if (observers.count != (NSUInteger)old->count) {
+            self.snapshot = [[ObserverSnapshot alloc] initWithObservers:[observers copy] masks:masks];
+        }
+        free(masks);
+    }
+}
+@end
@@ -0,0 +1,77 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#import <Foundation/Foundation.h>
+
+//等待服务器ack的消息类型
+typedef NS_ENUM(NSInteger, PendingMessageKind) {
+    PENDING_PEER = 1,
+    PENDING_GROUP,
+    PENDING_ROOM,
+    //顾客->客服
+    PENDING_CUSTOMER,
+    //客服->顾客
+    PENDING_CUSTOMER_SUPPORT,
+};
+
+@interface PendingMessage : NSObject
+@property(nonatomic, readonly) PendingMessageKind kind;
+//最后一次发送的seq
+@property(nonatomic, readonly) int seq;
+@property(nonatomic, readonly) int64_t receiver;
+//客服消息是顾客的appid, 其它消息为0
+@property(nonatomic, readonly) int64_t appID;
+@property(nonatomic, readonly) int msgLocalID;
+//第一次发送时的mach_absolute_time
+@property(nonatomic, readonly) uint64_t sendTime;
+@property(nonatomic, readonly) id message;
+
+//已经重发的次数
+@property(nonatomic) int retries;
+//超过这个tick仍未收到ack则发送失败
+@property(nonatomic) uint64_t expireTick;
+@end
+
+/*
+ * 在途消息表, 同时按seq和(kind, receiver, appID, msgLocalID)索引
+ * 房间消息没有msgLocalID, 只能按seq查找
+ * 重发的消息保留之前所有的seq, 任何一次发送的ack都算作送达
+ * 超时使用时间轮管理, 由调用方定时调用expireMessages推进
+ */
+@interface PendingMessageTable : NSObject
+@property(nonatomic, readonly) NSUInteger count;
+//时间轮当前的tick
+@property(nonatomic, readonly) uint64_t currentTick;
+
+//seq为0表示还没有发送, 发送时用addSeq:forMessage:记录
+-(PendingMessage*)addMessage:(id)message kind:(PendingMessageKind)kind seq:(int)seq
+                    receiver:(int64_t)receiver appID:(int64_t)appID msgLocalID:(int)msgLocalID;
+//重发之后记录新的seq
+-(void)addSeq:(int)seq forMessage:(PendingMessage*)m;
+
+-(PendingMessage*)messageForSeq:(int)seq;
+-(PendingMessage*)messageForKind:(PendingMessageKind)kind receiver:(int64_t)receiver
+                           appID:(int64_t)appID msgLocalID:(int)msgLocalID;
+
+//收到ack后移除, 并记录ack延迟
+-(PendingMessage*)ackMessageForSeq:(int)seq;
+
+-(void)removeMessage:(PendingMessage*)m;
+-(NSArray*)removeMessagesOfKind:(PendingMessageKind)kind;
+-(NSArray*)allMessages;
+-(void)removeAllMessages;
+
+//ticks个tick之后超时
+-(void)scheduleMessage:(PendingMessage*)m ticks:(int)ticks;
+//推进一个tick, 返回到期的消息, 到期的消息需要重新调度或者移除
+-(NSArray*)expireMessages;
+
+//最近1024条只发送过一次的消息的ack延迟(毫秒), p取值0~1
+-(double)ackLatencyPercentile:(double)p;
+@end
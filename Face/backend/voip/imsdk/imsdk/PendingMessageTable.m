@@ -0,0 +1,273 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#include <mach/mach_time.h>
+#import "PendingMessageTable.h"
+#import "metrics.h"
+
+//保存最近的ack延迟样本数
+#define ACK_LATENCY_SAMPLES 1024
+
+//时间轮的槽位数, 超过一圈的超时用rounds计数
+#define WHEEL_SLOTS 64
+
+@interface PendingMessage()
+@property(nonatomic) PendingMessageKind kind;
+@property(nonatomic) int seq;
+@property(nonatomic) int64_t receiver;
+@property(nonatomic) int64_t appID;
+@property(nonatomic) int msgLocalID;
+@property(nonatomic) uint64_t sendTime;
+@property(nonatomic) id message;
+
+//发送过的所有seq
+@property(nonatomic) NSMutableArray *seqs;
+//在时间轮上的到期tick, 0表示没有调度
+@property(nonatomic) uint64_t timeoutTick;
+@end
+
+@implementation PendingMessage
+
+//keyIndex中只比较消息的key
+-(NSUInteger)hash {
+    uint64_t h = (uint64_t)self.kind;
+    h = h*31 + (uint64_t)self.receiver;
+    h = h*31 + (uint64_t)self.appID;
+    h = h*31 + (uint32_t)self.msgLocalID;
+    return (NSUInteger)(h ^ (h >> 32));
+}
+
+-(BOOL)isEqual:(id)object {
+    if (![object isKindOfClass:[PendingMessage class]]) {
+        return NO;
+    }
+    PendingMessage *other = (PendingMessage*)object;
+    return self.kind == other.kind &&
+        self.receiver == other.receiver &&
+        self.appID == other.appID &&
+        self.msgLocalID == other.msgLocalID;
+}
+
+@end
+
+@interface PendingMessageTable() {
+    uint32_t _samples[ACK_LATENCY_SAMPLES];
+    int _sampleCount;
+    int _sampleIndex;
+}
+@property(nonatomic) uint64_t currentTick;
+//seq -> PendingMessage
+@property(nonatomic) NSMutableDictionary *seqIndex;
+//按消息的key去重, member:即可取回原对象
+@property(nonatomic) NSMutableSet *keyIndex;
+//所有消息, 房间消息不在keyIndex中
+//同一房间的消息key相同, 所以按对象地址比较
+@property(nonatomic) NSHashTable *messages;
+//NSHashTable的数组, 按timeoutTick%WHEEL_SLOTS分槽
+@property(nonatomic) NSMutableArray *wheel;
+@end
+
+@implementation PendingMessageTable
+
+static NSHashTable *identityTable() {
+    return [NSHashTable hashTableWithOptions:NSPointerFunctionsStrongMemory|NSPointerFunctionsObjectPointerPersonality];
+}
+
+static double machToMillisecond(uint64_t t) {
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    return (double)t*timebase.numer/timebase.denom/NSEC_PER_MSEC;
+}
+
+-(id)init {
+    self = [super init];
+    if (self) {
+        self.seqIndex = [NSMutableDictionary dictionary];
+        self.keyIndex = [NSMutableSet set];
+        self.messages = identityTable();
+        self.wheel = [NSMutableArray arrayWithCapacity:WHEEL_SLOTS];
+        for (int i = 0; i < WHEEL_SLOTS; i++) {
+            [self.wheel addObject:identityTable()];
+        }
+        //0表示没有调度
+        self.currentTick = 1;
+    }
+    return self;
+}
+
+-(NSUInteger)count {
+    return self.messages.count;
+}
+
+-(PendingMessage*)addMessage:(id)message kind:(PendingMessageKind)kind seq:(int)seq
+                    receiver:(int64_t)receiver appID:(int64_t)appID msgLocalID:(int)msgLocalID {
+    PendingMessage *m = [[PendingMessage alloc] init];
+    m.kind = kind;
+    m.receiver = receiver;
+    m.appID = appID;
+    m.msgLocalID = msgLocalID;
+    m.sendTime = mach_absolute_time();
+    m.message = message;
+    m.seqs = [NSMutableArray array];
+    
+    if (kind != PENDING_ROOM) {
+        //应用层重复发送同一条消息时以最后一次为准
+        PendingMessage *old = [self.keyIndex member:m];
+        if (old) {
+            [self removeMessage:old];
+        }
+        [self.keyIndex addObject:m];
+    }
+    [self.messages addObject:m];
+    if (seq != 0) {
+        [self addSeq:seq forMessage:m];
+    }
+    return m;
+}
+
+-(void)addSeq:(int)seq forMessage:(PendingMessage*)m {
+    if (m.seqs.count == 0) {
+        //推迟发送的消息从真正发送时开始计算ack延迟
+        m.sendTime = mach_absolute_time();
+    }
+    NSNumber *k = [NSNumber numberWithInt:seq];
+    m.seq = seq;
+    [m.seqs addObject:k];
+    [self.seqIndex setObject:m forKey:k];
+}
+
+-(PendingMessage*)messageForSeq:(int)seq {
+    return [self.seqIndex objectForKey:[NSNumber numberWithInt:seq]];
+}
+
+-(PendingMessage*)messageForKind:(PendingMessageKind)kind receiver:(int64_t)receiver
+                           appID:(int64_t)appID msgLocalID:(int)msgLocalID {
+    PendingMessage *key = [[PendingMessage alloc] init];
+    key.kind = kind;
+    key.receiver = receiver;
+    key.appID = appID;
+    key.msgLocalID = msgLocalID;
+    return [self.keyIndex member:key];
+}
+
+-(PendingMessage*)ackMessageForSeq:(int)seq {
+    PendingMessage *m = [self messageForSeq:seq];
+    if (!m) {
+        return nil;
+    }
+    [self removeMessage:m];
+    
+    //发送过多次的消息无法确定ack对应哪一次发送, 不计入延迟(Karn算法)
+    if (m.seqs.count > 1) {
+        return m;
+    }
+    double ms = machToMillisecond(mach_absolute_time() - m.sendTime);
+    _samples[_sampleIndex] = (uint32_t)MIN(ms*1000, UINT32_MAX);
+    _sampleIndex = (_sampleIndex + 1) % ACK_LATENCY_SAMPLES;
+    _sampleCount = MIN(_sampleCount + 1, ACK_LATENCY_SAMPLES);
+    metrics_observe(METRIC_ACK_RTT, (uint64_t)(ms*1000));
+    return m;
+}
+
+-(void)removeMessage:(PendingMessage*)m {
+    if (![self.messages containsObject:m]) {
+        return;
+    }
+    [self unscheduleMessage:m];
+    [self.seqIndex removeObjectsForKeys:m.seqs];
+    if (m.kind != PENDING_ROOM) {
+        [self.keyIndex removeObject:m];
+    }
+    [self.messages removeObject:m];
+}
+
+-(NSArray*)removeMessagesOfKind:(PendingMessageKind)kind {
+    NSMutableArray *removed = [NSMutableArray array];
+    for (PendingMessage *m in self.messages) {
+        if (m.kind == kind) {
+            [removed addObject:m];
+        }
+    }
+    for (PendingMessage *m in removed) {
+        [self removeMessage:m];
+    }
+    return removed;
+}
+
+-(NSArray*)allMessages {
+    return [self.messages allObjects];
+}
+
+-(void)removeAllMessages {
+    [self.seqIndex removeAllObjects];
+    [self.keyIndex removeAllObjects];
+    [self.messages removeAllObjects];
+    for (NSHashTable *slot in self.wheel) {
+        [slot removeAllObjects];
+    }
+}
+
+-(void)unscheduleMessage:(PendingMessage*)m {
+    if (m.timeoutTick == 0) {
+        return;
+    }
+    NSHashTable *slot = [self.wheel objectAtIndex:m.timeoutTick % WHEEL_SLOTS];
+    [slot removeObject:m];
+    m.timeoutTick = 0;
+}
+
+-(void)scheduleMessage:(PendingMessage*)m ticks:(int)ticks {
+    [self unscheduleMessage:m];
+    m.timeoutTick = self.currentTick + MAX(ticks, 1);
+    NSHashTable *slot = [self.wheel objectAtIndex:m.timeoutTick % WHEEL_SLOTS];
+    [slot addObject:m];
+}
+
+-(NSArray*)expireMessages {
+    self.currentTick = self.currentTick + 1;
+    NSHashTable *slot = [self.wheel objectAtIndex:self.currentTick % WHEEL_SLOTS];
+    if (slot.count == 0) {
+        return nil;
+    }
+    NSMutableArray *expired = [NSMutableArray array];
+    for (PendingMessage *m in slot) {
+        //还没有转完一圈
+        if (m.timeoutTick <= self.currentTick) {
+            [expired addObject:m];
+        }
+    }
+    for (PendingMessage *m in expired) {
+        [slot removeObject:m];
+        m.timeoutTick = 0;
+    }
+    return expired;
+}
+
+static int compareSample(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+-(double)ackLatencyPercentile:(double)p {
+    if (_sampleCount == 0) {
+        return 0;
+    }
+    uint32_t sorted[ACK_LATENCY_SAMPLES];
+    memcpy(sorted, _samples, _sampleCount*sizeof(uint32_t));
+    qsort(sorted, _sampleCount, sizeof(uint32_t), compareSample);
+    p = MAX(0, MIN(p, 1));
+    int i = (int)((_sampleCount - 1)*p);
+    //样本以微秒保存
+    return sorted[i]/1000.0;
+}
+
+@end
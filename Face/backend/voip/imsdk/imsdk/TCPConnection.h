@@ -23,20 +23,52 @@
 
 @class AsyncTCP;
 @interface TCPConnection : NSObject
+//连接的状态和所有回调都在queue上, 公开方法也需要在queue上调用
+//默认为主线程, socket读写在独立的网络线程上
+//子类的初始化放在initWithQueue:中, init转调initWithQueue:
+-(id)initWithQueue:(dispatch_queue_t)queue NS_DESIGNATED_INITIALIZER;
+
 //public
+@property(nonatomic, strong, readonly) dispatch_queue_t queue;
 @property(nonatomic, assign)int connectState;
 @property(nonatomic, copy) NSString *host;
+//调用stop之后为YES, 不会再自动重连
+@property(nonatomic, assign, readonly)BOOL stopped;
+
+//心跳统计
+@property(nonatomic, readonly)int pingCount;
+@property(nonatomic, readonly)int latePongCount;
+@property(nonatomic, readonly)int reconnectCount;
+//平滑后的ping往返时间(毫秒)
+@property(nonatomic, readonly)double rtt;
+//AF_INET/AF_INET6的连接耗时分布, 第i个元素为耗时不超过25ms*2^i的次数, 最后一个为超出的次数
+-(NSArray*)connectHistogram:(int)family;
+
+//进程内所有连接的协议统计, 见metrics.h
+//计数器为NSNumber, 收发的帧数为cmd.in.<cmd>/cmd.out.<cmd>, 直方图为包含count/sum/p50/p90/p99(微秒)的字典
++(NSDictionary*)metricsSnapshot;
+//每隔interval秒把统计快照追加到文件, 在主线程调用
++(void)startMetricsDump:(NSString*)path interval:(int)interval;
++(void)stopMetricsDump;
 
 //protect
 @property(nonatomic)int port;
+//初始心跳间隔(秒), 之后按网络类型自动调整
 @property(nonatomic, assign)int heartbeatHZ;
 @property(nonatomic)AsyncTCP *tcp;
 
 //subclass override
 -(void)sendPing;
+//返回NO时跳过这次心跳, 默认为YES
+-(BOOL)canSendPing;
 
 
--(BOOL)handleData:(NSData*)data;
+//在解码线程上调用, 返回NO表示数据非法
+-(BOOL)decodeData:(NSData*)data messages:(NSMutableArray*)messages;
+//在解码线程上调用, 新连接建立时丢弃残留的数据
+-(void)resetDecoder;
+//在queue上调用, 一次socket读取解码出来的所有消息
+-(void)handleMessages:(NSArray*)messages;
 
 -(void)onConnect;
 -(void)onClose;
@@ -45,7 +77,8 @@
 
 //protect method
 -(void)pong;
--(void)reconnect2S;
+//退避之后重新连接, retryAfter为服务器建议的最短间隔(秒), 0表示没有建议
+-(void)reconnect:(int)retryAfter;
 
 //public method
 -(void)start;
@@ -13,13 +13,56 @@
 #import "AsyncTCP.h"
 #import "util.h"
 #import "GOReachability.h"
+#import "spsc_queue.h"
+#import "Keepalive.h"
+#import "DNSCache.h"
+#import "backoff.h"
+#import "metrics.h"
+#import "imlog.h"
+
+//解码线程和连接队列之间最多积压的批次
+#define MAX_PENDING_BATCH 64
+
+//等待pong的最短和最长时间(秒)
+#define MIN_PING_TIMEOUT 3
+#define MAX_PING_TIMEOUT 15
+
+//连接耗时直方图, 第i个桶的上限为25ms*2^i, 最后一个桶记录超出的部分
+#define CONNECT_HISTOGRAM_BUCKETS 8
+#define CONNECT_HISTOGRAM_BASE 25
+
+//重连退避的初始间隔和最大间隔, 连接保持HEALTHY_CONNECTION之后断开才重置(毫秒)
+#define BACKOFF_BASE 500
+#define BACKOFF_CAP (60*1000)
+#define HEALTHY_CONNECTION (30*1000)
+
+//一次socket读取解码出来的消息
+@interface ReadBatch : NSObject
+@property(nonatomic) AsyncTCP *tcp;
+@property(nonatomic) NSArray *messages;
+@end
 
-@interface TCPConnection()
+@implementation ReadBatch
+@end
 
-@property(atomic, copy) NSString *hostIP;
-@property(atomic, assign) time_t timestmap;
+struct read_pipeline {
+    //生产者为解码线程, 消费者为连接所在的队列
+    struct spsc_queue batches;
+    atomic_int drain_scheduled;
+    atomic_int producer_waiting;
+};
+
+@interface TCPConnection() {
+    struct read_pipeline _pipeline;
+    //ipv4和ipv6的连接耗时分布
+    int _connectHistogram[2][CONNECT_HISTOGRAM_BUCKETS+1];
+    struct backoff _backoff;
+}
+@property(nonatomic, strong, readwrite) dispatch_queue_t queue;
+@property(nonatomic, strong) dispatch_queue_t decodeQueue;
+@property(nonatomic, strong) dispatch_semaphore_t pipelineSpace;
 
-@property(nonatomic, assign)BOOL stopped;
+@property(nonatomic, assign, readwrite)BOOL stopped;
 @property(nonatomic, assign)BOOL suspended;
 @property(nonatomic, assign)BOOL isBackground;
 
@@ -27,10 +70,22 @@
 @property(nonatomic, strong)dispatch_source_t connectTimer;
 
 @property(nonatomic, strong)dispatch_source_t heartbeatTimer;
-@property(nonatomic)time_t pingTimestamp;
+@property(nonatomic)Keepalive *keepalive;
+//最后一次收到数据的时间, 单位秒, 使用systemUptime
+@property(nonatomic)NSTimeInterval lastReceiveTime;
+//未收到pong的ping的发送时间, 0表示没有
+@property(nonatomic)NSTimeInterval pingTime;
+//发送ping之前空闲的秒数
+@property(nonatomic)int pingIdle;
+//平滑后的rtt和偏差(秒)
+@property(nonatomic)double srtt;
+@property(nonatomic)double rttvar;
+
+@property(nonatomic, readwrite)int pingCount;
+@property(nonatomic, readwrite)int latePongCount;
+@property(nonatomic, readwrite)int reconnectCount;
 
 
-@property(nonatomic)int connectFailCount;
 
 @property(nonatomic)NSMutableArray *connectionObservers;
 
@@ -41,9 +96,20 @@
 
 @implementation TCPConnection
 -(id)init {
+    return [self initWithQueue:dispatch_get_main_queue()];
+}
+
+-(id)initWithQueue:(dispatch_queue_t)queue {
     self = [super init];
     if (self) {
-        dispatch_queue_t queue = dispatch_get_main_queue();
+        self.queue = queue;
+        self.decodeQueue = dispatch_queue_create("im.decode", DISPATCH_QUEUE_SERIAL);
+        self.pipelineSpace = dispatch_semaphore_create(0);
+        spsc_queue_init(&_pipeline.batches, MAX_PENDING_BATCH);
+        atomic_init(&_pipeline.drain_scheduled, 0);
+        atomic_init(&_pipeline.producer_waiting, 0);
+        backoff_init(&_backoff, BACKOFF_BASE, BACKOFF_CAP, HEALTHY_CONNECTION, arc4random());
+
         self.connectTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0,queue);
         dispatch_source_set_event_handler(self.connectTimer, ^{
             [self connect];
@@ -51,7 +117,7 @@
         
         self.heartbeatTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0,queue);
         dispatch_source_set_event_handler(self.heartbeatTimer, ^{
-            [self ping];
+            [self onHeartbeat];
         });
         self.connectionObservers = [NSMutableArray array];
 
@@ -64,16 +130,24 @@
     return self;
 }
 
+-(void)dealloc {
+    void *p;
+    while ((p = spsc_queue_pop(&_pipeline.batches)) != NULL) {
+        CFBridgingRelease(p);
+    }
+    spsc_queue_free(&_pipeline.batches);
+}
+
 -(void)startRechabilityNotifier {
     TCPConnection *wself = self;
     self.reach = [GOReachability reachabilityForInternetConnection];
     
     self.reach.reachableBlock = ^(GOReachability*reach) {
-        dispatch_async(dispatch_get_main_queue(), ^{
-            NSLog(@"internet reachable");
+        dispatch_async(wself.queue, ^{
+            IMLogI("internet reachable");
             wself.reachable = YES;
             if (wself != nil && !wself.stopped && !wself.isBackground) {
-                NSLog(@"reconnect im service");
+                IMLogI("reconnect im service");
                 [wself suspend];
                 [wself resume];
             }
@@ -81,8 +155,8 @@
     };
     
     self.reach.unreachableBlock = ^(GOReachability*reach) {
-        dispatch_async(dispatch_get_main_queue(), ^{
-            NSLog(@"internet unreachable");
+        dispatch_async(wself.queue, ^{
+            IMLogI("internet unreachable");
             wself.reachable = NO;
             if (wself != nil && !wself.stopped) {
                 [wself suspend];
@@ -94,7 +168,7 @@
 }
 
 -(void)enterForeground {
-    NSLog(@"im service enter foreground");
+    IMLogI("im service enter foreground");
     self.isBackground = NO;
     if (!self.stopped && self.reachable) {
         [self resume];
@@ -102,7 +176,7 @@
 }
 
 -(void)enterBackground {
-    NSLog(@"im service enter background");
+    IMLogI("im service enter background");
     self.isBackground = YES;
     if (!self.stopped) {
         [self suspend];
@@ -111,13 +185,13 @@
 
 -(void)start {
     if (!self.host || !self.port) {
-        NSLog(@"should init im server host and port");
+        IMLogE("should init im server host and port");
         exit(1);
     }
     if (!self.stopped) {
         return;
     }
-    NSLog(@"start im service");
+    IMLogI("start im service");
     self.stopped = NO;
     if (self.reachable) {
         [self resume];
@@ -128,7 +202,7 @@
     if (self.stopped) {
         return;
     }
-    NSLog(@"stop im service");
+    IMLogI("stop im service");
     self.stopped = YES;
     
     [self suspend];
@@ -139,7 +213,7 @@
         return;
     }
     
-    NSLog(@"suspend im service");
+    IMLogI("suspend im service");
     self.suspended = YES;
     
     dispatch_suspend(self.connectTimer);
@@ -155,32 +229,43 @@
     if (!self.suspended) {
         return;
     }
-    NSLog(@"resume im service");
+    IMLogI("resume im service");
     self.suspended = NO;
     
     dispatch_time_t w = dispatch_walltime(NULL, 0);
     dispatch_source_set_timer(self.connectTimer, w, DISPATCH_TIME_FOREVER, 0);
     dispatch_resume(self.connectTimer);
     
-    w = dispatch_walltime(NULL, self.heartbeatHZ);
-    dispatch_source_set_timer(self.heartbeatTimer, w, self.heartbeatHZ*NSEC_PER_SEC, self.heartbeatHZ*NSEC_PER_SEC/2);
+    if (!self.keepalive) {
+        self.keepalive = [[Keepalive alloc] initWithInterval:self.heartbeatHZ];
+    }
+    self.keepalive.network = [self currentNetwork];
+    [self scheduleHeartbeat:self.keepalive.interval];
     dispatch_resume(self.heartbeatTimer);
     
-    [self refreshHostIP];
+    [[DNSCache instance] refresh:self.host];
 }
 
-//2s后重新连接
--(void)reconnect2S {
-    self.connectFailCount = 2;
+-(void)reconnect:(int)retryAfter {
+    self.reconnectCount = self.reconnectCount + 1;
+    metrics_add(METRIC_RECONNECTS, 1);
+    if (retryAfter > 0) {
+        backoff_retry_after(&_backoff, retryAfter*1000);
+    }
     [self close];
     [self startConnectTimer];
     self.connectState = STATE_UNCONNECTED;
     [self publishConnectState:STATE_UNCONNECTED];
 }
 
+-(int64_t)uptimeMS {
+    return (int64_t)([[NSProcessInfo processInfo] systemUptime]*1000);
+}
+
 -(void)close {
     if (self.tcp) {
-        NSLog(@"im service on close");
+        IMLogI("im service on close");
+        backoff_disconnected(&_backoff, [self uptimeMS]);
         [self.tcp flush];
         [self.tcp close];
         self.tcp = nil;
@@ -192,20 +277,21 @@
         return;
     }
     //重连
-    int64_t t = 0;
-    if (self.connectFailCount > 60) {
-        t = 60ull*NSEC_PER_SEC;
-    } else {
-        t = self.connectFailCount*NSEC_PER_SEC;
-    }
-    
-    dispatch_time_t w = dispatch_walltime(NULL, t);
+    int delay = backoff_next(&_backoff);
+    dispatch_time_t w = dispatch_walltime(NULL, (int64_t)delay*NSEC_PER_MSEC);
     dispatch_source_set_timer(self.connectTimer, w, DISPATCH_TIME_FOREVER, 0);
     
-    NSLog(@"start connect timer:%lld", t/NSEC_PER_SEC);
+    IMLogI("start connect timer:%dms attempts:%d", delay, _backoff.attempts);
 }
 
 -(void)handleClose {
+    if (self.pingTime > 0) {
+        //空闲一段时间之后的ping没有得到回应, 认为nat映射已经失效
+        [self.keepalive onIdleFailure:self.pingIdle];
+        self.pingTime = 0;
+    }
+    self.reconnectCount = self.reconnectCount + 1;
+    metrics_add(METRIC_RECONNECTS, 1);
     [self onClose];
     self.connectState = STATE_UNCONNECTED;
     [self publishConnectState:STATE_UNCONNECTED];
@@ -215,79 +301,119 @@
 }
 
 
--(BOOL)handleData:(NSData*)data {
+-(BOOL)decodeData:(NSData*)data messages:(NSMutableArray*)messages {
     NSAssert(NO, @"not implmented");
     return NO;
 }
 
--(void)onRead:(NSData*)data error:(int)err {
-    if (err) {
-        NSLog(@"tcp read err");
-        [self handleClose];
-        return;
-    } else if (!data) {
-        NSLog(@"tcp closed");
-        [self handleClose];
+-(void)resetDecoder {
+    
+}
+
+-(void)handleMessages:(NSArray*)messages {
+    NSAssert(NO, @"not implmented");
+}
+
+//解码线程
+-(void)onRead:(NSData*)data error:(int)err tcp:(AsyncTCP*)tcp {
+    if (err || !data) {
+        IMLogW("tcp read err:%d", err);
+        dispatch_async(self.queue, ^{
+            if (self.tcp == tcp) {
+                [self handleClose];
+            }
+        });
         return;
-    } else {
-        self.pingTimestamp = 0;
-        BOOL r = [self handleData:data];
-        if (!r) {
-            [self handleClose];
+    }
+
+    NSMutableArray *messages = [NSMutableArray array];
+    uint64_t begin = metrics_now_us();
+    BOOL r = [self decodeData:data messages:messages];
+    metrics_observe(METRIC_DECODE_TIME, metrics_now_us() - begin);
+    metrics_add(METRIC_BYTES_IN, data.length);
+    if (!r) {
+        metrics_add(METRIC_DECODE_ERRORS, 1);
+    }
+    ReadBatch *batch = [[ReadBatch alloc] init];
+    batch.tcp = tcp;
+    batch.messages = messages;
+    [self pushBatch:batch tcp:tcp];
+
+    if (!r) {
+        dispatch_async(self.queue, ^{
+            if (self.tcp == tcp) {
+                [self handleClose];
+            }
+        });
+    }
+}
+
+//解码线程, 队列满时暂停读socket并等待连接队列处理
+-(void)pushBatch:(ReadBatch*)batch tcp:(AsyncTCP*)tcp {
+    void *p = (__bridge_retained void*)batch;
+    if (spsc_queue_push(&_pipeline.batches, p) != 0) {
+        IMLogW("read pipeline full, suspend read");
+        [tcp suspendRead];
+        while (spsc_queue_push(&_pipeline.batches, p) != 0) {
+            atomic_store(&_pipeline.producer_waiting, 1);
+            [self scheduleDrain];
+            dispatch_semaphore_wait(self.pipelineSpace, dispatch_time(DISPATCH_TIME_NOW, 100*NSEC_PER_MSEC));
         }
+        [tcp resumeRead];
     }
+    [self scheduleDrain];
 }
 
--(NSString*)IP2String:(struct in_addr)addr {
-    char buf[64] = {0};
-    const char *p = inet_ntop(AF_INET, &addr, buf, 64);
-    if (p) {
-        return [NSString stringWithUTF8String:p];
+-(void)scheduleDrain {
+    if (atomic_exchange(&_pipeline.drain_scheduled, 1) == 0) {
+        dispatch_async(self.queue, ^{
+            [self drainBatches];
+        });
     }
-    return nil;
-    
 }
 
--(NSString*)resolveIP:(NSString*)host {
-    struct addrinfo hints;
-    struct addrinfo *result, *rp;
-    int s;
-    
-    char buf[32];
-    snprintf(buf, 32, "%d", 0);
-    
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-    hints.ai_flags = 0;
-    
-    s = getaddrinfo([host UTF8String], buf, &hints, &result);
-    if (s != 0) {
-        NSLog(@"get addr info error:%s", gai_strerror(s));
-        return nil;
+//连接所在的队列, 一次处理所有已经解码的消息
+-(void)drainBatches {
+    atomic_store(&_pipeline.drain_scheduled, 0);
+    void *p;
+    while ((p = spsc_queue_pop(&_pipeline.batches)) != NULL) {
+        ReadBatch *batch = (__bridge_transfer ReadBatch*)p;
+        if (atomic_exchange(&_pipeline.producer_waiting, 0) == 1) {
+            dispatch_semaphore_signal(self.pipelineSpace);
+        }
+        //丢弃已经关闭的连接上的消息
+        if (batch.tcp != self.tcp) {
+            continue;
+        }
+        self.lastReceiveTime = [[NSProcessInfo processInfo] systemUptime];
+        if (batch.messages.count > 0) {
+            [self handleMessages:batch.messages];
+        }
     }
-    NSString *ip = nil;
-    rp = result;
-    if (rp != NULL) {
-        struct sockaddr_in *addr = (struct sockaddr_in*)rp->ai_addr;
-        ip = [self IP2String:addr->sin_addr];
+}
+
+//只有连接保持一段时间之后断开, 下次重连才重新从最小间隔开始
+-(void)onTCPConnected {
+    backoff_connected(&_backoff, [self uptimeMS]);
+}
+
+-(void)recordConnectTime:(double)ms family:(int)family {
+    int i = 0;
+    double bound = CONNECT_HISTOGRAM_BASE;
+    while (i < CONNECT_HISTOGRAM_BUCKETS && ms > bound) {
+        bound *= 2;
+        i++;
     }
-    freeaddrinfo(result);
-    return ip;
+    _connectHistogram[family == AF_INET6 ? 1 : 0][i]++;
 }
 
--(void)refreshHostIP {
-    
-    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), ^{
-        NSLog(@"refresh host ip...");
-        NSString *ip = [self resolveIP:self.host];
-        NSLog(@"host:%@ ip:%@", self.host, ip);
-        if ([ip length] > 0) {
-            self.hostIP = ip;
-            self.timestmap = time(NULL);
-        }
-    });
+-(NSArray*)connectHistogram:(int)family {
+    int *h = _connectHistogram[family == AF_INET6 ? 1 : 0];
+    NSMutableArray *a = [NSMutableArray arrayWithCapacity:CONNECT_HISTOGRAM_BUCKETS+1];
+    for (int i = 0; i <= CONNECT_HISTOGRAM_BUCKETS; i++) {
+        [a addObject:[NSNumber numberWithInt:h[i]]];
+    }
+    return a;
 }
 
 -(void)connect {
@@ -295,49 +421,54 @@
         return;
     }
     if (self.stopped) {
-        NSLog(@"opps......");
+        IMLogW("opps......");
         return;
     }
     
-    if (self.hostIP.length == 0) {
-        [self refreshHostIP];
-        self.connectFailCount = self.connectFailCount + 1;
+    //过期的地址会在后台刷新, 没有地址时等待下次重连
+    NSArray *addrs = [[DNSCache instance] addressesForHost:self.host];
+    if (addrs.count == 0) {
         [self startConnectTimer];
         return;
     }
-    time_t now = time(NULL);
-    if (now - self.timestmap > 5*60) {
-        [self refreshHostIP];
-    }
     
-    self.pingTimestamp = 0;
+    self.pingTime = 0;
     self.connectState = STATE_CONNECTING;
     [self publishConnectState:STATE_CONNECTING];
-    self.tcp = [[AsyncTCP alloc] init];
+    self.tcp = [[AsyncTCP alloc] initWithQueue:self.queue];
     __weak TCPConnection *wself = self;
-    BOOL r = [self.tcp connect:self.hostIP port:self.port cb:^(AsyncTCP *tcp, int err) {
+    BOOL r = [self.tcp connectAddresses:addrs port:self.port cb:^(AsyncTCP *tcp, int err) {
         if (err) {
-            NSLog(@"tcp connect err");
-            wself.connectFailCount = wself.connectFailCount + 1;
+            IMLogW("tcp connect err");
+            metrics_add(METRIC_CONNECT_FAILURES, 1);
             [wself close];
             self.connectState = STATE_CONNECTFAIL;
             [self publishConnectState:STATE_CONNECTFAIL];
             [self startConnectTimer];
             return;
         } else {
-            NSLog(@"tcp connected");
-            wself.connectFailCount = 0;
+            IMLogI("tcp connected family:%d time:%.0fms", tcp.family, tcp.connectTime);
+            [wself recordConnectTime:tcp.connectTime family:tcp.family];
+            metrics_add(METRIC_CONNECTS, 1);
+            metrics_observe(METRIC_CONNECT_TIME, (uint64_t)(tcp.connectTime*1000));
+            [wself onTCPConnected];
+            wself.lastReceiveTime = [[NSProcessInfo processInfo] systemUptime];
+            [wself scheduleHeartbeat:wself.keepalive.interval];
             self.connectState = STATE_CONNECTED;
             [self publishConnectState:STATE_CONNECTED];
+            dispatch_async(wself.decodeQueue, ^{
+                [wself resetDecoder];
+            });
+            wself.tcp.readQueue = wself.decodeQueue;
             [wself.tcp startRead:^(AsyncTCP *tcp, NSData *data, int err) {
-                [wself onRead:data error:err];
+                [wself onRead:data error:err tcp:tcp];
             }];
             [self onConnect];
         }
     }];
     if (!r) {
-        NSLog(@"tcp connect err");
-        wself.connectFailCount = wself.connectFailCount + 1;
+        IMLogW("tcp connect err");
+        metrics_add(METRIC_CONNECT_FAILURES, 1);
         self.connectState = STATE_CONNECTFAIL;
         [self publishConnectState:STATE_CONNECTFAIL];
         
@@ -347,27 +478,97 @@
 }
 
 -(void)pong {
-    self.pingTimestamp = 0;
+    if (self.pingTime == 0) {
+        return;
+    }
+    //rfc6298的平滑算法
+    double rtt = [[NSProcessInfo processInfo] systemUptime] - self.pingTime;
+    if (self.srtt == 0) {
+        self.srtt = rtt;
+        self.rttvar = rtt/2;
+    } else {
+        self.rttvar = 0.75*self.rttvar + 0.25*fabs(self.srtt - rtt);
+        self.srtt = 0.875*self.srtt + 0.125*rtt;
+    }
+    self.pingTime = 0;
+    [self.keepalive onIdleSuccess:self.pingIdle];
+    [self scheduleHeartbeat:self.keepalive.interval];
+}
+
+-(double)rtt {
+    return self.srtt*1000;
 }
 
 -(void)sendPing {
     NSAssert(NO, @"not implemented");
 }
 
--(void)ping {
-    NSLog(@"send ping");
+-(BOOL)canSendPing {
+    return YES;
+}
+
+-(NSString*)currentNetwork {
+    switch ([self.reach currentReachabilityStatus]) {
+        case ReachableViaWiFi:
+            return @"wifi";
+        case ReachableViaWWAN:
+            return @"wwan";
+        default:
+            return @"default";
+    }
+}
+
+//心跳只在空闲时发送, 触发时间允许10%的误差以便系统合并唤醒
+-(void)scheduleHeartbeat:(int)seconds {
+    int64_t t = MAX(seconds, 1)*NSEC_PER_SEC;
+    dispatch_source_set_timer(self.heartbeatTimer, dispatch_time(DISPATCH_TIME_NOW, t), DISPATCH_TIME_FOREVER, t/10);
+}
+
+-(void)onHeartbeat {
+    if (!self.tcp || self.connectState != STATE_CONNECTED || ![self canSendPing]) {
+        [self scheduleHeartbeat:self.keepalive.interval];
+        return;
+    }
+    if (self.pingTime > 0) {
+        //等待上一个pong
+        return;
+    }
+    NSTimeInterval now = [[NSProcessInfo processInfo] systemUptime];
+    int idle = (int)(now - self.lastReceiveTime);
+    if (idle < self.keepalive.interval) {
+        //最近有数据往来, 推迟心跳
+        [self scheduleHeartbeat:self.keepalive.interval - idle];
+        return;
+    }
+    [self ping:idle];
+}
+
+-(void)ping:(int)idle {
+    IMLogD("send ping idle:%d", idle);
     [self sendPing];
+    self.pingCount = self.pingCount + 1;
     
-    if (self.tcp != nil && self.pingTimestamp == 0) {
-        self.pingTimestamp = time(NULL);
-        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(3.1 * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
-            time_t now = time(NULL);
-            if (self.pingTimestamp > 0 && now - self.pingTimestamp >= 3) {
-                NSLog(@"ping timeout");
-                [self handleClose];
-            }
-        });
-    }
+    NSTimeInterval pingTime = [[NSProcessInfo processInfo] systemUptime];
+    self.pingTime = pingTime;
+    self.pingIdle = idle;
+    
+    double timeout = MIN(MAX(self.srtt + 4*self.rttvar, MIN_PING_TIMEOUT), MAX_PING_TIMEOUT);
+    AsyncTCP *tcp = self.tcp;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout*NSEC_PER_SEC)), self.queue, ^{
+        if (self.tcp != tcp || self.pingTime != pingTime) {
+            return;
+        }
+        self.latePongCount = self.latePongCount + 1;
+        if (self.lastReceiveTime > pingTime) {
+            //pong之前已经收到了其它数据, 连接仍然可用
+            IMLogI("pong late");
+            self.pingTime = 0;
+            [self scheduleHeartbeat:self.keepalive.interval];
+            return;
+        }
+        IMLogW("ping timeout");
+        [self handleClose];
+    });
 }
 
 -(void)onConnect {
@@ -393,4 +594,75 @@
     }
 }
 
++(NSDictionary*)metricsSnapshot {
+    struct metrics_snapshot *snap = malloc(sizeof(struct metrics_snapshot));
+    metrics_snapshot(snap);
+    NSMutableDictionary *dict = [NSMutableDictionary dictionary];
+    for (int i = 0; i < METRIC_COUNTER_MAX; i++) {
+        NSString *name = [NSString stringWithUTF8String:metrics_counter_name(i)];
+        [dict setObject:[NSNumber numberWithUnsignedLongLong:snap->counters[i]] forKey:name];
+    }
+    for (int i = 0; i < 256; i++) {
+        if (snap->cmd_in[i]) {
+            NSString *name = [NSString stringWithFormat:@"cmd.in.%d", i];
+            [dict setObject:[NSNumber numberWithUnsignedLongLong:snap->cmd_in[i]] forKey:name];
+        }
+        if (snap->cmd_out[i]) {
+            NSString *name = [NSString stringWithFormat:@"cmd.out.%d", i];
+            [dict setObject:[NSNumber numberWithUnsignedLongLong:snap->cmd_out[i]] forKey:name];
+        }
+    }
+    for (int i = 0; i < METRIC_HISTOGRAM_MAX; i++) {
+        NSString *name = [NSString stringWithUTF8String:metrics_histogram_name(i)];
+        NSDictionary *h = @{@"count":[NSNumber numberWithUnsignedLongLong:snap->histograms[i].count],
+                            @"sum":[NSNumber numberWithUnsignedLongLong:snap->histograms[i].sum],
+                            @"p50":[NSNumber numberWithUnsignedLongLong:metrics_percentile(snap, i, 0.5)],
+                            @"p90":[NSNumber numberWithUnsignedLongLong:metrics_percentile(snap, i, 0.9)],
+                            @"p99":[NSNumber numberWithUnsignedLongLong:metrics_percentile(snap, i, 0.99)]};
+        [dict setObject:h forKey:name];
+    }
+    free(snap);
+    return dict;
+}
+
+static dispatch_source_t metricsTimer;
+
++(void)startMetricsDump:(NSString*)path interval:(int)interval {
+    [self stopMetricsDump];
+    if (path.length == 0 || interval <= 0) {
+        return;
+    }
+    const char *file = strdup([path fileSystemRepresentation]);
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+    dispatch_source_t timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
+    dispatch_source_set_event_handler(timer, ^{
+        struct metrics_snapshot *snap = malloc(sizeof(struct metrics_snapshot));
+        metrics_snapshot(snap);
+        int len = metrics_format(snap, NULL, 0);
+        char *buf = malloc(len + 1);
+        metrics_format(snap, buf, len + 1);
+        FILE *f = fopen(file, "a");
+        if (f) {
+            fprintf(f, "time %lld\n%s\n", (long long)time(NULL), buf);
+            fclose(f);
+        }
+        free(buf);
+        free(snap);
+    });
+    dispatch_source_set_cancel_handler(timer, ^{
+        free((void*)file);
+    });
+    dispatch_source_set_timer(timer, dispatch_walltime(NULL, (int64_t)interval*NSEC_PER_SEC),
+                              (uint64_t)interval*NSEC_PER_SEC, NSEC_PER_SEC);
+    metricsTimer = timer;
+    dispatch_resume(timer);
+}
+
++(void)stopMetricsDump {
+    if (metricsTimer) {
+        dispatch_source_cancel(metricsTimer);
+        metricsTimer = nil;
+    }
+}
+
 @end
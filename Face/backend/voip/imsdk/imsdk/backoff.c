@@ -0,0 +1,78 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#include "backoff.h"
+
+//xorshift32, 只用于打散重连时间
+static uint32_t next_rand(struct backoff *b) {
+    uint32_t x = b->rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    b->rand_state = x;
+    return x;
+}
+
+//[lo, hi]之间的随机数
+static int rand_between(struct backoff *b, int lo, int hi) {
+    if (hi <= lo) {
+        return lo;
+    }
+    return lo + (int)(next_rand(b) % (uint32_t)(hi - lo + 1));
+}
+
+void backoff_init(struct backoff *b, int base, int cap, int healthy, uint32_t seed) {
+    b->base = base;
+    b->cap = cap;
+    b->healthy = healthy;
+    b->rand_state = seed ? seed : 0x9e3779b9;
+    backoff_reset(b);
+}
+
+void backoff_reset(struct backoff *b) {
+    b->prev = b->base;
+    b->retry_after = 0;
+    b->attempts = 0;
+    b->connected_at = 0;
+}
+
+int backoff_next(struct backoff *b) {
+    int delay;
+    if (b->retry_after > 0) {
+        //在服务器建议的时间之后再随机分散一段, 避免所有客户端在同一时刻回来
+        int spread = b->retry_after/2 > b->base ? b->retry_after/2 : b->base;
+        delay = rand_between(b, b->retry_after, b->retry_after + spread);
+        b->retry_after = 0;
+    } else {
+        int64_t hi = (int64_t)b->prev*3;
+        delay = rand_between(b, b->base, hi < b->cap ? (int)hi : b->cap);
+    }
+    b->prev = delay < b->cap ? delay : b->cap;
+    b->attempts++;
+    return delay;
+}
+
+void backoff_retry_after(struct backoff *b, int delay) {
+    if (delay > b->retry_after) {
+        b->retry_after = delay;
+    }
+}
+
+void backoff_connected(struct backoff *b, int64_t now) {
+    b->connected_at = now;
+}
+
+void backoff_disconnected(struct backoff *b, int64_t now) {
+    if (b->connected_at > 0 && now - b->connected_at >= b->healthy) {
+        int retry_after = b->retry_after;
+        backoff_reset(b);
+        b->retry_after = retry_after;
+    }
+    b->connected_at = 0;
+}
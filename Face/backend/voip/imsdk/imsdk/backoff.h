@@ -0,0 +1,42 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#ifndef IM_BACKOFF_H
+#define IM_BACKOFF_H
+
+#include <stdint.h>
+
+//重连退避策略, 使用decorrelated jitter: delay = min(cap, random(base, prev*3))
+//服务器重启时所有客户端同时断开, 随机的间隔把重连分散开, 避免同时涌入
+//连接保持健康healthy毫秒之后断开才重新从base开始, 否则继续增大间隔
+struct backoff {
+    int base;
+    int cap;
+    int healthy;
+    int prev;
+    //服务器通过auth status建议的最短重连间隔, 只作用于下一次
+    int retry_after;
+    int attempts;
+    //连接建立的时间, 0表示当前没有连接
+    int64_t connected_at;
+    uint32_t rand_state;
+};
+
+//时间单位都是毫秒, seed用于初始化随机数, 不同客户端应该不同
+void backoff_init(struct backoff *b, int base, int cap, int healthy, uint32_t seed);
+void backoff_reset(struct backoff *b);
+
+//下一次重连之前等待的时间
+int backoff_next(struct backoff *b);
+void backoff_retry_after(struct backoff *b, int delay);
+
+void backoff_connected(struct backoff *b, int64_t now);
+void backoff_disconnected(struct backoff *b, int64_t now);
+
+#endif
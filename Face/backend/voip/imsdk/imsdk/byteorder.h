@@ -0,0 +1,109 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#ifndef IM_BYTEORDER_H
+#define IM_BYTEORDER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+//协议中的整数都是大端, 这里的函数都是static inline, 常量参数在编译期求值
+//memcpy到局部变量再交换字节序, 编译器生成一次非对齐的load/store和一条bswap指令
+
+#if defined(__GNUC__) || defined(__clang__)
+#define im_bswap16(v) __builtin_bswap16(v)
+#define im_bswap32(v) __builtin_bswap32(v)
+#define im_bswap64(v) __builtin_bswap64(v)
+#else
+static inline uint16_t im_bswap16(uint16_t v) {
+    return (uint16_t)((v << 8) | (v >> 8));
+}
+static inline uint32_t im_bswap32(uint32_t v) {
+    return ((v & 0xff) << 24) | ((v & 0xff00) << 8) | ((v >> 8) & 0xff00) | (v >> 24);
+}
+static inline uint64_t im_bswap64(uint64_t v) {
+    return ((uint64_t)im_bswap32((uint32_t)v) << 32) | im_bswap32((uint32_t)(v >> 32));
+}
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define im_be16(v) ((uint16_t)(v))
+#define im_be32(v) ((uint32_t)(v))
+#define im_be64(v) ((uint64_t)(v))
+#else
+#define im_be16(v) im_bswap16((uint16_t)(v))
+#define im_be32(v) im_bswap32((uint32_t)(v))
+#define im_be64(v) im_bswap64((uint64_t)(v))
+#endif
+
+static inline uint16_t load_be16(const void *p) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return im_be16(v);
+}
+
+static inline uint32_t load_be32(const void *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return im_be32(v);
+}
+
+static inline uint64_t load_be64(const void *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return im_be64(v);
+}
+
+static inline void store_be16(void *p, uint16_t v) {
+    v = im_be16(v);
+    memcpy(p, &v, 2);
+}
+
+static inline void store_be32(void *p, uint32_t v) {
+    v = im_be32(v);
+    memcpy(p, &v, 4);
+}
+
+static inline void store_be64(void *p, uint64_t v) {
+    v = im_be64(v);
+    memcpy(p, &v, 8);
+}
+
+//批量解码连续的定长记录, 如同步批次中的(id, key)列表, 记录的字段依次展开到out
+//一次循环完成, 编译器可以向量化
+static inline void load_be32_array(uint32_t *out, const void *p, size_t n) {
+    const uint8_t *s = (const uint8_t*)p;
+    for (size_t i = 0; i < n; i++) {
+        out[i] = load_be32(s + i*4);
+    }
+}
+
+static inline void load_be64_array(uint64_t *out, const void *p, size_t n) {
+    const uint8_t *s = (const uint8_t*)p;
+    for (size_t i = 0; i < n; i++) {
+        out[i] = load_be64(s + i*8);
+    }
+}
+
+static inline void store_be32_array(void *p, const uint32_t *in, size_t n) {
+    uint8_t *d = (uint8_t*)p;
+    for (size_t i = 0; i < n; i++) {
+        store_be32(d + i*4, in[i]);
+    }
+}
+
+static inline void store_be64_array(void *p, const uint64_t *in, size_t n) {
+    uint8_t *d = (uint8_t*)p;
+    for (size_t i = 0; i < n; i++) {
+        store_be64(d + i*8, in[i]);
+    }
+}
+
+#endif
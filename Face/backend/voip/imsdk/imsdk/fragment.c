@@ -0,0 +1,93 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "fragment.h"
+#include "byteorder.h"
+
+void fragment_write_head(uint8_t *p, const struct fragment_head *h) {
+    p[0] = (uint8_t)h->cmd;
+    store_be32(p + 1, (uint32_t)h->total);
+    store_be32(p + 5, (uint32_t)h->offset);
+}
+
+int fragment_read_head(const uint8_t *p, int len, struct fragment_head *h) {
+    if (len < FRAGMENT_HEAD_SIZE) {
+        return -1;
+    }
+    h->cmd = p[0];
+    h->total = (int32_t)load_be32(p + 1);
+    h->offset = (int32_t)load_be32(p + 5);
+    return 0;
+}
+
+int fragment_encode(uint8_t *out, int cmd, const uint8_t *body, int len, int index) {
+    struct fragment_head h;
+    h.cmd = cmd;
+    h.total = len;
+    h.offset = index*FRAGMENT_MAX_BODY;
+    int n = len - h.offset < FRAGMENT_MAX_BODY ? len - h.offset : FRAGMENT_MAX_BODY;
+    fragment_write_head(out, &h);
+    memcpy(out + FRAGMENT_HEAD_SIZE, body + h.offset, n);
+    return FRAGMENT_HEAD_SIZE + n;
+}
+
+void fragment_arena_init(struct fragment_arena *a, int reserve) {
+    memset(a, 0, sizeof(struct fragment_arena));
+    a->reserve = reserve;
+}
+
+void fragment_arena_free(struct fragment_arena *a) {
+    free(a->buf);
+    fragment_arena_init(a, a->reserve);
+}
+
+void fragment_arena_reset(struct fragment_arena *a) {
+    a->total = 0;
+    a->received = 0;
+}
+
+int fragment_arena_add(struct fragment_arena *a, const uint8_t *p, int len) {
+    struct fragment_head h;
+    if (fragment_read_head(p, len, &h) != 0) {
+        return -1;
+    }
+    int n = len - FRAGMENT_HEAD_SIZE;
+    if (h.offset == 0) {
+        //上一条消息没有收完就开始了新的消息
+        if (a->received > 0 || h.total <= FRAGMENT_MAX_BODY || h.total > FRAGMENT_MAX_MESSAGE) {
+            return -1;
+        }
+        if (a->cap < a->reserve + h.total) {
+            uint8_t *buf = realloc(a->buf, a->reserve + h.total);
+            if (!buf) {
+                return -1;
+            }
+            a->buf = buf;
+            a->cap = a->reserve + h.total;
+        }
+        a->cmd = h.cmd;
+        a->total = h.total;
+    } else if (h.offset != a->received || h.cmd != a->cmd || h.total != a->total) {
+        return -1;
+    }
+    //除了最后一个分片都是满的
+    if (n <= 0 || n > FRAGMENT_MAX_BODY || h.offset + n > a->total ||
+        (h.offset + n < a->total && n != FRAGMENT_MAX_BODY)) {
+        return -1;
+    }
+    memcpy(a->buf + a->reserve + h.offset, p + FRAGMENT_HEAD_SIZE, n);
+    a->received += n;
+    if (a->received < a->total) {
+        return 0;
+    }
+    a->received = 0;
+    return 1;
+}
@@ -0,0 +1,59 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#ifndef IM_FRAGMENT_H
+#define IM_FRAGMENT_H
+
+#include <stdint.h>
+
+//消息体超过FRAGMENT_MAX_BODY时拆成多个MSG_FRAGMENT帧连续发送
+//分片的消息体: cmd(1) + total(4) + offset(4) + 数据, total为整条消息体的长度
+//每个分片占用一个seq, 整条消息的seq为最后一个分片的seq, 按整条消息ack
+//分片按顺序到达, 每个方向同时只有一条消息在重组
+#define FRAGMENT_HEAD_SIZE 9
+#define FRAGMENT_MAX_BODY (32*1024)
+//重组之后一条消息体的最大长度
+#define FRAGMENT_MAX_MESSAGE (1024*1024)
+
+struct fragment_head {
+    int cmd;
+    int32_t total;
+    int32_t offset;
+};
+
+static inline int fragment_count(int len) {
+    return (len + FRAGMENT_MAX_BODY - 1)/FRAGMENT_MAX_BODY;
+}
+
+void fragment_write_head(uint8_t *p, const struct fragment_head *h);
+//返回0表示成功, -1表示长度不够
+int fragment_read_head(const uint8_t *p, int len, struct fragment_head *h);
+//把消息体的第index个分片(分片头+数据)写入out, out至少要有FRAGMENT_HEAD_SIZE+FRAGMENT_MAX_BODY个字节
+int fragment_encode(uint8_t *out, int cmd, const uint8_t *body, int len, int index);
+
+//重组缓冲区, 大小不超过reserve+FRAGMENT_MAX_MESSAGE, 消息之间复用
+//消息体前面保留reserve个字节, 调用者可以在那里写入帧头
+struct fragment_arena {
+    uint8_t *buf;
+    int cap;
+    int reserve;
+    int cmd;
+    int total;
+    int received;
+};
+
+void fragment_arena_init(struct fragment_arena *a, int reserve);
+void fragment_arena_free(struct fragment_arena *a);
+//丢弃正在重组的消息
+void fragment_arena_reset(struct fragment_arena *a);
+//加入一个分片的消息体, 返回1表示消息完整, 消息体为buf+reserve开始的total个字节,
+//0表示还需要后面的分片, -1表示非法的分片(乱序, 长度不一致或者超过上限)
+int fragment_arena_add(struct fragment_arena *a, const uint8_t *p, int len);
+
+#endif
@@ -0,0 +1,96 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "frame_decoder.h"
+#include "byteorder.h"
+
+void frame_decoder_init(struct frame_decoder *dec) {
+    memset(dec, 0, sizeof(struct frame_decoder));
+}
+
+void frame_decoder_free(struct frame_decoder *dec) {
+    free(dec->buf);
+    memset(dec, 0, sizeof(struct frame_decoder));
+}
+
+void frame_decoder_reset(struct frame_decoder *dec) {
+    dec->rpos = 0;
+    dec->wpos = 0;
+}
+
+static void frame_decoder_compact(struct frame_decoder *dec) {
+    if (dec->rpos == 0) {
+        return;
+    }
+    size_t n = dec->wpos - dec->rpos;
+    if (n > 0) {
+        memmove(dec->buf, dec->buf + dec->rpos, n);
+    }
+    dec->rpos = 0;
+    dec->wpos = n;
+}
+
+int frame_decoder_append(struct frame_decoder *dec, const void *bytes, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (dec->rpos == dec->wpos) {
+        //缓冲区已读空,无需搬移数据
+        dec->rpos = 0;
+        dec->wpos = 0;
+    } else if (dec->rpos >= FRAME_COMPACT_THRESHOLD) {
+        frame_decoder_compact(dec);
+    }
+
+    if (dec->cap - dec->wpos < len) {
+        //剩余空间不足,先整理再扩容
+        frame_decoder_compact(dec);
+        if (dec->cap - dec->wpos < len) {
+            size_t cap = dec->cap > 0 ? dec->cap : 64*1024;
+            while (cap - dec->wpos < len) {
+                cap *= 2;
+            }
+            uint8_t *buf = realloc(dec->buf, cap);
+            if (!buf) {
+                return -1;
+            }
+            dec->buf = buf;
+            dec->cap = cap;
+        }
+    }
+    memcpy(dec->buf + dec->wpos, bytes, len);
+    dec->wpos += len;
+    return 0;
+}
+
+int frame_decoder_next(struct frame_decoder *dec, struct frame_view *frame) {
+    size_t avail = dec->wpos - dec->rpos;
+    if (avail < FRAME_LENGTH_SIZE + FRAME_HEAD_SIZE) {
+        return 0;
+    }
+    const uint8_t *p = dec->buf + dec->rpos;
+    int32_t len = (int32_t)load_be32(p);
+    if (len < 0 || len > FRAME_MAX_BODY_SIZE) {
+        return -1;
+    }
+    if (avail < FRAME_LENGTH_SIZE + FRAME_HEAD_SIZE + (size_t)len) {
+        return 0;
+    }
+    frame->head = p + FRAME_LENGTH_SIZE;
+    frame->body = frame->head + FRAME_HEAD_SIZE;
+    frame->body_len = len;
+    dec->rpos += FRAME_LENGTH_SIZE + FRAME_HEAD_SIZE + len;
+    return 1;
+}
+
+size_t frame_decoder_pending(const struct frame_decoder *dec) {
+    return dec->wpos - dec->rpos;
+}
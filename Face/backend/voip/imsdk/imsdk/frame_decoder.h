@@ -0,0 +1,49 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#ifndef IM_FRAME_DECODER_H
+#define IM_FRAME_DECODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//帧格式: len(4) + seq(4) + cmd(1) + version(1) + padding(2) + body(len)
+#define FRAME_LENGTH_SIZE 4
+#define FRAME_HEAD_SIZE 8
+#define FRAME_MAX_BODY_SIZE (16*1024*1024)
+
+//读指针超过此阈值后才整理缓冲区
+#define FRAME_COMPACT_THRESHOLD (64*1024)
+
+struct frame_decoder {
+    uint8_t *buf;
+    size_t cap;
+    size_t rpos;
+    size_t wpos;
+};
+
+//指向decoder内部缓冲区,下一次frame_decoder_append之前有效
+struct frame_view {
+    const uint8_t *head;
+    const uint8_t *body;
+    int body_len;
+};
+
+void frame_decoder_init(struct frame_decoder *dec);
+void frame_decoder_free(struct frame_decoder *dec);
+void frame_decoder_reset(struct frame_decoder *dec);
+
+int frame_decoder_append(struct frame_decoder *dec, const void *bytes, size_t len);
+
+//1:取到一帧 0:数据不完整 -1:非法帧
+int frame_decoder_next(struct frame_decoder *dec, struct frame_view *frame);
+
+size_t frame_decoder_pending(const struct frame_decoder *dec);
+
+#endif
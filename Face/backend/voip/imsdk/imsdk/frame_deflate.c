@@ -0,0 +1,197 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "frame_deflate.h"
+#include "frame_decoder.h"
+
+#define WINDOW_BITS 13
+#define MEM_LEVEL 5
+
+//deflate优先匹配字典末尾的内容, 最常见的放在最后
+static const char dictionary[] =
+    "v=0\r\no=- IN IP4 127.0.0.1\r\ns=-\r\nt=0 0\r\na=group:BUNDLE audio video\r\n"
+    "a=msid-semantic: WMS\r\nm=audio 9 UDP/TLS/RTP/SAVPF\r\nc=IN IP4 0.0.0.0\r\n"
+    "a=rtcp:9 IN IP4 0.0.0.0\r\na=ice-ufrag:a=ice-pwd:a=fingerprint:sha-256 "
+    "a=setup:actpass\r\na=mid:audio\r\na=sendrecv\r\na=rtcp-mux\r\na=rtpmap:111 opus/48000/2\r\n"
+    "a=rtpmap:100 H264/90000\r\na=rtcp-fb:100 nack pli\r\na=fmtp:"
+    "{\"type\":\"offer\",\"sdp\":\"{\"type\":\"answer\",\"sdp\":\""
+    "{\"type\":\"candidate\",\"label\":0,\"id\":\"audio\",\"candidate\":\"candidate:"
+    " 1 udp 2122260223 typ host generation 0 typ srflx raddr rport "
+    "{\"disband\":{\"group_id\":{\"update_name\":{\"group_id\":"
+    "{\"quit_group\":{\"group_id\":{\"add_member\":{\"group_id\":,\"member_id\":"
+    "{\"create\":{\"master\":,\"group_id\":,\"name\":\",\"members\":[],\"timestamp\":"
+    "{\"location\":{\"latitude\":,\"longitude\":}}"
+    "{\"audio\":{\"url\":\"http://,\"duration\":}}"
+    "{\"image2\":{\"url\":\"http://\",\"width\":,\"height\":}}"
+    "{\"image\":\"http://.jpg\"}.png\"}"
+    "\",\"uuid\":\"{\"text\":\"";
+
+static int grow(uint8_t **buf, int *cap, int need) {
+    if (need <= *cap) {
+        return 0;
+    }
+    if (need > FRAME_MAX_BODY_SIZE + 64) {
+        return -1;
+    }
+    int n = *cap ? *cap : 1024;
+    while (n < need) {
+        n *= 2;
+    }
+    uint8_t *p = realloc(*buf, n);
+    if (!p) {
+        return -1;
+    }
+    *buf = p;
+    *cap = n;
+    return 0;
+}
+
+void frame_deflate_init(struct frame_deflate *d, int level) {
+    memset(d, 0, sizeof(struct frame_deflate));
+    d->level = level;
+}
+
+void frame_deflate_free(struct frame_deflate *d) {
+    if (d->ready) {
+        deflateEnd(&d->zs);
+    }
+    free(d->buf);
+    memset(d, 0, sizeof(struct frame_deflate));
+}
+
+//流在第一次使用时才创建, 没有协商压缩的连接不占内存
+void frame_deflate_reset(struct frame_deflate *d) {
+    if (d->ready) {
+        deflateEnd(&d->zs);
+        d->ready = 0;
+    }
+}
+
+static int deflate_start(struct frame_deflate *d) {
+    memset(&d->zs, 0, sizeof(z_stream));
+    if (deflateInit2(&d->zs, d->level, Z_DEFLATED, -WINDOW_BITS, MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    d->ready = 1;
+    if (deflateSetDictionary(&d->zs, (const Bytef*)dictionary, sizeof(dictionary) - 1) != Z_OK) {
+        return -1;
+    }
+    return 0;
+}
+
+int frame_deflate_body(struct frame_deflate *d, const uint8_t *p, int len, const uint8_t **out) {
+    if (!d->ready && deflate_start(d) != 0) {
+        return -1;
+    }
+    //deflateBound不包括sync flush的空块
+    int bound = (int)deflateBound(&d->zs, len) + 16;
+    if (grow(&d->buf, &d->cap, bound) != 0) {
+        return -1;
+    }
+    d->zs.next_in = (Bytef*)p;
+    d->zs.avail_in = len;
+    d->zs.next_out = d->buf;
+    d->zs.avail_out = d->cap;
+    int r = deflate(&d->zs, Z_SYNC_FLUSH);
+    if (r != Z_OK || d->zs.avail_in != 0 || d->zs.avail_out == 0) {
+        return -1;
+    }
+    int n = d->cap - d->zs.avail_out;
+    //sync flush以00 00 ff ff结尾, 不用发送, 解压时补上
+    if (n < 4 || memcmp(d->buf + n - 4, "\x00\x00\xff\xff", 4) != 0) {
+        return -1;
+    }
+    *out = d->buf;
+    return n - 4;
+}
+
+void frame_inflate_init(struct frame_inflate *f) {
+    memset(f, 0, sizeof(struct frame_inflate));
+}
+
+void frame_inflate_free(struct frame_inflate *f) {
+    if (f->ready) {
+        inflateEnd(&f->zs);
+    }
+    free(f->buf);
+    memset(f, 0, sizeof(struct frame_inflate));
+}
+
+void frame_inflate_reset(struct frame_inflate *f) {
+    if (f->ready) {
+        inflateEnd(&f->zs);
+        f->ready = 0;
+    }
+}
+
+static int inflate_start(struct frame_inflate *f) {
+    memset(&f->zs, 0, sizeof(z_stream));
+    if (inflateInit2(&f->zs, -WINDOW_BITS) != Z_OK) {
+        return -1;
+    }
+    f->ready = 1;
+    //raw inflate可以在开始时直接设置字典
+    if (inflateSetDictionary(&f->zs, (const Bytef*)dictionary, sizeof(dictionary) - 1) != Z_OK) {
+        return -1;
+    }
+    return 0;
+}
+
+static int inflate_input(struct frame_inflate *f, const uint8_t *p, int len, int *n) {
+    f->zs.next_in = (Bytef*)p;
+    f->zs.avail_in = len;
+    while (f->zs.avail_in > 0) {
+        if (grow(&f->buf, &f->cap, *n + len*2 + 256) != 0) {
+            return -1;
+        }
+        f->zs.next_out = f->buf + *n;
+        f->zs.avail_out = f->cap - *n;
+        int r = inflate(&f->zs, Z_SYNC_FLUSH);
+        *n = f->cap - f->zs.avail_out;
+        if (r != Z_OK && r != Z_BUF_ERROR) {
+            return -1;
+        }
+        if (*n > FRAME_MAX_BODY_SIZE) {
+            return -1;
+        }
+        if (r == Z_BUF_ERROR && f->zs.avail_out > 0) {
+            //没有进展
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int frame_inflate_body(struct frame_inflate *f, const uint8_t *p, int len, const uint8_t **out) {
+    if (!f->ready && inflate_start(f) != 0) {
+        return -1;
+    }
+    int n = 0;
+    if (inflate_input(f, p, len, &n) != 0 ||
+        inflate_input(f, (const uint8_t*)"\x00\x00\xff\xff", 4, &n) != 0) {
+        return -1;
+    }
+    //输入都消耗完之后, 窗口里可能还有输出
+    while (f->zs.avail_out == 0) {
+        if (grow(&f->buf, &f->cap, f->cap*2) != 0) {
+            return -1;
+        }
+        f->zs.next_out = f->buf + n;
+        f->zs.avail_out = f->cap - n;
+        int r = inflate(&f->zs, Z_SYNC_FLUSH);
+        n = f->cap - f->zs.avail_out;
+        if ((r != Z_OK && r != Z_BUF_ERROR) || n > FRAME_MAX_BODY_SIZE) {
+            return -1;
+        }
+    }
+    *out = f->buf;
+    return n;
+}
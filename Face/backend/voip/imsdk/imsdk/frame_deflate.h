@@ -0,0 +1,59 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#ifndef IM_FRAME_DEFLATE_H
+#define IM_FRAME_DEFLATE_H
+
+#include <stdint.h>
+#include <zlib.h>
+
+//帧头padding的第一个字节为标志位
+//消息体用连接上的deflate流压缩
+#define FRAME_FLAG_COMPRESSED 0x01
+//认证和恢复请求: 客户端支持压缩, 对应的应答: 服务器同意压缩
+#define FRAME_FLAG_DEFLATE 0x02
+
+//小于此长度的消息体(ack, 同步点等)压缩之后基本不会变小, 直接发送
+#define FRAME_DEFLATE_THRESHOLD 32
+#define FRAME_DEFLATE_LEVEL 6
+
+//每个方向一个raw deflate流, 整个连接共享压缩的上下文, 每帧之后sync flush
+//只有带FRAME_FLAG_COMPRESSED的帧经过流, 两端必须按发送的顺序处理
+//流用预置的字典初始化, 字典来自常见的消息内容(json的字段名, 群通知, webrtc信令)
+//窗口为8K, 每个连接的内存大约是压缩48K, 解压8K
+struct frame_deflate {
+    z_stream zs;
+    int level;
+    int ready;
+    uint8_t *buf;
+    int cap;
+};
+
+struct frame_inflate {
+    z_stream zs;
+    int ready;
+    uint8_t *buf;
+    int cap;
+};
+
+void frame_deflate_init(struct frame_deflate *d, int level);
+void frame_deflate_free(struct frame_deflate *d);
+//新的连接重新开始
+void frame_deflate_reset(struct frame_deflate *d);
+//压缩一帧的消息体, *out指向内部缓冲区, 下一次调用之前有效
+//返回压缩之后的长度, -1表示失败, 之后这个流不能再使用
+int frame_deflate_body(struct frame_deflate *d, const uint8_t *p, int len, const uint8_t **out);
+
+void frame_inflate_init(struct frame_inflate *f);
+void frame_inflate_free(struct frame_inflate *f);
+void frame_inflate_reset(struct frame_inflate *f);
+//解压一帧的消息体, 超过FRAME_MAX_BODY_SIZE或者数据错误时返回-1
+int frame_inflate_body(struct frame_inflate *f, const uint8_t *p, int len, const uint8_t **out);
+
+#endif
@@ -0,0 +1,620 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "imlog.h"
+
+//每个线程的缓冲区大小, 2的幂
+#define RING_SIZE (64*1024)
+//一条记录的最大长度, 超出时截断字符串参数
+#define MAX_RECORD 2048
+#define MAX_STRING 1024
+#define MAX_LINE 4096
+//没有被唤醒时也定期检查, 防止错过通知
+#define DRAIN_TIMEOUT_MS 1000
+//唤醒之后稍等一会再处理, 避免每条记录都切换一次线程
+#define DRAIN_DELAY_MS 10
+
+//缓冲区末尾放不下一条记录时写入填充, 从头开始写
+#define LEVEL_PADDING 0xff
+
+#define RING_USED 0
+#define RING_EXITED 1
+
+//记录的布局: record_head + 按格式串中转换的顺序排列的参数
+//整数统一扩展为8字节, 浮点数为double, 指针为8字节, 字符串为2字节长度+内容
+struct record_head {
+    uint16_t size;
+    uint8_t level;
+    uint8_t reserved;
+    uint32_t tid;
+    uint64_t time_us;
+    const char *fmt;
+};
+
+#define HEAD_SIZE ((int)sizeof(struct record_head))
+
+struct log_ring {
+    struct log_ring *next;
+    atomic_int state;
+    int tid;
+    atomic_size_t head;//消费者的位置
+    atomic_size_t tail;//生产者的位置
+    uint8_t buf[RING_SIZE];
+};
+
+atomic_int im_log_level = IMLOG_MIN_LEVEL;
+
+static _Atomic(struct log_ring*) rings;
+static atomic_int next_tid;
+static atomic_ullong dropped;
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+
+static atomic_int drain_pending;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+//后台线程和im_log_flush都是消费者, 互斥
+static pthread_mutex_t consume_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static im_log_sink sink;
+static void *sink_ctx;
+
+enum {
+    LEN_NONE, LEN_HH, LEN_H, LEN_L, LEN_LL, LEN_J, LEN_Z, LEN_T, LEN_BIG_L,
+};
+
+//一个转换说明, begin指向'%'之后
+struct spec {
+    const char *flags;
+    int nflags;
+    const char *width;//NULL表示没有, "*"表示来自参数
+    int nwidth;
+    const char *prec;
+    int nprec;
+    int length;
+    char conv;
+};
+
+static int is_flag(char c) {
+    return c == '-' || c == '+' || c == ' ' || c == '#' || c == '0' || c == '\'';
+}
+
+static int is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+//返回转换说明之后的位置
+static const char *parse_spec(const char *p, struct spec *s) {
+    memset(s, 0, sizeof(*s));
+    s->flags = p;
+    while (is_flag(*p)) p++;
+    s->nflags = (int)(p - s->flags);
+
+    if (*p == '*') {
+        s->width = p++;
+        s->nwidth = 1;
+    } else if (is_digit(*p)) {
+        s->width = p;
+        while (is_digit(*p)) p++;
+        s->nwidth = (int)(p - s->width);
+    }
+
+    if (*p == '.') {
+        p++;
+        s->prec = p;
+        if (*p == '*') {
+            p++;
+        } else {
+            while (is_digit(*p)) p++;
+        }
+        s->nprec = (int)(p - s->prec);
+    }
+
+    switch (*p) {
+    case 'h':
+        p++;
+        s->length = LEN_H;
+        if (*p == 'h') { p++; s->length = LEN_HH; }
+        break;
+    case 'l':
+        p++;
+        s->length = LEN_L;
+        if (*p == 'l') { p++; s->length = LEN_LL; }
+        break;
+    case 'q': p++; s->length = LEN_LL; break;
+    case 'j': p++; s->length = LEN_J; break;
+    case 'z': p++; s->length = LEN_Z; break;
+    case 't': p++; s->length = LEN_T; break;
+    case 'L': p++; s->length = LEN_BIG_L; break;
+    }
+    s->conv = *p;
+    return *p ? p + 1 : p;
+}
+
+static int is_signed_conv(char c) {
+    return c == 'd' || c == 'i';
+}
+
+static int is_unsigned_conv(char c) {
+    return c == 'u' || c == 'o' || c == 'x' || c == 'X';
+}
+
+static int is_float_conv(char c) {
+    return c == 'f' || c == 'F' || c == 'e' || c == 'E' || c == 'g' || c == 'G' || c == 'a' || c == 'A';
+}
+
+//编码时的写入位置, 超出时置满
+struct writer {
+    uint8_t *p;
+    int n;
+    int cap;
+};
+
+static void put_bytes(struct writer *w, const void *v, int n) {
+    if (w->n + n > w->cap) {
+        w->n = w->cap + 1;
+        return;
+    }
+    memcpy(w->p + w->n, v, n);
+    w->n += n;
+}
+
+static void put_u64(struct writer *w, uint64_t v) {
+    put_bytes(w, &v, 8);
+}
+
+static void put_string(struct writer *w, const char *str, int prec) {
+    if (!str) {
+        str = "(null)";
+    }
+    size_t max = prec >= 0 && prec < MAX_STRING ? (size_t)prec : MAX_STRING;
+    //剩余空间不够时截断, 至少保留长度字段
+    int room = w->cap - w->n - 2;
+    if (room < 0) {
+        w->n = w->cap + 1;
+        return;
+    }
+    if ((size_t)room < max) {
+        max = room;
+    }
+    uint16_t len = (uint16_t)strnlen(str, max);
+    put_bytes(w, &len, 2);
+    put_bytes(w, str, len);
+}
+
+static int64_t signed_arg(int length, va_list *ap) {
+    switch (length) {
+    case LEN_HH: return (signed char)va_arg(*ap, int);
+    case LEN_H: return (short)va_arg(*ap, int);
+    case LEN_L: return va_arg(*ap, long);
+    case LEN_LL: return va_arg(*ap, long long);
+    case LEN_J: return va_arg(*ap, intmax_t);
+    case LEN_Z: return (int64_t)va_arg(*ap, size_t);
+    case LEN_T: return va_arg(*ap, ptrdiff_t);
+    default: return va_arg(*ap, int);
+    }
+}
+
+static uint64_t unsigned_arg(int length, va_list *ap) {
+    switch (length) {
+    case LEN_HH: return (unsigned char)va_arg(*ap, unsigned int);
+    case LEN_H: return (unsigned short)va_arg(*ap, unsigned int);
+    case LEN_L: return va_arg(*ap, unsigned long);
+    case LEN_LL: return va_arg(*ap, unsigned long long);
+    case LEN_J: return va_arg(*ap, uintmax_t);
+    case LEN_Z: return va_arg(*ap, size_t);
+    case LEN_T: return (uint64_t)va_arg(*ap, ptrdiff_t);
+    default: return va_arg(*ap, unsigned int);
+    }
+}
+
+//按格式串把参数写成二进制, 返回记录的长度, 超出MAX_RECORD时返回-1
+static int encode(uint8_t *buf, const char *fmt, va_list *ap) {
+    struct writer w = {buf, HEAD_SIZE, MAX_RECORD};
+    const char *p = fmt;
+    while ((p = strchr(p, '%')) != NULL) {
+        struct spec s;
+        p = parse_spec(p + 1, &s);
+        if (s.width && s.width[0] == '*') {
+            put_u64(&w, (uint64_t)(int64_t)va_arg(*ap, int));
+        }
+        int prec = -1;
+        if (s.prec && s.nprec > 0 && s.prec[0] == '*') {
+            prec = va_arg(*ap, int);
+            put_u64(&w, (uint64_t)(int64_t)prec);
+        } else if (s.prec) {
+            prec = atoi(s.prec);
+        }
+
+        if (is_signed_conv(s.conv)) {
+            put_u64(&w, (uint64_t)signed_arg(s.length, ap));
+        } else if (is_unsigned_conv(s.conv)) {
+            put_u64(&w, unsigned_arg(s.length, ap));
+        } else if (s.conv == 'c') {
+            put_u64(&w, (uint64_t)va_arg(*ap, int));
+        } else if (is_float_conv(s.conv)) {
+            double d = s.length == LEN_BIG_L ? (double)va_arg(*ap, long double) : va_arg(*ap, double);
+            put_bytes(&w, &d, 8);
+        } else if (s.conv == 'p') {
+            put_u64(&w, (uint64_t)(uintptr_t)va_arg(*ap, void*));
+        } else if (s.conv == 's') {
+            put_string(&w, va_arg(*ap, const char*), prec);
+        } else if (s.conv == 'n') {
+            (void)va_arg(*ap, void*);
+        }
+    }
+    if (w.n > w.cap) {
+        return -1;
+    }
+    //8字节对齐, 保证下一条记录的头部对齐
+    return (w.n + 7) & ~7;
+}
+
+struct reader {
+    const uint8_t *p;
+    int n;
+    int size;
+};
+
+static uint64_t get_u64(struct reader *r) {
+    uint64_t v = 0;
+    if (r->n + 8 <= r->size) {
+        memcpy(&v, r->p + r->n, 8);
+    }
+    r->n += 8;
+    return v;
+}
+
+//输出的位置, 超出时截断
+struct line {
+    char *p;
+    int n;
+    int cap;
+};
+
+static void line_append(struct line *l, const char *s, int n) {
+    if (n > l->cap - l->n) {
+        n = l->cap - l->n;
+    }
+    if (n > 0) {
+        memcpy(l->p + l->n, s, n);
+        l->n += n;
+    }
+}
+
+static void line_printf(struct line *l, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void line_printf(struct line *l, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int r = vsnprintf(l->p + l->n, l->cap - l->n + 1, fmt, ap);
+    va_end(ap);
+    if (r > 0) {
+        l->n += r < l->cap - l->n ? r : l->cap - l->n;
+    }
+}
+
+//按格式串和二进制参数格式化, 每个转换说明单独交给snprintf
+static void decode(const struct record_head *h, const uint8_t *args, int size, struct line *l) {
+    struct reader r = {args, 0, size};
+    const char *p = h->fmt;
+    while (*p) {
+        const char *pct = strchr(p, '%');
+        if (!pct) {
+            line_append(l, p, (int)strlen(p));
+            break;
+        }
+        line_append(l, p, (int)(pct - p));
+        struct spec s;
+        const char *end = parse_spec(pct + 1, &s);
+        p = end;
+        if (s.conv == '%') {
+            line_append(l, "%", 1);
+            continue;
+        }
+
+        //重新组织转换说明, 参数宽度统一为long long和double
+        char spec[64];
+        int n = 0;
+        spec[n++] = '%';
+        if (s.nflags < 8) {
+            memcpy(spec + n, s.flags, s.nflags);
+            n += s.nflags;
+        }
+        if (s.width && s.width[0] == '*') {
+            n += snprintf(spec + n, 16, "%d", (int)get_u64(&r));
+        } else if (s.width && s.nwidth < 8) {
+            memcpy(spec + n, s.width, s.nwidth);
+            n += s.nwidth;
+        }
+        int before_prec = n;
+        if (s.prec && s.nprec > 0 && s.prec[0] == '*') {
+            int prec = (int)get_u64(&r);
+            if (prec >= 0) {
+                n += snprintf(spec + n, 16, ".%d", prec);
+            }
+        } else if (s.prec && s.nprec < 8) {
+            spec[n++] = '.';
+            memcpy(spec + n, s.prec, s.nprec);
+            n += s.nprec;
+        }
+
+        if (is_signed_conv(s.conv) || is_unsigned_conv(s.conv)) {
+            spec[n++] = 'l';
+            spec[n++] = 'l';
+            spec[n++] = s.conv;
+            spec[n] = 0;
+            line_printf(l, spec, (long long)get_u64(&r));
+        } else if (s.conv == 'c') {
+            spec[n++] = 'c';
+            spec[n] = 0;
+            line_printf(l, spec, (int)get_u64(&r));
+        } else if (is_float_conv(s.conv)) {
+            uint64_t v = get_u64(&r);
+            double d;
+            memcpy(&d, &v, 8);
+            spec[n++] = s.conv;
+            spec[n] = 0;
+            line_printf(l, spec, d);
+        } else if (s.conv == 'p') {
+            spec[n++] = 'p';
+            spec[n] = 0;
+            line_printf(l, spec, (void*)(uintptr_t)get_u64(&r));
+        } else if (s.conv == 's') {
+            uint16_t len = 0;
+            if (r.n + 2 <= r.size) {
+                memcpy(&len, r.p + r.n, 2);
+            }
+            r.n += 2;
+            if (r.n + len > r.size) {
+                len = 0;
+            }
+            //内容已经按精度截断过, 换成实际长度, 记录中的字符串没有结尾的0
+            n = before_prec;
+            n += snprintf(spec + n, 16, ".%ds", (int)len);
+            line_printf(l, spec, (const char*)(r.p + r.n));
+            r.n += len;
+        } else if (s.conv != 'n') {
+            //不认识的转换原样输出
+            line_append(l, pct, (int)(end - pct));
+        }
+    }
+}
+
+static void ring_destructor(void *p) {
+    struct log_ring *ring = p;
+    atomic_store_explicit(&ring->state, RING_EXITED, memory_order_release);
+}
+
+static void default_sink(int level, const char *line, int len, void *ctx) {
+    (void)level;
+    (void)ctx;
+    fwrite(line, 1, len, stderr);
+}
+
+static void *drain_main(void *arg);
+
+static void init(void) {
+    pthread_key_create(&ring_key, ring_destructor);
+    sink = default_sink;
+    atexit(im_log_flush);
+
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&tid, &attr, drain_main, NULL);
+    pthread_attr_destroy(&attr);
+}
+
+//复用已经退出的线程的缓冲区, 否则新建一个加入链表, 缓冲区不会释放
+static struct log_ring *thread_ring(void) {
+    struct log_ring *ring = pthread_getspecific(ring_key);
+    if (ring) {
+        return ring;
+    }
+    for (ring = atomic_load_explicit(&rings, memory_order_acquire); ring; ring = ring->next) {
+        int exited = RING_EXITED;
+        if (atomic_compare_exchange_strong_explicit(&ring->state, &exited, RING_USED,
+                                                    memory_order_acquire, memory_order_relaxed)) {
+            break;
+        }
+    }
+    if (!ring) {
+        ring = calloc(1, sizeof(struct log_ring));
+        if (!ring) {
+            return NULL;
+        }
+        atomic_init(&ring->state, RING_USED);
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        struct log_ring *first = atomic_load_explicit(&rings, memory_order_relaxed);
+        do {
+            ring->next = first;
+        } while (!atomic_compare_exchange_weak_explicit(&rings, &first, ring,
+                                                        memory_order_release, memory_order_relaxed));
+    }
+    ring->tid = atomic_fetch_add_explicit(&next_tid, 1, memory_order_relaxed) + 1;
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+static int ring_push(struct log_ring *ring, const uint8_t *rec, size_t n) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t pos = tail & (RING_SIZE - 1);
+    size_t contiguous = RING_SIZE - pos;
+    size_t need = n <= contiguous ? n : contiguous + n;
+    if (RING_SIZE - (tail - head) < need) {
+        return -1;
+    }
+    if (n > contiguous) {
+        struct record_head *pad = (struct record_head*)(ring->buf + pos);
+        pad->size = (uint16_t)contiguous;
+        pad->level = LEVEL_PADDING;
+        tail += contiguous;
+        pos = 0;
+    }
+    memcpy(ring->buf + pos, rec, n);
+    atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+    return 0;
+}
+
+static void wakeup_drain(void) {
+    if (atomic_load_explicit(&drain_pending, memory_order_relaxed) ||
+        atomic_exchange_explicit(&drain_pending, 1, memory_order_relaxed)) {
+        return;
+    }
+    pthread_mutex_lock(&drain_mutex);
+    pthread_cond_signal(&drain_cond);
+    pthread_mutex_unlock(&drain_mutex);
+}
+
+void im_log_write(int level, const char *fmt, ...) {
+    pthread_once(&once, init);
+    struct log_ring *ring = thread_ring();
+    if (!ring) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    uint8_t buf[MAX_RECORD] __attribute__((aligned(8)));
+    va_list ap;
+    va_start(ap, fmt);
+    int n = encode(buf, fmt, &ap);
+    va_end(ap);
+    if (n < 0) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    struct record_head *h = (struct record_head*)buf;
+    h->size = (uint16_t)n;
+    h->level = (uint8_t)level;
+    h->reserved = 0;
+    h->tid = (uint32_t)ring->tid;
+    h->time_us = (uint64_t)tv.tv_sec*1000000 + tv.tv_usec;
+    h->fmt = fmt;
+
+    if (ring_push(ring, buf, n) != 0) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+    wakeup_drain();
+}
+
+//消费者, 跳过填充, 返回下一条记录, 没有时返回NULL
+static const struct record_head *ring_peek(struct log_ring *ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    while (head != tail) {
+        const struct record_head *h = (const struct record_head*)(ring->buf + (head & (RING_SIZE - 1)));
+        if (h->level != LEVEL_PADDING) {
+            return h;
+        }
+        head += h->size;
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+    }
+    return NULL;
+}
+
+static void ring_pop(struct log_ring *ring, const struct record_head *h) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + h->size, memory_order_release);
+}
+
+static void emit(const struct record_head *h) {
+    static const char levels[] = "DIWE";
+    char buf[MAX_LINE + 1];
+    struct line l = {buf, 0, MAX_LINE - 1};
+
+    time_t sec = (time_t)(h->time_us/1000000);
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    line_printf(&l, "%04d-%02d-%02d %02d:%02d:%02d.%03d %c [%d] ",
+                tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                (int)(h->time_us%1000000/1000), h->level < 4 ? levels[h->level] : '?', (int)h->tid);
+    decode(h, (const uint8_t*)h + HEAD_SIZE, h->size - HEAD_SIZE, &l);
+    l.cap = MAX_LINE;
+    line_append(&l, "\n", 1);
+    sink(h->level, buf, l.n, sink_ctx);
+}
+
+//每次输出所有线程中最早的一条, 保证日志按时间排序
+static void drain(void) {
+    pthread_mutex_lock(&consume_mutex);
+    while (1) {
+        struct log_ring *first = NULL;
+        const struct record_head *earliest = NULL;
+        for (struct log_ring *ring = atomic_load_explicit(&rings, memory_order_acquire); ring; ring = ring->next) {
+            const struct record_head *h = ring_peek(ring);
+            if (h && (!earliest || h->time_us < earliest->time_us)) {
+                earliest = h;
+                first = ring;
+            }
+        }
+        if (!earliest) {
+            break;
+        }
+        emit(earliest);
+        ring_pop(first, earliest);
+    }
+    pthread_mutex_unlock(&consume_mutex);
+}
+
+static void *drain_main(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&drain_mutex);
+        if (!atomic_load(&drain_pending)) {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            struct timespec deadline;
+            deadline.tv_sec = now.tv_sec + DRAIN_TIMEOUT_MS/1000;
+            deadline.tv_nsec = now.tv_usec*1000;
+            pthread_cond_timedwait(&drain_cond, &drain_mutex, &deadline);
+        }
+        pthread_mutex_unlock(&drain_mutex);
+
+        struct timespec delay = {0, DRAIN_DELAY_MS*1000000};
+        nanosleep(&delay, NULL);
+        atomic_store(&drain_pending, 0);
+        drain();
+    }
+    return NULL;
+}
+
+void im_log_set_sink(im_log_sink s, void *ctx) {
+    pthread_once(&once, init);
+    pthread_mutex_lock(&consume_mutex);
+    sink = s ? s : default_sink;
+    sink_ctx = ctx;
+    pthread_mutex_unlock(&consume_mutex);
+}
+
+void im_log_flush(void) {
+    pthread_once(&once, init);
+    drain();
+    fflush(stderr);
+}
+
+unsigned long long im_log_dropped(void) {
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
@@ -0,0 +1,64 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#ifndef IM_IMLOG_H
+#define IM_IMLOG_H
+
+#include <stdatomic.h>
+
+//异步日志
+//调用线程只把格式串的地址和参数的二进制值写入本线程的无锁环形缓冲区, 不格式化也不做io
+//后台线程按时间顺序合并各线程的记录, 格式化之后交给输出函数
+//缓冲区满时丢弃新记录并计数, 不会阻塞调用线程
+
+#define IMLOG_DEBUG 0
+#define IMLOG_INFO  1
+#define IMLOG_WARN  2
+#define IMLOG_ERROR 3
+#define IMLOG_NONE  4
+
+//低于此级别的日志在编译时去掉, 参数也不会求值
+#ifndef IMLOG_MIN_LEVEL
+#ifdef DEBUG
+#define IMLOG_MIN_LEVEL IMLOG_DEBUG
+#else
+#define IMLOG_MIN_LEVEL IMLOG_INFO
+#endif
+#endif
+
+//运行时的级别, 默认为IMLOG_MIN_LEVEL
+extern atomic_int im_log_level;
+
+//格式同printf, 不支持%@和%n, 对象需要转成字符串用%s
+//格式串只保存地址, 宏限定为字符串常量; %s的内容在调用时复制
+void im_log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define IMLOG(level, fmt, ...) do { \
+        if ((level) >= IMLOG_MIN_LEVEL && \
+            (level) >= atomic_load_explicit(&im_log_level, memory_order_relaxed)) { \
+            im_log_write((level), "" fmt, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define IMLogD(fmt, ...) IMLOG(IMLOG_DEBUG, fmt, ##__VA_ARGS__)
+#define IMLogI(fmt, ...) IMLOG(IMLOG_INFO, fmt, ##__VA_ARGS__)
+#define IMLogW(fmt, ...) IMLOG(IMLOG_WARN, fmt, ##__VA_ARGS__)
+#define IMLogE(fmt, ...) IMLOG(IMLOG_ERROR, fmt, ##__VA_ARGS__)
+
+//在后台线程上调用, line以换行结尾, 默认写到stderr
+typedef void (*im_log_sink)(int level, const char *line, int len, void *ctx);
+void im_log_set_sink(im_log_sink sink, void *ctx);
+
+//同步输出所有已经写入的记录, 进程退出时自动调用
+void im_log_flush(void);
+
+//缓冲区满丢弃的记录数
+unsigned long long im_log_dropped(void);
+
+#endif
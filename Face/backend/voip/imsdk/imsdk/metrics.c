@@ -0,0 +1,150 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+#include "metrics.h"
+
+//静态存储的原子变量初始为0
+struct metrics im_metrics;
+
+static const char *counter_names[METRIC_COUNTER_MAX] = {
+    [METRIC_BYTES_IN] = "bytes.in",
+    [METRIC_BYTES_OUT] = "bytes.out",
+    [METRIC_DECODE_ERRORS] = "decode.errors",
+    [METRIC_CONNECTS] = "connects",
+    [METRIC_CONNECT_FAILURES] = "connect.failures",
+    [METRIC_RECONNECTS] = "reconnects",
+    [METRIC_AUTHS] = "auths",
+    [METRIC_RESUMES] = "resumes",
+};
+
+static const char *histogram_names[METRIC_HISTOGRAM_MAX] = {
+    [METRIC_DECODE_TIME] = "decode.us",
+    [METRIC_ACK_RTT] = "ack.rtt.us",
+    [METRIC_CONNECT_TIME] = "connect.us",
+    [METRIC_AUTH_TIME] = "auth.us",
+    [METRIC_RESUME_TIME] = "resume.us",
+    [METRIC_SEND_DELAY_CONTROL] = "send.control.us",
+    [METRIC_SEND_DELAY_ACK] = "send.ack.us",
+    [METRIC_SEND_DELAY_INTERACTIVE] = "send.interactive.us",
+    [METRIC_SEND_DELAY_BULK] = "send.bulk.us",
+};
+
+uint64_t metrics_now_us(void) {
+#ifdef __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time()*timebase.numer/timebase.denom/1000;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+#endif
+}
+
+static uint64_t load(_Atomic uint64_t *v) {
+    return atomic_load_explicit(v, memory_order_relaxed);
+}
+
+void metrics_snapshot(struct metrics_snapshot *s) {
+    for (int i = 0; i < METRIC_COUNTER_MAX; i++) {
+        s->counters[i] = load(&im_metrics.counters[i]);
+    }
+    for (int i = 0; i < 256; i++) {
+        s->cmd_in[i] = load(&im_metrics.cmd_in[i]);
+        s->cmd_out[i] = load(&im_metrics.cmd_out[i]);
+    }
+    for (int i = 0; i < METRIC_HISTOGRAM_MAX; i++) {
+        struct metric_histogram_data *h = &im_metrics.histograms[i];
+        s->histograms[i].count = 0;
+        for (int j = 0; j < METRIC_BUCKETS; j++) {
+            s->histograms[i].buckets[j] = load(&h->buckets[j]);
+            s->histograms[i].count += s->histograms[i].buckets[j];
+        }
+        s->histograms[i].sum = load(&h->sum);
+    }
+}
+
+void metrics_snapshot_diff(struct metrics_snapshot *out, const struct metrics_snapshot *now,
+                           const struct metrics_snapshot *prev) {
+    //所有字段都是uint64_t, 逐个相减
+    const uint64_t *a = (const uint64_t*)now;
+    const uint64_t *b = (const uint64_t*)prev;
+    uint64_t *d = (uint64_t*)out;
+    for (size_t i = 0; i < sizeof(struct metrics_snapshot)/sizeof(uint64_t); i++) {
+        d[i] = a[i] - b[i];
+    }
+}
+
+uint64_t metrics_percentile(const struct metrics_snapshot *s, int histogram, double p) {
+    const uint64_t *buckets = s->histograms[histogram].buckets;
+    uint64_t total = s->histograms[histogram].count;
+    if (total == 0) {
+        return 0;
+    }
+    p = p < 0 ? 0 : (p > 1 ? 1 : p);
+    //nearest-rank
+    uint64_t rank = (uint64_t)ceil(total*p);
+    rank = rank > 0 ? rank : 1;
+    uint64_t n = 0;
+    for (int i = 0; i < METRIC_BUCKETS; i++) {
+        n += buckets[i];
+        if (n >= rank) {
+            return i == 0 ? 0 : (uint64_t)1 << i;
+        }
+    }
+    return (uint64_t)1 << (METRIC_BUCKETS - 1);
+}
+
+const char *metrics_counter_name(int counter) {
+    return counter_names[counter];
+}
+
+const char *metrics_histogram_name(int histogram) {
+    return histogram_names[histogram];
+}
+
+int metrics_format(const struct metrics_snapshot *s, char *buf, size_t size) {
+    size_t n = 0;
+#define APPEND(...) do { \
+        int r = snprintf(n < size ? buf + n : NULL, n < size ? size - n : 0, __VA_ARGS__); \
+        n += r > 0 ? r : 0; \
+    } while (0)
+    for (int i = 0; i < METRIC_COUNTER_MAX; i++) {
+        APPEND("%s %llu\n", counter_names[i], (unsigned long long)s->counters[i]);
+    }
+    for (int i = 0; i < 256; i++) {
+        if (s->cmd_in[i]) {
+            APPEND("cmd.in.%d %llu\n", i, (unsigned long long)s->cmd_in[i]);
+        }
+    }
+    for (int i = 0; i < 256; i++) {
+        if (s->cmd_out[i]) {
+            APPEND("cmd.out.%d %llu\n", i, (unsigned long long)s->cmd_out[i]);
+        }
+    }
+    for (int i = 0; i < METRIC_HISTOGRAM_MAX; i++) {
+        APPEND("%s.count %llu\n%s.sum %llu\n%s.p50 %llu\n%s.p90 %llu\n%s.p99 %llu\n",
+               histogram_names[i], (unsigned long long)s->histograms[i].count,
+               histogram_names[i], (unsigned long long)s->histograms[i].sum,
+               histogram_names[i], (unsigned long long)metrics_percentile(s, i, 0.5),
+               histogram_names[i], (unsigned long long)metrics_percentile(s, i, 0.9),
+               histogram_names[i], (unsigned long long)metrics_percentile(s, i, 0.99));
+    }
+#undef APPEND
+    return (int)n;
+}
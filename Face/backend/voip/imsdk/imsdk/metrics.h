@@ -0,0 +1,121 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#ifndef IM_METRICS_H
+#define IM_METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+//传输层的统计, 进程内所有连接共享一份, 任意线程都可以无锁地更新
+//热路径上每次更新只有两三次relaxed的原子加法, 快照逐个读取, 不同计数器之间不保证一致
+
+enum metric_counter {
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_DECODE_ERRORS,
+    METRIC_CONNECTS,
+    METRIC_CONNECT_FAILURES,
+    METRIC_RECONNECTS,
+    METRIC_AUTHS,
+    METRIC_RESUMES,
+    METRIC_COUNTER_MAX,
+};
+
+//直方图的单位为微秒, 第0个桶为0, 第i个桶为[2^(i-1), 2^i)
+enum metric_histogram {
+    //一次socket读取的数据的解码耗时
+    METRIC_DECODE_TIME,
+    //消息从发送到收到服务器ack, 重发过的消息不统计
+    METRIC_ACK_RTT,
+    //tcp连接建立的耗时
+    METRIC_CONNECT_TIME,
+    //tcp连接建立到认证并完成首次同步
+    METRIC_AUTH_TIME,
+    //tcp连接建立到会话恢复
+    METRIC_RESUME_TIME,
+    //各优先级的数据从提交写到全部写入socket的排队时间
+    METRIC_SEND_DELAY_CONTROL,
+    METRIC_SEND_DELAY_ACK,
+    METRIC_SEND_DELAY_INTERACTIVE,
+    METRIC_SEND_DELAY_BULK,
+    METRIC_HISTOGRAM_MAX,
+};
+
+#define METRIC_BUCKETS 40
+
+//样本数在快照时由各桶累加得到, 记录一个样本只需要两次原子加法
+struct metric_histogram_data {
+    _Atomic uint64_t buckets[METRIC_BUCKETS];
+    _Atomic uint64_t sum;
+};
+
+struct metrics {
+    _Atomic uint64_t counters[METRIC_COUNTER_MAX];
+    //按命令字统计的收发消息数, 分片的消息重组之后算一条
+    _Atomic uint64_t cmd_in[256];
+    _Atomic uint64_t cmd_out[256];
+    struct metric_histogram_data histograms[METRIC_HISTOGRAM_MAX];
+};
+
+extern struct metrics im_metrics;
+
+static inline void metrics_add(int counter, uint64_t v) {
+    atomic_fetch_add_explicit(&im_metrics.counters[counter], v, memory_order_relaxed);
+}
+
+static inline void metrics_frame_in(int cmd) {
+    atomic_fetch_add_explicit(&im_metrics.cmd_in[(uint8_t)cmd], 1, memory_order_relaxed);
+}
+
+static inline void metrics_frame_out(int cmd) {
+    atomic_fetch_add_explicit(&im_metrics.cmd_out[(uint8_t)cmd], 1, memory_order_relaxed);
+}
+
+static inline int metrics_bucket(uint64_t us) {
+    int i = us ? 64 - __builtin_clzll(us) : 0;
+    return i < METRIC_BUCKETS ? i : METRIC_BUCKETS - 1;
+}
+
+static inline void metrics_observe(int histogram, uint64_t us) {
+    struct metric_histogram_data *h = &im_metrics.histograms[histogram];
+    atomic_fetch_add_explicit(&h->buckets[metrics_bucket(us)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, us, memory_order_relaxed);
+}
+
+//单调时钟(微秒)
+uint64_t metrics_now_us(void);
+
+struct metrics_snapshot {
+    uint64_t counters[METRIC_COUNTER_MAX];
+    uint64_t cmd_in[256];
+    uint64_t cmd_out[256];
+    struct {
+        uint64_t buckets[METRIC_BUCKETS];
+        uint64_t count;
+        uint64_t sum;
+    } histograms[METRIC_HISTOGRAM_MAX];
+};
+
+void metrics_snapshot(struct metrics_snapshot *s);
+//now - prev, 用于计算一段时间内的增量
+void metrics_snapshot_diff(struct metrics_snapshot *out, const struct metrics_snapshot *now,
+                           const struct metrics_snapshot *prev);
+//p取值0~1, 返回所在桶的上限(微秒), 没有样本时返回0
+uint64_t metrics_percentile(const struct metrics_snapshot *s, int histogram, double p);
+
+const char *metrics_counter_name(int counter);
+const char *metrics_histogram_name(int histogram);
+
+//每行"名字 值", 命令为cmd.in.<cmd>/cmd.out.<cmd>, 直方图为<name>.count/.sum/.p50/.p90/.p99
+//只输出非0的命令, 返回写入的长度(不含结尾的0), 和snprintf一样超出时截断
+int metrics_format(const struct metrics_snapshot *s, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,63 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#include <stdlib.h>
+#include "spsc_queue.h"
+
+int spsc_queue_init(struct spsc_queue *q, size_t capacity) {
+    size_t n = 2;
+    while (n < capacity) {
+        n <<= 1;
+    }
+    q->slots = calloc(n, sizeof(void*));
+    if (!q->slots) {
+        return -1;
+    }
+    q->mask = n - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return 0;
+}
+
+void spsc_queue_free(struct spsc_queue *q) {
+    free(q->slots);
+    q->slots = NULL;
+}
+
+int spsc_queue_push(struct spsc_queue *q, void *item) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail - head > q->mask) {
+        return -1;
+    }
+    q->slots[tail & q->mask] = item;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+void *spsc_queue_pop(struct spsc_queue *q) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head == tail) {
+        return NULL;
+    }
+    void *item = q->slots[head & q->mask];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return item;
+}
+
+size_t spsc_queue_size(struct spsc_queue *q) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    return tail - head;
+}
+
+size_t spsc_queue_capacity(const struct spsc_queue *q) {
+    return q->mask + 1;
+}
@@ -0,0 +1,36 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#ifndef IM_SPSC_QUEUE_H
+#define IM_SPSC_QUEUE_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+//单生产者单消费者的有界无锁队列, push只能在一个线程上调用, pop只能在另一个线程上调用
+struct spsc_queue {
+    void **slots;
+    size_t mask;
+    atomic_size_t head;//消费者的位置
+    atomic_size_t tail;//生产者的位置
+};
+
+//capacity向上取整为2的幂
+int spsc_queue_init(struct spsc_queue *q, size_t capacity);
+void spsc_queue_free(struct spsc_queue *q);
+
+//0:成功 -1:队列已满
+int spsc_queue_push(struct spsc_queue *q, void *item);
+//队列为空时返回NULL
+void *spsc_queue_pop(struct spsc_queue *q);
+
+size_t spsc_queue_size(struct spsc_queue *q);
+size_t spsc_queue_capacity(const struct spsc_queue *q);
+
+#endif
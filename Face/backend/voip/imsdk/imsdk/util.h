@@ -10,14 +10,32 @@
 #ifndef IM_UTIL_H
 #define IM_UTIL_H
 
-void writeInt32(int32_t v, void *p);
-int32_t readInt32(const void *p);
+#include "byteorder.h"
 
-void writeInt64(int64_t v, void *p);
-int64_t readInt64(const void *p);
+//大端整数的读写, 见byteorder.h
+static inline void writeInt32(int32_t v, void *p) {
+    store_be32(p, (uint32_t)v);
+}
 
-void writeInt16(int16_t v, void *p);
-int16_t readInt16(const void *p);
+static inline int32_t readInt32(const void *p) {
+    return (int32_t)load_be32(p);
+}
+
+static inline void writeInt64(int64_t v, void *p) {
+    store_be64(p, (uint64_t)v);
+}
+
+static inline int64_t readInt64(const void *p) {
+    return (int64_t)load_be64(p);
+}
+
+static inline void writeInt16(int16_t v, void *p) {
+    store_be16(p, (uint16_t)v);
+}
+
+static inline int16_t readInt16(const void *p) {
+    return (int16_t)load_be16(p);
+}
 
 int lookupAddr(const char *host, int port, struct sockaddr_in *addr);
 
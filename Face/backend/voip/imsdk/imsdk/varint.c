@@ -0,0 +1,41 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#include "varint.h"
+
+int varint_size(uint64_t v) {
+    int n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+uint8_t *varint_write(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+int varint_read(const uint8_t *p, int len, uint64_t *v) {
+    uint64_t r = 0;
+    int max = len < VARINT_MAX_SIZE ? len : VARINT_MAX_SIZE;
+    for (int i = 0; i < max; i++) {
+        r |= (uint64_t)(p[i] & 0x7f) << (7*i);
+        if ((p[i] & 0x80) == 0) {
+            *v = r;
+            return i + 1;
+        }
+    }
+    return 0;
+}
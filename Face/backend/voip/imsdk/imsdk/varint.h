@@ -0,0 +1,33 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#ifndef IM_VARINT_H
+#define IM_VARINT_H
+
+#include <stdint.h>
+
+//v2协议使用的LEB128变长整数, 每个字节低7位为数据, 最高位表示后面还有字节
+#define VARINT_MAX_SIZE 10
+
+int varint_size(uint64_t v);
+//返回写入之后的位置
+uint8_t *varint_write(uint8_t *p, uint64_t v);
+//返回读取的字节数, 0表示数据不完整或者超过VARINT_MAX_SIZE
+int varint_read(const uint8_t *p, int len, uint64_t *v);
+
+//有符号数先做zigzag, 使绝对值小的负数也只占很少的字节
+static inline uint64_t zigzag_encode(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+#endif
@@ -0,0 +1,868 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+//imserver的压测客户端, 模拟大量imsdk连接
+//用法: imbench [-h host] [-p port] [-c clients] [-m messages] [-w window] [-u uid] [-R rate] [-T timeout] [-B] [-S] [-V version] [-z bytes] [-L bytes]
+//  1. 连接并认证, 统计从connect到收到auth status的时间
+//  2. 每个客户端向下一个客户端发送messages条消息, 统计消息的ack延时
+//  3. 所有客户端从0开始同步, 统计同步完所有离线消息的时间
+//  4. -B 保持连接等待服务器断开(imserver -K), 按imsdk的退避策略重连, 统计重连的分布
+//     重连之后认证并同步完成才算可用, -S时用会话票据恢复, 统计从发起连接到可用的时间
+//  -R 每秒发起的连接数, 0表示同时发起全部连接
+//  -V 认证时声明支持的最高协议版本(默认1), 结束时输出收发的字节数
+//  -z 请求压缩, 不小于此长度的上行消息体用deflate压缩, 默认0不请求
+//  -L 每8条消息中有一条长度为bytes的文件消息, 超过FRAGMENT_MAX_BODY时分片发送
+//消息内容按文字, 图片, 语音, 位置混合, 和imsdk的消息格式相同
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+#include "backoff.h"
+#include "frame_deflate.h"
+#include "fragment.h"
+
+#define MAX_WINDOW 64
+#define MAX_EVENTS 256
+#define STORM_SECONDS 120
+
+//和TCPConnection相同的退避参数
+#define BACKOFF_BASE 500
+#define BACKOFF_CAP (60*1000)
+#define HEALTHY_CONNECTION (30*1000)
+
+enum {
+    PHASE_CONNECT,
+    PHASE_MESSAGE,
+    PHASE_SYNC,
+    PHASE_RECONNECT,
+    PHASE_DONE,
+};
+
+enum {
+    STATE_IDLE,
+    STATE_CONNECTING,
+    STATE_AUTHING,
+    STATE_READY,
+    STATE_FAILED,
+    STATE_WAITING,
+};
+
+struct bench_client {
+    int fd;
+    int state;
+    int64_t uid;
+    int64_t peer;
+    int32_t seq;
+    uint64_t connect_start;
+
+    int sent;
+    int acked;
+    int inflight;
+    int32_t pending_seq[MAX_WINDOW];
+    uint64_t pending_time[MAX_WINDOW];
+
+    int syncing;
+    int synced;
+    int64_t sync_key;
+    int received;
+    uint64_t sync_start;
+
+    struct frame_decoder dec;
+    struct buffer out;
+    int want_write;
+
+    struct backoff backoff;
+    uint64_t disconnect_time;
+    uint64_t next_connect;
+
+    //会话恢复
+    int64_t ticket;
+    int32_t last_seq;
+    //重连之后等待同步完成
+    int reconnect_syncing;
+    //当前连接使用的协议版本, 收到服务器的高版本帧之后升级
+    int version;
+    //服务器同意压缩之后上行帧才压缩
+    int compress;
+    struct frame_deflate deflater;
+    struct frame_inflate inflater;
+    struct fragment_arena arena;
+};
+
+struct samples {
+    uint64_t *values;
+    int count;
+    int cap;
+};
+
+static const char *host = "127.0.0.1";
+static int port = 23000;
+static int nclients = 100;
+static int nmessages = 10;
+static int window = 1;
+static int64_t base_uid = 1;
+static int rate = 0;
+static int timeout_sec = 30;
+static int storm = 0;
+static int storm_clients;
+static int resume = 0;
+static int max_version = PROTOCOL_VERSION_1;
+static int compress_threshold = 0;
+static int large_size = 0;
+static uint64_t bytes_out;
+static uint64_t bytes_in;
+//v1和v2消息体转换的临时缓冲区, 处理收到的帧时可能会发送
+static struct buffer scratch_in;
+static struct buffer scratch_out;
+static struct buffer scratch_fragment;
+//重连阶段第一个连接断开的时间
+static uint64_t storm_start;
+
+static struct bench_client *clients;
+static struct bench_client **by_fd;
+static int by_fd_len;
+static int epfd;
+static int phase;
+static int started;
+static int finished;
+static uint64_t phase_start;
+
+static struct samples connect_samples;
+static struct samples ack_samples;
+static struct samples sync_samples;
+static struct samples reconnect_samples;
+static struct samples usable_samples;
+static int resumed;
+
+//重连阶段每秒发起的连接数, 被拒绝的认证数
+static uint64_t storm_attempts[STORM_SECONDS];
+static uint64_t storm_rejects[STORM_SECONDS];
+static struct sockaddr_in server_addr;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static void sample(struct samples *s, uint64_t v) {
+    if (s->count == s->cap) {
+        s->cap = s->cap ? s->cap*2 : 1024;
+        s->values = realloc(s->values, s->cap*sizeof(uint64_t));
+    }
+    s->values[s->count++] = v;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void report(const char *name, struct samples *s, int expected) {
+    if (s->count == 0) {
+        printf("%-8s count:0/%d\n", name, expected);
+        return;
+    }
+    qsort(s->values, s->count, sizeof(uint64_t), compare_u64);
+    #define PCT(p) ((double)s->values[(int)((s->count - 1)*(p))]/1000.0)
+    printf("%-8s count:%d/%d p50:%.2fms p90:%.2fms p99:%.2fms max:%.2fms\n",
+           name, s->count, expected, PCT(0.5), PCT(0.9), PCT(0.99), PCT(1.0));
+    #undef PCT
+}
+
+static void update_events(struct bench_client *c) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (c->want_write ? EPOLLOUT : 0);
+    ev.data.fd = c->fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void storm_count(uint64_t *counter) {
+    uint64_t sec = (now_us() - storm_start)/1000000;
+    if (sec < STORM_SECONDS) {
+        counter[sec]++;
+    }
+}
+
+static void close_client(struct bench_client *c) {
+    if (c->fd >= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        by_fd[c->fd] = NULL;
+        c->fd = -1;
+    }
+    frame_decoder_free(&c->dec);
+    frame_decoder_init(&c->dec);
+    frame_deflate_reset(&c->deflater);
+    frame_inflate_reset(&c->inflater);
+    fragment_arena_reset(&c->arena);
+    c->compress = 0;
+    buffer_consume(&c->out, buffer_size(&c->out));
+    c->want_write = 0;
+}
+
+//重连阶段断开之后按退避策略等待重连
+static void schedule_reconnect(struct bench_client *c) {
+    uint64_t now = now_us();
+    close_client(c);
+    backoff_disconnected(&c->backoff, (int64_t)(now/1000));
+    if (c->disconnect_time == 0) {
+        c->disconnect_time = now;
+    }
+    if (storm_start == 0) {
+        storm_start = now;
+    }
+    c->next_connect = now + (uint64_t)backoff_next(&c->backoff)*1000;
+    c->state = STATE_WAITING;
+}
+
+static void fail(struct bench_client *c) {
+    if (c->state == STATE_FAILED || c->state == STATE_WAITING) {
+        return;
+    }
+    if (phase == PHASE_RECONNECT) {
+        schedule_reconnect(c);
+        return;
+    }
+    if (c->state == STATE_CONNECTING || c->state == STATE_AUTHING) {
+        finished++;
+    }
+    c->state = STATE_FAILED;
+    if (c->fd >= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        by_fd[c->fd] = NULL;
+        c->fd = -1;
+    }
+}
+
+static void flush(struct bench_client *c) {
+    while (buffer_size(&c->out) > 0) {
+        ssize_t n = write(c->fd, buffer_data(&c->out), buffer_size(&c->out));
+        if (n > 0) {
+            bytes_out += n;
+            buffer_consume(&c->out, n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            break;
+        } else {
+            fail(c);
+            return;
+        }
+    }
+    int want_write = buffer_size(&c->out) > 0;
+    if (want_write != c->want_write) {
+        c->want_write = want_write;
+        update_events(c);
+    }
+}
+
+static int32_t send_wire(struct bench_client *c, struct im_header *h, const void *body, int len);
+
+//body都是v1格式, 按连接的协议版本转换, 返回的seq为最后一个分片的seq
+static int32_t send_frame(struct bench_client *c, int cmd, const void *body, int len) {
+    struct im_header h = {0, (uint8_t)cmd, (uint8_t)c->version, 0};
+    if (cmd == MSG_AUTH_TOKEN || cmd == MSG_RESUME) {
+        //两个版本的布局相同, 帧头带上支持的最高版本和是否支持压缩
+        h.version = (uint8_t)max_version;
+        h.flags = compress_threshold > 0 ? FRAME_FLAG_DEFLATE : 0;
+    }
+    if (h.version >= PROTOCOL_VERSION_2) {
+        uint8_t *p = buffer_reserve(&scratch_out, len + IM_V2_SLACK);
+        len = im_body_to_v2(cmd, body, len, c->uid, p);
+        body = p;
+    }
+    if (len <= FRAGMENT_MAX_BODY) {
+        return send_wire(c, &h, body, len);
+    }
+    int count = fragment_count(len);
+    uint8_t *p = buffer_reserve(&scratch_fragment, FRAGMENT_HEAD_SIZE + FRAGMENT_MAX_BODY);
+    h.cmd = MSG_FRAGMENT;
+    for (int i = 0; i < count; i++) {
+        int n = fragment_encode(p, cmd, body, len, i);
+        h.flags = 0;
+        send_wire(c, &h, p, n);
+    }
+    return h.seq;
+}
+
+static int32_t send_wire(struct bench_client *c, struct im_header *h, const void *body, int len) {
+    h->seq = ++c->seq;
+    if (c->compress && len >= compress_threshold) {
+        const uint8_t *out;
+        int n = frame_deflate_body(&c->deflater, body, len, &out);
+        if (n < 0) {
+            fprintf(stderr, "deflate error\n");
+            exit(1);
+        }
+        h->flags |= FRAME_FLAG_COMPRESSED;
+        body = out;
+        len = n;
+    }
+    im_write_frame(&c->out, h, body, len);
+    return h->seq;
+}
+
+static void send_auth(struct bench_client *c) {
+    char token[32];
+    uint8_t body[64];
+    struct im_auth auth;
+    snprintf(token, sizeof(token), "%lld", (long long)c->uid);
+    auth.platform = 1;
+    auth.token = token;
+    auth.token_len = (int)strlen(token);
+    auth.device = "imbench";
+    auth.device_len = 7;
+    int len = im_encode_auth(body, &auth);
+    send_frame(c, MSG_AUTH_TOKEN, body, len);
+}
+
+static void send_resume(struct bench_client *c) {
+    uint8_t body[IM_RESUME_SIZE];
+    struct im_resume r;
+    r.ticket = c->ticket;
+    r.last_seq = c->last_seq;
+    r.sync_key = c->sync_key;
+    send_frame(c, MSG_RESUME, body, im_encode_resume(body, &r));
+}
+
+static int message_content(struct bench_client *c, int i, char *buf, int size) {
+    if (large_size > 0 && i % 8 == 4) {
+        int n = snprintf(buf, size, "{\"file\":{\"name\":\"%lld_%d.bin\",\"data\":\"", (long long)c->uid, i);
+        while (n < large_size - 3 && n < size - 4) {
+            buf[n] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[(n*7 + i) % 64];
+            n++;
+        }
+        return n + snprintf(buf + n, size - n, "\"}}");
+    }
+    switch (i % 8) {
+    case 5:
+        return snprintf(buf, size, "{\"image2\":{\"url\":\"http://api.gobelieve.io/images/%lld_%d.jpg\","
+                        "\"width\":%d,\"height\":%d}}", (long long)c->uid, i, 640 + i % 7*10, 1136 - i % 5*10);
+    case 6:
+        return snprintf(buf, size, "{\"audio\":{\"url\":\"http://api.gobelieve.io/audios/%lld_%d.amr\","
+                        "\"duration\":%d}}", (long long)c->uid, i, 1 + i % 59);
+    case 7:
+        return snprintf(buf, size, "{\"location\":{\"latitude\":%.6f,\"longitude\":%.6f}}",
+                        30.2 + (c->uid % 100)*0.001 + i*0.0001, 120.1 + (c->uid % 77)*0.001);
+    default:
+        return snprintf(buf, size, "{\"text\":\"bench message %d from %lld to %lld\"}",
+                        i, (long long)c->uid, (long long)c->peer);
+    }
+}
+
+static void send_messages(struct bench_client *c) {
+    static uint8_t *body;
+    static char *content;
+    int size = 256 + large_size;
+    if (!content) {
+        body = malloc(size + 64);
+        content = malloc(size);
+    }
+    while (c->sent < nmessages && c->inflight < window) {
+        struct im_message m;
+        int n = message_content(c, c->sent, content, size);
+        m.sender = c->uid;
+        m.receiver = c->peer;
+        m.timestamp = (int32_t)time(NULL);
+        m.msg_local_id = c->sent + 1;
+        m.content = content;
+        m.content_len = n;
+        int len = im_encode_message(body, &m);
+        int32_t seq = send_frame(c, MSG_IM, body, len);
+        c->pending_seq[c->inflight] = seq;
+        c->pending_time[c->inflight] = now_us();
+        c->inflight++;
+        c->sent++;
+    }
+}
+
+static void send_sync(struct bench_client *c) {
+    uint8_t body[8];
+    put64(body, c->sync_key);
+    send_frame(c, MSG_SYNC, body, 8);
+    c->syncing = 1;
+}
+
+static void on_ack(struct bench_client *c, int32_t seq) {
+    for (int i = 0; i < c->inflight; i++) {
+        if (c->pending_seq[i] != seq) {
+            continue;
+        }
+        sample(&ack_samples, now_us() - c->pending_time[i]);
+        c->inflight--;
+        c->pending_seq[i] = c->pending_seq[c->inflight];
+        c->pending_time[i] = c->pending_time[c->inflight];
+        c->acked++;
+        if (c->acked == nmessages) {
+            finished++;
+        }
+        send_messages(c);
+        return;
+    }
+}
+
+//重连之后可以收发消息
+static void on_usable(struct bench_client *c) {
+    uint64_t now = now_us();
+    sample(&reconnect_samples, now - c->disconnect_time);
+    sample(&usable_samples, now - c->connect_start);
+    c->disconnect_time = 0;
+    c->reconnect_syncing = 0;
+    c->state = STATE_READY;
+    finished++;
+}
+
+static void handle_frame(struct bench_client *c, const struct frame_view *v) {
+    struct im_header h;
+    im_decode_header(v->head, &h);
+    int32_t v32;
+    int64_t v64;
+    struct im_session_ticket ticket;
+
+    //下面都按v1处理
+    struct frame_view v1 = *v;
+    const struct frame_view *frame = &v1;
+    if (h.version > c->version) {
+        c->version = h.version;
+    }
+    if (h.flags & FRAME_FLAG_DEFLATE) {
+        c->compress = compress_threshold > 0;
+    }
+    if (h.flags & FRAME_FLAG_COMPRESSED) {
+        v1.body_len = frame_inflate_body(&c->inflater, v->body, v->body_len, &v1.body);
+        if (v1.body_len < 0) {
+            fail(c);
+            return;
+        }
+    }
+    if (h.cmd == MSG_FRAGMENT) {
+        int r = fragment_arena_add(&c->arena, v1.body, v1.body_len);
+        if (r < 0) {
+            fail(c);
+            return;
+        } else if (r == 0) {
+            return;
+        }
+        h.cmd = (uint8_t)c->arena.cmd;
+        v1.body = c->arena.buf;
+        v1.body_len = c->arena.total;
+    }
+    if (h.version >= PROTOCOL_VERSION_2) {
+        uint8_t *p = buffer_reserve(&scratch_in, v1.body_len + IM_V2_SLACK);
+        v1.body_len = im_body_from_v2(h.cmd, v1.body, v1.body_len, c->uid, p);
+        v1.body = p;
+        if (v1.body_len < 0) {
+            fail(c);
+            return;
+        }
+    }
+
+    if (h.seq > c->last_seq) {
+        c->last_seq = h.seq;
+    }
+
+    switch (h.cmd) {
+    case MSG_AUTH_STATUS:
+        if (im_decode_int32(frame->body, frame->body_len, &v32) < 0 || v32 != 0) {
+            //服务器过载时带有建议的重连间隔(秒)
+            if (frame->body_len >= 8) {
+                backoff_retry_after(&c->backoff, get32(frame->body + 4)*1000);
+            }
+            if (phase == PHASE_RECONNECT) {
+                storm_count(storm_rejects);
+            }
+            fail(c);
+            return;
+        }
+        backoff_connected(&c->backoff, (int64_t)(now_us()/1000));
+        if (phase == PHASE_RECONNECT) {
+            //完整的重连需要重新同步
+            c->reconnect_syncing = 1;
+            send_sync(c);
+            break;
+        }
+        sample(&connect_samples, now_us() - c->connect_start);
+        c->state = STATE_READY;
+        finished++;
+        break;
+    case MSG_SESSION_TICKET:
+        if (im_decode_session_ticket(frame->body, frame->body_len, &ticket) == 0) {
+            c->ticket = ticket.ticket;
+        }
+        break;
+    case MSG_RESUME_STATUS:
+        if (im_decode_int32(frame->body, frame->body_len, &v32) < 0 || v32 != 0) {
+            //票据失效, 退回到完整的认证
+            c->ticket = 0;
+            c->last_seq = 0;
+            send_auth(c);
+            break;
+        }
+        backoff_connected(&c->backoff, (int64_t)(now_us()/1000));
+        resumed++;
+        on_usable(c);
+        break;
+    case MSG_ACK:
+        if (im_decode_int32(frame->body, frame->body_len, &v32) == 0) {
+            on_ack(c, v32);
+        }
+        break;
+    case MSG_IM: {
+        uint8_t ack[4];
+        put32(ack, h.seq);
+        send_frame(c, MSG_ACK, ack, 4);
+        if (c->syncing) {
+            c->received++;
+        }
+        break;
+    }
+    case MSG_SYNC_END:
+        if (im_decode_int64(frame->body, frame->body_len, &v64) < 0) {
+            break;
+        }
+        c->syncing = 0;
+        if (v64 > c->sync_key) {
+            c->sync_key = v64;
+        }
+        if (c->reconnect_syncing) {
+            on_usable(c);
+            break;
+        }
+        if (phase == PHASE_SYNC && !c->synced && c->received >= nmessages) {
+            c->synced = 1;
+            sample(&sync_samples, now_us() - c->sync_start);
+            finished++;
+        }
+        break;
+    case MSG_SYNC_NOTIFY:
+        //只在同步阶段跟随notify继续同步
+        if (phase == PHASE_SYNC && !c->syncing && !c->synced &&
+            im_decode_int64(frame->body, frame->body_len, &v64) == 0 && v64 > c->sync_key) {
+            send_sync(c);
+        }
+        break;
+    case MSG_VOIP_CONTROL:
+    case MSG_PONG:
+    default:
+        break;
+    }
+}
+
+static void on_read(struct bench_client *c) {
+    char buf[64*1024];
+    ssize_t n = read(c->fd, buf, sizeof(buf));
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return;
+    }
+    if (n <= 0 || frame_decoder_append(&c->dec, buf, n) < 0) {
+        fail(c);
+        return;
+    }
+    bytes_in += n;
+    struct frame_view frame;
+    int r;
+    while (c->state != STATE_FAILED && (r = frame_decoder_next(&c->dec, &frame)) != 0) {
+        if (r < 0) {
+            fail(c);
+            return;
+        }
+        handle_frame(c, &frame);
+    }
+    if (c->state != STATE_FAILED) {
+        flush(c);
+    }
+}
+
+static void on_connected(struct bench_client *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err) {
+        fail(c);
+        return;
+    }
+    c->state = STATE_AUTHING;
+    c->version = PROTOCOL_VERSION_1;
+    if (resume && c->ticket) {
+        send_resume(c);
+    } else {
+        c->last_seq = 0;
+        send_auth(c);
+    }
+    flush(c);
+}
+
+static void start_connect(struct bench_client *c, const struct sockaddr_in *addr) {
+    c->connect_start = now_us();
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0) {
+        if (errno == EMFILE || errno == ENFILE) {
+            fprintf(stderr, "socket: %s, raise ulimit -n\n", strerror(errno));
+        }
+        c->state = STATE_CONNECTING;
+        fail(c);
+        return;
+    }
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (c->fd >= by_fd_len) {
+        int n = by_fd_len ? by_fd_len : 1024;
+        while (n <= c->fd) {
+            n *= 2;
+        }
+        by_fd = realloc(by_fd, n*sizeof(struct bench_client*));
+        memset(by_fd + by_fd_len, 0, (n - by_fd_len)*sizeof(struct bench_client*));
+        by_fd_len = n;
+    }
+    by_fd[c->fd] = c;
+    c->state = STATE_CONNECTING;
+    c->want_write = 1;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.fd = c->fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+
+    int r = connect(c->fd, (const struct sockaddr*)addr, sizeof(*addr));
+    if (r < 0 && errno != EINPROGRESS) {
+        fail(c);
+    }
+}
+
+//到时间的客户端重新连接
+static void run_reconnect(void) {
+    uint64_t now = now_us();
+    for (int i = 0; i < nclients; i++) {
+        struct bench_client *c = &clients[i];
+        if (c->state == STATE_WAITING && c->next_connect <= now) {
+            storm_count(storm_attempts);
+            start_connect(c, &server_addr);
+        }
+    }
+}
+
+static void report_storm(void) {
+    int last = 0;
+    for (int i = 0; i < STORM_SECONDS; i++) {
+        if (storm_attempts[i] || storm_rejects[i]) {
+            last = i;
+        }
+    }
+    for (int i = 0; i <= last; i++) {
+        printf("  %3ds connects:%llu rejected:%llu\n", i,
+               (unsigned long long)storm_attempts[i], (unsigned long long)storm_rejects[i]);
+    }
+}
+
+static void enter_phase(int p);
+
+//-B时保持连接等待服务器断开, 否则结束
+static void enter_storm(int ready) {
+    if (!storm) {
+        phase = PHASE_DONE;
+        return;
+    }
+    storm_clients = ready;
+    printf("waiting for server to drop %d clients\n", storm_clients);
+    fflush(stdout);
+    enter_phase(PHASE_RECONNECT);
+}
+
+static void enter_phase(int p) {
+    phase = p;
+    finished = 0;
+    phase_start = now_us();
+    for (int i = 0; i < nclients; i++) {
+        struct bench_client *c = &clients[i];
+        if (c->state != STATE_READY) {
+            continue;
+        }
+        if (p == PHASE_MESSAGE) {
+            send_messages(c);
+        } else if (p == PHASE_SYNC) {
+            c->sync_start = now_us();
+            c->received = 0;
+            send_sync(c);
+        }
+        flush(c);
+    }
+}
+
+static int ready_count(void) {
+    int n = 0;
+    for (int i = 0; i < nclients; i++) {
+        if (clients[i].state == STATE_READY) {
+            n++;
+        }
+    }
+    return n;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:m:w:u:R:T:BSV:z:L:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': nclients = atoi(optarg); break;
+        case 'm': nmessages = atoi(optarg); break;
+        case 'w': window = atoi(optarg); break;
+        case 'u': base_uid = atoll(optarg); break;
+        case 'R': rate = atoi(optarg); break;
+        case 'T': timeout_sec = atoi(optarg); break;
+        case 'B': storm = 1; break;
+        case 'S': resume = 1; break;
+        case 'V': max_version = atoi(optarg); break;
+        case 'z': compress_threshold = atoi(optarg); break;
+        case 'L': large_size = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-h host] [-p port] [-c clients] [-m messages] [-w window] [-u uid] [-R rate] [-T timeout] [-B] [-S] [-V version] [-z bytes]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nclients < 2 || window < 1 || window > MAX_WINDOW) {
+        fprintf(stderr, "clients must be >= 2, window must be in [1, %d]\n", MAX_WINDOW);
+        return 1;
+    }
+    if (max_version < PROTOCOL_VERSION_1 || max_version > PROTOCOL_MAX_VERSION) {
+        fprintf(stderr, "version must be in [%d, %d]\n", PROTOCOL_VERSION_1, PROTOCOL_MAX_VERSION);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "invalid host:%s\n", host);
+        return 1;
+    }
+
+    server_addr = addr;
+
+    epfd = epoll_create1(0);
+    clients = calloc(nclients, sizeof(struct bench_client));
+    for (int i = 0; i < nclients; i++) {
+        struct bench_client *c = &clients[i];
+        c->fd = -1;
+        c->uid = base_uid + i;
+        c->peer = base_uid + (i + 1) % nclients;
+        frame_decoder_init(&c->dec);
+        buffer_init(&c->out);
+        frame_deflate_init(&c->deflater, FRAME_DEFLATE_LEVEL);
+        frame_inflate_init(&c->inflater);
+        fragment_arena_init(&c->arena, 0);
+        backoff_init(&c->backoff, BACKOFF_BASE, BACKOFF_CAP, HEALTHY_CONNECTION,
+                     (uint32_t)(time(NULL) ^ (c->uid*2654435761u)));
+    }
+
+    phase = PHASE_CONNECT;
+    phase_start = now_us();
+    uint64_t bench_start = phase_start;
+    struct epoll_event events[MAX_EVENTS];
+    while (phase != PHASE_DONE) {
+        uint64_t now = now_us();
+        //按照速率发起连接
+        int target = nclients;
+        if (phase == PHASE_CONNECT && rate > 0) {
+            target = (int)((now - bench_start)*rate/1000000) + 1;
+            target = target < nclients ? target : nclients;
+        }
+        while (phase == PHASE_CONNECT && started < target) {
+            start_connect(&clients[started++], &addr);
+        }
+        if (phase == PHASE_RECONNECT) {
+            run_reconnect();
+        }
+
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 10);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            struct bench_client *c = fd < by_fd_len ? by_fd[fd] : NULL;
+            if (!c) {
+                continue;
+            }
+            if (c->state == STATE_CONNECTING) {
+                if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+                    on_connected(c);
+                }
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                on_read(c);
+            }
+            if (c->state != STATE_FAILED && c->state != STATE_WAITING &&
+                (events[i].events & EPOLLOUT)) {
+                flush(c);
+            }
+        }
+
+        int ready = ready_count();
+        int expected = phase == PHASE_CONNECT ? nclients : ready;
+        if (phase == PHASE_RECONNECT) {
+            expected = storm_clients;
+        }
+        int timeout = now_us() - phase_start > (uint64_t)timeout_sec*1000000;
+        if (finished < expected && !timeout) {
+            continue;
+        }
+        if (timeout) {
+            printf("phase %d timeout, finished:%d/%d\n", phase, finished, expected);
+        }
+        if (phase == PHASE_CONNECT) {
+            printf("connect: %d/%d clients in %.2fms\n", ready, nclients,
+                   (double)(now_us() - phase_start)/1000.0);
+            if (nmessages > 0) {
+                enter_phase(PHASE_MESSAGE);
+            } else {
+                enter_storm(ready);
+            }
+        } else if (phase == PHASE_MESSAGE) {
+            printf("message: %d messages in %.2fms\n", ack_samples.count,
+                   (double)(now_us() - phase_start)/1000.0);
+            enter_phase(PHASE_SYNC);
+        } else if (phase == PHASE_SYNC) {
+            printf("sync: %d/%d clients in %.2fms\n", sync_samples.count, ready,
+                   (double)(now_us() - phase_start)/1000.0);
+            enter_storm(ready);
+        } else {
+            printf("reconnect: %d/%d clients in %.2fms, resumed:%d\n", reconnect_samples.count,
+                   storm_clients, (double)(now_us() - phase_start)/1000.0, resumed);
+            report_storm();
+            phase = PHASE_DONE;
+        }
+    }
+
+    report("connect", &connect_samples, nclients);
+    report("ack", &ack_samples, nclients*nmessages);
+    report("sync", &sync_samples, nclients);
+    if (storm) {
+        report("reconnect", &reconnect_samples, storm_clients);
+        report("usable", &usable_samples, storm_clients);
+    }
+    printf("bytes version:%d out:%llu in:%llu\n", max_version,
+           (unsigned long long)bytes_out, (unsigned long long)bytes_in);
+    return 0;
+}
@@ -0,0 +1,297 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+//按命令统计v2协议和压缩节省的字节数
+//用法: imcodec [-V version] [-z bytes] [-l level] dump...
+//  dump为imserver -D保存的语料, 每条记录为uid(8) dir(1) cmd(1) len(4) v1消息体
+//  每条消息体转换成v2再转换回来, 和原始数据不一致时计入errors
+//  帧的长度和帧头(12字节)两个版本相同, 计入frame列, body列只统计消息体
+//  之后按连接和方向模拟deflate流, 压缩-V版本(默认2)不小于-z字节(默认32)的消息体,
+//  统计压缩之后的字节数和压缩/解压的cpu时间, 解压结果不一致时计入errors
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "protocol.h"
+#include "frame_deflate.h"
+
+#define STREAM_BUCKETS 4096
+
+struct codec_stats {
+    uint64_t count;
+    uint64_t v1;
+    uint64_t v2;
+    uint64_t errors;
+};
+
+struct deflate_stats {
+    uint64_t count;
+    uint64_t compressed;
+    uint64_t in;
+    uint64_t out;
+    uint64_t errors;
+};
+
+//一个连接一个方向的压缩流, 和imserver/imsdk一样两端各有一个
+struct stream {
+    int64_t uid;
+    int dir;
+    struct frame_deflate deflater;
+    struct frame_inflate inflater;
+    struct stream *next;
+};
+
+static struct codec_stats stats[256];
+static struct deflate_stats deflate_stats[256];
+static struct stream *streams[STREAM_BUCKETS];
+static int version = PROTOCOL_VERSION_2;
+static int threshold = FRAME_DEFLATE_THRESHOLD;
+static int level = FRAME_DEFLATE_LEVEL;
+static uint64_t deflate_ns;
+static uint64_t inflate_ns;
+
+static uint64_t cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static struct stream *stream_get(int64_t uid, int dir) {
+    int b = (int)(((uint64_t)uid*2 + dir) % STREAM_BUCKETS);
+    for (struct stream *s = streams[b]; s; s = s->next) {
+        if (s->uid == uid && s->dir == dir) {
+            return s;
+        }
+    }
+    struct stream *s = calloc(1, sizeof(struct stream));
+    s->uid = uid;
+    s->dir = dir;
+    frame_deflate_init(&s->deflater, level);
+    frame_inflate_init(&s->inflater);
+    s->next = streams[b];
+    streams[b] = s;
+    return s;
+}
+
+//body为线上的消息体(-V版本)
+static void account_deflate(int64_t uid, int dir, int cmd, const uint8_t *body, int len) {
+    struct deflate_stats *s = &deflate_stats[cmd];
+    s->count++;
+    s->in += len;
+    if (len < threshold) {
+        s->out += len;
+        return;
+    }
+    struct stream *st = stream_get(uid, dir);
+    const uint8_t *out;
+    uint64_t t = cpu_ns();
+    int n = frame_deflate_body(&st->deflater, body, len, &out);
+    deflate_ns += cpu_ns() - t;
+    if (n < 0) {
+        s->errors++;
+        s->out += len;
+        return;
+    }
+    s->compressed++;
+    s->out += n;
+    t = cpu_ns();
+    int m = frame_inflate_body(&st->inflater, out, n, &out);
+    inflate_ns += cpu_ns() - t;
+    if (m != len || memcmp(out, body, len) != 0) {
+        s->errors++;
+    }
+}
+
+static const char *command_name(int cmd) {
+    switch (cmd) {
+    case MSG_AUTH_STATUS: return "auth_status";
+    case MSG_IM: return "im";
+    case MSG_ACK: return "ack";
+    case MSG_GROUP_NOTIFICATION: return "group_notification";
+    case MSG_GROUP_IM: return "group_im";
+    case MSG_INPUTING: return "inputing";
+    case MSG_PING: return "ping";
+    case MSG_PONG: return "pong";
+    case MSG_AUTH_TOKEN: return "auth_token";
+    case MSG_RT: return "rt";
+    case MSG_ENTER_ROOM: return "enter_room";
+    case MSG_LEAVE_ROOM: return "leave_room";
+    case MSG_ROOM_IM: return "room_im";
+    case MSG_SYSTEM: return "system";
+    case MSG_UNREAD_COUNT: return "unread_count";
+    case MSG_CUSTOMER: return "customer";
+    case MSG_CUSTOMER_SUPPORT: return "customer_support";
+    case MSG_SYNC: return "sync";
+    case MSG_SYNC_BEGIN: return "sync_begin";
+    case MSG_SYNC_END: return "sync_end";
+    case MSG_SYNC_NOTIFY: return "sync_notify";
+    case MSG_SYNC_GROUP: return "sync_group";
+    case MSG_SYNC_GROUP_BEGIN: return "sync_group_begin";
+    case MSG_SYNC_GROUP_END: return "sync_group_end";
+    case MSG_SYNC_GROUP_NOTIFY: return "sync_group_notify";
+    case MSG_SESSION_TICKET: return "session_ticket";
+    case MSG_RESUME: return "resume";
+    case MSG_RESUME_STATUS: return "resume_status";
+    case MSG_VOIP_CONTROL: return "voip_control";
+    default: return "unknown";
+    }
+}
+
+static void account(int64_t uid, int dir, int cmd, const uint8_t *body, int len, struct buffer *v2, struct buffer *v1) {
+    struct codec_stats *s = &stats[cmd];
+    uint8_t *p2 = buffer_reserve(v2, len + IM_V2_SLACK);
+    int len2 = im_body_to_v2(cmd, body, len, uid, p2);
+    s->count++;
+    s->v1 += len;
+    if (len2 < 0) {
+        //v1消息体不完整, 按原样计算
+        s->v2 += len;
+        s->errors++;
+        account_deflate(uid, dir, cmd, body, len);
+        return;
+    }
+    s->v2 += len2;
+    if (version >= PROTOCOL_VERSION_2) {
+        account_deflate(uid, dir, cmd, p2, len2);
+    } else {
+        account_deflate(uid, dir, cmd, body, len);
+    }
+    uint8_t *p1 = buffer_reserve(v1, len2 + IM_V2_SLACK);
+    int len1 = im_body_from_v2(cmd, p2, len2, uid, p1);
+    if (len1 != len || memcmp(p1, body, len) != 0) {
+        s->errors++;
+    }
+}
+
+static int load(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    struct buffer body, v2, v1;
+    buffer_init(&body);
+    buffer_init(&v2);
+    buffer_init(&v1);
+    uint8_t head[14];
+    int r = 0;
+    while (fread(head, 1, sizeof(head), f) == sizeof(head)) {
+        int len = get32(head + 10);
+        if (len < 0 || len > 16*1024*1024) {
+            fprintf(stderr, "%s: invalid record length:%d\n", path, len);
+            r = -1;
+            break;
+        }
+        uint8_t *p = buffer_reserve(&body, len);
+        if (fread(p, 1, len, f) != (size_t)len) {
+            fprintf(stderr, "%s: truncated record\n", path);
+            r = -1;
+            break;
+        }
+        account(get64(head), head[8], head[9], p, len, &v2, &v1);
+    }
+    buffer_free(&body);
+    buffer_free(&v2);
+    buffer_free(&v1);
+    fclose(f);
+    return r;
+}
+
+static double saving(uint64_t v1, uint64_t v2) {
+    return v1 ? 100.0*((double)v1 - (double)v2)/(double)v1 : 0;
+}
+
+static uint64_t report_deflate(void) {
+    struct deflate_stats total = {0, 0, 0, 0, 0};
+    printf("\ndeflate v%d bodies, threshold:%d level:%d\n", version, threshold, level);
+    printf("%-18s %9s %10s %12s %12s %7s %6s\n", "command", "count", "compressed",
+           "body", "deflated", "saved", "errors");
+    for (int cmd = 0; cmd < 256; cmd++) {
+        struct deflate_stats *s = &deflate_stats[cmd];
+        if (s->count == 0) {
+            continue;
+        }
+        printf("%-18s %9llu %10llu %12llu %12llu %6.1f%% %6llu\n",
+               command_name(cmd), (unsigned long long)s->count, (unsigned long long)s->compressed,
+               (unsigned long long)s->in, (unsigned long long)s->out, saving(s->in, s->out),
+               (unsigned long long)s->errors);
+        total.count += s->count;
+        total.compressed += s->compressed;
+        total.in += s->in;
+        total.out += s->out;
+        total.errors += s->errors;
+    }
+    printf("%-18s %9llu %10llu %12llu %12llu %6.1f%% %6llu\n", "total",
+           (unsigned long long)total.count, (unsigned long long)total.compressed,
+           (unsigned long long)total.in, (unsigned long long)total.out, saving(total.in, total.out),
+           (unsigned long long)total.errors);
+    uint64_t saved = total.in - total.out;
+    printf("cpu deflate:%.2fms inflate:%.2fms, %.1fns/frame %.1fns/frame, saved %.0f bytes per cpu ms\n",
+           deflate_ns/1e6, inflate_ns/1e6,
+           total.compressed ? (double)deflate_ns/total.compressed : 0,
+           total.compressed ? (double)inflate_ns/total.compressed : 0,
+           deflate_ns + inflate_ns ? saved/((deflate_ns + inflate_ns)/1e6) : 0);
+    return total.errors;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "V:z:l:")) != -1) {
+        switch (opt) {
+        case 'V': version = atoi(optarg); break;
+        case 'z': threshold = atoi(optarg); break;
+        case 'l': level = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-V version] [-z bytes] [-l level] dump...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-V version] [-z bytes] [-l level] dump...\n", argv[0]);
+        return 1;
+    }
+    for (int i = optind; i < argc; i++) {
+        if (load(argv[i]) < 0) {
+            return 1;
+        }
+    }
+
+    const uint64_t head = FRAME_LENGTH_SIZE + FRAME_HEAD_SIZE;
+    struct codec_stats total = {0, 0, 0, 0};
+    printf("%-18s %9s %12s %12s %7s %12s %12s %7s %6s\n", "command", "count",
+           "body v1", "body v2", "saved", "frame v1", "frame v2", "saved", "errors");
+    for (int cmd = 0; cmd < 256; cmd++) {
+        struct codec_stats *s = &stats[cmd];
+        if (s->count == 0) {
+            continue;
+        }
+        uint64_t f1 = s->v1 + s->count*head;
+        uint64_t f2 = s->v2 + s->count*head;
+        printf("%-18s %9llu %12llu %12llu %6.1f%% %12llu %12llu %6.1f%% %6llu\n",
+               command_name(cmd), (unsigned long long)s->count,
+               (unsigned long long)s->v1, (unsigned long long)s->v2, saving(s->v1, s->v2),
+               (unsigned long long)f1, (unsigned long long)f2, saving(f1, f2),
+               (unsigned long long)s->errors);
+        total.count += s->count;
+        total.v1 += s->v1;
+        total.v2 += s->v2;
+        total.errors += s->errors;
+    }
+    uint64_t f1 = total.v1 + total.count*head;
+    uint64_t f2 = total.v2 + total.count*head;
+    printf("%-18s %9llu %12llu %12llu %6.1f%% %12llu %12llu %6.1f%% %6llu\n", "total",
+           (unsigned long long)total.count,
+           (unsigned long long)total.v1, (unsigned long long)total.v2, saving(total.v1, total.v2),
+           (unsigned long long)f1, (unsigned long long)f2, saving(f1, f2),
+           (unsigned long long)total.errors);
+    uint64_t errors = total.errors + report_deflate();
+    return errors ? 2 : 0;
+}
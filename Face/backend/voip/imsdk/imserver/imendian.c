@@ -0,0 +1,278 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+//byteorder.h和原来util.c中大端读写函数的对比
+//用法: imendian [-n records] [-r rounds] [-f iterations]
+//  1. 随机值经过store/load往返, 和逐字节的参考实现比较, 不一致时计入errors
+//  2. 编解码n条定长记录(im消息头: sender(8) receiver(8) timestamp(4) msgLocalID(4))r轮,
+//     分别使用原来的函数, 内联函数逐字段和批量解码, 输出每条记录的耗时
+//  3. 解码n组(gid(8), sync key(8)), 对比逐字段和批量解码
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "byteorder.h"
+
+#define RECORD_SIZE 24
+
+//原来util.c中的实现, noinline保持原来跨编译单元调用的开销, 只去掉了有符号数左移溢出
+static int64_t legacy_ntoh64(int64_t val) {
+    int64_t high, low;
+    low = (int64_t)(val & 0x00000000FFFFFFFF);
+    val >>= 32;
+    high = (int64_t)(val & 0x00000000FFFFFFFF);
+    low = ntohl(low);
+    high = ntohl(high);
+    return (int64_t)((uint64_t)low << 32 | (uint64_t)high);
+}
+
+__attribute__((noinline)) static void legacy_writeInt32(int32_t v, void *p) {
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+__attribute__((noinline)) static int32_t legacy_readInt32(const void *p) {
+    int32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+__attribute__((noinline)) static void legacy_writeInt64(int64_t v, void *p) {
+    v = legacy_ntoh64(v);
+    memcpy(p, &v, 8);
+}
+
+__attribute__((noinline)) static int64_t legacy_readInt64(const void *p) {
+    int64_t v;
+    memcpy(&v, p, 8);
+    return legacy_ntoh64(v);
+}
+
+struct record {
+    int64_t sender;
+    int64_t receiver;
+    int32_t timestamp;
+    int32_t msg_local_id;
+};
+
+static uint64_t cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static uint64_t rand64(void) {
+    uint64_t v = 0;
+    for (int i = 0; i < 4; i++) {
+        v = (v << 16) ^ (uint64_t)(rand() & 0xffff);
+    }
+    //多取一些边界值
+    switch (rand() % 8) {
+    case 0: return 0;
+    case 1: return ~(uint64_t)0;
+    case 2: return (uint64_t)1 << (rand() % 64);
+    case 3: return v & 0xffffffff;
+    default: return v;
+    }
+}
+
+static void ref_store(uint8_t *p, uint64_t v, int n) {
+    for (int i = n - 1; i >= 0; i--) {
+        p[i] = (uint8_t)v;
+        v >>= 8;
+    }
+}
+
+static uint64_t ref_load(const uint8_t *p, int n) {
+    uint64_t v = 0;
+    for (int i = 0; i < n; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static uint64_t fuzz(int iterations) {
+    uint64_t errors = 0;
+    uint8_t buf[8 + 64*8], ref[8];
+    uint64_t in[64], out[64];
+    uint32_t in32[64], out32[64];
+    for (int i = 0; i < iterations; i++) {
+        uint64_t v = rand64();
+        //非对齐的地址
+        uint8_t *p = buf + rand() % 8;
+
+        store_be16(p, (uint16_t)v);
+        ref_store(ref, (uint16_t)v, 2);
+        errors += memcmp(p, ref, 2) != 0 || load_be16(p) != (uint16_t)v;
+
+        store_be32(p, (uint32_t)v);
+        ref_store(ref, (uint32_t)v, 4);
+        errors += memcmp(p, ref, 4) != 0 || load_be32(p) != (uint32_t)v;
+        errors += legacy_readInt32(p) != (int32_t)load_be32(p);
+
+        store_be64(p, v);
+        ref_store(ref, v, 8);
+        errors += memcmp(p, ref, 8) != 0 || load_be64(p) != v || ref_load(p, 8) != v;
+        errors += legacy_readInt64(p) != (int64_t)load_be64(p);
+
+        int n = 1 + rand() % 64;
+        for (int j = 0; j < n; j++) {
+            in[j] = rand64();
+            in32[j] = (uint32_t)rand64();
+        }
+        store_be64_array(p, in, n);
+        load_be64_array(out, p, n);
+        errors += memcmp(in, out, n*8) != 0 || ref_load(p + (n - 1)*8, 8) != in[n - 1];
+        store_be32_array(p, in32, n);
+        load_be32_array(out32, p, n);
+        errors += memcmp(in32, out32, n*4) != 0;
+    }
+    return errors;
+}
+
+static void encode_legacy(uint8_t *p, const struct record *r, int n) {
+    for (int i = 0; i < n; i++, p += RECORD_SIZE) {
+        legacy_writeInt64(r[i].sender, p);
+        legacy_writeInt64(r[i].receiver, p + 8);
+        legacy_writeInt32(r[i].timestamp, p + 16);
+        legacy_writeInt32(r[i].msg_local_id, p + 20);
+    }
+}
+
+static void decode_legacy(struct record *r, const uint8_t *p, int n) {
+    for (int i = 0; i < n; i++, p += RECORD_SIZE) {
+        r[i].sender = legacy_readInt64(p);
+        r[i].receiver = legacy_readInt64(p + 8);
+        r[i].timestamp = legacy_readInt32(p + 16);
+        r[i].msg_local_id = legacy_readInt32(p + 20);
+    }
+}
+
+static void encode_inline(uint8_t *p, const struct record *r, int n) {
+    for (int i = 0; i < n; i++, p += RECORD_SIZE) {
+        store_be64(p, (uint64_t)r[i].sender);
+        store_be64(p + 8, (uint64_t)r[i].receiver);
+        store_be32(p + 16, (uint32_t)r[i].timestamp);
+        store_be32(p + 20, (uint32_t)r[i].msg_local_id);
+    }
+}
+
+static void decode_inline(struct record *r, const uint8_t *p, int n) {
+    for (int i = 0; i < n; i++, p += RECORD_SIZE) {
+        r[i].sender = (int64_t)load_be64(p);
+        r[i].receiver = (int64_t)load_be64(p + 8);
+        r[i].timestamp = (int32_t)load_be32(p + 16);
+        r[i].msg_local_id = (int32_t)load_be32(p + 20);
+    }
+}
+
+//记录的两个64位字段和两个32位字段各自连续, 分两段批量解码
+static void decode_bulk(struct record *r, const uint8_t *p, int n) {
+    for (int i = 0; i < n; i++, p += RECORD_SIZE) {
+        load_be64_array((uint64_t*)&r[i].sender, p, 2);
+        load_be32_array((uint32_t*)&r[i].timestamp, p + 16, 2);
+    }
+}
+
+static double per_record(uint64_t ns, int n, int rounds) {
+    return (double)ns/((double)n*rounds);
+}
+
+int main(int argc, char **argv) {
+    int n = 100000;
+    int rounds = 100;
+    int iterations = 1000000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:f:")) != -1) {
+        switch (opt) {
+        case 'n': n = atoi(optarg); break;
+        case 'r': rounds = atoi(optarg); break;
+        case 'f': iterations = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n records] [-r rounds] [-f iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+    srand((unsigned)time(NULL));
+    uint64_t errors = fuzz(iterations);
+    printf("round trip: %d iterations errors:%llu\n", iterations, (unsigned long long)errors);
+
+    struct record *in = malloc(sizeof(struct record)*n);
+    struct record *out = malloc(sizeof(struct record)*n);
+    uint8_t *wire = malloc((size_t)RECORD_SIZE*n);
+    uint8_t *check = malloc((size_t)RECORD_SIZE*n);
+    for (int i = 0; i < n; i++) {
+        in[i].sender = (int64_t)rand64();
+        in[i].receiver = (int64_t)rand64();
+        in[i].timestamp = (int32_t)rand64();
+        in[i].msg_local_id = (int32_t)rand64();
+    }
+
+    uint64_t t = cpu_ns();
+    for (int i = 0; i < rounds; i++) {
+        encode_legacy(wire, in, n);
+    }
+    uint64_t legacy_encode = cpu_ns() - t;
+    t = cpu_ns();
+    for (int i = 0; i < rounds; i++) {
+        encode_inline(check, in, n);
+    }
+    uint64_t inline_encode = cpu_ns() - t;
+    errors += memcmp(wire, check, (size_t)RECORD_SIZE*n) != 0;
+
+    void (*decoders[])(struct record*, const uint8_t*, int) = {decode_legacy, decode_inline, decode_bulk};
+    const char *names[] = {"legacy", "inline", "bulk"};
+    uint64_t decode_ns[3];
+    for (int d = 0; d < 3; d++) {
+        memset(out, 0, sizeof(struct record)*n);
+        t = cpu_ns();
+        for (int i = 0; i < rounds; i++) {
+            decoders[d](out, wire, n);
+        }
+        decode_ns[d] = cpu_ns() - t;
+        errors += memcmp(in, out, sizeof(struct record)*n) != 0;
+    }
+    printf("record encode legacy:%.2fns inline:%.2fns\n",
+           per_record(legacy_encode, n, rounds), per_record(inline_encode, n, rounds));
+    printf("record decode");
+    for (int d = 0; d < 3; d++) {
+        printf(" %s:%.2fns", names[d], per_record(decode_ns[d], n, rounds));
+    }
+    printf("\n");
+
+    //(gid, sync key)列表
+    uint64_t *keys = (uint64_t*)out;
+    uint64_t sum = 0;
+    t = cpu_ns();
+    for (int i = 0; i < rounds; i++) {
+        for (int j = 0; j < n; j++) {
+            keys[j*2] = (uint64_t)legacy_readInt64(wire + j*16);
+            keys[j*2 + 1] = (uint64_t)legacy_readInt64(wire + j*16 + 8);
+        }
+        sum += keys[i % n];
+    }
+    uint64_t legacy_keys = cpu_ns() - t;
+    t = cpu_ns();
+    for (int i = 0; i < rounds; i++) {
+        load_be64_array(keys, wire, (size_t)n*2);
+        sum += keys[i % n];
+    }
+    uint64_t bulk_keys = cpu_ns() - t;
+    printf("group key list legacy:%.2fns bulk:%.2fns (%llu)\n", per_record(legacy_keys, n, rounds),
+           per_record(bulk_keys, n, rounds), (unsigned long long)(sum & 1));
+    printf("errors:%llu\n", (unsigned long long)errors);
+    free(in);
+    free(out);
+    free(wire);
+    free(check);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,618 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+//帧解码和消息体编解码的模糊测试, 覆盖imsdk接收方向的整个流程:
+//frame_decoder分帧 -> 解压 -> 分片重组 -> v2转换成v1 -> 按命令解码
+//输入是连接上收到的原始字节流, 解码成功的消息体再做一次v1/v2往返, 不一致时abort
+//用法: imfuzz [-p rounds] [-b rounds] [-s dump outdir] [file|dir]...
+//  不带选项时逐个运行文件或者目录中的输入, 可以作为AFL的目标(imfuzz @@)
+//  -p 随机生成的消息做rounds轮属性测试: 编解码, v1/v2, 分片, 压缩和任意切分的分帧
+//  -b 对输入做rounds轮解码, 输出吞吐量
+//  -s 把imserver -D保存的语料转换成种子, 每条消息体按v1和v2各写一个帧
+//make imfuzz-libfuzzer 用clang的libFuzzer编译同一个入口, 语料在corpus目录
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "protocol.h"
+#include "frame_deflate.h"
+#include "fragment.h"
+
+//与连接的uid相关的v2字段按这个uid解码
+#define FUZZ_UID 1000
+
+static void check(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "property failed: %s\n", what);
+        abort();
+    }
+}
+
+static void decode_body(int cmd, const uint8_t *p, int len) {
+    struct im_auth auth;
+    struct im_message m;
+    struct im_voip_control ctl;
+    struct im_session_ticket ticket;
+    struct im_resume resume;
+    int32_t v32;
+    int64_t v64;
+    volatile int64_t sink = 0;
+    switch (cmd) {
+    case MSG_AUTH_TOKEN:
+        if (im_decode_auth(p, len, &auth) == 0) {
+            check(auth.token_len >= 0 && auth.device_len >= 0 &&
+                  3 + auth.token_len + auth.device_len <= len, "auth bounds");
+            sink += (auth.token_len > 0 ? auth.token[auth.token_len - 1] : 0) +
+                (auth.device_len > 0 ? auth.device[auth.device_len - 1] : 0);
+        }
+        break;
+    case MSG_IM:
+    case MSG_GROUP_IM:
+        if (im_decode_message(p, len, &m) == 0) {
+            check(m.content_len == len - 24, "message bounds");
+            sink += m.sender + (m.content_len > 0 ? m.content[m.content_len - 1] : 0);
+        }
+        break;
+    case MSG_VOIP_CONTROL:
+        if (im_decode_voip_control(p, len, &ctl) == 0) {
+            check(ctl.content_len == len - 16, "voip bounds");
+            sink += ctl.sender + (ctl.content_len > 0 ? ctl.content[ctl.content_len - 1] : 0);
+        }
+        break;
+    case MSG_SESSION_TICKET:
+        if (im_decode_session_ticket(p, len, &ticket) == 0) {
+            sink += ticket.ticket;
+        }
+        break;
+    case MSG_RESUME:
+        if (im_decode_resume(p, len, &resume) == 0) {
+            sink += resume.sync_key;
+        }
+        break;
+    case MSG_SYNC:
+    case MSG_SYNC_BEGIN:
+    case MSG_SYNC_END:
+    case MSG_SYNC_NOTIFY:
+        if (im_decode_int64(p, len, &v64) == 0) {
+            sink += v64;
+        }
+        break;
+    default:
+        if (im_decode_int32(p, len, &v32) == 0) {
+            sink += v32;
+        }
+        break;
+    }
+    (void)sink;
+}
+
+//v1消息体转换成v2之后必须能转换回来, 长度不合法的v1消息体第一次转换之后就是规范的
+static void check_v2_round_trip(int cmd, const uint8_t *v1, int len) {
+    uint8_t *v2 = malloc(len + IM_V2_SLACK);
+    uint8_t *back = malloc(len + IM_V2_SLACK);
+    int n = im_body_to_v2(cmd, v1, len, FUZZ_UID, v2);
+    if (n >= 0) {
+        check(n <= len + IM_V2_SLACK, "v2 size");
+        int m = im_body_from_v2(cmd, v2, n, FUZZ_UID, back);
+        check(m >= 0 && m <= len, "v2 decode");
+        uint8_t *again = malloc(m + IM_V2_SLACK);
+        check(im_body_to_v2(cmd, back, m, FUZZ_UID, again) == n && memcmp(again, v2, n) == 0,
+              "v2 canonical");
+        free(again);
+    }
+    free(v2);
+    free(back);
+}
+
+struct fuzz_stream {
+    struct frame_decoder dec;
+    struct frame_inflate inflater;
+    struct fragment_arena arena;
+    struct buffer scratch;
+    uint64_t frames;
+    uint64_t messages;
+};
+
+static void stream_init(struct fuzz_stream *s) {
+    memset(s, 0, sizeof(struct fuzz_stream));
+    frame_decoder_init(&s->dec);
+    frame_inflate_init(&s->inflater);
+    fragment_arena_init(&s->arena, 0);
+    buffer_init(&s->scratch);
+}
+
+static void stream_free(struct fuzz_stream *s) {
+    frame_decoder_free(&s->dec);
+    frame_inflate_free(&s->inflater);
+    fragment_arena_free(&s->arena);
+    buffer_free(&s->scratch);
+}
+
+//和imsdk的decodeData一样, 遇到错误时断开连接, 这里停止处理
+static int stream_feed(struct fuzz_stream *s, const uint8_t *data, size_t size, int properties) {
+    if (frame_decoder_append(&s->dec, data, size) != 0) {
+        return -1;
+    }
+    struct frame_view frame;
+    int r;
+    while ((r = frame_decoder_next(&s->dec, &frame)) != 0) {
+        if (r < 0) {
+            return -1;
+        }
+        s->frames++;
+        struct im_header h;
+        im_decode_header(frame.head, &h);
+        if (h.version > PROTOCOL_MAX_VERSION) {
+            return -1;
+        }
+        const uint8_t *body = frame.body;
+        int len = frame.body_len;
+        if (h.flags & FRAME_FLAG_COMPRESSED) {
+            len = frame_inflate_body(&s->inflater, body, len, &body);
+            if (len < 0) {
+                return -1;
+            }
+        }
+        if (h.cmd == MSG_FRAGMENT) {
+            r = fragment_arena_add(&s->arena, body, len);
+            if (r < 0) {
+                return -1;
+            } else if (r == 0) {
+                continue;
+            }
+            check(s->arena.total > FRAGMENT_MAX_BODY && s->arena.total <= FRAGMENT_MAX_MESSAGE,
+                  "fragment total");
+            h.cmd = (uint8_t)s->arena.cmd;
+            body = s->arena.buf;
+            len = s->arena.total;
+        }
+        if (h.version >= PROTOCOL_VERSION_2) {
+            uint8_t *p = buffer_reserve(&s->scratch, len + IM_V2_SLACK);
+            len = im_body_from_v2(h.cmd, body, len, FUZZ_UID, p);
+            if (len < 0) {
+                return -1;
+            }
+            body = p;
+        }
+        s->messages++;
+        decode_body(h.cmd, body, len);
+        if (properties) {
+            check_v2_round_trip(h.cmd, body, len);
+        }
+    }
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    struct fuzz_stream s;
+    stream_init(&s);
+    stream_feed(&s, data, size, 1);
+    stream_free(&s);
+    return 0;
+}
+
+#ifndef IM_LIBFUZZER
+
+static uint64_t rand64(void) {
+    uint64_t v = 0;
+    for (int i = 0; i < 4; i++) {
+        v = (v << 16) ^ (uint64_t)(rand() & 0xffff);
+    }
+    switch (rand() % 6) {
+    case 0: return 0;
+    case 1: return (uint64_t)(FUZZ_UID + rand() % 1000 - 500);
+    case 2: return v >> (rand() % 64);
+    default: return v;
+    }
+}
+
+//随机长度的消息体, 偶尔超过一帧的上限
+static int rand_len(void) {
+    switch (rand() % 16) {
+    case 0: return FRAGMENT_MAX_BODY + rand() % (3*FRAGMENT_MAX_BODY);
+    case 1: return rand() % 2048;
+    default: return rand() % 128;
+    }
+}
+
+static void rand_bytes(uint8_t *p, int n) {
+    //文本的压缩率更接近真实的消息
+    for (int i = 0; i < n; i++) {
+        p[i] = rand() % 4 ? (uint8_t)('a' + rand() % 26) : (uint8_t)rand();
+    }
+}
+
+//按cmd生成合法的v1消息体
+static int rand_body(int cmd, uint8_t *p) {
+    int n;
+    switch (cmd) {
+    case MSG_IM:
+    case MSG_GROUP_IM:
+        n = rand_len();
+        put64(p, (int64_t)rand64());
+        put64(p + 8, (int64_t)rand64());
+        put32(p + 16, (int32_t)rand64());
+        put32(p + 20, (int32_t)rand64());
+        rand_bytes(p + 24, n);
+        return 24 + n;
+    case MSG_CUSTOMER:
+        n = rand_len();
+        for (int i = 0; i < 4; i++) {
+            put64(p + i*8, (int64_t)rand64());
+        }
+        put32(p + 32, (int32_t)rand64());
+        rand_bytes(p + 36, n);
+        return 36 + n;
+    case MSG_ROOM_IM:
+    case MSG_VOIP_CONTROL:
+        n = rand_len();
+        put64(p, (int64_t)rand64());
+        put64(p + 8, (int64_t)rand64());
+        rand_bytes(p + 16, n);
+        return 16 + n;
+    case MSG_INPUTING:
+    case MSG_SYNC_GROUP_NOTIFY:
+        put64(p, (int64_t)rand64());
+        put64(p + 8, (int64_t)rand64());
+        return 16;
+    case MSG_AUTH_STATUS:
+        put32(p, (int32_t)rand64());
+        if (rand() % 2) {
+            put32(p + 4, (int32_t)rand64());
+            return 8;
+        }
+        return 4;
+    case MSG_SYNC_NOTIFY:
+        put64(p, (int64_t)rand64());
+        return 8;
+    case MSG_SESSION_TICKET: {
+        struct im_session_ticket t = {(int64_t)rand64(), (int32_t)rand64()};
+        return im_encode_session_ticket(p, &t);
+    }
+    default:
+        put32(p, (int32_t)rand64());
+        return 4;
+    }
+}
+
+static const int rand_cmds[] = {
+    MSG_IM, MSG_GROUP_IM, MSG_CUSTOMER, MSG_ROOM_IM, MSG_VOIP_CONTROL, MSG_INPUTING,
+    MSG_SYNC_GROUP_NOTIFY, MSG_AUTH_STATUS, MSG_SYNC_NOTIFY, MSG_SESSION_TICKET, MSG_ACK,
+};
+
+//和imserver的send_frame一样: 转换版本, 分片, 压缩
+static void write_message(struct buffer *out, struct frame_deflate *d, int *seq, int cmd,
+                          int version, int compress, const uint8_t *body, int len) {
+    uint8_t *v2 = NULL;
+    if (version >= PROTOCOL_VERSION_2) {
+        v2 = malloc(len + IM_V2_SLACK);
+        len = im_body_to_v2(cmd, body, len, FUZZ_UID, v2);
+        check(len >= 0, "encode v2");
+        body = v2;
+    }
+    int count = len > FRAGMENT_MAX_BODY ? fragment_count(len) : 1;
+    uint8_t *fragment = malloc(FRAGMENT_HEAD_SIZE + FRAGMENT_MAX_BODY);
+    for (int i = 0; i < count; i++) {
+        struct im_header h = {++*seq, (uint8_t)cmd, (uint8_t)version, 0};
+        const uint8_t *p = body;
+        int n = len;
+        if (count > 1) {
+            h.cmd = MSG_FRAGMENT;
+            n = fragment_encode(fragment, cmd, body, len, i);
+            p = fragment;
+        }
+        if (compress && n >= FRAME_DEFLATE_THRESHOLD) {
+            n = frame_deflate_body(d, p, n, &p);
+            check(n >= 0, "deflate");
+            h.flags |= FRAME_FLAG_COMPRESSED;
+        }
+        im_write_frame(out, &h, p, n);
+    }
+    free(fragment);
+    free(v2);
+}
+
+struct expected {
+    int cmd;
+    int len;
+    uint8_t *body;
+};
+
+//一批随机消息按随机的版本和压缩写成字节流, 再按随机的位置切开送入解码流程,
+//解码出来的消息序列必须和原来的一样
+static void property_round(void) {
+    int nmessages = 1 + rand() % 16;
+    int version = 1 + rand() % PROTOCOL_MAX_VERSION;
+    int compress = rand() % 2;
+    struct expected *msgs = calloc(nmessages, sizeof(struct expected));
+    struct buffer wire;
+    struct frame_deflate deflater;
+    int seq = 0;
+    buffer_init(&wire);
+    frame_deflate_init(&deflater, FRAME_DEFLATE_LEVEL);
+    uint8_t *body = malloc(64 + 4*FRAGMENT_MAX_BODY);
+    for (int i = 0; i < nmessages; i++) {
+        int cmd = rand_cmds[rand() % (sizeof(rand_cmds)/sizeof(rand_cmds[0]))];
+        int len = rand_body(cmd, body);
+        msgs[i].cmd = cmd;
+        msgs[i].len = len;
+        msgs[i].body = malloc(len);
+        memcpy(msgs[i].body, body, len);
+        write_message(&wire, &deflater, &seq, cmd, version, compress, body, len);
+    }
+    free(body);
+
+    struct fuzz_stream s;
+    stream_init(&s);
+    const uint8_t *p = buffer_data(&wire);
+    size_t left = buffer_size(&wire);
+    while (left > 0) {
+        size_t n = 1 + (size_t)rand() % (left < 4096 ? left : 4096);
+        check(stream_feed(&s, p, n, 1) == 0, "decode stream");
+        p += n;
+        left -= n;
+    }
+    check(s.messages == (uint64_t)nmessages, "message count");
+
+    //重新解码, 这次逐条和原始消息体比较
+    struct frame_decoder dec;
+    struct frame_inflate inflater;
+    struct fragment_arena arena;
+    frame_decoder_init(&dec);
+    frame_inflate_init(&inflater);
+    fragment_arena_init(&arena, 0);
+    frame_decoder_append(&dec, buffer_data(&wire), buffer_size(&wire));
+    struct frame_view frame;
+    int i = 0;
+    while (frame_decoder_next(&dec, &frame) == 1) {
+        struct im_header h;
+        im_decode_header(frame.head, &h);
+        const uint8_t *b = frame.body;
+        int len = frame.body_len;
+        if (h.flags & FRAME_FLAG_COMPRESSED) {
+            len = frame_inflate_body(&inflater, b, len, &b);
+        }
+        if (h.cmd == MSG_FRAGMENT) {
+            if (fragment_arena_add(&arena, b, len) == 0) {
+                continue;
+            }
+            h.cmd = (uint8_t)arena.cmd;
+            b = arena.buf;
+            len = arena.total;
+        }
+        uint8_t *v1 = malloc(len + IM_V2_SLACK);
+        if (h.version >= PROTOCOL_VERSION_2) {
+            len = im_body_from_v2(h.cmd, b, len, FUZZ_UID, v1);
+            b = v1;
+        }
+        check(h.cmd == msgs[i].cmd && len == msgs[i].len && memcmp(b, msgs[i].body, len) == 0,
+              "message round trip");
+        check(h.seq <= seq, "seq");
+        free(v1);
+        i++;
+    }
+    check(i == nmessages, "message order");
+
+    frame_decoder_free(&dec);
+    frame_inflate_free(&inflater);
+    fragment_arena_free(&arena);
+    stream_free(&s);
+    frame_deflate_free(&deflater);
+    buffer_free(&wire);
+    for (i = 0; i < nmessages; i++) {
+        free(msgs[i].body);
+    }
+    free(msgs);
+}
+
+static uint8_t *read_file(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return NULL;
+    }
+    struct buffer b;
+    buffer_init(&b);
+    size_t n;
+    uint8_t tmp[64*1024];
+    while ((n = fread(tmp, 1, sizeof(tmp), f)) > 0) {
+        buffer_append(&b, tmp, n);
+    }
+    fclose(f);
+    *size = buffer_size(&b);
+    if (*size == 0) {
+        buffer_free(&b);
+        return malloc(1);
+    }
+    return b.data;
+}
+
+//目录展开成其中的文件
+static int collect(const char *path, char ***files, int *count) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "can't open %s\n", path);
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        *files = realloc(*files, sizeof(char*)*(*count + 1));
+        (*files)[(*count)++] = strdup(path);
+        return 0;
+    }
+    DIR *dir = opendir(path);
+    struct dirent *e;
+    while (dir && (e = readdir(dir)) != NULL) {
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+        char child[4096];
+        snprintf(child, sizeof(child), "%s/%s", path, e->d_name);
+        collect(child, files, count);
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    return 0;
+}
+
+static void write_seed(const char *dir, int index, const char *name, const struct buffer *b) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%04d-%s", dir, index, name);
+    FILE *f = fopen(path, "wb");
+    if (f) {
+        fwrite(buffer_data(b), 1, buffer_size(b), f);
+        fclose(f);
+    }
+}
+
+//按v1, v2和压缩的v2各写一个种子, 另外写一个连续的会话
+static int make_seeds(const char *dump, const char *dir) {
+    size_t size;
+    uint8_t *data = read_file(dump, &size);
+    if (!data) {
+        fprintf(stderr, "can't open %s\n", dump);
+        return 1;
+    }
+    int per_cmd[256] = {0};
+    int index = 0;
+    int seq = 0;
+    struct buffer session;
+    struct frame_deflate session_deflater;
+    buffer_init(&session);
+    frame_deflate_init(&session_deflater, FRAME_DEFLATE_LEVEL);
+    for (size_t off = 0; off + 14 <= size;) {
+        int cmd = data[off + 9];
+        int len = get32(data + off + 10);
+        if (len < 0 || off + 14 + len > size) {
+            break;
+        }
+        const uint8_t *body = data + off + 14;
+        off += 14 + len;
+        //每个命令取前两条, 另外取一条需要分片的
+        if (len > FRAGMENT_MAX_BODY ? per_cmd[cmd] & 0x100 : (per_cmd[cmd] & 0xff) >= 2) {
+            continue;
+        }
+        per_cmd[cmd] += len > FRAGMENT_MAX_BODY ? 0x100 : 1;
+        for (int variant = 0; variant < 3; variant++) {
+            struct buffer b;
+            struct frame_deflate d;
+            int s = 0;
+            buffer_init(&b);
+            frame_deflate_init(&d, FRAME_DEFLATE_LEVEL);
+            write_message(&b, &d, &s, cmd, variant ? PROTOCOL_VERSION_2 : PROTOCOL_VERSION_1,
+                          variant == 2, body, len);
+            char name[32];
+            snprintf(name, sizeof(name), "cmd%d-%s", cmd, variant == 0 ? "v1" : variant == 1 ? "v2" : "v2z");
+            write_seed(dir, index++, name, &b);
+            frame_deflate_free(&d);
+            buffer_free(&b);
+        }
+        if (buffer_size(&session) < 16*1024) {
+            write_message(&session, &session_deflater, &seq, cmd, PROTOCOL_VERSION_2, 1, body, len);
+        }
+    }
+    write_seed(dir, index++, "session-v2z", &session);
+    printf("%d seeds\n", index);
+    frame_deflate_free(&session_deflater);
+    buffer_free(&session);
+    free(data);
+    return 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    int properties = 0;
+    int bench = 0;
+    const char *dump = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:b:s:")) != -1) {
+        switch (opt) {
+        case 'p': properties = atoi(optarg); break;
+        case 'b': bench = atoi(optarg); break;
+        case 's': dump = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-p rounds] [-b rounds] [-s dump outdir] [file|dir]...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (dump) {
+        if (optind >= argc) {
+            fprintf(stderr, "usage: %s -s dump outdir\n", argv[0]);
+            return 1;
+        }
+        mkdir(argv[optind], 0755);
+        return make_seeds(dump, argv[optind]);
+    }
+    srand((unsigned)time(NULL));
+    for (int i = 0; i < properties; i++) {
+        property_round();
+    }
+    if (properties) {
+        printf("property: %d rounds ok\n", properties);
+    }
+
+    char **files = NULL;
+    int count = 0;
+    for (int i = optind; i < argc; i++) {
+        if (collect(argv[i], &files, &count) < 0) {
+            return 1;
+        }
+    }
+    uint64_t bytes = 0;
+    uint8_t **inputs = calloc(count + 1, sizeof(uint8_t*));
+    size_t *sizes = calloc(count + 1, sizeof(size_t));
+    for (int i = 0; i < count; i++) {
+        inputs[i] = read_file(files[i], &sizes[i]);
+        if (!inputs[i]) {
+            fprintf(stderr, "can't read %s\n", files[i]);
+            return 1;
+        }
+        LLVMFuzzerTestOneInput(inputs[i], sizes[i]);
+        bytes += sizes[i];
+    }
+    if (count) {
+        printf("inputs: %d files %llu bytes ok\n", count, (unsigned long long)bytes);
+    }
+
+    //解码吞吐量, 不做属性检查
+    if (bench && count) {
+        uint64_t frames = 0;
+        uint64_t t = now_ns();
+        for (int r = 0; r < bench; r++) {
+            for (int i = 0; i < count; i++) {
+                struct fuzz_stream s;
+                stream_init(&s);
+                stream_feed(&s, inputs[i], sizes[i], 0);
+                frames += s.frames;
+                stream_free(&s);
+            }
+        }
+        uint64_t ns = now_ns() - t;
+        printf("decode: %llu frames %.1fMB/s %.1fns/frame\n", (unsigned long long)frames,
+               (double)bytes*bench/(ns/1e9)/1e6, frames ? (double)ns/frames : 0);
+    }
+    for (int i = 0; i < count; i++) {
+        free(inputs[i]);
+        free(files[i]);
+    }
+    free(inputs);
+    free(sizes);
+    free(files);
+    return 0;
+}
+
+#endif
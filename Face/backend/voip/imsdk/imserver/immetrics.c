@@ -0,0 +1,154 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+//metrics.h热路径的开销
+//用法: immetrics [-n iterations] [-t threads]
+//  每次迭代模拟收到一帧: 按命令计数, 累加字节数, 记录一次解码耗时
+//  分别使用普通变量(不是线程安全的, 作为下限), metrics.h和一把互斥锁, 输出每次迭代的耗时
+//  多线程时各线程同时更新, 最后检查计数器的总数
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "metrics.h"
+
+static int iterations = 10000000;
+
+struct plain_metrics {
+    uint64_t bytes_in;
+    uint64_t cmd_in[256];
+    uint64_t buckets[METRIC_BUCKETS];
+    uint64_t sum;
+};
+
+static struct plain_metrics plain;
+static struct plain_metrics locked;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+//编译器不能把循环中的更新合并成一次
+__attribute__((noinline)) static void plain_frame(struct plain_metrics *m, int cmd, int bytes, uint64_t us) {
+    m->cmd_in[(uint8_t)cmd]++;
+    m->bytes_in += bytes;
+    m->buckets[metrics_bucket(us)]++;
+    m->sum += us;
+}
+
+__attribute__((noinline)) static void atomic_frame(int cmd, int bytes, uint64_t us) {
+    metrics_frame_in(cmd);
+    metrics_add(METRIC_BYTES_IN, bytes);
+    metrics_observe(METRIC_DECODE_TIME, us);
+}
+
+__attribute__((noinline)) static void mutex_frame(int cmd, int bytes, uint64_t us) {
+    pthread_mutex_lock(&mutex);
+    plain_frame(&locked, cmd, bytes, us);
+    pthread_mutex_unlock(&mutex);
+}
+
+enum { MODE_PLAIN, MODE_ATOMIC, MODE_MUTEX, MODE_MAX };
+static const char *mode_names[MODE_MAX] = {"plain", "atomic", "mutex"};
+
+struct worker {
+    pthread_t thread;
+    int mode;
+    int seed;
+};
+
+static void *run(void *arg) {
+    struct worker *w = arg;
+    //命令和耗时取自固定的小集合, 接近真实分布且不引入随机数的开销
+    static const int cmds[8] = {3, 4, 5, 8, 11, 33, 34, 35};
+    static const uint64_t times[8] = {3, 7, 12, 25, 60, 140, 900, 5000};
+    for (int i = 0; i < iterations; i++) {
+        int k = (i + w->seed) & 7;
+        switch (w->mode) {
+        case MODE_PLAIN: plain_frame(&plain, cmds[k], 64 + k, times[k]); break;
+        case MODE_ATOMIC: atomic_frame(cmds[k], 64 + k, times[k]); break;
+        case MODE_MUTEX: mutex_frame(cmds[k], 64 + k, times[k]); break;
+        }
+    }
+    return NULL;
+}
+
+static double bench(int mode, int threads) {
+    struct worker *workers = calloc(threads, sizeof(struct worker));
+    uint64_t begin = wall_ns();
+    for (int i = 0; i < threads; i++) {
+        workers[i].mode = mode;
+        workers[i].seed = i;
+        pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    uint64_t ns = wall_ns() - begin;
+    free(workers);
+    //所有线程完成一次迭代的平均墙钟时间, 没有竞争时和单线程相同
+    return (double)ns/((double)iterations*threads);
+}
+
+int main(int argc, char **argv) {
+    int threads = 4;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+        switch (opt) {
+        case 'n': iterations = atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-t threads]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (iterations <= 0 || threads <= 0) {
+        return 1;
+    }
+
+    printf("1 thread:");
+    for (int m = 0; m < MODE_MAX; m++) {
+        printf(" %s:%.2fns", mode_names[m], bench(m, 1));
+    }
+    printf("\n");
+
+    printf("%d threads:", threads);
+    //普通变量在多线程下会丢失更新, 不参与比较
+    for (int m = MODE_ATOMIC; m < MODE_MAX; m++) {
+        printf(" %s:%.2fns", mode_names[m], bench(m, threads));
+    }
+    printf("\n");
+
+    struct metrics_snapshot *snap = malloc(sizeof(struct metrics_snapshot));
+    metrics_snapshot(snap);
+    uint64_t frames = 0;
+    for (int i = 0; i < 256; i++) {
+        frames += snap->cmd_in[i];
+    }
+    uint64_t expected = (uint64_t)iterations*(1 + threads);
+    uint64_t snapshot_begin = wall_ns();
+    for (int i = 0; i < 1000; i++) {
+        metrics_snapshot(snap);
+    }
+    double snapshot_us = (double)(wall_ns() - snapshot_begin)/1000/1000;
+    printf("frames:%llu expected:%llu decode.count:%llu decode.p50:%lluus decode.p99:%lluus snapshot:%.2fus\n",
+           (unsigned long long)frames, (unsigned long long)expected,
+           (unsigned long long)snap->histograms[METRIC_DECODE_TIME].count,
+           (unsigned long long)metrics_percentile(snap, METRIC_DECODE_TIME, 0.5),
+           (unsigned long long)metrics_percentile(snap, METRIC_DECODE_TIME, 0.99),
+           snapshot_us);
+    free(snap);
+    return frames == expected ? 0 : 1;
+}
@@ -0,0 +1,333 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "protocol.h"
+#include "varint.h"
+
+void buffer_init(struct buffer *b) {
+    memset(b, 0, sizeof(struct buffer));
+}
+
+void buffer_free(struct buffer *b) {
+    free(b->data);
+    memset(b, 0, sizeof(struct buffer));
+}
+
+uint8_t *buffer_reserve(struct buffer *b, size_t n) {
+    if (b->off == b->len) {
+        b->off = 0;
+        b->len = 0;
+    }
+    if (b->cap - b->len < n && b->off > 0) {
+        memmove(b->data, b->data + b->off, b->len - b->off);
+        b->len -= b->off;
+        b->off = 0;
+    }
+    if (b->cap - b->len < n) {
+        size_t cap = b->cap > 0 ? b->cap : 4096;
+        while (cap - b->len < n) {
+            cap *= 2;
+        }
+        uint8_t *data = realloc(b->data, cap);
+        if (!data) {
+            abort();
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    return b->data + b->len;
+}
+
+void buffer_append(struct buffer *b, const void *p, size_t n) {
+    memcpy(buffer_reserve(b, n), p, n);
+    b->len += n;
+}
+
+void buffer_consume(struct buffer *b, size_t n) {
+    b->off += n;
+    if (b->off >= b->len) {
+        b->off = 0;
+        b->len = 0;
+    }
+}
+
+void im_decode_header(const uint8_t *head, struct im_header *h) {
+    h->seq = get32(head);
+    h->cmd = head[4];
+    h->version = head[5];
+    h->flags = head[6];
+}
+
+void im_write_frame(struct buffer *out, const struct im_header *h, const void *body, int body_len) {
+    uint8_t *p = buffer_reserve(out, FRAME_LENGTH_SIZE + FRAME_HEAD_SIZE + body_len);
+    put32(p, body_len);
+    put32(p + 4, h->seq);
+    p[8] = h->cmd;
+    p[9] = h->version;
+    p[10] = h->flags;
+    p[11] = 0;
+    if (body_len > 0) {
+        memcpy(p + 12, body, body_len);
+    }
+    out->len += FRAME_LENGTH_SIZE + FRAME_HEAD_SIZE + body_len;
+}
+
+int im_decode_auth(const uint8_t *p, int len, struct im_auth *auth) {
+    if (len < 2) {
+        return -1;
+    }
+    auth->platform = p[0];
+    auth->token_len = p[1];
+    if (len < 3 + auth->token_len) {
+        return -1;
+    }
+    auth->token = (const char*)p + 2;
+    auth->device_len = p[2 + auth->token_len];
+    if (len < 3 + auth->token_len + auth->device_len) {
+        return -1;
+    }
+    auth->device = (const char*)p + 3 + auth->token_len;
+    return 0;
+}
+
+int im_decode_message(const uint8_t *p, int len, struct im_message *m) {
+    if (len < 24) {
+        return -1;
+    }
+    m->sender = get64(p);
+    m->receiver = get64(p + 8);
+    m->timestamp = get32(p + 16);
+    m->msg_local_id = get32(p + 20);
+    m->content = (const char*)p + 24;
+    m->content_len = len - 24;
+    return 0;
+}
+
+int im_decode_voip_control(const uint8_t *p, int len, struct im_voip_control *ctl) {
+    if (len < 16) {
+        return -1;
+    }
+    ctl->sender = get64(p);
+    ctl->receiver = get64(p + 8);
+    ctl->content = p + 16;
+    ctl->content_len = len - 16;
+    return 0;
+}
+
+int im_decode_int32(const uint8_t *p, int len, int32_t *v) {
+    if (len < 4) {
+        return -1;
+    }
+    *v = get32(p);
+    return 0;
+}
+
+int im_decode_int64(const uint8_t *p, int len, int64_t *v) {
+    if (len < 8) {
+        return -1;
+    }
+    *v = get64(p);
+    return 0;
+}
+
+int im_decode_session_ticket(const uint8_t *p, int len, struct im_session_ticket *t) {
+    if (len < IM_SESSION_TICKET_SIZE) {
+        return -1;
+    }
+    t->ticket = get64(p);
+    t->ttl = get32(p + 8);
+    return 0;
+}
+
+int im_decode_resume(const uint8_t *p, int len, struct im_resume *r) {
+    if (len < IM_RESUME_SIZE) {
+        return -1;
+    }
+    r->ticket = get64(p);
+    r->last_seq = get32(p + 8);
+    r->sync_key = get64(p + 12);
+    return 0;
+}
+
+int im_auth_size(const struct im_auth *auth) {
+    return 3 + auth->token_len + auth->device_len;
+}
+
+int im_encode_auth(uint8_t *p, const struct im_auth *auth) {
+    uint8_t *s = p;
+    *p++ = (uint8_t)auth->platform;
+    *p++ = (uint8_t)auth->token_len;
+    memcpy(p, auth->token, auth->token_len);
+    p += auth->token_len;
+    *p++ = (uint8_t)auth->device_len;
+    memcpy(p, auth->device, auth->device_len);
+    p += auth->device_len;
+    return (int)(p - s);
+}
+
+int im_message_size(const struct im_message *m) {
+    return 24 + m->content_len;
+}
+
+int im_encode_message(uint8_t *p, const struct im_message *m) {
+    put64(p, m->sender);
+    put64(p + 8, m->receiver);
+    put32(p + 16, m->timestamp);
+    put32(p + 20, m->msg_local_id);
+    memcpy(p + 24, m->content, m->content_len);
+    return 24 + m->content_len;
+}
+
+int im_encode_session_ticket(uint8_t *p, const struct im_session_ticket *t) {
+    put64(p, t->ticket);
+    put32(p + 8, t->ttl);
+    return IM_SESSION_TICKET_SIZE;
+}
+
+int im_encode_resume(uint8_t *p, const struct im_resume *r) {
+    put64(p, r->ticket);
+    put32(p + 8, r->last_seq);
+    put64(p + 12, r->sync_key);
+    return IM_RESUME_SIZE;
+}
+
+//v2消息体的字段布局, 与imsdk/Message.m的v2编解码函数一致
+//d: 8字节的用户id, v2为与uid差值的zigzag变长整数
+//v: 8字节整数, v2为变长整数
+//i: 4字节整数, v2为变长整数
+//f: 4字节整数, 两个版本相同
+//?: 之后的字段可以没有
+//*: 剩余的字节, 两个版本相同
+static const char *v2_layouts[256] = {
+    [MSG_AUTH_STATUS] = "i?i",
+    [MSG_IM] = "ddfi*",
+    [MSG_GROUP_IM] = "ddfi*",
+    [MSG_CUSTOMER] = "vdvdf*",
+    [MSG_CUSTOMER_SUPPORT] = "vdvdf*",
+    [MSG_ACK] = "i",
+    [MSG_UNREAD_COUNT] = "i",
+    [MSG_INPUTING] = "dd",
+    [MSG_ENTER_ROOM] = "v",
+    [MSG_LEAVE_ROOM] = "v",
+    [MSG_ROOM_IM] = "dv*",
+    [MSG_RT] = "dv*",
+    [MSG_VOIP_CONTROL] = "dd*",
+    [MSG_SYNC] = "v",
+    [MSG_SYNC_BEGIN] = "v",
+    [MSG_SYNC_END] = "v",
+    [MSG_SYNC_NOTIFY] = "v",
+    [MSG_SYNC_GROUP] = "vv",
+    [MSG_SYNC_GROUP_BEGIN] = "vv",
+    [MSG_SYNC_GROUP_END] = "vv",
+    [MSG_SYNC_GROUP_NOTIFY] = "vv",
+    [MSG_RESUME_STATUS] = "i",
+};
+
+static int fixed_size(char field) {
+    return field == 'd' || field == 'v' ? 8 : 4;
+}
+
+int im_body_to_v2(int cmd, const uint8_t *p, int len, int64_t uid, uint8_t *out) {
+    const char *layout = v2_layouts[(uint8_t)cmd];
+    const uint8_t *end = p + len;
+    uint8_t *s = out;
+    int optional = 0;
+    if (!layout) {
+        if (len > 0) {
+            memcpy(out, p, len);
+        }
+        return len;
+    }
+    for (; *layout; layout++) {
+        char field = *layout;
+        if (field == '?') {
+            optional = 1;
+            continue;
+        }
+        if (field == '*') {
+            memcpy(out, p, end - p);
+            out += end - p;
+            p = end;
+            break;
+        }
+        if (optional && p == end) {
+            break;
+        }
+        if (end - p < fixed_size(field)) {
+            return -1;
+        }
+        if (field == 'd') {
+            out = varint_write(out, zigzag_encode((int64_t)((uint64_t)get64(p) - (uint64_t)uid)));
+        } else if (field == 'v') {
+            out = varint_write(out, (uint64_t)get64(p));
+        } else if (field == 'i') {
+            out = varint_write(out, (uint32_t)get32(p));
+        } else {
+            memcpy(out, p, 4);
+            out += 4;
+        }
+        p += fixed_size(field);
+    }
+    return (int)(out - s);
+}
+
+int im_body_from_v2(int cmd, const uint8_t *p, int len, int64_t uid, uint8_t *out) {
+    const char *layout = v2_layouts[(uint8_t)cmd];
+    const uint8_t *end = p + len;
+    uint8_t *s = out;
+    int optional = 0;
+    if (!layout) {
+        if (len > 0) {
+            memcpy(out, p, len);
+        }
+        return len;
+    }
+    for (; *layout; layout++) {
+        char field = *layout;
+        uint64_t v;
+        if (field == '?') {
+            optional = 1;
+            continue;
+        }
+        if (field == '*') {
+            memcpy(out, p, end - p);
+            out += end - p;
+            p = end;
+            break;
+        }
+        if (optional && p == end) {
+            break;
+        }
+        if (field == 'f') {
+            if (end - p < 4) {
+                return -1;
+            }
+            memcpy(out, p, 4);
+            p += 4;
+            out += 4;
+            continue;
+        }
+        int n = varint_read(p, (int)(end - p), &v);
+        if (n == 0) {
+            return -1;
+        }
+        p += n;
+        if (field == 'd') {
+            put64(out, (int64_t)((uint64_t)uid + (uint64_t)zigzag_decode(v)));
+        } else if (field == 'v') {
+            put64(out, (int64_t)v);
+        } else {
+            put32(out, (int32_t)v);
+        }
+        out += fixed_size(field);
+    }
+    return (int)(out - s);
+}
@@ -0,0 +1,167 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#ifndef IM_PROTOCOL_H
+#define IM_PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "frame_decoder.h"
+#include "byteorder.h"
+
+//与imsdk/Message.h保持一致
+#define MSG_HEARTBEAT 1
+#define MSG_AUTH_STATUS 3
+#define MSG_IM 4
+#define MSG_ACK 5
+#define MSG_GROUP_NOTIFICATION 7
+#define MSG_GROUP_IM 8
+#define MSG_INPUTING 10
+#define MSG_PING 13
+#define MSG_PONG 14
+#define MSG_AUTH_TOKEN 15
+#define MSG_RT 17
+#define MSG_ENTER_ROOM 18
+#define MSG_LEAVE_ROOM 19
+#define MSG_ROOM_IM 20
+#define MSG_SYSTEM 21
+#define MSG_UNREAD_COUNT 22
+#define MSG_CUSTOMER 24
+#define MSG_CUSTOMER_SUPPORT 25
+#define MSG_SYNC 26
+#define MSG_SYNC_BEGIN 27
+#define MSG_SYNC_END 28
+#define MSG_SYNC_NOTIFY 29
+#define MSG_SYNC_GROUP 30
+#define MSG_SYNC_GROUP_BEGIN 31
+#define MSG_SYNC_GROUP_END 32
+#define MSG_SYNC_GROUP_NOTIFY 33
+#define MSG_SESSION_TICKET 40
+#define MSG_RESUME 41
+#define MSG_RESUME_STATUS 42
+#define MSG_FRAGMENT 43
+#define MSG_VOIP_CONTROL 64
+
+//帧头的version字节, 与imsdk/Message.h保持一致
+#define PROTOCOL_VERSION_1 1
+#define PROTOCOL_VERSION_2 2
+#define PROTOCOL_MAX_VERSION PROTOCOL_VERSION_2
+
+struct buffer {
+    uint8_t *data;
+    size_t off;
+    size_t len;
+    size_t cap;
+};
+
+void buffer_init(struct buffer *b);
+void buffer_free(struct buffer *b);
+//返回可以写入n个字节的位置
+uint8_t *buffer_reserve(struct buffer *b, size_t n);
+void buffer_append(struct buffer *b, const void *p, size_t n);
+void buffer_consume(struct buffer *b, size_t n);
+static inline size_t buffer_size(const struct buffer *b) {
+    return b->len - b->off;
+}
+static inline const uint8_t *buffer_data(const struct buffer *b) {
+    return b->data + b->off;
+}
+
+static inline void put32(uint8_t *p, int32_t v) {
+    store_be32(p, (uint32_t)v);
+}
+
+static inline void put64(uint8_t *p, int64_t v) {
+    store_be64(p, (uint64_t)v);
+}
+
+static inline int32_t get32(const uint8_t *p) {
+    return (int32_t)load_be32(p);
+}
+
+static inline int64_t get64(const uint8_t *p) {
+    return (int64_t)load_be64(p);
+}
+
+struct im_header {
+    int32_t seq;
+    uint8_t cmd;
+    uint8_t version;
+    //FRAME_FLAG_*
+    uint8_t flags;
+};
+
+void im_decode_header(const uint8_t *head, struct im_header *h);
+void im_write_frame(struct buffer *out, const struct im_header *h, const void *body, int body_len);
+
+struct im_auth {
+    int platform;
+    const char *token;
+    int token_len;
+    const char *device;
+    int device_len;
+};
+
+struct im_message {
+    int64_t sender;
+    int64_t receiver;
+    int32_t timestamp;
+    int32_t msg_local_id;
+    const char *content;
+    int content_len;
+};
+
+//认证成功之后下发, 断开ttl秒之内可以用ticket恢复会话
+struct im_session_ticket {
+    int64_t ticket;
+    int32_t ttl;
+};
+
+struct im_resume {
+    int64_t ticket;
+    //客户端收到的最后一个服务器seq, 之后的帧由服务器重发
+    int32_t last_seq;
+    int64_t sync_key;
+};
+
+struct im_voip_control {
+    int64_t sender;
+    int64_t receiver;
+    const uint8_t *content;
+    int content_len;
+};
+
+//解码函数返回0表示成功, -1表示消息体长度不够
+int im_decode_auth(const uint8_t *p, int len, struct im_auth *auth);
+int im_decode_message(const uint8_t *p, int len, struct im_message *m);
+int im_decode_voip_control(const uint8_t *p, int len, struct im_voip_control *ctl);
+int im_decode_int32(const uint8_t *p, int len, int32_t *v);
+int im_decode_int64(const uint8_t *p, int len, int64_t *v);
+int im_decode_session_ticket(const uint8_t *p, int len, struct im_session_ticket *t);
+int im_decode_resume(const uint8_t *p, int len, struct im_resume *r);
+
+//编码函数返回消息体的长度, p至少要有im_*_size()个字节
+int im_auth_size(const struct im_auth *auth);
+int im_encode_auth(uint8_t *p, const struct im_auth *auth);
+int im_message_size(const struct im_message *m);
+int im_encode_message(uint8_t *p, const struct im_message *m);
+#define IM_SESSION_TICKET_SIZE 12
+int im_encode_session_ticket(uint8_t *p, const struct im_session_ticket *t);
+#define IM_RESUME_SIZE 20
+int im_encode_resume(uint8_t *p, const struct im_resume *r);
+
+//v1和v2消息体互相转换, 上面的编解码函数都只处理v1
+//v2的整数为变长编码, 用户id编码为与连接的uid的差值
+//没有v2格式的命令(认证, 会话恢复, 字符串等)两个版本相同, 原样复制
+//out至少要有len+IM_V2_SLACK个字节, 返回转换之后的长度, -1表示消息体不完整
+#define IM_V2_SLACK 32
+int im_body_to_v2(int cmd, const uint8_t *p, int len, int64_t uid, uint8_t *out);
+int im_body_from_v2(int cmd, const uint8_t *p, int len, int64_t uid, uint8_t *out);
+
+#endif
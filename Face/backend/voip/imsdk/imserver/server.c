@@ -0,0 +1,1175 @@
+/*                                                                            
+  Copyright (c) 2014-2015, GoBelieve     
+    All rights reserved.		    				     			
+ 
+  This source code is licensed under the BSD-style license found in the
+  LICENSE file in the root directory of this source tree. An additional grant
+  of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+//本地模拟im服务器, 用于在linux上对imsdk的协议做端到端压测
+//用法: imserver [-p port] [-l latency] [-j jitter] [-d loss] [-r reorder] [-P] [-s script]
+//               [-A auths] [-a retry] [-K ms] [-t ttl] [-D dump] [-z bytes]
+//  -l/-j 下行帧的固定延时和随机抖动(毫秒)
+//  -d/-r 下行帧的丢弃和乱序概率(百分比)
+//  -P    接收者在线时直接推送消息, 否则只发送sync notify
+//  -s    脚本文件, 每行"<毫秒> <latency|jitter|loss|reorder|push> <值>", 到时间后修改对应参数
+//  -A/-a 每秒最多接受的认证数, 超出时返回auth status 2和建议的重连间隔(秒, 默认5)
+//  -K    启动ms毫秒之后断开所有连接, 模拟服务器重启, 统计之后每秒的连接数
+//  -t    会话票据的有效期(秒, 默认60), 断开之后在有效期内可以跳过认证和同步直接恢复, 0表示关闭
+//  -D    把收发的所有消息体按v1格式追加到文件, 作为imcodec的语料
+//        每条记录为uid(8) dir(1) cmd(1) len(4) body, dir 0为上行 1为下行, 整数都是大端
+//  -z    同意客户端的压缩请求, 不小于此长度的下行消息体用deflate压缩(默认32), 0表示不压缩
+//发送者, msgLocalID, 时间戳和内容都相同的消息是客户端没有收到ack之后的重发, 只ack不再保存和转发
+//超过FRAGMENT_MAX_BODY的消息体按MSG_FRAGMENT分片收发, 分片不参与丢弃和乱序的模拟
+//客户端在认证或者恢复请求的帧头中声明支持的最高协议版本, 之后的下行帧使用双方都支持的版本
+//上行帧按各自帧头的版本解码, 内部只保存和转发v1格式的消息体
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "protocol.h"
+#include "frame_deflate.h"
+#include "fragment.h"
+
+#define USER_BUCKETS 4096
+#define SYNC_BATCH 1000
+#define MAX_EVENTS 256
+#define MAX_SCRIPT 256
+//模拟重启之后统计的秒数
+#define STORM_SECONDS 120
+
+#define AUTH_OVERLOAD 2
+//会话恢复时可以重发的最近下行帧数
+#define REPLAY_FRAMES 64
+//每个接收者记录的最近消息数, 用于过滤重发的消息
+#define RECENT_MESSAGES 64
+
+//下行帧的副本, 用于会话恢复时重发客户端没有收到的帧
+struct replay_frame {
+    int32_t seq;
+    int len;
+    uint8_t *data;
+};
+
+struct stored_message {
+    int64_t id;
+    int len;
+    uint8_t *body;
+};
+
+//msg_local_id是发送设备上的本地id, 同一个用户的多个设备会重复, 加上时间戳和内容的hash区分
+//msg_local_id为0时不去重
+struct message_key {
+    int64_t sender;
+    int32_t msg_local_id;
+    int32_t timestamp;
+    uint32_t hash;
+};
+
+struct client;
+
+struct user {
+    int64_t uid;
+    struct client *client;
+    struct stored_message *messages;
+    int count;
+    int cap;
+    int64_t last_id;
+    struct user *next;
+    struct message_key recent[RECENT_MESSAGES];
+    int recent_pos;
+
+    //会话恢复的状态, ticket为0表示没有会话
+    int64_t ticket;
+    //连接断开之后会话的过期时间, 连接时为0
+    uint64_t session_expire;
+    int32_t session_seq;
+    struct replay_frame replay[REPLAY_FRAMES];
+    struct user *ticket_next;
+};
+
+struct client {
+    int fd;
+    uint32_t gen;
+    int64_t uid;
+    int32_t seq;
+    int closing;
+    int want_write;
+    //已经建立可以恢复的会话, 下行帧需要保存副本
+    int resumable;
+    //最后一个延时帧的到期时间, 不乱序时后面的帧不能早于它
+    uint64_t last_due;
+    //下行帧使用的协议版本
+    int version;
+    //已经协商压缩, 每个方向一个deflate流
+    int compress;
+    struct frame_deflate deflater;
+    struct frame_inflate inflater;
+    //上行分片的重组缓冲区
+    struct fragment_arena arena;
+    struct frame_decoder dec;
+    struct buffer out;
+};
+
+//等待延时发送的帧
+struct delayed {
+    uint64_t due;
+    //同一时间到期的帧按放入的顺序发送
+    uint64_t order;
+    int fd;
+    uint32_t gen;
+    int len;
+    uint8_t *data;
+};
+
+struct script_step {
+    uint64_t at;
+    char key[16];
+    int value;
+};
+
+struct config {
+    int latency;
+    int jitter;
+    int loss;
+    int reorder;
+    int push;
+    int auth_rate;
+    int retry_after;
+    int kick;
+    int ticket_ttl;
+    int compress_threshold;
+};
+
+struct stats {
+    uint64_t connections;
+    uint64_t auths;
+    uint64_t ims;
+    uint64_t acks;
+    uint64_t syncs;
+    uint64_t voips;
+    uint64_t pings;
+    uint64_t delayed;
+    uint64_t dropped;
+    uint64_t reordered;
+    uint64_t rejected;
+    uint64_t kicked;
+    uint64_t resumes;
+    uint64_t resume_failures;
+    uint64_t duplicates;
+    uint64_t compressed;
+    uint64_t deflate_in;
+    uint64_t deflate_out;
+    uint64_t fragments_in;
+    uint64_t fragments_out;
+};
+
+static struct config config;
+static struct stats stats;
+static struct user *users[USER_BUCKETS];
+static struct user *tickets[USER_BUCKETS];
+static struct client **clients;
+static int nclients;
+static uint32_t generation;
+static int epfd;
+
+static struct delayed *heap;
+static int heap_len;
+static uint64_t heap_order;
+static int heap_cap;
+
+static struct script_step script[MAX_SCRIPT];
+static int script_len;
+static int script_pos;
+static uint64_t start_time;
+
+//认证的令牌桶
+static double auth_tokens;
+static uint64_t auth_refill;
+
+//模拟重启的时间和之后每秒的连接数, 认证数
+static uint64_t kick_time;
+static int kicked;
+static uint64_t storm_connections[STORM_SECONDS];
+static uint64_t storm_auths[STORM_SECONDS];
+
+static int *closing;
+static int closing_len;
+static int closing_cap;
+
+static volatile sig_atomic_t stopped;
+
+static FILE *dump_file;
+//v1和v2消息体转换的临时缓冲区, 处理收到的帧时可能会发送
+static struct buffer scratch_in;
+static struct buffer scratch_out;
+static struct buffer scratch_fragment;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static int set_nonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static struct user *user_get(int64_t uid, int create) {
+    int b = (int)((uint64_t)uid % USER_BUCKETS);
+    for (struct user *u = users[b]; u; u = u->next) {
+        if (u->uid == uid) {
+            return u;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    struct user *u = calloc(1, sizeof(struct user));
+    u->uid = uid;
+    u->next = users[b];
+    users[b] = u;
+    return u;
+}
+
+//fnv-1a
+static uint32_t content_hash(const char *p, int len) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)p[i])*16777619u;
+    }
+    return h;
+}
+
+//已经收到过返回1, 否则记录下来返回0
+static int user_seen(struct user *u, const struct im_message *m) {
+    if (m->msg_local_id == 0) {
+        return 0;
+    }
+    struct message_key k = {m->sender, m->msg_local_id, m->timestamp, content_hash(m->content, m->content_len)};
+    for (int i = 0; i < RECENT_MESSAGES; i++) {
+        struct message_key *r = &u->recent[i];
+        if (r->msg_local_id == k.msg_local_id && r->sender == k.sender &&
+            r->timestamp == k.timestamp && r->hash == k.hash) {
+            return 1;
+        }
+    }
+    u->recent[u->recent_pos] = k;
+    u->recent_pos = (u->recent_pos + 1) % RECENT_MESSAGES;
+    return 0;
+}
+
+static int64_t user_store(struct user *u, const uint8_t *body, int len) {
+    if (u->count == u->cap) {
+        u->cap = u->cap ? u->cap*2 : 16;
+        u->messages = realloc(u->messages, u->cap*sizeof(struct stored_message));
+    }
+    struct stored_message *m = &u->messages[u->count++];
+    m->id = ++u->last_id;
+    m->len = len;
+    m->body = malloc(len);
+    memcpy(m->body, body, len);
+    return m->id;
+}
+
+static int heap_before(const struct delayed *a, const struct delayed *b) {
+    return a->due < b->due || (a->due == b->due && a->order < b->order);
+}
+
+static void heap_push(struct delayed d) {
+    if (heap_len == heap_cap) {
+        heap_cap = heap_cap ? heap_cap*2 : 1024;
+        heap = realloc(heap, heap_cap*sizeof(struct delayed));
+    }
+    int i = heap_len++;
+    while (i > 0) {
+        int parent = (i - 1)/2;
+        if (!heap_before(&d, &heap[parent])) {
+            break;
+        }
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = d;
+}
+
+static struct delayed heap_pop(void) {
+    struct delayed top = heap[0];
+    struct delayed last = heap[--heap_len];
+    int i = 0;
+    for (;;) {
+        int child = 2*i + 1;
+        if (child >= heap_len) {
+            break;
+        }
+        if (child + 1 < heap_len && heap_before(&heap[child+1], &heap[child])) {
+            child++;
+        }
+        if (!heap_before(&heap[child], &last)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (heap_len > 0) {
+        heap[i] = last;
+    }
+    return top;
+}
+
+static void mark_closing(struct client *c) {
+    if (c->closing) {
+        return;
+    }
+    c->closing = 1;
+    if (closing_len == closing_cap) {
+        closing_cap = closing_cap ? closing_cap*2 : 64;
+        closing = realloc(closing, closing_cap*sizeof(int));
+    }
+    closing[closing_len++] = c->fd;
+}
+
+static void update_events(struct client *c) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (c->want_write ? EPOLLOUT : 0);
+    ev.data.fd = c->fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void close_client(struct client *c) {
+    if (c->uid) {
+        struct user *u = user_get(c->uid, 0);
+        if (u && u->client == c) {
+            u->client = NULL;
+            if (u->ticket) {
+                u->session_expire = now_us() + (uint64_t)config.ticket_ttl*1000000;
+            }
+        }
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    clients[c->fd] = NULL;
+    frame_decoder_free(&c->dec);
+    buffer_free(&c->out);
+    frame_deflate_free(&c->deflater);
+    frame_inflate_free(&c->inflater);
+    fragment_arena_free(&c->arena);
+    free(c);
+}
+
+static int flush_client(struct client *c) {
+    while (buffer_size(&c->out) > 0) {
+        ssize_t n = write(c->fd, buffer_data(&c->out), buffer_size(&c->out));
+        if (n > 0) {
+            buffer_consume(&c->out, n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            break;
+        } else {
+            return -1;
+        }
+    }
+    int want_write = buffer_size(&c->out) > 0;
+    if (want_write != c->want_write) {
+        c->want_write = want_write;
+        update_events(c);
+    }
+    return 0;
+}
+
+static int emulating(void) {
+    return config.latency || config.jitter || config.loss || config.reorder;
+}
+
+static struct user *ticket_get(int64_t ticket) {
+    int b = (int)((uint64_t)ticket % USER_BUCKETS);
+    for (struct user *u = tickets[b]; u; u = u->ticket_next) {
+        if (u->ticket == ticket) {
+            return u;
+        }
+    }
+    return NULL;
+}
+
+static void ticket_remove(struct user *u) {
+    struct user **p = &tickets[(uint64_t)u->ticket % USER_BUCKETS];
+    while (*p && *p != u) {
+        p = &(*p)->ticket_next;
+    }
+    if (*p) {
+        *p = u->ticket_next;
+    }
+    u->ticket_next = NULL;
+    u->ticket = 0;
+}
+
+//重新认证之后旧的会话作废
+static void session_new(struct user *u) {
+    if (u->ticket) {
+        ticket_remove(u);
+    }
+    for (int i = 0; i < REPLAY_FRAMES; i++) {
+        free(u->replay[i].data);
+        u->replay[i].data = NULL;
+        u->replay[i].seq = 0;
+    }
+    do {
+        u->ticket = ((int64_t)rand() << 32 | (uint32_t)rand()) & INT64_MAX;
+    } while (u->ticket == 0 || ticket_get(u->ticket));
+    int b = (int)((uint64_t)u->ticket % USER_BUCKETS);
+    u->ticket_next = tickets[b];
+    tickets[b] = u;
+    u->session_expire = 0;
+    u->session_seq = 0;
+}
+
+//保存的是没有压缩的帧, 恢复之后的新连接直接重发
+static void replay_record(struct client *c, const struct im_header *h, const void *body, int len) {
+    struct user *u = user_get(c->uid, 0);
+    if (!u || u->client != c) {
+        return;
+    }
+    struct buffer b;
+    buffer_init(&b);
+    im_write_frame(&b, h, body, len);
+    struct replay_frame *f = &u->replay[(uint32_t)h->seq % REPLAY_FRAMES];
+    free(f->data);
+    f->seq = h->seq;
+    f->len = (int)buffer_size(&b);
+    f->data = b.data;
+    u->session_seq = h->seq;
+}
+
+//(last_seq, session_seq]之间的帧都还保存着才能恢复
+static int replay_covers(struct user *u, int32_t last_seq) {
+    if (last_seq > u->session_seq || u->session_seq - last_seq > REPLAY_FRAMES) {
+        return 0;
+    }
+    for (int32_t seq = last_seq + 1; seq <= u->session_seq; seq++) {
+        if (u->replay[(uint32_t)seq % REPLAY_FRAMES].seq != seq) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void dump_body(int64_t uid, int dir, int cmd, const void *body, int len) {
+    uint8_t head[14];
+    if (!dump_file) {
+        return;
+    }
+    put64(head, uid);
+    head[8] = (uint8_t)dir;
+    head[9] = (uint8_t)cmd;
+    put32(head + 10, len);
+    fwrite(head, 1, sizeof(head), dump_file);
+    fwrite(body, 1, len, dump_file);
+}
+
+//压缩流的输出按顺序写入连接, 不能再丢弃或者乱序
+static void compress_body(struct client *c, struct im_header *h, const void **body, int *len) {
+    if (!c->compress || *len < config.compress_threshold) {
+        return;
+    }
+    const uint8_t *out;
+    int n = frame_deflate_body(&c->deflater, *body, *len, &out);
+    if (n < 0) {
+        //流已经不能使用, 之后的帧都不压缩
+        fprintf(stderr, "deflate error\n");
+        c->compress = 0;
+        mark_closing(c);
+        return;
+    }
+    stats.compressed++;
+    stats.deflate_in += *len;
+    stats.deflate_out += n;
+    h->flags |= FRAME_FLAG_COMPRESSED;
+    *body = out;
+    *len = n;
+}
+
+//按当前的网络参数把帧放入延时队列, 或者直接写入发送缓冲区
+//分片只模拟延时, 丢弃或者乱序之后整条消息都不能重组
+static void send_wire(struct client *c, int cmd, const void *body, int len) {
+    struct im_header h = {++c->seq, (uint8_t)cmd, (uint8_t)c->version, 0};
+    if (c->resumable) {
+        replay_record(c, &h, body, len);
+    }
+    if (c->compress && (cmd == MSG_AUTH_STATUS || cmd == MSG_RESUME_STATUS)) {
+        //同意客户端的压缩请求
+        h.flags |= FRAME_FLAG_DEFLATE;
+    }
+    if (!emulating()) {
+        compress_body(c, &h, &body, &len);
+        im_write_frame(&c->out, &h, body, len);
+        return;
+    }
+    int fragment = cmd == MSG_FRAGMENT;
+    if (!fragment && config.loss && rand() % 100 < config.loss) {
+        stats.dropped++;
+        return;
+    }
+    uint64_t delay = (uint64_t)config.latency*1000;
+    if (config.jitter) {
+        delay += (uint64_t)(rand() % (config.jitter*1000));
+    }
+    int reorder = !fragment && config.reorder && rand() % 100 < config.reorder;
+    if (reorder) {
+        delay += (uint64_t)(config.latency + config.jitter + 10)*1000;
+        stats.reordered++;
+    }
+    //乱序的帧不经过压缩流, 否则对端解压的顺序和压缩的不一致
+    if (!reorder) {
+        compress_body(c, &h, &body, &len);
+    }
+    struct buffer b;
+    buffer_init(&b);
+    im_write_frame(&b, &h, body, len);
+    struct delayed d;
+    d.due = now_us() + delay;
+    //抖动不会让同一个tcp连接上的数据乱序
+    if (!reorder) {
+        if (d.due < c->last_due) {
+            d.due = c->last_due;
+        }
+        c->last_due = d.due;
+    }
+    d.order = ++heap_order;
+    d.fd = c->fd;
+    d.gen = c->gen;
+    d.len = (int)buffer_size(&b);
+    d.data = b.data;
+    heap_push(d);
+    stats.delayed++;
+}
+
+//body是v1格式, 按连接的协议版本转换, 超过一帧的上限时分片发送
+static void send_frame(struct client *c, int cmd, const void *body, int len) {
+    dump_body(c->uid, 1, cmd, body, len);
+    if (c->version >= PROTOCOL_VERSION_2) {
+        uint8_t *p = buffer_reserve(&scratch_out, len + IM_V2_SLACK);
+        len = im_body_to_v2(cmd, body, len, c->uid, p);
+        body = p;
+    }
+    if (len <= FRAGMENT_MAX_BODY) {
+        send_wire(c, cmd, body, len);
+        return;
+    }
+    int count = fragment_count(len);
+    uint8_t *p = buffer_reserve(&scratch_fragment, FRAGMENT_HEAD_SIZE + FRAGMENT_MAX_BODY);
+    for (int i = 0; i < count; i++) {
+        int n = fragment_encode(p, cmd, body, len, i);
+        send_wire(c, MSG_FRAGMENT, p, n);
+    }
+    stats.fragments_out += count;
+}
+
+static void send_int32(struct client *c, int cmd, int32_t v) {
+    uint8_t body[4];
+    put32(body, v);
+    send_frame(c, cmd, body, 4);
+}
+
+static void send_int64(struct client *c, int cmd, int64_t v) {
+    uint8_t body[8];
+    put64(body, v);
+    send_frame(c, cmd, body, 8);
+}
+
+static void flush_later(struct client *c) {
+    if (c && !emulating() && !c->closing && flush_client(c) < 0) {
+        mark_closing(c);
+    }
+}
+
+//按-A的速率接受认证, 突发量为一秒的速率
+static int auth_admit(void) {
+    if (config.auth_rate <= 0) {
+        return 1;
+    }
+    uint64_t now = now_us();
+    auth_tokens += (double)(now - auth_refill)*config.auth_rate/1000000.0;
+    if (auth_tokens > config.auth_rate) {
+        auth_tokens = config.auth_rate;
+    }
+    auth_refill = now;
+    if (auth_tokens < 1) {
+        return 0;
+    }
+    auth_tokens -= 1;
+    return 1;
+}
+
+static void storm_count(uint64_t *counter) {
+    if (!kicked) {
+        return;
+    }
+    uint64_t sec = (now_us() - kick_time)/1000000;
+    if (sec < STORM_SECONDS) {
+        counter[sec]++;
+    }
+}
+
+static void handle_auth(struct client *c, const uint8_t *body, int len) {
+    struct im_auth auth;
+    char token[256];
+    int64_t uid = 0;
+    if (im_decode_auth(body, len, &auth) == 0) {
+        memcpy(token, auth.token, auth.token_len);
+        token[auth.token_len] = 0;
+        uid = strtoll(token, NULL, 10);
+    }
+    if (uid <= 0) {
+        send_int32(c, MSG_AUTH_STATUS, 1);
+        return;
+    }
+    if (!auth_admit()) {
+        //过载时告诉客户端多久之后再来, 由客户端断开连接
+        uint8_t status[8];
+        put32(status, AUTH_OVERLOAD);
+        put32(status + 4, config.retry_after);
+        send_frame(c, MSG_AUTH_STATUS, status, 8);
+        stats.rejected++;
+        return;
+    }
+    storm_count(storm_auths);
+    c->uid = uid;
+    struct user *u = user_get(uid, 1);
+    u->client = c;
+    stats.auths++;
+    send_int32(c, MSG_AUTH_STATUS, 0);
+    if (config.ticket_ttl > 0) {
+        uint8_t body[IM_SESSION_TICKET_SIZE];
+        struct im_session_ticket t;
+        session_new(u);
+        c->resumable = 1;
+        t.ticket = u->ticket;
+        t.ttl = config.ticket_ttl;
+        send_frame(c, MSG_SESSION_TICKET, body, im_encode_session_ticket(body, &t));
+    }
+}
+
+//用票据恢复会话: 不需要认证, 重发客户端没有收到的帧, 有新消息时通知客户端同步
+static void handle_resume(struct client *c, const uint8_t *body, int len) {
+    struct im_resume r;
+    struct user *u = NULL;
+    if (config.ticket_ttl > 0 && im_decode_resume(body, len, &r) == 0) {
+        u = ticket_get(r.ticket);
+    }
+    if (!u || (u->session_expire && u->session_expire < now_us()) || !replay_covers(u, r.last_seq)) {
+        stats.resume_failures++;
+        send_int32(c, MSG_RESUME_STATUS, 1);
+        return;
+    }
+    //服务器可能还没有发现旧的连接已经断开
+    if (u->client && u->client != c) {
+        mark_closing(u->client);
+    }
+    c->uid = u->uid;
+    c->resumable = 1;
+    c->seq = u->session_seq;
+    u->client = c;
+    u->session_expire = 0;
+    stats.resumes++;
+
+    int32_t end = u->session_seq;
+    send_int32(c, MSG_RESUME_STATUS, 0);
+    for (int32_t seq = r.last_seq + 1; seq <= end; seq++) {
+        struct replay_frame *f = &u->replay[(uint32_t)seq % REPLAY_FRAMES];
+        buffer_append(&c->out, f->data, f->len);
+    }
+    if (u->last_id > r.sync_key) {
+        send_int64(c, MSG_SYNC_NOTIFY, u->last_id);
+    }
+}
+
+static void handle_im(struct client *c, int32_t seq, const uint8_t *body, int len) {
+    struct im_message m;
+    if (im_decode_message(body, len, &m) < 0) {
+        mark_closing(c);
+        return;
+    }
+    stats.ims++;
+    struct user *u = user_get(m.receiver, 1);
+    if (user_seen(u, &m)) {
+        //之前的ack丢失或者连接断开, 消息已经保存过
+        stats.duplicates++;
+        send_int32(c, MSG_ACK, seq);
+        return;
+    }
+    int64_t id = user_store(u, body, len);
+    send_int32(c, MSG_ACK, seq);
+
+    struct client *peer = u->client;
+    if (!peer || peer->closing) {
+        return;
+    }
+    if (config.push) {
+        send_frame(peer, MSG_IM, body, len);
+    } else {
+        send_int64(peer, MSG_SYNC_NOTIFY, id);
+    }
+    if (peer != c) {
+        flush_later(peer);
+    }
+}
+
+static void handle_sync(struct client *c, const uint8_t *body, int len) {
+    int64_t key;
+    if (im_decode_int64(body, len, &key) < 0) {
+        mark_closing(c);
+        return;
+    }
+    stats.syncs++;
+    struct user *u = user_get(c->uid, 1);
+    send_int64(c, MSG_SYNC_BEGIN, key);
+
+    //消息id从1开始连续递增, 下标即id-1
+    int64_t i = key < 0 ? 0 : key;
+    int64_t end = i + SYNC_BATCH < u->count ? i + SYNC_BATCH : u->count;
+    int64_t last = key;
+    for (; i < end; i++) {
+        struct stored_message *m = &u->messages[i];
+        send_frame(c, MSG_IM, m->body, m->len);
+        last = m->id;
+    }
+    send_int64(c, MSG_SYNC_END, last);
+    if (last < u->last_id) {
+        //一次没有同步完, 通知客户端继续同步
+        send_int64(c, MSG_SYNC_NOTIFY, u->last_id);
+    }
+}
+
+static void handle_sync_group(struct client *c, const uint8_t *body, int len) {
+    if (len < 16) {
+        mark_closing(c);
+        return;
+    }
+    //不保存群消息, 原样返回同步点
+    send_frame(c, MSG_SYNC_GROUP_BEGIN, body, 16);
+    send_frame(c, MSG_SYNC_GROUP_END, body, 16);
+}
+
+static void handle_voip(struct client *c, const uint8_t *body, int len) {
+    struct im_voip_control ctl;
+    if (im_decode_voip_control(body, len, &ctl) < 0) {
+        mark_closing(c);
+        return;
+    }
+    stats.voips++;
+    struct user *u = user_get(ctl.receiver, 0);
+    if (u && u->client && !u->client->closing) {
+        send_frame(u->client, MSG_VOIP_CONTROL, body, len);
+        if (u->client != c) {
+            flush_later(u->client);
+        }
+    }
+}
+
+static void handle_frame(struct client *c, const struct frame_view *frame) {
+    struct im_header h;
+    im_decode_header(frame->head, &h);
+    if ((h.cmd != MSG_AUTH_TOKEN && h.cmd != MSG_RESUME && c->uid == 0) ||
+        h.version > PROTOCOL_MAX_VERSION) {
+        mark_closing(c);
+        return;
+    }
+    if (h.cmd == MSG_AUTH_TOKEN || h.cmd == MSG_RESUME) {
+        c->version = h.version >= PROTOCOL_VERSION_2 ? PROTOCOL_VERSION_2 : PROTOCOL_VERSION_1;
+        c->compress = (h.flags & FRAME_FLAG_DEFLATE) && config.compress_threshold > 0;
+    }
+    const uint8_t *body = frame->body;
+    int len = frame->body_len;
+    if (h.flags & FRAME_FLAG_COMPRESSED) {
+        if (!c->compress || (len = frame_inflate_body(&c->inflater, body, len, &body)) < 0) {
+            mark_closing(c);
+            return;
+        }
+    }
+    if (h.cmd == MSG_FRAGMENT) {
+        stats.fragments_in++;
+        int r = fragment_arena_add(&c->arena, body, len);
+        if (r < 0) {
+            mark_closing(c);
+            return;
+        } else if (r == 0) {
+            return;
+        }
+        //按原来的命令处理, seq为最后一个分片的seq
+        h.cmd = (uint8_t)c->arena.cmd;
+        body = c->arena.buf;
+        len = c->arena.total;
+    }
+    if (h.version >= PROTOCOL_VERSION_2) {
+        uint8_t *p = buffer_reserve(&scratch_in, len + IM_V2_SLACK);
+        len = im_body_from_v2(h.cmd, body, len, c->uid, p);
+        body = p;
+        if (len < 0) {
+            mark_closing(c);
+            return;
+        }
+    }
+    dump_body(c->uid, 0, h.cmd, body, len);
+    switch (h.cmd) {
+    case MSG_AUTH_TOKEN:
+        handle_auth(c, body, len);
+        break;
+    case MSG_RESUME:
+        handle_resume(c, body, len);
+        break;
+    case MSG_IM:
+        handle_im(c, h.seq, body, len);
+        break;
+    case MSG_ACK:
+        stats.acks++;
+        break;
+    case MSG_SYNC:
+        handle_sync(c, body, len);
+        break;
+    case MSG_SYNC_GROUP:
+        handle_sync_group(c, body, len);
+        break;
+    case MSG_VOIP_CONTROL:
+        handle_voip(c, body, len);
+        break;
+    case MSG_PING:
+        stats.pings++;
+        send_frame(c, MSG_PONG, NULL, 0);
+        break;
+    default:
+        break;
+    }
+}
+
+static void on_read(struct client *c) {
+    char buf[64*1024];
+    for (;;) {
+        ssize_t n = read(c->fd, buf, sizeof(buf));
+        if (n > 0) {
+            if (frame_decoder_append(&c->dec, buf, n) < 0) {
+                mark_closing(c);
+                return;
+            }
+            if (n < (ssize_t)sizeof(buf)) {
+                break;
+            }
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            break;
+        } else {
+            mark_closing(c);
+            return;
+        }
+    }
+
+    struct frame_view frame;
+    int r;
+    while (!c->closing && (r = frame_decoder_next(&c->dec, &frame)) != 0) {
+        if (r < 0) {
+            mark_closing(c);
+            return;
+        }
+        handle_frame(c, &frame);
+    }
+    flush_later(c);
+}
+
+static void on_accept(int listenfd) {
+    for (;;) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                fprintf(stderr, "accept: %s, raise ulimit -n\n", strerror(errno));
+            }
+            return;
+        }
+        set_nonblock(fd);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (fd >= nclients) {
+            int n = nclients ? nclients : 1024;
+            while (n <= fd) {
+                n *= 2;
+            }
+            clients = realloc(clients, n*sizeof(struct client*));
+            memset(clients + nclients, 0, (n - nclients)*sizeof(struct client*));
+            nclients = n;
+        }
+        struct client *c = calloc(1, sizeof(struct client));
+        c->fd = fd;
+        c->gen = ++generation;
+        c->version = PROTOCOL_VERSION_1;
+        frame_decoder_init(&c->dec);
+        buffer_init(&c->out);
+        frame_deflate_init(&c->deflater, FRAME_DEFLATE_LEVEL);
+        frame_inflate_init(&c->inflater);
+        fragment_arena_init(&c->arena, 0);
+        clients[fd] = c;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        stats.connections++;
+        storm_count(storm_connections);
+    }
+}
+
+//到时间之后断开所有连接, 返回下一次检查的时间(毫秒)
+static int run_kick(void) {
+    if (config.kick <= 0 || kicked) {
+        return -1;
+    }
+    uint64_t elapsed = now_us() - start_time;
+    if (elapsed < (uint64_t)config.kick*1000) {
+        return (int)(((uint64_t)config.kick*1000 - elapsed + 999)/1000);
+    }
+    kicked = 1;
+    kick_time = now_us();
+    //在事件循环之外, 可以直接关闭
+    for (int i = 0; i < nclients; i++) {
+        if (clients[i]) {
+            close_client(clients[i]);
+            stats.kicked++;
+        }
+    }
+    printf("kick %llu connections\n", (unsigned long long)stats.kicked);
+    fflush(stdout);
+    return -1;
+}
+
+//把到期的延时帧写入对应连接的发送缓冲区, 返回下一个到期时间(毫秒)
+static int deliver_delayed(void) {
+    uint64_t now = now_us();
+    while (heap_len > 0 && heap[0].due <= now) {
+        struct delayed d = heap_pop();
+        struct client *c = d.fd < nclients ? clients[d.fd] : NULL;
+        if (c && c->gen == d.gen && !c->closing) {
+            buffer_append(&c->out, d.data, d.len);
+            if (flush_client(c) < 0) {
+                mark_closing(c);
+            }
+        }
+        free(d.data);
+    }
+    if (heap_len == 0) {
+        return -1;
+    }
+    return (int)((heap[0].due - now + 999)/1000);
+}
+
+static int load_script(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f) && script_len < MAX_SCRIPT) {
+        struct script_step *s = &script[script_len];
+        unsigned long long at;
+        if (line[0] == '#' || sscanf(line, "%llu %15s %d", &at, s->key, &s->value) != 3) {
+            continue;
+        }
+        s->at = at*1000;
+        script_len++;
+    }
+    fclose(f);
+    return 0;
+}
+
+//执行已经到时间的脚本步骤, 返回下一个步骤的等待时间(毫秒)
+static int run_script(void) {
+    uint64_t elapsed = now_us() - start_time;
+    while (script_pos < script_len && script[script_pos].at <= elapsed) {
+        struct script_step *s = &script[script_pos++];
+        if (strcmp(s->key, "latency") == 0) {
+            config.latency = s->value;
+        } else if (strcmp(s->key, "jitter") == 0) {
+            config.jitter = s->value;
+        } else if (strcmp(s->key, "loss") == 0) {
+            config.loss = s->value;
+        } else if (strcmp(s->key, "reorder") == 0) {
+            config.reorder = s->value;
+        } else if (strcmp(s->key, "push") == 0) {
+            config.push = s->value;
+        } else {
+            fprintf(stderr, "unknown script key:%s\n", s->key);
+            continue;
+        }
+        printf("%llums %s=%d\n", (unsigned long long)(elapsed/1000), s->key, s->value);
+    }
+    if (script_pos == script_len) {
+        return -1;
+    }
+    return (int)((script[script_pos].at - elapsed + 999)/1000);
+}
+
+static void print_stats(void) {
+    printf("connections:%llu auths:%llu ims:%llu acks:%llu syncs:%llu voips:%llu pings:%llu\n",
+           (unsigned long long)stats.connections, (unsigned long long)stats.auths,
+           (unsigned long long)stats.ims, (unsigned long long)stats.acks,
+           (unsigned long long)stats.syncs, (unsigned long long)stats.voips,
+           (unsigned long long)stats.pings);
+    printf("delayed:%llu dropped:%llu reordered:%llu rejected:%llu resumes:%llu resume failures:%llu duplicates:%llu\n",
+           (unsigned long long)stats.delayed, (unsigned long long)stats.dropped,
+           (unsigned long long)stats.reordered, (unsigned long long)stats.rejected,
+           (unsigned long long)stats.resumes, (unsigned long long)stats.resume_failures,
+           (unsigned long long)stats.duplicates);
+    if (stats.compressed) {
+        printf("compressed:%llu deflate in:%llu out:%llu\n", (unsigned long long)stats.compressed,
+               (unsigned long long)stats.deflate_in, (unsigned long long)stats.deflate_out);
+    }
+    if (stats.fragments_in || stats.fragments_out) {
+        printf("fragments in:%llu out:%llu\n", (unsigned long long)stats.fragments_in,
+               (unsigned long long)stats.fragments_out);
+    }
+    if (!kicked) {
+        return;
+    }
+    int last = 0;
+    for (int i = 0; i < STORM_SECONDS; i++) {
+        if (storm_connections[i] || storm_auths[i]) {
+            last = i;
+        }
+    }
+    printf("after kick of %llu connections:\n", (unsigned long long)stats.kicked);
+    for (int i = 0; i <= last; i++) {
+        printf("  %3ds connections:%llu auths:%llu\n", i,
+               (unsigned long long)storm_connections[i], (unsigned long long)storm_auths[i]);
+    }
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    stopped = 1;
+}
+
+static int min_timeout(int a, int b) {
+    if (a < 0) {
+        return b;
+    }
+    if (b < 0) {
+        return a;
+    }
+    return a < b ? a : b;
+}
+
+int main(int argc, char **argv) {
+    int port = 23000;
+    int opt;
+    config.retry_after = 5;
+    config.ticket_ttl = 60;
+    config.compress_threshold = FRAME_DEFLATE_THRESHOLD;
+    while ((opt = getopt(argc, argv, "p:l:j:d:r:s:PA:a:K:t:D:z:")) != -1) {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 'l': config.latency = atoi(optarg); break;
+        case 'j': config.jitter = atoi(optarg); break;
+        case 'd': config.loss = atoi(optarg); break;
+        case 'r': config.reorder = atoi(optarg); break;
+        case 'P': config.push = 1; break;
+        case 'A': config.auth_rate = atoi(optarg); break;
+        case 'a': config.retry_after = atoi(optarg); break;
+        case 'K': config.kick = atoi(optarg); break;
+        case 't': config.ticket_ttl = atoi(optarg); break;
+        case 'z': config.compress_threshold = atoi(optarg); break;
+        case 's':
+            if (load_script(optarg) < 0) {
+                return 1;
+            }
+            break;
+        case 'D':
+            dump_file = fopen(optarg, "wb");
+            if (!dump_file) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p port] [-l latency] [-j jitter] [-d loss] [-r reorder] [-P] [-s script] [-A auths] [-a retry] [-K ms] [-t ttl] [-D dump] [-z bytes]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(listenfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenfd, 4096) < 0) {
+        perror("listen");
+        return 1;
+    }
+    set_nonblock(listenfd);
+
+    epfd = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = listenfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+
+    srand((unsigned)time(NULL));
+    start_time = now_us();
+    auth_refill = start_time;
+    auth_tokens = config.auth_rate;
+    printf("imserver listen on:%d\n", port);
+    fflush(stdout);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (!stopped) {
+        int timeout = min_timeout(min_timeout(run_script(), deliver_delayed()), run_kick());
+        int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listenfd) {
+                on_accept(listenfd);
+                continue;
+            }
+            struct client *c = clients[fd];
+            if (!c) {
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                on_read(c);
+            }
+            if (!c->closing && (events[i].events & EPOLLOUT) && flush_client(c) < 0) {
+                mark_closing(c);
+            }
+        }
+        //处理过程中可能标记了其它连接, 统一在这里关闭
+        for (int i = 0; i < closing_len; i++) {
+            close_client(clients[closing[i]]);
+        }
+        closing_len = 0;
+    }
+    print_stats();
+    if (dump_file) {
+        fclose(dump_file);
+    }
+    return 0;
+}
@@ -8,6 +8,7 @@
 
 #import "VOIPCommand.h"
 #import <imsdk/util.h>
+#import <imsdk/imlog.h>
 
 @implementation NatPortMap
 
@@ -48,7 +49,8 @@
 }
 
 -(NSData*)content {
-    char buf[64*1024] = {0};
+    //最长的VOIP_COMMAND_CONNECTED只有14个字节
+    char buf[16];
     char *p = buf;
     
     writeInt32(self.cmd, p);
@@ -58,14 +60,14 @@
         p += 4;
         return [NSData dataWithBytes:buf length:8];
     } else if (self.cmd == VOIP_COMMAND_ACCEPT) {
-        NSLog(@"nat map ip:%x", self.natMap.ip);
+        IMLogD("nat map ip:%x", self.natMap.ip);
         writeInt32(self.natMap.ip, p);
         p += 4;
         writeInt16(self.natMap.port, p);
         p += 2;
         return [NSData dataWithBytes:buf length:10];
     } else if (self.cmd == VOIP_COMMAND_CONNECTED) {
-        NSLog(@"nat map ip:%x", self.natMap.ip);
+        IMLogD("nat map ip:%x", self.natMap.ip);
         writeInt32(self.natMap.ip, p);
         p += 4;
         writeInt16(self.natMap.port, p);
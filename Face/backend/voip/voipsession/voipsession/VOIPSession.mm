@@ -6,9 +6,8 @@
  LICENSE file in the root directory of this source tree. An additional grant
  of patent rights can be found in the PATENTS file in the same directory.
  */
-#include <netdb.h>
-#include <arpa/inet.h>
-#include <netinet/in.h>
+#include <sys/socket.h>
+#import <imsdk/DNSCache.h>
 #import "VOIPSession.h"
 #import "VOIPService.h"
 
@@ -52,43 +51,8 @@ enum SessionMode {
     return self;
 }
 
--(NSString*)IP2String:(struct in_addr)addr {
-    char buf[64] = {0};
-    const char *p = inet_ntop(AF_INET, &addr, buf, 64);
-    if (p) {
-        return [NSString stringWithUTF8String:p];
-    }
-    return nil;
-    
-}
-
 -(NSString*)resolveIP:(NSString*)host {
-    struct addrinfo hints;
-    struct addrinfo *result, *rp;
-    int s;
-    
-    char buf[32];
-    snprintf(buf, 32, "%d", 0);
-    
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-    hints.ai_flags = 0;
-    
-    s = getaddrinfo([host UTF8String], buf, &hints, &result);
-    if (s != 0) {
-        NSLog(@"get addr info error:%s", gai_strerror(s));
-        return nil;
-    }
-    NSString *ip = nil;
-    rp = result;
-    if (rp != NULL) {
-        struct sockaddr_in *addr = (struct sockaddr_in*)rp->ai_addr;
-        ip = [self IP2String:addr->sin_addr];
-    }
-    freeaddrinfo(result);
-    return ip;
+    return [[DNSCache instance] resolveIP:host family:AF_INET];
 }
 
 
@@ -8,6 +8,7 @@
 #import "ContactViewController.h"
 #import "UserPresent.h"
 #import "APIRequest.h"
+#import <imsdk/imlog.h>
 
 @interface ContactListTableViewController()
 @property (nonatomic) NSArray *contacts;
@@ -58,7 +59,7 @@
     self.tableView.separatorColor = [UIColor colorWithRed:208.0/255.0 green:208.0/255.0 blue:208.0/255.0 alpha:1.0];
     
     self.tableView.frame = CGRectMake(0, KNavigationBarHeight + kStatusBarHeight + kSearchBarHeight, self.view.frame.size.width, self.view.frame.size.height - (KNavigationBarHeight + kStatusBarHeight + kSearchBarHeight + kTabBarHeight));
-    NSLog(@"height:%f", self.view.frame.size.height);
+    IMLogD("height:%f", self.view.frame.size.height);
 	[self.view addSubview:self.tableView];
 
     UILabel *head = [[UILabel alloc] initWithFrame:CGRectMake(0, 0, self.view.frame.size.width, 40)];
@@ -166,7 +167,7 @@
         NSString *string = contact.contactName;
         if ([contact.users count] > 0) {
             User *user = [contact.users objectAtIndex:0];
-            NSLog(@"name:%@ state:%@", string, user.state);
+            IMLogD("name:%s state:%s", [string UTF8String], [user.state UTF8String]);
         }
         
         NSString *sectionName;
@@ -368,7 +369,7 @@
                 }else{
                     [cell.detailTextLabel setText:@"~没有状态~"];
                 }
-                NSLog(@"name:%@ state:%@", contact.contactName, u.state);
+                IMLogD("name:%s state:%s", [contact.contactName UTF8String], [u.state UTF8String]);
             }
         } else {
             [cell.detailTextLabel setText:@""];
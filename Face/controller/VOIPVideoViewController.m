@@ -8,6 +8,7 @@
 
 #import "VOIPVideoViewController.h"
 #import <voipsession/VOIPSession.h>
+#import <imsdk/imlog.h>
 #import "UserPresent.h"
 #import "Token.h"
 
@@ -85,7 +86,7 @@
                         [self waitAccept];
                     }
                 } else {
-                    NSLog(@"can't grant record permission");
+                    IMLogW("can't grant record permission");
                 }
             }];
             
@@ -99,7 +100,7 @@
         // not determined?!
         [AVCaptureDevice requestAccessForMediaType:AVMediaTypeVideo completionHandler:^(BOOL granted) {
             if(granted){
-                NSLog(@"Granted access to %@", AVMediaTypeVideo);
+                IMLogD("Granted access to %s", [AVMediaTypeVideo UTF8String]);
                 AVAuthorizationStatus audioAuthStatus = [AVCaptureDevice authorizationStatusForMediaType:AVMediaTypeAudio];
                 if(audioAuthStatus == AVAuthorizationStatusAuthorized) {
                     if (self.isCaller) {
@@ -121,12 +122,12 @@
                                 [self waitAccept];
                             }
                         } else {
-                            NSLog(@"can't grant record permission");
+                            IMLogW("can't grant record permission");
                         }
                     }];
                 }
             } else {
-                NSLog(@"Not granted access to %@", AVMediaTypeVideo);
+                IMLogW("Not granted access to %s", [AVMediaTypeVideo UTF8String]);
             }
         }];
     }
@@ -142,7 +143,7 @@
 }
 
 -(void)switchCamera:(id)sender {
-    NSLog(@"switch camera");
+    IMLogD("switch camera");
     
     RTCVideoSource* source = self.localVideoTrack.source;
     if ([source isKindOfClass:[RTCAVFoundationVideoSource class]]) {
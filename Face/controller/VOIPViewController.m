@@ -11,6 +11,7 @@
 #import "UserDB.h"
 #import "UserPresent.h"
 #import <voipsession/VOIPSession.h>
+#import <imsdk/imlog.h>
 #import "HistoryDB.h"
 
 #import "UIImageView+WebCache.h"
@@ -97,7 +98,7 @@
 }
 
 -(void)dealloc {
-    NSLog(@"voip view controller dealloc");
+    IMLogD("voip view controller dealloc");
 }
 
 
@@ -364,7 +365,7 @@
              withOptions:options
                    error:&error];
     if (error != nil) {
-        NSLog(@"set loudspeaker err:%@", error);
+        IMLogW("set loudspeaker err:%s", [[error description] UTF8String]);
         return -1;
     }
     
@@ -375,14 +376,14 @@
 
 #pragma mark - AVAudioPlayerDelegate
 - (void)audioPlayerDidFinishPlaying:(AVAudioPlayer *)player successfully:(BOOL)flag {
-    NSLog(@"player finished");
+    IMLogD("player finished");
     if (!self.isConnected) {
         [self.player play];
     }
 }
 
 - (void)audioPlayerDecodeErrorDidOccur:(AVAudioPlayer *)player error:(NSError *)error {
-    NSLog(@"player decode error");
+    IMLogW("player decode error");
 }
 
 
@@ -399,7 +400,7 @@
     
     NSString *path = [[[NSBundle mainBundle] resourcePath] stringByAppendingPathComponent:@"CallConnected.mp3"];
     BOOL r = [[NSFileManager defaultManager] fileExistsAtPath:path];
-    NSLog(@"exist:%d", r);
+    IMLogD("exist:%d", r);
     
     AVAudioSession *session = [AVAudioSession sharedInstance];
     [session setCategory:AVAudioSessionCategoryPlayAndRecord error:nil];
@@ -510,7 +511,7 @@
 }
 
 -(void)onConnected {
-    NSLog(@"call voip connected");
+    IMLogI("call voip connected");
     self.isConnected = YES;
     self.history.flag = self.history.flag|FLAG_ACCEPTED;
 
@@ -10,6 +10,7 @@
 #include <arpa/inet.h>
 #import <UIKit/UIKit.h>
 #import <voipsession/VOIPSession.h>
+#import <imsdk/imlog.h>
 #import "UserPresent.h"
 #import "Token.h"
 
@@ -47,7 +48,7 @@
                     [self waitAccept];
                 }
             } else {
-                NSLog(@"can't grant record permission");
+                IMLogW("can't grant record permission");
             }
         }];
     }
@@ -10,6 +10,7 @@
 
 
 #import <voipsession/VOIPSession.h>
+#import <imsdk/imlog.h>
 #import <WebRTC/WebRTC.h>
 #import "ARDSDPUtils.h"
 
@@ -120,7 +121,7 @@ static NSString * const kARDVideoTrackId = @"ARDAMSv0";
 
 
 -(void)stopStream {
-    NSLog(@"stop stream");
+    IMLogI("stop stream");
     [[UIApplication sharedApplication] setIdleTimerDisabled:NO];
     self.peerConnection = nil;
     RTCStopInternalCapture();
@@ -233,7 +234,7 @@ didCreateSessionDescription:(RTCSessionDescription *)sdp
                  error:(NSError *)error {
     dispatch_async(dispatch_get_main_queue(), ^{
         if (error) {
-            NSLog(@"Failed to create session description. Error: %@", error);
+            IMLogE("Failed to create session description. Error: %s", [[error description] UTF8String]);
             NSDictionary *userInfo = @{
                                        NSLocalizedDescriptionKey: @"Failed to create session description.",
                                        };
@@ -241,7 +242,7 @@ didCreateSessionDescription:(RTCSessionDescription *)sdp
             [[NSError alloc] initWithDomain:kARDAppClientErrorDomain
                                        code:kARDAppClientErrorCreateSDP
                                    userInfo:userInfo];
-            NSLog(@"sdp error:%@", sdpError);
+            IMLogE("sdp error:%s", [[sdpError description] UTF8String]);
             //[_delegate appClient:self didError:sdpError];
             return;
         }
@@ -255,7 +256,7 @@ didCreateSessionDescription:(RTCSessionDescription *)sdp
                                    
                                }];
         
-        NSLog(@"sdp description:%@", sdpPreferringH264);
+        IMLogD("sdp description length:%d", (int)sdpPreferringH264.sdp.length);
         
         ARDSessionDescriptionMessage *message = [[ARDSessionDescriptionMessage alloc] initWithDescription:sdpPreferringH264];
         [self sendSignalingMessage:message];
@@ -270,7 +271,7 @@ didCreateSessionDescription:(RTCSessionDescription *)sdp
     
     ARDSignalingMessage *message = [ARDSignalingMessage messageFromJSONString:rt.content];
     
-    NSLog(@"recv signal message:%@", rt.content);
+    IMLogD("recv signal message length:%d", (int)rt.content.length);
     [self processMessage:message];
 }
 
@@ -293,7 +294,7 @@ didCreateSessionDescription:(RTCSessionDescription *)sdp
         [self.peerConnection setRemoteDescription:sdpPreferringH264
                                 completionHandler:^(NSError *error) {
                                     if (error) {
-                                        NSLog(@"error:%@", error);
+                                        IMLogE("error:%s", [[error description] UTF8String]);
                                         return;
                                     }
                                     
@@ -319,7 +320,7 @@ didCreateSessionDescription:(RTCSessionDescription *)sdp
         [self.peerConnection setRemoteDescription:sdpPreferringH264
                                 completionHandler:^(NSError *error) {
                                     if (error) {
-                                        NSLog(@"error:%@", error);
+                                        IMLogE("error:%s", [[error description] UTF8String]);
                                         return;
                                     }
                                 }];
@@ -334,7 +335,7 @@ didCreateSessionDescription:(RTCSessionDescription *)sdp
     
     NSString *str = [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
     
-    NSLog(@"send signal message:%@", str);
+    IMLogD("send signal message length:%d", (int)str.length);
     
     RTMessage *rt = [[RTMessage alloc] init];
     rt.sender = self.currentUID;
@@ -350,18 +351,18 @@ didCreateSessionDescription:(RTCSessionDescription *)sdp
 
 - (void)peerConnection:(RTCPeerConnection *)peerConnection
 didChangeSignalingState:(RTCSignalingState)stateChanged {
-    NSLog(@"Signaling state changed: %ld", (long)stateChanged);
+    IMLogD("Signaling state changed: %ld", (long)stateChanged);
 }
 
 - (void)peerConnection:(RTCPeerConnection *)peerConnection
           didAddStream:(RTCMediaStream *)stream {
     dispatch_async(dispatch_get_main_queue(), ^{
-        NSLog(@"Received %lu video tracks and %lu audio tracks",
+        IMLogI("Received %lu video tracks and %lu audio tracks",
               (unsigned long)stream.videoTracks.count,
               (unsigned long)stream.audioTracks.count);
         if (stream.videoTracks.count) {
             RTCVideoTrack *videoTrack = stream.videoTracks[0];
-            NSLog(@"did receive remote video track");
+            IMLogD("did receive remote video track");
             self.remoteVideoTrack = videoTrack;
         }
     });
@@ -369,16 +370,16 @@ didChangeSignalingState:(RTCSignalingState)stateChanged {
 
 - (void)peerConnection:(RTCPeerConnection *)peerConnection
        didRemoveStream:(RTCMediaStream *)stream {
-    NSLog(@"Stream was removed.");
+    IMLogD("Stream was removed.");
 }
 
 - (void)peerConnectionShouldNegotiate:(RTCPeerConnection *)peerConnection {
-    NSLog(@"WARNING: Renegotiation needed but unimplemented.");
+    IMLogW("WARNING: Renegotiation needed but unimplemented.");
 }
 
 - (void)peerConnection:(RTCPeerConnection *)peerConnection
 didChangeIceConnectionState:(RTCIceConnectionState)newState {
-    NSLog(@"ICE state changed: %ld", (long)newState);
+    IMLogI("ICE state changed: %ld", (long)newState);
     dispatch_async(dispatch_get_main_queue(), ^{
         //        [_delegate appClient:self didChangeConnectionState:newState];
     });
@@ -386,7 +387,7 @@ didChangeIceConnectionState:(RTCIceConnectionState)newState {
 
 - (void)peerConnection:(RTCPeerConnection *)peerConnection
 didChangeIceGatheringState:(RTCIceGatheringState)newState {
-    NSLog(@"ICE gathering state changed: %ld", (long)newState);
+    IMLogD("ICE gathering state changed: %ld", (long)newState);
 }
 
 - (void)peerConnection:(RTCPeerConnection *)peerConnection